@@ -15,6 +15,24 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <regex.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Gets ASCII value of Ctrl-k by setting bits 5-7 as 0
 #define CTRL_KEY(letter) ((letter) & 0x1f) 
@@ -27,18 +45,234 @@
 #define HLDB_ENTRIES (sizeof(HLDB)/sizeof(HLDB[0])) // stores length of HLDB array
 
 #define QUIT_TIMES 2
+#define HIGHLIGHT_CHUNK_MIN_ROWS 4096 // Fewer rows than this per thread is not worth spawning a thread for
+#define HIGHLIGHT_MAX_THREADS 64
+#define JOURNAL_MAGIC "TEXTOJ2\n"
+#define JOURNAL_HEADER_SIZE (8 + 3 * sizeof(int64_t)) // Magic, then size, modification seconds and nanoseconds of the file
+#define JOURNAL_FLUSH_SIZE 65536 // Pending journal records are written early if they grow past this
+#define JOURNAL_BATCH_ROWS 512 // Rows per record when many rows are inserted at once
+#define JOURNAL_BATCH_SIZE (1 << 30) // Bytes of text per record when many rows are inserted at once
+#define INDEX_MAGIC "TEXTOI1\n"
+#define INDEX_HEADER_FIELDS 7 // File size, mtime seconds, mtime nanoseconds, content hash, syntax signature, row count, path hash
+#define INDEX_HASH_EDGE 65536 // Bytes hashed at each end of the file
+#define INDEX_HASH_STRIDE (1 << 20) // One sample block is hashed per stride in between
+#define INDEX_HASH_SAMPLE 4096
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_IDLE_MS 100 // Matches the read() timeout of raw mode, so idle work runs as often as in a normal editor
+#define SYNTAX_MAX_STATES 65535 // Keyword lexer states are stored as unsigned shorts
+#define SYNTAX_LOAD_BUDGET_US 1000 // Loading syntax definitions slower than this is reported at startup
+#define GIANT_ROW_SIZE (1 << 20) // Rows at least this long are only rendered and highlighted around the part on screen
+#define GIANT_ROW_CHUNK 16384 // Bytes between the checkpoints of a giant row
+#define GIANT_ROW_OVERRUN 4096 // How far a token may run past the end of a chunk while scanning a giant row
+#define GIANT_ROW_IDLE_US 10000 // Time spent validating giant row checkpoints per idle tick
+#define FOLLOW_READ_SIZE (1 << 20) // Bytes read at a time when catching up with a followed file
+#define FOLLOW_WAIT_MS 100 // Longest wait for a key or a change to a followed file, the same as the read() timeout
+#define DIFF_MAX_EDITS 4096 // A range of lines that needs more edits than this is treated as replaced as a whole
+#define DIFF_CONTEXT_ROWS 64 // Unchanged rows on each side of an edit that are diffed again with it, so lines can pair up across it
+#define LOAD_BLOCK_SIZE (256 * 1024) // Files are read in the background into blocks of this size, which rows point into
+#define TEXT_BLOCK_POOL_MAX 256 // Released blocks kept for reuse by later loads
+#define TRIGRAM_KEYS (1 << 18) // Trigrams are hashed into this many posting lists
+#define TRIGRAM_IDLE_US 20000 // Time spent indexing rows per idle tick
+#define TRIGRAM_COMPACT_MIN 65536 // Dead ids the index gathers before compaction is worth a pass over every list
+#define PAGED_DEFAULT_BUDGET 256 // Megabytes of rendered rows and edited text a paged buffer keeps in memory
+#define PAGED_SCAN_CHUNK (64 << 20) // Bytes of a paged file scanned for lines, or walked over while idle, before they are dropped from memory
+#define FILTER_PIPE_ROWS 256 // Rows handed to a filter command per write
+#define FILTER_CHUNK (1 << 20) // Bytes moved from or to a pipe per system call
+#define KEY_QUEUE_SIZE 256 // Keys read ahead of read_key(), such as those typed while a filter command runs
+#define ESCAPE_TIMEOUT_MS 50 // An Esc followed by nothing for this long was pressed on its own
+#define STATS_IDLE_US 10000 // Time spent counting the words of new rows per idle tick
+#define COMMENT_SCAN_IDLE_US 10000 // Time spent carrying multiline comment states down a loaded file per idle tick
+#define LINE_NUMBER_MIN_DIGITS 3 // So the gutter doesn't widen while a short file grows
+
+// Classes of bytes in charClass, shared by the highlighter, word motion and the word count
+#define CHAR_SPACE (1 << 0)
+#define CHAR_SEPARATOR (1 << 1) // Ends a keyword or number for the highlighter
+#define CHAR_WORD (1 << 2) // Letters, digits, underscores and the bytes of UTF-8 characters
+#define CHAR_DIGIT (1 << 3)
+#define CHAR_CLASS(c) charClass[(unsigned char) (c)]
+
+// Flags in editorSyntax.startFlags telling the highlighter which tokens can begin with a given byte
+#define SYNTAX_START_SLCOMMENT (1 << 0)
+#define SYNTAX_START_MLCOMMENT (1 << 1)
+#define SYNTAX_END_MLCOMMENT (1 << 2)
+#define SYNTAX_START_STRING (1 << 3)
+#define SYNTAX_START_NUMBER (1 << 4)
+#define SYNTAX_START_RULE (1 << 5)
+
+// This allows us to create our own dynamic string 
+struct appendBuffer {
+    char *buf;
+    int length;
+};
+
+// Shared read-only storage that rows can point into instead of owning their text (for example a mapped file)
+struct textBlock {
+    int refs; // Only changed atomically, loader threads drop references too
+    char *base;
+    size_t length;
+    int mapped; // base is a mapping rather than an allocation: 1 for a file, 2 for the swap file of a paged buffer
+    struct textBlock *next; // Next free block while in textBlockPool
+};
+
+// A line read by a file loader, not yet turned into a row
+struct loadedLine {
+    struct textBlock *block;
+    char *characters;
+    int size;
+};
+
+// Reads a file on a background thread. Lines are handed over a block at a time, once the thread is done with the block.
+struct fileLoader {
+    pthread_t thread;
+    int threaded;
+    int fd;
+    struct textBlock *mapping; // Set for paged buffers, whose lines point into a mapping of the file instead of blocks read into memory
+    pthread_mutex_t lock; // Guards the fields below
+    pthread_cond_t progress;
+    struct loadedLine *lines;
+    int numLines, linesCapacity;
+    int done;
+    int cancel;
+    int adopted; // Lines already turned into rows. Only used by the editor thread.
+};
+
+// Where the highlighter is partway through a row
+struct highlightState {
+    int inComment;
+    int inString; // Quote character of the open string, or 0
+    unsigned char restOfLine; // Colour of the rest of the row after a single line comment or a rule running to the end of the line
+    int previousSeparator;
+    unsigned char previousHighlight;
+};
+
+// Column and highlighter state at a point in a giant row, so work can start there instead of at the start of the row
+struct rowCheckpoint {
+    int index; // Position in characters, always at the start of a UTF-8 character
+    int column;
+    struct highlightState state; // State before the character at index
+};
+
+// Bookkeeping for rows too long to render as a whole. Checkpoints after an edit are dropped and rebuilt lazily, when a
+// later part of the row is needed or when the editor is idle.
+struct giantRow {
+    struct rowCheckpoint *checkpoints;
+    int numCheckpoints; // Valid checkpoints. The first one is always at index 0.
+    int checkpointsCapacity;
+    int complete; // The last checkpoint is at the end of the row, so it holds the state the row ends in
+    int editIndex; // Lowest index edited since the checkpoints were last trimmed, or -1 if unknown
+    int scanned; // Checkpoints have been built for the whole row at least once
+    struct editorSyntax *syntax; // Syntax the highlighter states were computed with
+    int windowColumn; // First column the render was asked to cover
+    int windowEnd, windowEndColumn; // Index and column the render ends at
+};
+
+// Bracket depth change over a range of rows and the lowest depth reached in it, combined in a segment tree
+struct bracketNode {
+    int sum;
+    int min;
+};
+
+// Rows start + 1 to end are folded away behind row start, which stays on screen
+struct foldRange {
+    int start;
+    int end;
+};
+
+// A line of copied text. It points into the text block of the row it came from, so copying doesn't duplicate the text.
+struct clipboardLine {
+    struct textBlock *block; // NULL for the empty line after the last row
+    char *characters;
+    int size;
+    int openComment; // Multiline comment state at the end of the row it came from
+};
+
+// Lines oldStart to oldStart + oldCount were replaced by lines newStart to newStart + newCount
+struct diffHunk {
+    int oldStart, oldCount;
+    int newStart, newCount;
+};
+
+// Ids of the rows containing one hashed trigram, ascending and stored as varint deltas
+struct trigramList {
+    unsigned char *postings;
+    uint32_t length, capacity;
+    int lastId; // Id the next delta is taken from
+};
+
+// Index of the trigrams in rows, used by find to skip rows that can't match. A row gets a new id whenever its text
+// changes, so lists only grow at the end and postings of old text merely lead to a dead id that no longer has a row.
+// Once dead ids outnumber live ones they are compacted away.
+struct trigramIndex {
+    struct trigramList *lists; // TRIGRAM_KEYS lists
+    int *idRow; // Index of the row with each id, or -1 once the row has changed or been removed
+    int numIds;
+    int deadIds;
+    int idsCapacity;
+    int indexed; // Ids below this are in the lists. Rows with later ids are always candidates.
+    unsigned int epoch; // Incremented whenever rows change or move, which makes the cached candidates stale
+    char *cachedQuery;
+    unsigned int cachedEpoch;
+    int *cachedRows; // Ascending indexes of the rows that may contain cachedQuery
+    int cachedCount;
+    int *compactNewId; // Set while a compaction is under way: the new id of each id below compactIds, or -1 if dead
+    int *compactOldId; // The other way round, for the lists already rewritten
+    int compactIds, compactLive, compactIndexed; // Ids, live ids and live indexed ids when the compaction started
+    int compactKey; // Lists before this one hold new ids
+};
+
+// Out-of-core state of a buffer opened with --paged. Unedited rows point into the file mapping and the row array lives
+// in a temporary file, so the kernel can page both out. Renders, colours and edited text are counted against a budget,
+// and past it renders are dropped and edited text is moved to a swap file.
+struct pagedBuffer {
+    size_t budget; // Bytes
+    int rowsFd; // Unlinked file the row array is mapped from
+    size_t rowsMapped; // Bytes of it mapped at eBuffer->row
+    int swapFd; // Unlinked file edited text is spilled to
+    off_t swapSize;
+    int *resident; // Indexes of the rows that may hold a render, colours or text of their own, oldest first
+    int numResident;
+    int residentCapacity;
+    size_t residentBytes; // Estimated memory of the resident rows, recounted whenever it passes the budget
+};
+
+// Mapped text a walk over the rows of a paged buffer has read, given back to the kernel once the run is long enough
+struct pagedStream {
+    char *start;
+    char *end;
+};
 
 // Stores a row of text
 typedef struct editorRow {
     int index;
     int highlightOpenComment;
     int rsize;
-    char *render; // This contains the text that will be displayed
+    char *render; // This contains the text that will be displayed. NULL until the row is first needed for rows loaded from an index.
     int size;
     char *characters;
     unsigned char *highlight;
+    struct textBlock *block; // If set, characters points into this block and must be copied before editing
+    int ascii; // Render is pure ASCII, so each byte is one column and no UTF-8 decoding is needed
+    int wrapHeight; // Number of screen lines the row takes up when soft wrapped, or 0 if not known yet
+    struct giantRow *giant; // Set for rows of at least GIANT_ROW_SIZE bytes, whose render only covers part of the row
+    int renderStart; // Index in characters that render starts at
+    int renderColumn; // Column that render starts at
+    int bracketDelta; // Opening minus closing brackets in the row, ignoring strings and comments
+    int bracketMin; // Lowest bracket depth reached in the row relative to its start, so at most 0. 1 until worked out.
+    int id; // Identifies the text of the row in the trigram index, or -1 if it hasn't been given one
+    uint64_t lineHash; // Hash of the characters for the diff gutter, or 0 if not computed since the row last changed
+    int resident; // Listed in the resident rows of a paged buffer
+    int words; // Words in the row as counted in the buffer's totals, or -1 if not counted yet
+    int countedSize; // Size the row had when its bytes were last added to the totals
 } editorRow;
 
+// Extra token rule from a syntax file: text starting with prefix is coloured up to the next separator or the end of the line
+struct syntaxRule {
+    char *prefix;
+    int prefixLength;
+    unsigned char highlight;
+    int toEndOfLine;
+};
+
 // Stores code syntax type
 struct editorSyntax {
     char *filetype;
@@ -48,31 +282,190 @@ struct editorSyntax {
     char *mlCommentStart;
     char *mlCommentEnd;
     int flags;
+    struct syntaxRule *rules;
+    int numRules;
+
+    // Keyword lexer built by compile_syntax(). Keywords form a trie whose transitions are indexed by byte class.
+    unsigned char startFlags[256];
+    unsigned char byteClass[256]; // 0 means no keyword contains the byte
+    int numClasses;
+    unsigned short *transitions; // numStates * numClasses entries. State 0 is dead and state 1 is the root.
+    unsigned char *accept; // Highlight of the keyword ending in each state, or HL_NORMAL
 };
 
-// Stores the configuration of the terminal and editor
-struct editorConfiguration {
+// An extra cursor for editing several places at once
+struct cursorPosition {
+    int x, y;
+    int primary; // Stands in for characterX and characterY while an edit is applied at every cursor
+};
+
+// Per-client state in server mode: where a client is looking, as opposed to the buffer it is looking at
+struct editorView {
     int characterX, characterY;
-    int renderX;
+    int renderX, renderY;
     int windowRows, windowCols;
+    int rowOffset, colOffset;
+    int softWrap;
+    int wrapOffset;
+    int markActive, markX, markY;
+    struct cursorPosition *cursors;
+    int numCursors, cursorsCapacity;
+    int screenValid;
+    int drawnRowOffset, drawnColOffset, drawnWrapOffset;
+    unsigned int drawnGeneration;
+    int synchronizedOutput;
+    char statusMessage[80];
+    time_t statusMessageTime;
+};
+
+// Maps a file extension onto the syntax used for it
+struct syntaxExtension {
+    char *extension;
+    struct editorSyntax *syntax;
+};
+
+// A file open in the editor: its rows, the cursor in it and everything kept up to date alongside the rows
+struct editorBuffer {
+    int characterX, characterY;
+    int renderX, renderY; // Screen position of the cursor, relative to the offsets
     int numRows;
     int rowOffset, colOffset;
+    int softWrap; // Long rows continue on the next screen line instead of scrolling horizontally
+    int wrapOffset; // Screen lines of the row at rowOffset that are scrolled off the top when soft wrapping
+    int markActive; // The text between the mark and the cursor is selected
+    int markX, markY;
+    struct cursorPosition *cursors; // Cursors besides the main one, sorted by row and then index
+    int numCursors, cursorsCapacity;
+    int *layoutTree; // Fenwick tree over the screen lines of rows, so screen lines and rows can be converted in O(log n)
+    int layoutValid; // The tree matches the rows and folds and was built for layoutCols columns
+    int layoutCols;
+    int layoutWrap; // Whether the tree counts wrapped lines or one line per row
+    struct foldRange *folds; // Sorted and never overlapping. Folded rows take up no lines in the layout tree.
+    int numFolds;
+    int foldsCapacity;
+    struct bracketNode *bracketTree; // Segment tree over the bracket depth changes of rows, leaves start at bracketTreeSize
+    int bracketTreeSize;
+    int bracketDirtyRow; // Leaves from this row on are out of date and rebuilt when needed, INT_MAX if none are
+    unsigned int generation; // Incremented whenever the contents or colours of rows change
     char *fileName;
-    char *statusMessage[80];
     int unsavedChanges;
-    time_t statusMessageTime;
     editorRow *row;
     struct editorSyntax *syntax;
-    struct termios original_termios; 
+    int deferHighlight; // When set, update_row() skips highlighting (used while loading a file)
+    int journalFd; // Crash recovery journal of edits since the last save, or -1
+    struct textBlock *fileMapping; // Mapping of the file that rows loaded from the index point into
+    int giantPending; // Some giant row has checkpoints left to validate while idle
+    int rowsCapacity; // Allocated length of row
+    int follow; // Read-only mode that keeps loading what is appended to the file, like tail -f
+    int followFd; // File being followed, or -1
+    int followWatch; // inotify instance watching the file, or -1 to check its size on every idle tick
+    off_t followOffset; // Bytes of the file loaded so far
+    int followPartial; // The last row didn't end in a newline yet, so appended bytes continue it
+    off_t fileSize; // State of the file when it was last loaded or saved, to notice other programs changing it
+    struct timespec fileModified;
+    ino_t fileInode;
+    uint64_t fileHash;
+    struct fileLoader *loader; // Set while the file is still being read in the background
+    struct trigramIndex *trigrams; // Set once the file is opened if useTrigrams is
+    int diffGutter; // Rows that differ from the file on disk are marked at the left of the screen
+    int lineNumbers; // Row numbers are shown at the left of the screen
+    int lineNumberDigits; // Width of the numbers, worked out again only when numRows changes
+    int lineNumberRows; // numRows the width was worked out for, or -1
+    uint64_t *savedHashes; // Line hashes of the file on disk, while the gutter is on
+    int numSavedLines;
+    struct diffHunk *diffHunks; // Differences between savedHashes and the rows, ordered by row
+    int numDiffHunks;
+    int diffValid; // The hunks match the rows. Cleared whenever a row changes.
+    int diffPartial; // Only rows diffFrom to diffTo - 1 changed since the hunks were computed, adding diffShift rows in all
+    int diffFrom, diffTo, diffShift;
+    int firstDirtyRow; // Rows before this are unchanged since the file was loaded or saved, or INT_MAX if none changed
+    int cleanTailRows; // Number of rows at the end that are unchanged as well
+    int fileRowsExact; // The file on disk holds exactly the rows as they were then, each followed by a newline
+    struct pagedBuffer *paged; // Set once the file is opened if usePaging is
+    long long totalBytes; // Bytes the rows take in the file, newlines included, kept up to date as rows change
+    long long totalWords; // Words in the rows that have been counted
+    int uncountedRows; // Rows whose words are still to be counted while the editor is idle
+    int nextUncountedRow; // Where the idle count carries on from
+    int commentScanRow; // Rows from here on don't know their multiline comment state yet, or INT_MAX once all do
+    struct appendBuffer journal; // Journal records waiting to be written
 };
 
-// This allows us to create our own dynamic string 
-struct appendBuffer {
-    char *buf;
-    int length;
+// Stores the configuration of the terminal and editor
+struct editorConfiguration {
+    int windowRows, windowCols;
+    int screenValid; // Cleared when the rows on the terminal can't be trusted and must all be redrawn
+    int drawnRowOffset, drawnColOffset, drawnWrapOffset; // Offsets the rows on the terminal were drawn with
+    unsigned int drawnGeneration;
+    int synchronizedOutput; // Terminal supports synchronized updates (DEC private mode 2026), so frames are drawn atomically
+    char *statusMessage[80];
+    time_t statusMessageTime;
+    int useIndex; // Keep a line index and highlight state cache next to the file for fast reopening
+    int useTrigrams; // Keep a trigram index of the rows to speed up find
+    int usePaging; // Open files out of core, keeping memory within pagingBudget megabytes
+    int pagingBudget;
+    struct termios original_termios; 
 };
 
 struct editorConfiguration eConfig;
+struct editorBuffer *eBuffer; // The buffer being edited
+
+// A file kept loaded by the server, shared by the clients that have it open
+struct serverBuffer {
+    char *path;
+    struct editorBuffer *state;
+};
+
+// A terminal attached to the server
+struct serverClient {
+    int fd;
+    struct serverBuffer *buffer;
+    struct editorView view;
+};
+
+int serverMode = 0;
+jmp_buf serverDetachJump; // Where a client's key handling returns to if it quits or disconnects
+struct serverClient serverClients[SERVER_MAX_CLIENTS];
+int serverNumClients = 0;
+struct serverBuffer **serverBuffers = NULL;
+int serverNumBuffers = 0;
+
+// Files open in this editor. The current one is also eBuffer.
+struct editorBuffer **editorBuffers = NULL;
+int numEditorBuffers = 0;
+int currentBuffer = 0;
+
+// Class of every byte value, a combination of the CHAR_ flags
+unsigned char charClass[256];
+
+// Bytes read from the terminal but not handled yet, which read_key() takes before reading any more
+char keyQueue[KEY_QUEUE_SIZE];
+int keyQueueLength = 0;
+
+// Released text blocks of LOAD_BLOCK_SIZE bytes, shared by the loaders of all buffers
+struct textBlock *textBlockPool = NULL;
+int textBlockPoolSize = 0;
+pthread_mutex_t textBlockPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Text copied or cut from any buffer
+struct clipboardLine *clipboard = NULL;
+int clipboardLength = 0;
+struct editorSyntax *clipboardSyntax; // Comment states of the lines only mean something for the same syntax
+int clipboardCommentsKnown;
+
+// Every known syntax (built-in and loaded from files) along with the extension hash used to look them up
+struct editorSyntax *syntaxDB = NULL;
+int syntaxDBLength = 0;
+struct syntaxExtension *syntaxExtensions = NULL;
+int syntaxExtensionsCapacity = 0; // Always a power of two
+char syntaxWarning[96]; // Problem found while building the syntax database, shown in the status bar on start
+
+// A range of rows highlighted by one thread during the initial highlight pass
+struct highlightChunk {
+    pthread_t thread;
+    int threaded;
+    int start, end;
+    int giantPending; // Some giant row in the chunk has checkpoints left to validate
+};
 
 enum customKeyValues {
     BACKSPACE = 127,
@@ -84,7 +477,23 @@ enum customKeyValues {
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DELETE_KEY
+    DELETE_KEY,
+    CTRL_ARROW_LEFT,
+    CTRL_ARROW_RIGHT,
+    CTRL_ARROW_DOWN
+};
+
+// Edit operations recorded in the crash recovery journal
+enum journalOperation {
+    JOURNAL_INSERT_ROW = 1,
+    JOURNAL_DELETE_ROW,
+    JOURNAL_INSERT_CHARACTER,
+    JOURNAL_DELETE_CHARACTER,
+    JOURNAL_APPEND_STRING,
+    JOURNAL_TRUNCATE_ROW,
+    JOURNAL_SET_ROW,
+    JOURNAL_DELETE_ROWS,
+    JOURNAL_INSERT_ROWS
 };
 
 enum editorHighlight {
@@ -107,24 +516,31 @@ char *C_HL_keywords[] = {
     NULL 
 };
 
+// The lexer fields are filled in by compile_syntax()
 struct editorSyntax HLDB[] = {
     {
-        "c",
-        C_HL_extensions,
-        C_HL_keywords,
-        "//",
-        "/*",
-        "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        .filetype = "c",
+        .filematch = C_HL_extensions,
+        .keywords = C_HL_keywords,
+        .singlelineCommentStart = "//",
+        .mlCommentStart = "/*",
+        .mlCommentEnd = "*/",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        .rules = NULL,
+        .numRules = 0
     }
 };
 
 // Functions declared here in the exact order with which they are defined
 void init();
+struct editorBuffer *buffer_create();
 void open_file(char*);
-char *prompt(char*, void (*func)(char*, int));
+char *prompt(char*, void (*func)(char*, int), int);
 void insert_row(int, char*, size_t);
+void splice_rows(int, int, char**, size_t*, struct textBlock**, int);
 void update_row(editorRow*);
+void update_render(editorRow*);
+void render_span(editorRow*, int, int, int);
 void free_row(editorRow*);
 void delete_row(int);
 void insert_character_in_row(editorRow*, int, int);
@@ -135,43 +551,290 @@ void disable_raw_mode();
 void enable_raw_mode();
 int get_window_size(int*, int*);
 int get_cursor_position(int*, int*);
+int detect_synchronized_output();
+int terminal_reply_length(const char*, int);
+int input_pending();
 void refresh_screen();
 void set_status_message(const char*, ...);
-void draw_rows(struct appendBuffer*);
+void draw_rows(struct appendBuffer*, int, int);
+void draw_row_from(struct appendBuffer*, editorRow*, int);
+int draw_row_text(struct appendBuffer*, editorRow*, int, int);
 void draw_status_bar(struct appendBuffer*);
 void draw_message_bar(struct appendBuffer*);
+int is_ascii(const char*, int);
+int utf8_decode(const char*, int, int*);
+int codepoint_width(int);
 int row_character_index_to_render_index(editorRow*, int);
+int row_character_index_to_column(editorRow*, int);
+int row_column_to_character_index(editorRow*, int);
 int row_render_index_to_character_index(editorRow*, int);
 void scroll();
+int row_wrap_height(editorRow*);
+void wrap_place(int, int*, int*);
+int row_wrap_position(editorRow*, int, int*);
+int row_wrap_character_index(editorRow*, int, int);
+int render_wrap_end(editorRow*, int);
+void layout_build();
+void layout_update_row(editorRow*);
+int layout_line_of_row(int);
+int layout_row_at_line(int, int*);
+int layout_top_line(int, int);
 int read_key();
 void move_cursor(int);
 void insert_character(int);
 void insert_new_line();
 void delete_character();
 void process_key_press();
+int is_edit_key(int);
 void append_to_append_buffer(struct appendBuffer*, const char*, int);
 void free_append_buffer(struct appendBuffer*);
 char *rows_to_string(int*);
 void update_syntax(editorRow*);
+int highlight_row(editorRow*, int, int*);
+int highlight_text(const char*, int, int, unsigned char*, struct highlightState*);
+void *highlight_chunk_worker(void*);
+int rehighlight_from(int, int);
+void highlight_all_rows();
 int syntax_to_colour(int);
 void select_syntax_highlight();
+long load_syntax_database();
+void load_syntax_file(const char*);
+int compile_syntax(struct editorSyntax*);
+unsigned int hash_string(const char*);
+void register_syntax_extensions();
 void save();
 void find_callback(char*, int);
 void find();
-int is_separator(int);
+char *sidecar_path(const char*, const char*);
+void journal_open();
+void journal_record(int, int, int, const char*, int);
+void journal_flush();
+void journal_reset();
+void journal_remove();
+void journal_recover();
+void journal_replay(char*, int);
+int confirm(const char*);
+void editor_idle();
+void giant_row_edited(editorRow*, int);
+void giant_row_invalidate(editorRow*);
+void giant_row_extend(editorRow*, int, int);
+struct rowCheckpoint *giant_row_checkpoint(editorRow*, int, int);
+void giant_row_window(editorRow*, int, int);
+int giant_row_highlight(editorRow*, int, int*);
+void giant_row_free(editorRow*);
+int columns_advance(const char*, int, int);
+int replace_in_row(editorRow*, const char*, int, regex_t*, const char*, int);
+void replace_all();
+void view_save(struct editorView*);
+void view_load(const struct editorView*);
+char *server_socket_path();
+int server_main();
+void server_attach(int);
+void server_handle_client(int);
+void server_activate(struct serverClient*);
+void server_redraw(struct serverBuffer*);
+void server_remove_client(int);
+void server_detach();
+int client_main(char*);
+void text_block_release(struct textBlock*, struct textBlock**);
+void row_make_writable(editorRow*);
+void row_materialize(editorRow*);
+uint64_t hash_bytes(const char*, size_t, uint64_t);
+uint64_t hash_file_content(const char*, size_t);
+uint64_t syntax_signature();
+uint64_t index_path_hash();
+int open_file_from_index();
+void write_index();
+void follow_start();
+void follow_watch();
+void follow_poll();
+void follow_read();
+void follow_reset();
+void file_state_record();
+void reload_check();
+void reload_apply(const char*, size_t, int);
+int diff_lines(const uint64_t*, int, const uint64_t*, int, struct diffHunk**);
+void diff_compare(const uint64_t*, int, int, const uint64_t*, int, int, int*, unsigned char*, unsigned char*);
+int diff_bisect(const uint64_t*, int, const uint64_t*, int, int*, int*, int*);
+int diff_map_line(const struct diffHunk*, int, int);
+void buffer_open(char*);
+void buffer_switch(int);
+void buffer_close();
+struct textBlock *text_block_alloc(size_t);
+void loader_start();
+void *loader_worker(void*);
+void loader_publish(struct fileLoader*, struct textBlock*, struct loadedLine*, int);
+void loader_poll(int);
+void loader_finish();
+void loader_cancel();
+int bracket_change(int);
+void bracket_row_summary(editorRow*);
+void bracket_row_set(editorRow*, int, int);
+void bracket_rows_moved(int);
+void bracket_build();
+void bracket_update(int);
+int bracket_find_forward(int, int, int, int, int, int*);
+int bracket_find_backward(int, int, int, int, int, int*);
+int bracket_scan_row(editorRow*, int*, int, int*);
+int bracket_search(int*, int*, int, int);
+void bracket_match();
+void bracket_enclosing();
+int layout_active();
+int fold_containing(int);
+int fold_next_row(int);
+int fold_visible_row(int);
+void fold_add(int, int);
+void fold_remove(int);
+void fold_rows_changed(int, int, int);
+void fold_changed();
+int fold_indent(editorRow*);
+void fold_block();
+void fold_manual();
+void truncate_row(editorRow*, int);
+void delete_rows(int, int);
+void journal_record_rows(int, char**, size_t*, int);
+void journal_replay_rows(int, int, char*, int);
+struct textBlock *row_share(editorRow*);
+int selection_bounds(int*, int*, int*, int*);
+void selection_render_range(editorRow*, int*, int*);
+void selection_clear();
+void clipboard_clear();
+int clipboard_copy();
+void clipboard_cut();
+void clipboard_paste();
+struct trigramIndex *trigram_create();
+void trigram_free(struct trigramIndex*);
+void trigram_row_changed(editorRow*);
+void trigram_rows_moved(int);
+void trigram_build();
+int trigram_key(const char*);
+void trigram_decode(const struct trigramList*, int**, int*, int*);
+int trigram_compare_rows(const void*, const void*);
+int trigram_candidates(const char*, int**);
+int text_columns();
+int gutter_width();
+uint64_t line_hash(const char*, size_t);
+void diff_gutter_toggle();
+void diff_gutter_record(const char*, size_t);
+void diff_gutter_update();
+int diff_mark(int);
+void draw_diff_mark(struct appendBuffer*, int);
+void rows_reserve(int);
+struct pagedBuffer *paged_create();
+void paged_free();
+void paged_touch(editorRow*);
+void paged_rows_moved(int, int, int);
+size_t paged_row_cost(editorRow*);
+void paged_trim();
+void paged_release_all();
+void paged_spill(int*, int);
+void paged_stream(struct pagedStream*, editorRow*);
+void *loader_map_worker(void*);
+void save_paged();
+void save_mark_dirty(int, int);
+void save_state_reset(const char*, off_t);
+int save_in_place();
+long long write_rows(int, int, int, off_t);
+int file_rows_on_disk();
+void filter_rows();
+int filter_run(int, int, char*, char**, size_t*);
+int filter_output_file();
+void char_class_init();
+void stats_row_added(editorRow*);
+void stats_row_removed(editorRow*);
+void stats_row_changed(editorRow*);
+void stats_count_row(editorRow*);
+void stats_count_idle();
+void move_word(int);
+int cursor_compare(const void*, const void*);
+void cursors_add();
+void cursors_clear();
+void cursors_gather();
+void cursors_normalize();
+void cursors_scatter();
+int cursors_handle_key(int);
+void cursors_edit(int);
+void cursors_move(int);
+int cursors_first_in_row(int);
+int cursor_render_index(editorRow*, int*, int);
+void line_numbers_toggle();
+void line_numbers_update();
+void draw_line_number(struct appendBuffer*, int);
+void goto_line();
+void trigram_compact();
+void diff_rows_changed(int, int, int);
+int journal_write(struct iovec*, int);
+int socket_peer_is_user(int);
+ssize_t read_input(char*);
+void queue_input(const char*, int);
+int input_arrives(int);
+void comment_scan_start();
+void comment_scan_idle();
+int row_summarize(editorRow*, int, unsigned char*);
+int row_carry_comment(editorRow*, int, unsigned char**);
+void trigram_lookup(struct trigramIndex*, int, int**, int*, int*);
+int follow_wait();
 
 int main(int argc /* Argument count */, char ** argv /* Argument values */) {
+    char_class_init();
+    if (argc >= 2 && !strcmp(argv[1], "--server")) { // Resident process that keeps files loaded for clients
+        return server_main();
+    }
+    if (argc >= 3 && (!strcmp(argv[1], "-c") || !strcmp(argv[1], "--attach"))) { // Thin client of the server
+        return client_main(argv[2]);
+    }
+
     enable_raw_mode(); // Before doing anything else, we must put terminal in correct mode
     init();
+    editorBuffers = malloc(sizeof(struct editorBuffer*));
+    editorBuffers[0] = eBuffer = buffer_create();
+    numEditorBuffers = 1;
+    if (get_window_size(&eConfig.windowRows, &eConfig.windowCols) == -1) {
+        safe_exit("get_window_size");
+    }
+    eConfig.windowRows -= 2;
+    eConfig.synchronizedOutput = detect_synchronized_output();
+    long syntaxLoadTime = load_syntax_database();
+
+    char *fileName = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--index")) {
+            eConfig.useIndex = 1;
+        } else if (!strcmp(argv[i], "--follow")) {
+            eBuffer->follow = 1;
+        } else if (!strcmp(argv[i], "--trigrams")) {
+            eConfig.useTrigrams = 1;
+        } else if (!strcmp(argv[i], "--paged")) {
+            eConfig.usePaging = 1;
+        } else if (!strcmp(argv[i], "--budget") && i + 1 < argc) {
+            eConfig.pagingBudget = atoi(argv[++i]);
+            if (eConfig.pagingBudget < 1) {
+                eConfig.pagingBudget = 1;
+            }
+        } else {
+            fileName = argv[i];
+        }
+    }
 
-    if (argc >= 2) {
-        open_file(argv[1]);
+    // Set first, so messages from opening the file (such as about its journal) replace it
+    set_status_message("HELP: Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = replace | Ctrl-S = save");
+    if (syntaxLoadTime > SYNTAX_LOAD_BUDGET_US) {
+        set_status_message("Loading syntax definitions took %ld us", syntaxLoadTime);
+    }
+    if (syntaxWarning[0]) {
+        set_status_message("%s", syntaxWarning);
     }
 
-    set_status_message("HELP: Ctrl-Q = quit | Ctrl-F = find | Ctrl-S = save");
+    if (fileName) {
+        open_file(fileName);
+    }
 
     while (1) {
-        refresh_screen();
+        if (!input_pending()) { // Keys already typed would make this frame out of date before it is seen
+            refresh_screen();
+        } else { // Keys like PAGE_DOWN still need the offsets the frame would have settled
+            scroll();
+        }
         process_key_press();
     }
 
@@ -182,25 +845,91 @@ int main(int argc /* Argument count */, char ** argv /* Argument values */) {
  * Initializes the editorConfiguration object
  */
 void init() {
-    eConfig.characterX = 0; // Horizontal (with respect to characters array)
-    eConfig.characterY = 0; // Vertical (with respect to characters array)
-    eConfig.renderX = 0; // Position of cursor within render array of row
-    eConfig.numRows = 0;
-    eConfig.row = NULL;
-    eConfig.fileName = NULL;
-    eConfig.rowOffset = 0;
-    eConfig.colOffset = 0;
+    eConfig.screenValid = 0;
+    eConfig.synchronizedOutput = 0;
     eConfig.statusMessage[0] = '\0';
     eConfig.statusMessageTime = 0;
-    eConfig.unsavedChanges = 0; // Tells editor if file is modified
-    eConfig.syntax = NULL;
-
-    if (get_window_size(&eConfig.windowRows, &eConfig.windowCols) == -1) {
-        safe_exit("get_window_size");
-    }
+    eConfig.useIndex = 0;
+    eConfig.useTrigrams = 0;
+    eConfig.usePaging = 0;
+    eConfig.pagingBudget = PAGED_DEFAULT_BUDGET;
+}
 
-    eConfig.windowRows -= 2;
-} 
+/**
+ * Allocates an empty buffer with no file
+ */
+struct editorBuffer *buffer_create() {
+    struct editorBuffer *buffer = malloc(sizeof(struct editorBuffer));
+    buffer->characterX = 0; // Horizontal (with respect to characters array)
+    buffer->characterY = 0; // Vertical (with respect to characters array)
+    buffer->renderX = 0; // Position of cursor within render array of row
+    buffer->renderY = 0;
+    buffer->numRows = 0;
+    buffer->row = NULL;
+    buffer->fileName = NULL;
+    buffer->rowOffset = 0;
+    buffer->colOffset = 0;
+    buffer->softWrap = 0;
+    buffer->wrapOffset = 0;
+    buffer->markActive = 0;
+    buffer->markX = 0;
+    buffer->markY = 0;
+    buffer->cursors = NULL;
+    buffer->numCursors = 0;
+    buffer->cursorsCapacity = 0;
+    buffer->layoutTree = NULL;
+    buffer->layoutValid = 0;
+    buffer->layoutCols = 0;
+    buffer->layoutWrap = 0;
+    buffer->folds = NULL;
+    buffer->numFolds = 0;
+    buffer->foldsCapacity = 0;
+    buffer->bracketTree = NULL;
+    buffer->bracketTreeSize = 0;
+    buffer->bracketDirtyRow = 0;
+    buffer->generation = 0;
+    buffer->unsavedChanges = 0; // Tells editor if file is modified
+    buffer->syntax = NULL;
+    buffer->deferHighlight = 0;
+    buffer->journalFd = -1;
+    buffer->journal.buf = NULL;
+    buffer->journal.length = 0;
+    buffer->fileMapping = NULL;
+    buffer->giantPending = 0;
+    buffer->rowsCapacity = 0;
+    buffer->follow = 0;
+    buffer->followFd = -1;
+    buffer->followWatch = -1;
+    buffer->followOffset = 0;
+    buffer->followPartial = 0;
+    buffer->fileSize = -1;
+    buffer->fileModified.tv_sec = 0;
+    buffer->fileModified.tv_nsec = 0;
+    buffer->fileInode = 0;
+    buffer->fileHash = 0;
+    buffer->loader = NULL;
+    buffer->trigrams = NULL;
+    buffer->totalBytes = 0;
+    buffer->totalWords = 0;
+    buffer->uncountedRows = 0;
+    buffer->nextUncountedRow = 0;
+    buffer->commentScanRow = INT_MAX;
+    buffer->diffGutter = 0;
+    buffer->lineNumbers = 0;
+    buffer->lineNumberDigits = LINE_NUMBER_MIN_DIGITS;
+    buffer->lineNumberRows = -1;
+    buffer->savedHashes = NULL;
+    buffer->numSavedLines = 0;
+    buffer->diffHunks = NULL;
+    buffer->numDiffHunks = 0;
+    buffer->diffValid = 0;
+    buffer->diffPartial = 0;
+    buffer->firstDirtyRow = 0;
+    buffer->cleanTailRows = 0;
+    buffer->fileRowsExact = 0;
+    buffer->paged = NULL;
+    return buffer;
+}
 
 /**
  * Opens desired file
@@ -208,19 +937,44 @@ void init() {
 void open_file(char *fileName) {
     // Opens file and checks for success
     FILE *fp =fopen(fileName, "r");
+    if (!fp && serverMode) { // Only the client that asked for the file is turned away
+        server_detach();
+    }
     if (!fp) {
         safe_exit("fopen");
     }
-    free(eConfig.fileName);
-    eConfig.fileName = strdup(fileName); // strdup() copies given string and allocates memory (assumes that we will free it later)
+    free(eBuffer->fileName);
+    eBuffer->fileName = strdup(fileName); // strdup() copies given string and allocates memory (assumes that we will free it later)
+    if (eConfig.useTrigrams && !eBuffer->trigrams) { // Filled in while idle, as rows arrive
+        eBuffer->trigrams = trigram_create();
+    }
+    if (eConfig.usePaging && !eBuffer->paged && !eBuffer->follow && !serverMode) { // Only the background loader can map the file
+        eBuffer->paged = paged_create();
+    }
 
     select_syntax_highlight();
 
+    if (eConfig.useIndex && !eBuffer->follow && open_file_from_index()) { // Nothing to parse or highlight, rows are read lazily from a mapping
+        fclose(fp);
+        file_state_record();
+        journal_recover();
+        return;
+    }
+
+    if (!eBuffer->follow && !serverMode) { // Read on a background thread, so only the first screenful is waited for
+        fclose(fp);
+        loader_start();
+        return;
+    }
+
     // Gets te 
     char *line = NULL;
     size_t lineCap = 0;
     ssize_t lineLen; // ssize_t differs from size_t by being signed. As a result, it can take on a negative if an error occurs.
 
+    // Rows are highlighted all at once after loading so the work can be split across threads
+    eBuffer->deferHighlight = 1;
+
     // NOTE: getline() is useful for reading lines from a file when we don’t know how much memory to allocate for each line.
     while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
         // Trims file
@@ -229,19 +983,35 @@ void open_file(char *fileName) {
         }
 
         // Adds row to editorConfiguration object
-        insert_row(eConfig.numRows, line, lineLen);
+        insert_row(eBuffer->numRows, line, lineLen);
     }
 
-    eConfig.unsavedChanges = 0;
+    eBuffer->deferHighlight = 0;
+    highlight_all_rows();
+
+    eBuffer->unsavedChanges = 0;
 
     free(line);
+    eBuffer->followOffset = ftello(fp);
     fclose(fp);
+
+    if (eBuffer->follow) { // Nothing is edited, so there is no journal or index to keep
+        follow_start();
+        return;
+    }
+
+    if (eConfig.useIndex) {
+        write_index();
+    }
+
+    file_state_record();
+    journal_recover();
 }
 
 /**
- * Promps user in message bar and accepts input
+ * Promps user in message bar and accepts input. Pressing enter on an empty input cancels unless allowEmpty is set.
  */
-char *prompt(char *promp, void (*func)(char*, int)) {
+char *prompt(char *promp, void (*func)(char*, int), int allowEmpty) {
     size_t bufferSize = 128;
     char *buf = malloc(bufferSize);
 
@@ -251,14 +1021,16 @@ char *prompt(char *promp, void (*func)(char*, int)) {
     // Gets user input
     while(1) {
         set_status_message(promp, buf);
-        refresh_screen();
+        if (!input_pending()) {
+            refresh_screen();
+        }
 
         int input = read_key();
 
         if (input == DELETE_KEY || input == CTRL_KEY('h') || input == BACKSPACE) { 
-            if (bufferLength != 0) {
-                buf[--bufferLength] = '\0';
+            while (bufferLength != 0 && (buf[--bufferLength] & 0xc0) == 0x80) { // Removes a whole UTF-8 character
             }
+            buf[bufferLength] = '\0';
         } else if (input == '\x1b') { // Cancel process
             set_status_message("");
             if (func) {
@@ -267,15 +1039,16 @@ char *prompt(char *promp, void (*func)(char*, int)) {
             free(buf);
             return NULL;
         } else if (input == '\r'){ // Enter key is pressed, returns buf
-            if (bufferLength != 0) {
+            if (bufferLength != 0 || allowEmpty) {
                 set_status_message("");
                 if (func) {
                     func(buf, '\x1b');
                 }
                 return buf;
             }
+            free(buf);
             return NULL;
-        } else if (!iscntrl(input) && input < 128) { // If user enters key
+        } else if (input < 256 && !iscntrl(input)) { // If user enters key. Bytes above 127 are parts of UTF-8 characters.
             if (bufferLength == bufferSize - 1) {
                 bufferSize *= 2;
                 buf = realloc(buf, bufferSize);
@@ -294,90 +1067,238 @@ char *prompt(char *promp, void (*func)(char*, int)) {
  * Adds row to the array of rows in the editorConfiguration object.
  */
 void insert_row(int index, char *rowValue, size_t length) {
-    if (index < 0 || index > eConfig.numRows) {
+    if (index < 0 || index > eBuffer->numRows) {
         return;
     }
 
-    eConfig.row = realloc(eConfig.row, sizeof(editorRow) * (eConfig.numRows + 1));
-    memmove(&eConfig.row[index + 1], &eConfig.row[index], sizeof(editorRow) * (eConfig.numRows - index));
-    for (int i = index + 1; i <= eConfig.numRows; i++) {
-        eConfig.row[i].index++;
+    splice_rows(index, 0, &rowValue, &length, NULL, 1);
+    eBuffer->unsavedChanges++;
+
+    journal_record(JOURNAL_INSERT_ROW, index, 0, rowValue, length);
+}
+
+/**
+ * Replaces deleteCount rows starting at index with insertCount new rows, moving the rows after them only once. Rows
+ * given a text block share its text instead of copying it, and are only rendered once they are displayed.
+ */
+void splice_rows(int index, int deleteCount, char **values, size_t *lengths, struct textBlock **blocks, int insertCount) {
+    for (int i = index; i < index + deleteCount; i++) {
+        free_row(&eBuffer->row[i]);
+    }
+
+    int numRows = eBuffer->numRows - deleteCount + insertCount;
+    rows_reserve(numRows);
+    memmove(&eBuffer->row[index + insertCount], &eBuffer->row[index + deleteCount], sizeof(editorRow) * (eBuffer->numRows - index - deleteCount));
+    if (insertCount != deleteCount) {
+        for (int i = index + insertCount; i < numRows; i++) {
+            eBuffer->row[i].index = i;
+        }
+    }
+    eBuffer->numRows = numRows;
+    save_mark_dirty(index, numRows - index - insertCount);
+    if (eBuffer->paged) {
+        paged_rows_moved(index, deleteCount, insertCount);
+    }
+    if (eBuffer->trigrams && insertCount != deleteCount) {
+        trigram_rows_moved(index + insertCount);
+    }
+    diff_rows_changed(index, deleteCount, insertCount);
+    eBuffer->layoutValid = 0;
+    bracket_rows_moved(index);
+    eBuffer->generation++;
+    if (eBuffer->numFolds) {
+        fold_rows_changed(index, deleteCount, insertCount);
+    }
+    if (eBuffer->commentScanRow != INT_MAX && index < eBuffer->commentScanRow) { // The rows the scan hasn't reached moved
+        eBuffer->commentScanRow = (index + deleteCount <= eBuffer->commentScanRow) ? eBuffer->commentScanRow + insertCount - deleteCount : index;
     }
 
-    eConfig.row[index].index = index;
+    for (int i = 0; i < insertCount; i++) {
+        editorRow *row = &eBuffer->row[index + i];
+        row->index = index + i;
 
-    eConfig.row[index].size = length;
-    eConfig.row[index].characters = malloc(length + 1);
-    memcpy(eConfig.row[index].characters, rowValue, length);
-    eConfig.row[index].characters[length] = '\0';
-    eConfig.numRows++;
-    eConfig.unsavedChanges++;
+        row->size = lengths[i];
+        row->block = blocks ? blocks[i] : NULL;
+        if (row->block) {
+            row->characters = values[i];
+            __atomic_add_fetch(&row->block->refs, 1, __ATOMIC_RELAXED);
+        } else {
+            row->characters = malloc(lengths[i] + 1);
+            memcpy(row->characters, values[i], lengths[i]);
+            row->characters[lengths[i]] = '\0';
+        }
 
-    eConfig.row[index].rsize = 0;
-    eConfig.row[index].render = NULL;
-    eConfig.row[index].highlight = NULL;
-    eConfig.row[index].highlightOpenComment = 0;
-    update_row(&eConfig.row[index]);   
+        row->rsize = 0;
+        row->render = NULL;
+        row->highlight = NULL;
+        row->ascii = row->block == NULL;
+        row->wrapHeight = 0;
+        row->giant = NULL;
+        row->renderStart = 0;
+        row->renderColumn = 0;
+        row->highlightOpenComment = 0;
+        row->bracketDelta = 0;
+        row->bracketMin = 1;
+        row->id = -1;
+        row->lineHash = 0;
+        row->resident = 0;
+        stats_row_added(row);
+        if (!row->block) {
+            update_row(row);
+        } else if (eBuffer->trigrams) {
+            trigram_row_changed(row);
+        }
+    }
 }
 
 /**
  * Updates parameters of editorRow object
  */ 
 void update_row(editorRow *row) {
+    eBuffer->generation++;
+    save_mark_dirty(row->index, eBuffer->numRows - row->index - 1);
+    row->lineHash = 0;
+    diff_rows_changed(row->index, 1, 1);
+    stats_row_changed(row);
+    if (eBuffer->trigrams) {
+        trigram_row_changed(row);
+    }
+    if (row->giant) {
+        giant_row_invalidate(row);
+    }
+    update_render(row);
+    layout_update_row(row);
+
+    if (!eBuffer->deferHighlight) {
+        update_syntax(row);
+    } else if (row->bracketMin <= 0) { // Worked out again when the tree needs it, unless the row is coloured first
+        row->bracketMin = 1;
+        bracket_rows_moved(row->index);
+    }
+}
+
+/**
+ * Rebuilds the text that is displayed for a row
+ */
+void update_render(editorRow *row) {
+    if (eBuffer->paged) {
+        paged_touch(row);
+    }
+    if (row->size >= GIANT_ROW_SIZE) { // Keeps showing the same part of the row
+        giant_row_window(row, row->giant ? row->giant->windowColumn : 0, 1);
+        return;
+    }
+
+    if (row->giant) { // Shrunk below the size limit
+        giant_row_free(row);
+    }
+    render_span(row, 0, row->size, 0);
+}
+
+/**
+ * Builds the render from the characters between start and end, where start is displayed at the given column
+ */
+void render_span(editorRow *row, int start, int end, int column) {
     // Counts the number of tabs in the line
     int tabCount = 0;
-    for (int i = 0; i < row->size; i++) {
+    for (int i = start; i < end; i++) {
         if (row->characters[i] == '\t') {
             tabCount++;
         }
     }
 
     free(row->render);
-    row->render = malloc(row->size + (tabCount * (TAB_STOP - 1)) + 1); // Max size of each tab is 8 bytes. row->size accounts for one of the bytes, so we multiply tabCount by 7.
+    row->render = malloc(end - start + (tabCount * (TAB_STOP - 1)) + 1); // Max size of each tab is 8 bytes. The span length accounts for one of the bytes, so we multiply tabCount by 7.
+    row->renderStart = start;
+    row->renderColumn = column;
 
     // Updates the render 
     int index = 0;
-    for (int i = 0; i < row->size; i++) {
-        if (row->characters[i] == '\t') { // If there is a tab, render it as multiple spaces
-            row->render[index++] = ' ';
-            while (index % TAB_STOP != 0) { // Tabs only go up to the next column whose number is divisible by 8
+    row->ascii = is_ascii(&row->characters[start], end - start);
+    if (row->ascii) {
+        for (int i = start; i < end; i++) {
+            if (row->characters[i] == '\t') { // If there is a tab, render it as multiple spaces
                 row->render[index++] = ' ';
+                while ((column + index) % TAB_STOP != 0) { // Tabs only go up to the next column whose number is divisible by 8
+                    row->render[index++] = ' ';
+                }
+            } else {
+                row->render[index++] = row->characters[i];
+            }
+        }
+    } else { // Multibyte characters are copied as they are, but tab stops have to be counted in columns rather than bytes
+        for (int i = start; i < end;) {
+            if (row->characters[i] == '\t') {
+                do {
+                    row->render[index++] = ' ';
+                    column++;
+                } while (column % TAB_STOP != 0);
+                i++;
+            } else {
+                int codepoint;
+                int length = utf8_decode(&row->characters[i], end - i, &codepoint);
+                memcpy(&row->render[index], &row->characters[i], length);
+                index += length;
+                i += length;
+                column += codepoint_width(codepoint);
             }
-        } else {
-            row->render[index++] = row->characters[i];
         }
     }
 
     row->render[index] = '\0';
     row->rsize = index;
-
-    update_syntax(row);
 }
 
 /**
  * Frees all heap-allocated parameters of the editorRow object
  */
 void free_row(editorRow *row) {
+    stats_row_removed(row);
+    if (eBuffer->trigrams && row->id >= 0) {
+        eBuffer->trigrams->idRow[row->id] = -1;
+        eBuffer->trigrams->deadIds++;
+    }
+    giant_row_free(row);
     free(row->render);
-    free(row->characters);
     free(row->highlight);
+    if (row->block) {
+        text_block_release(row->block, &eBuffer->fileMapping);
+    } else {
+        free(row->characters);
+    }
 }
 
 /**
  * Removes row from the array of rows in the editorConfiguration object
  */
 void delete_row(int index) {
-    if (index < 0 || index > eConfig.numRows) {
+    if (index < 0 || index > eBuffer->numRows) {
         return;
     }
 
-    free_row(&eConfig.row[index]); // Clears buffers in row
-    memmove(&eConfig.row[index], &eConfig.row[index + 1], sizeof(editorRow) * (eConfig.numRows - index - 1)); // Move memory of previous row to the recently deleted.
-    for (int i = index; i < eConfig.numRows - 1; i++) {
-        eConfig.row[i].index--;
+    journal_record(JOURNAL_DELETE_ROW, index, 0, NULL, 0);
+    eBuffer->generation++;
+    eBuffer->layoutValid = 0;
+    bracket_rows_moved(index);
+
+    free_row(&eBuffer->row[index]); // Clears buffers in row
+    memmove(&eBuffer->row[index], &eBuffer->row[index + 1], sizeof(editorRow) * (eBuffer->numRows - index - 1)); // Move memory of previous row to the recently deleted.
+    for (int i = index; i < eBuffer->numRows - 1; i++) {
+        eBuffer->row[i].index--;
+    }
+    eBuffer->numRows--;
+    eBuffer->unsavedChanges++;
+    diff_rows_changed(index, 1, 0);
+    save_mark_dirty(index, eBuffer->numRows - index);
+    if (eBuffer->paged) {
+        paged_rows_moved(index, 1, 0);
+    }
+    if (eBuffer->trigrams) {
+        trigram_rows_moved(index);
+    }
+    if (eBuffer->numFolds) {
+        fold_rows_changed(index, 1, 0);
     }
-    eConfig.numRows--;
-    eConfig.unsavedChanges++;
 }
 
 /**
@@ -388,19 +1309,26 @@ void insert_character_in_row(editorRow *row, int index, int character) {
         index = row->size;
     }
 
+    row_make_writable(row);
+    giant_row_edited(row, index);
     row->characters = realloc(row->characters, row->size + 2); // Add two to make room for null byte
     memmove(&row->characters[index + 1], &row->characters[index], row->size - index + 1); // Memmove like memcpy, but is safer to use when memory overlaps
     row->size++;
     row->characters[index] = character;
     update_row(row);
 
-    eConfig.unsavedChanges++;
+    char journalCharacter = character;
+    journal_record(JOURNAL_INSERT_CHARACTER, row->index, index, &journalCharacter, 1);
+
+    eBuffer->unsavedChanges++;
 }
 
 /**
  * Used when deleting a row
  */
 void append_string_in_row(editorRow *row, char *str, size_t length) {
+    row_make_writable(row);
+    giant_row_edited(row, row->size);
     row->characters = realloc(row->characters, row->size + length + 1);
 
     memcpy(&row->characters[row->size], str, length);
@@ -409,8 +1337,10 @@ void append_string_in_row(editorRow *row, char *str, size_t length) {
     row->characters[row->size] = '\0';
     
     update_row(row);
+
+    journal_record(JOURNAL_APPEND_STRING, row->index, 0, str, length);
     
-    eConfig.unsavedChanges++;
+    eBuffer->unsavedChanges++;
 } 
 
 /**
@@ -421,10 +1351,13 @@ void delete_character_in_row(editorRow *row, int index) {
         return;
     }
 
+    row_make_writable(row);
+    giant_row_edited(row, index);
     memmove(&row->characters[index] /* Destination */, &row->characters[index + 1] /* Starting address */, row->size - index /* Indices */);
     row->size--;
     update_row(row);
-    eConfig.unsavedChanges++;
+    journal_record(JOURNAL_DELETE_CHARACTER, row->index, index, NULL, 0);
+    eBuffer->unsavedChanges++;
 } 
 
 /**
@@ -536,36 +1469,160 @@ int get_cursor_position(int *rows, int *cols) {
     return 0;
 } 
 
+/**
+ * Asks the terminal whether it supports synchronized updates with a DECRQM query for mode 2026. A device attributes
+ * query is sent after it, since every terminal answers that one, so we know when to stop waiting for a reply.
+ */
+int detect_synchronized_output() {
+    if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 13) != 13) {
+        return 0;
+    }
+
+    // Every terminal answers the device attributes query, and does so after the mode query, so its reply ends the wait
+    char buf[128];
+    int length = 0;
+    int answered = 0;
+    while (!answered && length < (int) sizeof(buf) && read(STDIN_FILENO, &buf[length], 1) == 1) {
+        length++;
+        for (int start = length - 1; buf[length - 1] == 'c' && start >= 0 && !answered; start--) {
+            answered = (terminal_reply_length(&buf[start], length - start) == length - start);
+        }
+    }
+
+    int supported = 0;
+    for (int i = 0; i < length;) {
+        int reply = terminal_reply_length(&buf[i], length - i);
+        if (reply == 0) { // Typed while the replies were awaited, so it is kept for read_key()
+            queue_input(&buf[i], 1);
+            i++;
+            continue;
+        }
+
+        // Mode report is CSI ? 2026 ; Ps $ y, where Ps is 1 (set), 2 (reset) or 3 (permanently set) if the mode is supported
+        if (reply == 11 && !strncmp(&buf[i], "\x1b[?2026;", 8) && buf[i + 8] >= '1' && buf[i + 8] <= '3') {
+            supported = 1;
+        }
+        i += reply;
+    }
+    return supported;
+}
+
+/**
+ * Returns the length of the terminal reply text starts with: CSI ? with digits and semicolons, ended by c for device
+ * attributes or $y for a mode report. Returns 0 if text doesn't start with a whole reply.
+ */
+int terminal_reply_length(const char *text, int length) {
+    if (length < 4 || strncmp(text, "\x1b[?", 3)) {
+        return 0;
+    }
+    int i = 3;
+    while (i < length && ((text[i] >= '0' && text[i] <= '9') || text[i] == ';')) {
+        i++;
+    }
+    if (i < length && text[i] == 'c') {
+        return i + 1;
+    }
+    if (i + 1 < length && text[i] == '$' && text[i + 1] == 'y') {
+        return i + 2;
+    }
+    return 0;
+}
+
+/**
+ * Returns 1 if there are keys waiting to be read
+ */
+int input_pending() {
+    if (keyQueueLength > 0) {
+        return 1;
+    }
+    int pending;
+    if (ioctl(STDIN_FILENO, FIONREAD, &pending) == 0) {
+        return pending > 0;
+    }
+
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    return poll(&input, 1, 0) > 0;
+}
+
 /**
  * Clears the screen when called
  * This function writes an escape sequence into the terminal, which instruct the terminal to do text formatting tasks
  */ 
 void refresh_screen() {
+    if (eBuffer->diffGutter && !eBuffer->diffValid && !eBuffer->loader) {
+        diff_gutter_update();
+    }
+    if (eBuffer->lineNumbers && eBuffer->lineNumberRows != eBuffer->numRows) {
+        line_numbers_update();
+    }
     scroll();
 
     struct appendBuffer obj = APPEND_BUFFER_INIT;
+    char buff[32];
+
+    // Tells the terminal to hold the frame until it is complete so it never shows half of one
+    if (eConfig.synchronizedOutput) {
+        append_to_append_buffer(&obj, "\x1b[?2026h", 8);
+    }
 
     // Hides cursor while screen refreshes (l means Reset Mode)
     append_to_append_buffer(&obj, "\x1b[?25l", 6);
 
-    // Moves the cursor to the top left of the screen. Uses H command (Cursor Position)
-    append_to_append_buffer(&obj, "\x1b[H", 3);
+    // The layout of wrapped rows only changes along with the generation, so comparing screen lines is safe once that matched
+    int redraw = !eConfig.screenValid || eConfig.drawnGeneration != eBuffer->generation || eConfig.drawnColOffset != eBuffer->colOffset;
+    int scrolled = 0;
+    if (!redraw) {
+        scrolled = layout_top_line(eBuffer->rowOffset, eBuffer->wrapOffset) - layout_top_line(eConfig.drawnRowOffset, eConfig.drawnWrapOffset);
+        redraw = abs(scrolled) >= eConfig.windowRows;
+    }
+
+    if (redraw) {
+        draw_rows(&obj, 0, eConfig.windowRows);
+    } else if (scrolled != 0) {
+        // Only the offset changed, so let the terminal shift the rows it already shows within a scroll region (DECSTBM)
+        // and draw just the rows that scrolled into view. S scrolls the content up, T scrolls it down.
+        snprintf(buff, sizeof(buff), "\x1b[1;%dr\x1b[%d%c", eConfig.windowRows, abs(scrolled), scrolled > 0 ? 'S' : 'T');
+        append_to_append_buffer(&obj, buff, strlen(buff));
+        append_to_append_buffer(&obj, "\x1b[r", 3); // Reset the scroll region to the whole screen
+
+        if (scrolled > 0) {
+            draw_rows(&obj, eConfig.windowRows - scrolled, eConfig.windowRows);
+        } else {
+            draw_rows(&obj, 0, -scrolled);
+        }
+    }
+
+    eConfig.screenValid = 1;
+    eConfig.drawnRowOffset = eBuffer->rowOffset;
+    eConfig.drawnColOffset = eBuffer->colOffset;
+    eConfig.drawnWrapOffset = eBuffer->wrapOffset;
+    eConfig.drawnGeneration = eBuffer->generation; // Set after drawing, since rows highlighted lazily while drawing don't need another draw
+
+    // Moves the cursor to the status bar below the rows
+    snprintf(buff, sizeof(buff), "\x1b[%d;1H", eConfig.windowRows + 1);
+    append_to_append_buffer(&obj, buff, strlen(buff));
 
-    draw_rows(&obj);
     draw_status_bar(&obj);
     draw_message_bar(&obj);
 
     // Moves cursor to the current position
-    char buff[32];
-    snprintf(buff, sizeof(buff), "\x1b[%d;%dH", (eConfig.characterY - eConfig.rowOffset) + 1, (eConfig.renderX - eConfig.colOffset) + 1);
+    snprintf(buff, sizeof(buff), "\x1b[%d;%dH", eBuffer->renderY + 1, (eBuffer->renderX - eBuffer->colOffset) + gutter_width() + 1);
     append_to_append_buffer(&obj, buff, strlen(buff));
 
     // Makes cursor visible (h means Set Mode)
     append_to_append_buffer(&obj, "\x1b[?25h", 6);
+
+    if (eConfig.synchronizedOutput) {
+        append_to_append_buffer(&obj, "\x1b[?2026l", 8);
+    }
     
     // Write out the buffer's content to the terminal
     write(STDOUT_FILENO, obj.buf, obj.length);
     free_append_buffer(&obj);
+
+    if (eBuffer->paged && eBuffer->paged->residentBytes > eBuffer->paged->budget) { // After drawing, so the rows on screen stay
+        paged_trim();
+    }
 }
 
 /**
@@ -583,24 +1640,44 @@ void set_status_message(const char *message, ...) {
 }
 
 /**
- * Draws tildes at the left hand side of each of the rows  
+ * Draws the screen rows from first up to (not including) last, with tildes at the left hand side of rows past the end of the file
  */
-void draw_rows(struct appendBuffer *obj) {
-    for (int y = 0; y < eConfig.windowRows; y++) {
-        int fileRow = y + eConfig.rowOffset; // Add offset so we get the lines we wish to see
+void draw_rows(struct appendBuffer *obj, int first, int last) {
+    // Moves the cursor to the start of the first row. Uses H command (Cursor Position)
+    char position[16];
+    int positionLength = snprintf(position, sizeof(position), "\x1b[%d;1H", first + 1);
+    append_to_append_buffer(obj, position, positionLength);
+
+    // When soft wrapping or folding, screen lines are found through the layout index and then walked a row at a time
+    int layout = layout_active();
+    int wrapRow = 0;
+    int wrapLine = 0; // Screen line within wrapRow
+    int wrapStart = -1; // Render index that wrapLine starts at, if known
+    if (layout) {
+        wrapRow = layout_row_at_line(layout_top_line(eBuffer->rowOffset, eBuffer->wrapOffset) + first, &wrapLine);
+    }
+
+    for (int y = first; y < last; y++) {
+        int fileRow = layout ? wrapRow : y + eBuffer->rowOffset; // Add offset so we get the lines we wish to see
+        if (eBuffer->lineNumbers) {
+            draw_line_number(obj, (fileRow < eBuffer->numRows && wrapLine == 0) ? fileRow + 1 : 0);
+        }
+        if (eBuffer->diffGutter) { // Continued lines of a wrapped row and lines past the end of the file are left blank
+            draw_diff_mark(obj, (fileRow < eBuffer->numRows && wrapLine == 0) ? diff_mark(fileRow) : ' ');
+        }
 
         // Displays message halfway down the screen after file is displayed
-        if (fileRow >= eConfig.numRows) { 
-            if (eConfig.numRows == 0 && y == eConfig.windowRows/2) {
+        if (fileRow >= eBuffer->numRows) { 
+            if (eBuffer->numRows == 0 && y == eConfig.windowRows/2) {
                 char message[80];
                 int messageLength = snprintf(message, sizeof(message), "Texto -- version %s", PROGRAM_VERSION);
 
-                if (messageLength > eConfig.windowCols) {
-                    messageLength = eConfig.windowCols;
+                if (messageLength > text_columns()) {
+                    messageLength = text_columns();
                 }
 
                 // Centers message
-                int padding = (eConfig.windowCols - messageLength) / 2; // Gets amount of space characters required to center message
+                int padding = (text_columns() - messageLength) / 2; // Gets amount of space characters required to center message
                 if (padding) {
                     append_to_append_buffer(obj, "~", 1);
                     padding--;
@@ -616,74 +1693,205 @@ void draw_rows(struct appendBuffer *obj) {
                 append_to_append_buffer(obj, "~", 1);
             }
         } else { // Displays file contents
-            int length = eConfig.row[fileRow].rsize - eConfig.colOffset;
-            if (length < 0) {
-                length = 0;
-            }
-
-            if (length > eConfig.windowCols) {
-                length = eConfig.windowCols;
+            editorRow *row = &eBuffer->row[fileRow];
+            row_materialize(row);
+
+            int lastLine = 1; // Whether this is the last screen line of the row
+            if (eBuffer->softWrap && row->giant) { // Not wrapped. The cursor's row shows the screen width containing the cursor.
+                int column = (fileRow == eBuffer->characterY) ? row_character_index_to_column(row, eBuffer->characterX) : 0;
+                draw_row_from(obj, row, column - (column % text_columns()));
+            } else if (eBuffer->softWrap) {
+                if (wrapStart < 0) {
+                    wrapStart = 0;
+                    for (int line = 0; line < wrapLine; line++) {
+                        wrapStart = render_wrap_end(row, wrapStart);
+                    }
+                }
+                wrapStart = draw_row_text(obj, row, wrapStart, 0); // Stops where the next screen line of the row starts
+                lastLine = wrapLine + 1 >= row->wrapHeight;
+                wrapLine++;
+            } else {
+                draw_row_from(obj, row, eBuffer->colOffset);
             }
 
-            char *s = &eConfig.row[fileRow].render[eConfig.colOffset];
-            unsigned char *hl = &eConfig.row[fileRow].highlight[eConfig.colOffset];
-            int currentColour = -1;
-            for (int i = 0; i < length; i++) {
-                if (iscntrl(s[i])) { // Handles non-printable characters
-                    char sym = (s[i] < 26) ? '@' + s[i] : '?';
-                    append_to_append_buffer(obj, "\x1b[7m", 4); // Highlight colour white
-                    append_to_append_buffer(obj, &sym, 1);
-                    append_to_append_buffer(obj, "\x1b[m", 3); // Set colour back to normal
-                    if (currentColour != -1) { // Set colour back to original
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColour); 
-                        append_to_append_buffer(obj, buf, clen);
-                    }
-                } else if (hl[i] == HL_NORMAL) {
-                    if (currentColour != -1) { // Only change colour if previous colour is not HL_NORMAL
-                        append_to_append_buffer(obj, "\x1b[39m", 5); // Set colour back to normal
-                        currentColour = -1;
-                    }
-                    append_to_append_buffer(obj, &s[i], 1);
+            int fold = (eBuffer->numFolds && lastLine) ? fold_containing(fileRow + 1) : -1;
+            if (fold >= 0 && !row->giant) { // Says how much is folded after the row if there is room
+                char marker[32];
+                int markerLength = snprintf(marker, sizeof(marker), " [+%d lines]", eBuffer->folds[fold].end - fileRow);
+                int end = row_character_index_to_column(row, row->size);
+                if (eBuffer->softWrap) {
+                    end = (row->wrapHeight == 1) ? end : -1;
                 } else {
-                    int colour = syntax_to_colour(hl[i]);
-                    if (colour != currentColour) { // Only change colour if previous colour is not HL_NORMAL
-                        currentColour = colour;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour); // Use snprintf to write escape sequence into buffer that will be passed into append_to_append_buffer()
-                        append_to_append_buffer(obj, buf, clen);
-                    }
-                    append_to_append_buffer(obj, &s[i], 1);
+                    end -= eBuffer->colOffset;
                 }
+                if (end >= 0 && end + markerLength <= text_columns()) {
+                    append_to_append_buffer(obj, "\x1b[2;36m", 7);
+                    append_to_append_buffer(obj, marker, markerLength);
+                    append_to_append_buffer(obj, "\x1b[22m", 5);
+                }
+            }
+            if (layout && lastLine) { // Steps over what is folded after the row
+                wrapRow = (fold >= 0) ? eBuffer->folds[fold].end + 1 : wrapRow + 1;
+                wrapLine = 0;
+                wrapStart = -1;
             }
             append_to_append_buffer(obj, "\x1b[39m", 5);
         }
 
         // \x1b is the escape character (27 in decimal). [0K are the remaining three bytes. We are using the K command (Erase in Line). The 0 says clear to the right of the cursor. 
         append_to_append_buffer(obj, "\x1b[0K", 4);
-        append_to_append_buffer(obj, "\r\n", 2);
+        if (y + 1 < last) { // No newline after the last row, it could scroll the screen
+            append_to_append_buffer(obj, "\r\n", 2);
+        }
     }
 }
 
 /**
- * Displays status bar at the second last row of window
+ * Draws a row starting at the given column. Giant rows have their render moved there first.
  */
-void draw_status_bar(struct appendBuffer *obj) {
-    append_to_append_buffer(obj, "\x1b[7m", 4); // inverts colours (m command is the "Select Graphic Rendition" condition)
+void draw_row_from(struct appendBuffer *obj, editorRow *row, int colOffset) {
+    if (row->giant) {
+        giant_row_window(row, colOffset, 0);
+    }
 
-    // Prepares string to be printed
-    char status[80], renderStatus[80];
-    int length = snprintf(status, sizeof(status), "%.20s - %d lines %s", eConfig.fileName ? eConfig.fileName : "[No Name]", eConfig.numRows, eConfig.unsavedChanges != 0 ? "(modified)" : "");
-    int renderLength = snprintf(renderStatus, sizeof(renderStatus), "%s | %d/%d", eConfig.syntax ? eConfig.syntax->filetype : "no file type", eConfig.characterY + 1, eConfig.numRows);
-    if (length > eConfig.windowCols) {
-        length = eConfig.windowCols;
+    // Finds the first byte of the render that is on screen. colOffset is in columns, which only match bytes for ASCII rows.
+    char *s = row->render;
+    int i = 0;
+    int column = 0; // Screen column the next character is drawn at
+    if (row->ascii) {
+        i = colOffset - row->renderColumn;
+        if (i > row->rsize) {
+            i = row->rsize;
+        }
+    } else {
+        int rowColumn = row->renderColumn;
+        while (i < row->rsize) {
+            int codepoint;
+            int length = utf8_decode(&s[i], row->rsize - i, &codepoint);
+            int width = codepoint_width(codepoint);
+            if (rowColumn + width > colOffset) {
+                if (rowColumn < colOffset) { // A wide character cut in half by the left edge is drawn as blanks
+                    for (column = 0; column < rowColumn + width - colOffset; column++) {
+                        append_to_append_buffer(obj, " ", 1);
+                    }
+                    i += length;
+                }
+                break;
+            }
+            rowColumn += width;
+            i += length;
+        }
     }
 
-    // Adds string
-    append_to_append_buffer(obj, status, length);
+    draw_row_text(obj, row, i, column);
+}
 
-    while (length < eConfig.windowCols) { // Fills in rest of row with white spaces until the point where renderStatus barely fits
-        if (eConfig.windowCols - length == renderLength) { 
+/**
+ * Draws the render of a row from index i, starting at screen column, until it reaches the end of the screen line. Returns
+ * the index of the first character that didn't fit.
+ */
+int draw_row_text(struct appendBuffer *obj, editorRow *row, int i, int column) {
+    int currentColour = -1;
+    char *s = row->render;
+    unsigned char *hl = row->highlight;
+    int selectStart = 0, selectEnd = 0; // Render indices of the selected part of the row
+    if (eBuffer->markActive) {
+        selection_render_range(row, &selectStart, &selectEnd);
+    }
+    int selected = 0;
+    int cursor = eBuffer->numCursors ? cursors_first_in_row(row->index) : 0; // Extra cursors are shown as inverted cells
+    int cursorIndex = eBuffer->numCursors ? cursor_render_index(row, &cursor, i) : -1;
+
+    while (i < row->rsize) {
+        int codepoint = (unsigned char) s[i];
+        int length = 1;
+        int width = 1;
+        if (!row->ascii && codepoint >= 0x80) {
+            length = utf8_decode(&s[i], row->rsize - i, &codepoint);
+            width = codepoint_width(codepoint);
+        }
+        if (column > 0 && column + width > text_columns()) { // Doesn't fit, wide characters are never split at the right edge
+            break;
+        }
+
+        if (((i >= selectStart && i < selectEnd) || i == cursorIndex) != selected) { // Selected text is shown in inverted colours
+            selected = !selected;
+            append_to_append_buffer(obj, selected ? "\x1b[7m" : "\x1b[27m", selected ? 4 : 5);
+        }
+
+        if (codepoint < 32 || codepoint == 127 || (codepoint >= 0x80 && codepoint < 0xa0)) { // Handles non-printable characters and invalid UTF-8 (codepoint -1)
+            char sym = (codepoint >= 0 && codepoint < 26) ? '@' + codepoint : '?';
+            append_to_append_buffer(obj, "\x1b[7m", 4); // Highlight colour white
+            append_to_append_buffer(obj, &sym, 1);
+            append_to_append_buffer(obj, "\x1b[m", 3); // Set colour back to normal
+            if (selected) {
+                append_to_append_buffer(obj, "\x1b[7m", 4);
+            }
+            if (currentColour != -1) { // Set colour back to original
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColour); 
+                append_to_append_buffer(obj, buf, clen);
+            }
+        } else if (hl[i] == HL_NORMAL) {
+            if (currentColour != -1) { // Only change colour if previous colour is not HL_NORMAL
+                append_to_append_buffer(obj, "\x1b[39m", 5); // Set colour back to normal
+                currentColour = -1;
+            }
+            append_to_append_buffer(obj, &s[i], length);
+        } else {
+            int colour = syntax_to_colour(hl[i]);
+            if (colour != currentColour) { // Only change colour if previous colour is not HL_NORMAL
+                currentColour = colour;
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour); // Use snprintf to write escape sequence into buffer that will be passed into append_to_append_buffer()
+                append_to_append_buffer(obj, buf, clen);
+            }
+            append_to_append_buffer(obj, &s[i], length);
+        }
+
+        column += width;
+        i += length;
+        if (cursorIndex >= 0 && cursorIndex < i) {
+            cursorIndex = cursor_render_index(row, &cursor, i);
+        }
+    }
+    if (i == row->rsize && cursorIndex == i && column < text_columns()) { // A cursor at the end of the row
+        append_to_append_buffer(obj, selected ? " " : "\x1b[7m \x1b[27m", selected ? 1 : 10);
+    }
+    if (selected) {
+        append_to_append_buffer(obj, "\x1b[27m", 5);
+    }
+    return i;
+}
+
+/**
+ * Displays status bar at the second last row of window
+ */
+void draw_status_bar(struct appendBuffer *obj) {
+    append_to_append_buffer(obj, "\x1b[7m", 4); // inverts colours (m command is the "Select Graphic Rendition" condition)
+
+    // Prepares string to be printed
+    char status[160], renderStatus[80], words[32] = "counting words";
+    char bufferNumber[24] = "";
+    if (numEditorBuffers > 1) {
+        snprintf(bufferNumber, sizeof(bufferNumber), "[%d/%d] ", currentBuffer + 1, numEditorBuffers);
+    }
+    const char *state = eBuffer->unsavedChanges != 0 ? "(modified)" : (eBuffer->follow ? "(following)" : (eBuffer->loader ? "(loading)" : ""));
+    if (eBuffer->uncountedRows == 0) { // The totals are kept up to date as rows change, so this costs nothing per frame
+        snprintf(words, sizeof(words), "%lld words", eBuffer->totalWords);
+    }
+    int length = snprintf(status, sizeof(status), "%s%.20s - %d lines, %s, %lld bytes %s", bufferNumber, eBuffer->fileName ? eBuffer->fileName : "[No Name]",
+        eBuffer->numRows, words, eBuffer->totalBytes, state);
+    int renderLength = snprintf(renderStatus, sizeof(renderStatus), "%s | %d/%d", eBuffer->syntax ? eBuffer->syntax->filetype : "no file type", eBuffer->characterY + 1, eBuffer->numRows);
+    if (length > eConfig.windowCols) {
+        length = eConfig.windowCols;
+    }
+
+    // Adds string
+    append_to_append_buffer(obj, status, length);
+
+    while (length < eConfig.windowCols) { // Fills in rest of row with white spaces until the point where renderStatus barely fits
+        if (eConfig.windowCols - length == renderLength) { 
             append_to_append_buffer(obj, renderStatus, renderLength);
             break;
         } else {
@@ -714,66 +1922,541 @@ void draw_message_bar(struct appendBuffer *obj) {
     }
 }
 
+/**
+ * Returns 1 if none of the bytes have the high bit set. Checks 16 bytes at a time where SSE2 is available and 8 otherwise.
+ */
+int is_ascii(const char *s, int length) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i highBits = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        highBits = _mm_or_si128(highBits, _mm_loadu_si128((const __m128i *) &s[i]));
+    }
+    if (_mm_movemask_epi8(highBits)) { // Collects the top bit of each byte
+        return 0;
+    }
+#endif
+
+    uint64_t highWord = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, &s[i], 8);
+        highWord |= word;
+    }
+    for (; i < length; i++) {
+        highWord |= (unsigned char) s[i];
+    }
+    return (highWord & 0x8080808080808080ULL) == 0;
+}
+
+/**
+ * Decodes the UTF-8 character at the start of s and returns how many bytes it takes up. Malformed sequences decode
+ * as a single byte with codepoint -1.
+ */
+int utf8_decode(const char *s, int length, int *codepoint) {
+    const unsigned char *u = (const unsigned char *) s;
+    *codepoint = -1;
+
+    int bytes;
+    int value;
+    if (u[0] < 0x80) {
+        *codepoint = u[0];
+        return 1;
+    } else if (u[0] >= 0xc2 && u[0] < 0xe0) {
+        bytes = 2;
+        value = u[0] & 0x1f;
+    } else if (u[0] >= 0xe0 && u[0] < 0xf0) {
+        bytes = 3;
+        value = u[0] & 0x0f;
+    } else if (u[0] >= 0xf0 && u[0] < 0xf5) {
+        bytes = 4;
+        value = u[0] & 0x07;
+    } else { // Continuation byte or a lead byte that can't start a valid sequence
+        return 1;
+    }
+
+    if (bytes > length) {
+        return 1;
+    }
+    for (int i = 1; i < bytes; i++) {
+        if ((u[i] & 0xc0) != 0x80) {
+            return 1;
+        }
+        value = (value << 6) | (u[i] & 0x3f);
+    }
+
+    // Rejects overlong encodings, surrogates and values past the end of Unicode
+    if ((bytes == 3 && value < 0x800) || (bytes == 4 && value < 0x10000) || (value >= 0xd800 && value < 0xe000) || value > 0x10ffff) {
+        return 1;
+    }
+
+    *codepoint = value;
+    return bytes;
+}
+
+/**
+ * Returns how many columns a terminal uses for a character: 0 for combining marks, 2 for East Asian wide characters and
+ * emoji, otherwise 1 (including malformed bytes, which are drawn as '?')
+ */
+int codepoint_width(int codepoint) {
+    static const int zeroWidth[][2] = {
+        {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x1ab0, 0x1aff},
+        {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xe0100, 0xe01ef}
+    };
+    static const int doubleWidth[][2] = {
+        {0x1100, 0x115f}, {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+        {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe30, 0xfe4f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x1f300, 0x1f64f},
+        {0x1f900, 0x1f9ff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd}
+    };
+
+    if (codepoint < 0x300) { // Latin-1 and malformed bytes, the common case
+        return 1;
+    }
+    for (unsigned int i = 0; i < sizeof(zeroWidth) / sizeof(zeroWidth[0]); i++) {
+        if (codepoint >= zeroWidth[i][0] && codepoint <= zeroWidth[i][1]) {
+            return 0;
+        }
+    }
+    for (unsigned int i = 0; i < sizeof(doubleWidth) / sizeof(doubleWidth[0]); i++) {
+        if (codepoint >= doubleWidth[i][0] && codepoint <= doubleWidth[i][1]) {
+            return 2;
+        }
+    }
+    return 1;
+}
+
 /**
  * Converts the cursor index in terms of the characters array to an index in terms of the render array
  */
 int row_character_index_to_render_index(editorRow *row, int characterX) {
-    int renderX = 0;
-    
-    for (int i = 0; i < characterX; i++) {
-        if (row->characters[i] == '\t') { 
-            // (renderX % TAB_STOP) gives us the number of columns between the renderX and the previous tab stop
-            // (TAB_STOP - 1) is the maximum we are away from the next tab stop
-            // The math is straightforward after this
-            renderX += (TAB_STOP - 1) - (renderX % TAB_STOP);
+    if (row->ascii && row->renderStart == 0) {
+        int renderX = 0;
+        
+        for (int i = 0; i < characterX; i++) {
+            if (row->characters[i] == '\t') { 
+                // (renderX % TAB_STOP) gives us the number of columns between the renderX and the previous tab stop
+                // (TAB_STOP - 1) is the maximum we are away from the next tab stop
+                // The math is straightforward after this
+                renderX += (TAB_STOP - 1) - (renderX % TAB_STOP);
+            }
+            renderX++; // Gets us to the right of the next tab stop if a tab did exist
+        }
+
+        return renderX;
+    }
+
+    // Tabs expand to the next tab stop in columns, while other characters keep their bytes. The render of a giant row
+    // only starts partway through it.
+    int renderIndex = 0;
+    int column = row->renderColumn;
+    for (int i = row->renderStart; i < characterX;) {
+        if (row->characters[i] == '\t') {
+            int spaces = TAB_STOP - (column % TAB_STOP);
+            renderIndex += spaces;
+            column += spaces;
+            i++;
+        } else {
+            int codepoint;
+            int length = utf8_decode(&row->characters[i], row->size - i, &codepoint);
+            renderIndex += length;
+            column += codepoint_width(codepoint);
+            i += length;
         }
-        renderX++; // Gets us to the right of the next tab stop if a tab did exist
+    }
+    return renderIndex;
+}
+
+/**
+ * Converts the cursor index in terms of the characters array to the screen column it is displayed at
+ */
+int row_character_index_to_column(editorRow *row, int characterX) {
+    if (row->size >= GIANT_ROW_SIZE) { // Counts from the nearest checkpoint
+        struct rowCheckpoint *checkpoint = giant_row_checkpoint(row, characterX, INT_MAX);
+        return columns_advance(&row->characters[checkpoint->index], characterX - checkpoint->index, checkpoint->column);
     }
 
-    return renderX;
+    if (row->ascii) { // Columns are render indices
+        return row_character_index_to_render_index(row, characterX);
+    }
+    return columns_advance(row->characters, characterX, 0);
 }
 
 /**
- * Converts the index in terms of the render array to the cursor index in ters of the characters array
+ * Converts a screen column to the cursor index in terms of the characters array of the character displayed there
  */
-int row_render_index_to_character_index(editorRow *row, int renderX) {
-    int currentRenderX = 0;
-    int characterX;
-    for (characterX = 0; characterX < row->size; characterX++) {
-        if (row->characters[characterX] == '\t') {
-            currentRenderX += (TAB_STOP - 1) - (currentRenderX % TAB_STOP);
+int row_column_to_character_index(editorRow *row, int column) {
+    int currentColumn = 0;
+    int characterX = 0;
+    if (row->size >= GIANT_ROW_SIZE) { // Starts from the nearest checkpoint
+        struct rowCheckpoint *checkpoint = giant_row_checkpoint(row, INT_MAX, column);
+        currentColumn = checkpoint->column;
+        characterX = checkpoint->index;
+    }
+
+    while (characterX < row->size) {
+        int codepoint;
+        int length = utf8_decode(&row->characters[characterX], row->size - characterX, &codepoint);
+        if (codepoint == '\t') {
+            currentColumn += TAB_STOP - (currentColumn % TAB_STOP);
+        } else {
+            currentColumn += codepoint_width(codepoint);
         }
-        currentRenderX++;
 
-        if (currentRenderX > renderX) {
+        if (currentColumn > column) {
             return characterX;
         }
+        characterX += length;
     }
     return characterX;
 }
 
+/**
+ * Finds the character whose render starts at or covers renderIndex
+ */
+int row_render_index_to_character_index(editorRow *row, int renderIndex) {
+    int currentIndex = 0;
+    int column = row->renderColumn;
+    for (int characterX = row->renderStart; characterX < row->size;) {
+        int codepoint;
+        int length = utf8_decode(&row->characters[characterX], row->size - characterX, &codepoint);
+        int renderLength = length; // Characters other than tabs keep their bytes
+        if (codepoint == '\t') {
+            renderLength = TAB_STOP - (column % TAB_STOP);
+            column += renderLength;
+        } else {
+            column += codepoint_width(codepoint);
+        }
+
+        if (currentIndex + renderLength > renderIndex) {
+            return characterX;
+        }
+        currentIndex += renderLength;
+        characterX += length;
+    }
+    return row->size;
+}
+
 /**
  * Scrolls screen if cursor exits the window from top or bottom
  */ 
 void scroll() {
-    eConfig.renderX = 0;
+    eBuffer->renderX = 0;
 
-    if (eConfig.characterY < eConfig.numRows) { // Above visuble window
-        eConfig.renderX = row_character_index_to_render_index(&eConfig.row[eConfig.characterY], eConfig.characterX);
+    // Jumps like find can land in a fold, which then opens
+    int fold = eBuffer->numFolds ? fold_containing(eBuffer->characterY) : -1;
+    if (fold >= 0) {
+        fold_remove(fold);
     }
 
-    if (eConfig.characterY >= eConfig.rowOffset + eConfig.windowRows) { // Below visible window
-        eConfig.rowOffset = eConfig.characterY - eConfig.windowRows + 1;
+    if (layout_active()) { // Works in screen lines rather than rows, and only scrolls horizontally when not wrapping
+        layout_build();
+
+        int cursorLine = layout_line_of_row(eBuffer->characterY);
+        if (eBuffer->softWrap) {
+            eBuffer->colOffset = 0;
+            if (eBuffer->characterY < eBuffer->numRows) {
+                cursorLine += row_wrap_position(&eBuffer->row[eBuffer->characterY], eBuffer->characterX, &eBuffer->renderX);
+            }
+        } else if (eBuffer->characterY < eBuffer->numRows) {
+            row_materialize(&eBuffer->row[eBuffer->characterY]);
+            eBuffer->renderX = row_character_index_to_column(&eBuffer->row[eBuffer->characterY], eBuffer->characterX);
+        }
+
+        // The offsets may be stale if rows were edited or another view shortened the buffer
+        if (eBuffer->rowOffset > eBuffer->numRows) {
+            eBuffer->rowOffset = eBuffer->numRows;
+        }
+        if (!eBuffer->softWrap || eBuffer->rowOffset == eBuffer->numRows || eBuffer->wrapOffset >= eBuffer->row[eBuffer->rowOffset].wrapHeight) {
+            eBuffer->wrapOffset = 0;
+        }
+
+        int topLine = layout_line_of_row(eBuffer->rowOffset) + eBuffer->wrapOffset;
+        if (cursorLine < topLine) { // Above visible window
+            topLine = cursorLine;
+        }
+        if (cursorLine >= topLine + eConfig.windowRows) { // Below visible window
+            topLine = cursorLine - eConfig.windowRows + 1;
+        }
+
+        eBuffer->rowOffset = layout_row_at_line(topLine, &eBuffer->wrapOffset);
+        eBuffer->renderY = cursorLine - topLine;
+        if (eBuffer->softWrap) {
+            return;
+        }
+    } else {
+        if (eBuffer->characterY < eBuffer->numRows) {
+            row_materialize(&eBuffer->row[eBuffer->characterY]);
+            eBuffer->renderX = row_character_index_to_column(&eBuffer->row[eBuffer->characterY], eBuffer->characterX);
+        }
+
+        if (eBuffer->characterY < eBuffer->rowOffset) { // Above visible window
+            eBuffer->rowOffset = eBuffer->characterY;
+        }
+
+        if (eBuffer->characterY >= eBuffer->rowOffset + eConfig.windowRows) { // Below visible window
+            eBuffer->rowOffset = eBuffer->characterY - eConfig.windowRows + 1;
+        }
+        eBuffer->wrapOffset = 0;
+        eBuffer->renderY = eBuffer->characterY - eBuffer->rowOffset;
     }
 
     // To left of screen
-    if (eConfig.renderX < eConfig.colOffset) {
-        eConfig.colOffset = eConfig.renderX;
+    if (eBuffer->renderX < eBuffer->colOffset) {
+        eBuffer->colOffset = eBuffer->renderX;
+    }
+
+    if (eBuffer->renderX >= eBuffer->colOffset + text_columns()) {
+        eBuffer->colOffset = eBuffer->renderX - text_columns() + 1;
+    }
+}
+
+/**
+ * Returns how many screen lines a row takes up when soft wrapped at the window width
+ */
+int row_wrap_height(editorRow *row) {
+    if (row->size >= GIANT_ROW_SIZE) { // Giant rows aren't wrapped, they scroll sideways on their own line
+        return 1;
+    }
+
+    if (is_ascii(row->characters, row->size)) { // One column per byte apart from tabs
+        int columns = row->size;
+        if (memchr(row->characters, '\t', row->size)) {
+            columns = 0;
+            for (int i = 0; i < row->size; i++) {
+                if (row->characters[i] == '\t') {
+                    columns += (TAB_STOP - 1) - (columns % TAB_STOP);
+                }
+                columns++;
+            }
+        }
+        return columns <= text_columns() ? 1 : (columns + text_columns() - 1) / text_columns();
+    }
+
+    int column;
+    return row_wrap_position(row, row->size, &column) + 1;
+}
+
+/**
+ * Moves a wrapped position to the start of the next screen line if something width columns wide doesn't fit on this one
+ */
+void wrap_place(int width, int *line, int *column) {
+    if (*column > 0 && *column + width > text_columns()) {
+        (*line)++;
+        *column = 0;
+    }
+}
+
+/**
+ * Lays out a soft wrapped row up to characterX. Returns the screen line of the row that the character at characterX is
+ * on and stores its column. The end of a full line stays on that line, at its last column.
+ */
+int row_wrap_position(editorRow *row, int characterX, int *column) {
+    if (row->size >= GIANT_ROW_SIZE) { // Shown a screen width at a time
+        *column = row_character_index_to_column(row, characterX) % text_columns();
+        return 0;
+    }
+
+    int line = 0;
+    int rowColumn = 0; // Tab stops are counted from the start of the row, not of the screen line
+    *column = 0;
+
+    for (int i = 0; i < characterX && i < row->size;) {
+        int codepoint;
+        int length = utf8_decode(&row->characters[i], row->size - i, &codepoint);
+        if (codepoint == '\t') { // Tabs render as spaces, which can be split across lines
+            int spaces = TAB_STOP - (rowColumn % TAB_STOP);
+            for (int k = 0; k < spaces; k++) {
+                wrap_place(1, &line, column);
+                (*column)++;
+            }
+            rowColumn += spaces;
+        } else {
+            int width = codepoint_width(codepoint);
+            wrap_place(width, &line, column);
+            *column += width;
+            rowColumn += width;
+        }
+        i += length;
+    }
+
+    if (characterX < row->size) {
+        int codepoint;
+        utf8_decode(&row->characters[characterX], row->size - characterX, &codepoint);
+        wrap_place(codepoint == '\t' ? 1 : codepoint_width(codepoint), &line, column);
+    } else if (*column >= text_columns()) {
+        *column = text_columns() - 1;
+    }
+    return line;
+}
+
+/**
+ * Returns the index in the characters array of the character shown at a screen line and column of a soft wrapped row
+ */
+int row_wrap_character_index(editorRow *row, int targetLine, int targetColumn) {
+    if (row->size >= GIANT_ROW_SIZE) {
+        return row_column_to_character_index(row, targetColumn);
+    }
+
+    int line = 0;
+    int column = 0;
+    int rowColumn = 0;
+
+    int i = 0;
+    while (i < row->size) {
+        int codepoint;
+        int length = utf8_decode(&row->characters[i], row->size - i, &codepoint);
+        int width = (codepoint == '\t') ? TAB_STOP - (rowColumn % TAB_STOP) : codepoint_width(codepoint);
+
+        wrap_place(codepoint == '\t' ? 1 : width, &line, &column);
+        if (line > targetLine || (line == targetLine && column + width > targetColumn)) {
+            return i;
+        }
+
+        // The rest of a tab may continue on the next line
+        column += (codepoint == '\t') ? 1 : width;
+        for (int k = 1; codepoint == '\t' && k < width; k++) {
+            wrap_place(1, &line, &column);
+            column++;
+        }
+        rowColumn += width;
+        i += length;
+    }
+    return i;
+}
+
+/**
+ * Returns the render index where the screen line of a soft wrapped row that starts at render index i ends
+ */
+int render_wrap_end(editorRow *row, int i) {
+    if (row->ascii) {
+        return (i + text_columns() < row->rsize) ? i + text_columns() : row->rsize;
+    }
+
+    int column = 0;
+    while (i < row->rsize) {
+        int codepoint;
+        int length = utf8_decode(&row->render[i], row->rsize - i, &codepoint);
+        int width = codepoint_width(codepoint);
+        if (column > 0 && column + width > text_columns()) {
+            break;
+        }
+        column += width;
+        i += length;
+    }
+    return i;
+}
+
+/**
+ * Brings the layout index up to date. Row heights are kept across rebuilds unless the window width changed, so after
+ * inserting or deleting rows only the tree itself is rebuilt, in O(n). Without soft wrap every row is one line high.
+ */
+void layout_build() {
+    if (eBuffer->layoutValid && eBuffer->layoutWrap == eBuffer->softWrap && (!eBuffer->softWrap || eBuffer->layoutCols == text_columns())) {
+        return;
+    }
+
+    int recompute = 0;
+    if (eBuffer->softWrap) { // Heights cached while the width was different are useless
+        recompute = eBuffer->layoutCols != text_columns();
+        eBuffer->layoutCols = text_columns();
+    }
+    eBuffer->layoutWrap = eBuffer->softWrap;
+    eBuffer->layoutTree = realloc(eBuffer->layoutTree, sizeof(int) * (eBuffer->numRows + 1));
+    eBuffer->layoutTree[0] = 0;
+
+    int fold = 0; // First fold that doesn't end before row i
+    for (int i = 0; i < eBuffer->numRows; i++) {
+        editorRow *row = &eBuffer->row[i];
+        int height = 1;
+        if (eBuffer->softWrap) {
+            if (recompute || row->wrapHeight == 0) {
+                row->wrapHeight = row_wrap_height(row);
+            }
+            height = row->wrapHeight;
+        }
+
+        while (fold < eBuffer->numFolds && eBuffer->folds[fold].end < i) {
+            fold++;
+        }
+        if (fold < eBuffer->numFolds && eBuffer->folds[fold].start < i) { // Folded away
+            height = 0;
+        }
+        eBuffer->layoutTree[i + 1] = height;
+    }
+
+    // Each node adds itself to its parent, which builds the tree in place
+    for (int i = 1; i <= eBuffer->numRows; i++) {
+        int parent = i + (i & -i);
+        if (parent <= eBuffer->numRows) {
+            eBuffer->layoutTree[parent] += eBuffer->layoutTree[i];
+        }
+    }
+    eBuffer->layoutValid = 1;
+}
+
+/**
+ * Updates the height of a row that was changed in the soft wrap layout index, or forgets it if the index isn't in use
+ */
+void layout_update_row(editorRow *row) {
+    // Rows are always one line high without soft wrap, so only the wrapped height can go out of date
+    if (!eBuffer->softWrap || !eBuffer->layoutValid || !eBuffer->layoutWrap || eBuffer->layoutCols != text_columns()) {
+        row->wrapHeight = 0;
+        return;
+    }
+
+    int height = row_wrap_height(row);
+    int delta = height - row->wrapHeight;
+    row->wrapHeight = height;
+    if (eBuffer->numFolds && fold_containing(row->index) >= 0) { // Still takes up no lines
+        delta = 0;
+    }
+    for (int i = row->index + 1; delta != 0 && i <= eBuffer->numRows; i += i & -i) {
+        eBuffer->layoutTree[i] += delta;
+    }
+}
+
+/**
+ * Returns the screen line that a row starts on when soft wrapping, counted from the top of the file
+ */
+int layout_line_of_row(int index) {
+    int line = 0;
+    for (int i = index; i > 0; i -= i & -i) {
+        line += eBuffer->layoutTree[i];
+    }
+    return line;
+}
+
+/**
+ * Returns the row shown on a screen line counted from the top of the file, and stores which of its lines it is. Lines
+ * past the end of the file belong to row numRows.
+ */
+int layout_row_at_line(int line, int *lineInRow) {
+    int step = 1;
+    while (step * 2 <= eBuffer->numRows) {
+        step *= 2;
     }
 
-    if (eConfig.renderX >= eConfig.colOffset + eConfig.windowCols) {
-        eConfig.colOffset = eConfig.renderX - eConfig.windowCols + 1;
+    // Descends the tree, keeping the largest number of rows that fit before the line
+    int index = 0;
+    for (; step > 0; step /= 2) {
+        if (index + step <= eBuffer->numRows && eBuffer->layoutTree[index + step] <= line) {
+            index += step;
+            line -= eBuffer->layoutTree[index];
+        }
+    }
+
+    *lineInRow = line;
+    return index;
+}
+
+/**
+ * Returns the first line on screen for a pair of offsets, in screen lines when soft wrapping or folding and in rows otherwise
+ */
+int layout_top_line(int rowOffset, int wrapOffset) {
+    if (!layout_active()) {
+        return rowOffset;
     }
+    return layout_line_of_row(rowOffset) + wrapOffset;
 }
 
 /**
@@ -781,22 +2464,30 @@ void scroll() {
  */ 
 int read_key() {
     int notRead;
-    char input;
+    unsigned char input; // Unsigned so bytes of UTF-8 characters aren't returned as negative keys
 
-    while ((notRead = read(STDIN_FILENO, &input, 1)) != 1) { 
+    while ((notRead = follow_wait() ? 0 : read_input((char*) &input)) != 1) { // 0 is a timeout, like read() gives
+        if ((notRead == 0 || (notRead == -1 && errno != EAGAIN)) && serverMode) { // Client hung up or its connection was reset
+            server_detach();
+        }
         if (notRead == -1 && errno != EAGAIN) {
             safe_exit("read");
         }
+        unsigned int generation = eBuffer->generation;
+        editor_idle(); // read() timed out, so the user isn't typing
+        if (generation != eBuffer->generation && !serverMode) { // Idle work changed what is on screen
+            refresh_screen();
+        }
     }
 
     // If input is an escape sequence
     if (input == '\x1b') {
         // Read two more bytes
         char seq[3]; 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        if (read_input(&seq[0]) != 1) {
             return '\x1b';
         }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (read_input(&seq[1]) != 1) {
             return '\x1b';
         }
         
@@ -804,10 +2495,27 @@ int read_key() {
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
                 // Reads one more byte
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (read_input(&seq[2]) != 1) {
                     return '\x1b';
                 }
 
+                if (seq[2] == ';') { // Arrow keys with modifiers arrive as ESC [ 1 ; <modifier> <letter>
+                    char modifier[2];
+                    if (read_input(&modifier[0]) != 1 || read_input(&modifier[1]) != 1) {
+                        return '\x1b';
+                    }
+                    if (modifier[0] == '5') { // Ctrl
+                        switch (modifier[1]) {
+                            case 'C':
+                                return CTRL_ARROW_RIGHT;
+                            case 'D':
+                                return CTRL_ARROW_LEFT;
+                            case 'B':
+                                return CTRL_ARROW_DOWN;
+                        }
+                    }
+                }
+
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1':
@@ -861,42 +2569,55 @@ int read_key() {
  * Handles key inputs meant for moving the cursor
  */ 
 void move_cursor(int input) {
-    editorRow *row = (eConfig.characterY >= eConfig.numRows) ? NULL : &eConfig.row[eConfig.characterY];
+    editorRow *row = (eBuffer->characterY >= eBuffer->numRows) ? NULL : &eBuffer->row[eBuffer->characterY];
+    int column = 0; // Up and down keep the cursor in the same screen column
+    if (row) {
+        row_materialize(row);
+        column = row_character_index_to_column(row, eBuffer->characterX);
+    }
 
     switch (input) {
         case ARROW_LEFT:
-            if (eConfig.characterX != 0) {
-                eConfig.characterX--;
-            } else if (eConfig.characterY > 0) { 
-                eConfig.characterY--;
-                eConfig.characterX = eConfig.row[eConfig.characterY].size;
+            if (eBuffer->characterX != 0) {
+                do { // Steps over the continuation bytes of a multibyte character
+                    eBuffer->characterX--;
+                } while (eBuffer->characterX > 0 && (row->characters[eBuffer->characterX] & 0xc0) == 0x80);
+            } else if (eBuffer->characterY > 0) { 
+                eBuffer->characterY = fold_visible_row(eBuffer->characterY - 1);
+                eBuffer->characterX = eBuffer->row[eBuffer->characterY].size;
             }
             break;
         case ARROW_RIGHT:
-            if (row && eConfig.characterX < row->size) {
-                eConfig.characterX++;
-            } else if (row && eConfig.characterX == row->size) {
-                eConfig.characterY++;
-                eConfig.characterX = 0;
+            if (row && eBuffer->characterX < row->size) {
+                do {
+                    eBuffer->characterX++;
+                } while (eBuffer->characterX < row->size && (row->characters[eBuffer->characterX] & 0xc0) == 0x80);
+            } else if (row && eBuffer->characterX == row->size) {
+                eBuffer->characterY = fold_next_row(eBuffer->characterY);
+                eBuffer->characterX = 0;
             }
             break;
         case ARROW_UP:
-            if (eConfig.characterY != 0) {
-                eConfig.characterY--;
+            if (eBuffer->characterY != 0) {
+                eBuffer->characterY = fold_visible_row(eBuffer->characterY - 1);
+                eBuffer->characterX = row_column_to_character_index(&eBuffer->row[eBuffer->characterY], column);
             }
             break;
         case ARROW_DOWN:
-            if (eConfig.characterY < eConfig.numRows) {
-                eConfig.characterY++;
+            if (eBuffer->characterY < eBuffer->numRows) {
+                eBuffer->characterY = fold_next_row(eBuffer->characterY);
+                if (eBuffer->characterY < eBuffer->numRows) {
+                    eBuffer->characterX = row_column_to_character_index(&eBuffer->row[eBuffer->characterY], column);
+                }
             }
             break;    
     }
 
     // If cursor goes past end of line, then this moves it back to the end of the line
-    row = (eConfig.characterY >= eConfig.numRows) ? NULL : &eConfig.row[eConfig.characterY];
+    row = (eBuffer->characterY >= eBuffer->numRows) ? NULL : &eBuffer->row[eBuffer->characterY];
     int rowLen = row ? row->size : 0;
-    if (eConfig.characterX > rowLen) {
-        eConfig.characterX = rowLen;
+    if (eBuffer->characterX > rowLen) {
+        eBuffer->characterX = rowLen;
     }
 }
 
@@ -904,52 +2625,56 @@ void move_cursor(int input) {
  * Called when character is typed
  */
 void insert_character(int character) {
-    if (eConfig.characterY == eConfig.numRows) { // If we are at the end of the file, we need to add a new row.
-        insert_row(eConfig.numRows, "", 0);
+    if (eBuffer->characterY == eBuffer->numRows) { // If we are at the end of the file, we need to add a new row.
+        insert_row(eBuffer->numRows, "", 0);
     }
-    insert_character_in_row(&eConfig.row[eConfig.characterY], eConfig.characterX, character);
-    eConfig.characterX++;
+    insert_character_in_row(&eBuffer->row[eBuffer->characterY], eBuffer->characterX, character);
+    eBuffer->characterX++;
 }
 
 /**
  * Called when newline (ENTER, etc) is pressed
  */
 void insert_new_line() {
-    if (eConfig.characterX == 0) { // If we are at begining of line, insert blank lie before row we were on
-        insert_row(eConfig.characterY, "", 0);
+    if (eBuffer->characterX == 0) { // If we are at begining of line, insert blank lie before row we were on
+        insert_row(eBuffer->characterY, "", 0);
     } else { // Otherwise, split line we are on into two rows
-        editorRow *row = &eConfig.row[eConfig.characterY];
-        insert_row(eConfig.characterY + 1, &row->characters[eConfig.characterX], row->size - eConfig.characterX);
-        row = &eConfig.row[eConfig.characterY];
-        row->size = eConfig.characterX;
-        row->characters[row->size] = '\0';
-        update_row(row);
+        editorRow *row = &eBuffer->row[eBuffer->characterY];
+        insert_row(eBuffer->characterY + 1, &row->characters[eBuffer->characterX], row->size - eBuffer->characterX);
+        truncate_row(&eBuffer->row[eBuffer->characterY], eBuffer->characterX);
     }
-    eConfig.characterY++;
-    eConfig.characterX = 0;
+    eBuffer->characterY++;
+    eBuffer->characterX = 0;
 }
 
 /**
  * Called when DELETE, etc. is pressed
  */
 void delete_character() {
-    if (eConfig.characterY == eConfig.numRows) { // Cursor past end of file, nothing to delete
+    if (eBuffer->characterY == eBuffer->numRows) { // Cursor past end of file, nothing to delete
         return;
     }
 
-    if (eConfig.characterX == 0 && eConfig.characterY == 0) {
+    if (eBuffer->characterX == 0 && eBuffer->characterY == 0) {
         return;
     }
 
-    editorRow *row = &eConfig.row[eConfig.characterY];
-    if (eConfig.characterX > 0) {
-        delete_character_in_row(row, eConfig.characterX - 1);
-        eConfig.characterX--; // Move cursor one to left after deleting
+    editorRow *row = &eBuffer->row[eBuffer->characterY];
+    if (eBuffer->characterX > 0) {
+        // Deletes every byte of the character before the cursor
+        int start = eBuffer->characterX - 1;
+        while (start > 0 && (row->characters[start] & 0xc0) == 0x80) {
+            start--;
+        }
+        while (eBuffer->characterX > start) {
+            delete_character_in_row(row, start);
+            eBuffer->characterX--; // Move cursor one to left after deleting
+        }
     } else {
-        eConfig.characterX = eConfig.row[eConfig.characterY - 1].size;
-        append_string_in_row(&eConfig.row[eConfig.characterY] - 1, row->characters, row->size);
-        delete_row(eConfig.characterY);
-        eConfig.characterY--;
+        eBuffer->characterX = eBuffer->row[eBuffer->characterY - 1].size;
+        append_string_in_row(&eBuffer->row[eBuffer->characterY] - 1, row->characters, row->size);
+        delete_row(eBuffer->characterY);
+        eBuffer->characterY--;
     }
 }
 
@@ -960,6 +2685,19 @@ void process_key_press() {
     static int quitTimes = QUIT_TIMES; // Use static variable so value is consistent every time we call this function (in subsequent calls, variable is not re-initialized)
 
     int input = read_key(); // Gets input
+    if (eBuffer->follow && is_edit_key(input)) {
+        set_status_message("Read-only while following %s", eBuffer->fileName);
+        return;
+    }
+    if (eBuffer->loader && is_edit_key(input)) {
+        set_status_message("Still loading %s", eBuffer->fileName);
+        return;
+    }
+
+    if (eBuffer->numCursors && cursors_handle_key(input)) { // Applied at every cursor in one batch
+        quitTimes = QUIT_TIMES;
+        return;
+    }
 
     // Checks if input matches any reserved commands
     switch (input) {
@@ -968,11 +2706,19 @@ void process_key_press() {
             break;
 
         case CTRL_KEY('q'):
-            if (eConfig.unsavedChanges != 0 && quitTimes > 0) {
+            if (serverMode) { // Only this client goes away, the buffer stays loaded for the next attach
+                server_detach();
+            }
+            if (eBuffer->unsavedChanges != 0 && quitTimes > 0) {
                 set_status_message("File has unsaved changes. Press Ctrl-Q %d more times to quit.", quitTimes);
                 quitTimes--;
                 return;
             }
+            journal_remove(); // Quitting discards unsaved changes on purpose
+            if (numEditorBuffers > 1) { // Only closes this buffer
+                buffer_close();
+                return;
+            }
             // Clears screen
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
@@ -986,6 +2732,10 @@ void process_key_press() {
         case CTRL_KEY('f'):
             find();
             break;
+
+        case CTRL_KEY('r'):
+            replace_all();
+            break;
         
         case BACKSPACE:
         case CTRL_KEY('h'):
@@ -1004,48 +2754,222 @@ void process_key_press() {
             move_cursor(input);
             break;
 
+        // Move a word at a time
+        case CTRL_ARROW_LEFT:
+        case CTRL_ARROW_RIGHT:
+            move_word(input);
+            break;
+
+        case CTRL_ARROW_DOWN: // Adds a cursor below, or on every selected row
+            cursors_add();
+            break;
+
+        case CTRL_KEY('n'): // Toggles line numbers
+            line_numbers_toggle();
+            break;
+
+        case CTRL_KEY('g'): // Jumps to a line number typed by the user
+            goto_line();
+            break;
+
         // Move to top or bottom of window
         case PAGE_UP:   
         case PAGE_DOWN:
             { // Create code block so we can declare variables
-                if (input == PAGE_UP) { // Moves cursor to top of window
-                    eConfig.characterY = eConfig.rowOffset;
-                } else if (input == PAGE_DOWN) { // Moves cursor to bottom of window
-                    eConfig.characterY = eConfig.rowOffset + eConfig.windowRows - 1;
-                    if (eConfig.characterY > eConfig.numRows) { // Ensures that the index is not larger than the max number
-                        eConfig.characterY = eConfig.numRows;
+                if (layout_active()) { // Moves a screen of lines from the top of the window, keeping the cursor's column
+                    int topLine = layout_top_line(eBuffer->rowOffset, eBuffer->wrapOffset);
+                    int line = (input == PAGE_UP) ? topLine - eConfig.windowRows : topLine + 2 * eConfig.windowRows - 1;
+                    int lastLine = layout_line_of_row(eBuffer->numRows);
+                    if (line < 0) {
+                        line = 0;
+                    } else if (line > lastLine) {
+                        line = lastLine;
+                    }
+
+                    int lineInRow;
+                    eBuffer->characterY = layout_row_at_line(line, &lineInRow);
+                    eBuffer->characterX = 0;
+                    if (eBuffer->characterY < eBuffer->numRows && eBuffer->softWrap) {
+                        eBuffer->characterX = row_wrap_character_index(&eBuffer->row[eBuffer->characterY], lineInRow, eBuffer->renderX);
+                    } else if (eBuffer->characterY < eBuffer->numRows) {
+                        eBuffer->characterX = row_column_to_character_index(&eBuffer->row[eBuffer->characterY], eBuffer->renderX);
                     }
+                    break;
                 }
 
-                int times = eConfig.windowRows;
-                while (times--) {
-                    move_cursor(input == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+                // Without folds or wrapping a screen is windowRows rows, so the cursor goes straight there from the top or
+                // bottom of the window instead of stepping through every row
+                int row = (input == PAGE_UP) ? eBuffer->rowOffset - eConfig.windowRows : eBuffer->rowOffset + 2 * eConfig.windowRows - 1;
+                if (row < 0) {
+                    row = 0;
+                } else if (row > eBuffer->numRows) { // Ensures that the index is not larger than the max number
+                    row = eBuffer->numRows;
+                }
+                eBuffer->characterY = row;
+                eBuffer->characterX = 0;
+                if (row < eBuffer->numRows) {
+                    eBuffer->characterX = row_column_to_character_index(&eBuffer->row[row], eBuffer->renderX);
                 }
             }
             break;
 
         // Move cursor to ends of line
         case HOME_KEY: // Begining
-            eConfig.characterX = 0;
+            eBuffer->characterX = 0;
             break;
         case END_KEY: // End
-            if (eConfig.characterY < eConfig.numRows) {
-                eConfig.characterX = eConfig.row[eConfig.characterY].size;
+            if (eBuffer->characterY < eBuffer->numRows) {
+                eBuffer->characterX = eBuffer->row[eBuffer->characterY].size;
             }
             break;
 
-        case CTRL_KEY('l'):
-        case '\x1b':
-            break;
-        
-        default:
-            insert_character(input);
+        case CTRL_KEY('l'): // Redraws the whole screen
+            eConfig.screenValid = 0;
+            break;
+
+        case CTRL_KEY('o'): // Opens another file in a new buffer
+            if (serverMode) { // The server keeps one buffer per file, shared between clients
+                set_status_message("Attach another client to open a file");
+                break;
+            }
+            {
+                char *fileName = prompt("Open: %s (ESC to cancel)", NULL, 0);
+                if (fileName) {
+                    buffer_open(fileName);
+                    free(fileName);
+                }
+            }
+            break;
+
+        case CTRL_KEY('b'): // Switches to the next buffer
+            if (serverMode) {
+                set_status_message("Attach another client to switch files");
+            } else if (numEditorBuffers > 1) {
+                buffer_switch((currentBuffer + 1) % numEditorBuffers);
+                set_status_message("Buffer %d of %d: %s", currentBuffer + 1, numEditorBuffers, eBuffer->fileName ? eBuffer->fileName : "[No Name]");
+            }
+            break;
+
+        case CTRL_KEY(']'): // Jumps to the bracket matching the one under the cursor
+            bracket_match();
+            break;
+
+        case CTRL_KEY('u'): // Jumps to the bracket that opens the enclosing block
+            bracket_enclosing();
+            break;
+
+        case CTRL_KEY('@'): // Ctrl-Space sets the mark at the cursor, or clears it
+            if (eBuffer->markActive) {
+                selection_clear();
+            } else {
+                eBuffer->markActive = 1;
+                eBuffer->markX = eBuffer->characterX;
+                eBuffer->markY = eBuffer->characterY;
+                set_status_message("Mark set");
+            }
+            break;
+
+        case CTRL_KEY('c'): // Copies the selection
+            if (clipboard_copy()) {
+                set_status_message("Copied %d lines", clipboardLength);
+                selection_clear();
+            }
+            break;
+
+        case CTRL_KEY('x'): // Cuts the selection
+            clipboard_cut();
+            break;
+
+        case CTRL_KEY('v'): // Pastes at the cursor
+            clipboard_paste();
+            break;
+
+        case CTRL_KEY('k'): // Folds the block the cursor is in, or opens the fold under the cursor
+            {
+                int fold = fold_containing(eBuffer->characterY + 1);
+                if (fold >= 0) {
+                    fold_remove(fold);
+                } else {
+                    fold_block();
+                }
+            }
+            break;
+
+        case CTRL_KEY('y'): // Folds the rows from the cursor to a given line
+            fold_manual();
+            break;
+
+        case CTRL_KEY('d'): // Toggles marking the rows that differ from the file on disk
+            diff_gutter_toggle();
+            break;
+
+        case CTRL_KEY('e'): // Replaces the selected rows with what a command makes of them
+            filter_rows();
+            break;
+
+        case CTRL_KEY('w'): // Toggles soft wrapping
+            eBuffer->softWrap = !eBuffer->softWrap;
+            eBuffer->layoutValid = 0; // Edits made while it is off don't keep the index up to date
+            eConfig.screenValid = 0;
+            set_status_message("Soft wrap %s", eBuffer->softWrap ? "on" : "off");
+            break;
+
+        case '\x1b':
+            selection_clear();
+            break;
+        
+        default:
+            insert_character(input);
             break;
     }
 
+    if (eBuffer->markActive) { // The selection follows the cursor
+        if (is_edit_key(input)) { // Rows the mark was on may have moved
+            selection_clear();
+        }
+        eConfig.screenValid = 0;
+    }
     quitTimes = QUIT_TIMES; // If Ctrl-Q is not pressed, value resets
 }
 
+/**
+ * Checks if a key would change the buffer or the file
+ */
+int is_edit_key(int key) {
+    switch (key) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('f'):
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case CTRL_ARROW_LEFT:
+        case CTRL_ARROW_RIGHT:
+        case CTRL_ARROW_DOWN:
+        case CTRL_KEY('n'):
+        case CTRL_KEY('g'):
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case HOME_KEY:
+        case END_KEY:
+        case CTRL_KEY('l'):
+        case CTRL_KEY('w'):
+        case CTRL_KEY('o'):
+        case CTRL_KEY('b'):
+        case CTRL_KEY(']'):
+        case CTRL_KEY('u'):
+        case CTRL_KEY('k'):
+        case CTRL_KEY('y'):
+        case CTRL_KEY('@'):
+        case CTRL_KEY('c'):
+        case CTRL_KEY('d'):
+        case '\x1b':
+            return 0;
+        default: // Everything else inserts, deletes or saves
+            return 1;
+    }
+}
+
 /**
  * Appends a string to the end of the appendBuffer's string.
  */ 
@@ -1080,8 +3004,8 @@ char *rows_to_string(int *bufferLength) {
     int totalLength = 0;
     
     // Add up lengths of each row (we add one for the newline character)
-    for (int i = 0; i < eConfig.numRows; i++) {
-        totalLength += eConfig.row[i].size + 1;
+    for (int i = 0; i < eBuffer->numRows; i++) {
+        totalLength += eBuffer->row[i].size + 1;
     }
     *bufferLength = totalLength;
 
@@ -1090,9 +3014,9 @@ char *rows_to_string(int *bufferLength) {
     char *p = buf;
 
     // In each iteration, we copy contents of the row and add a newline character
-    for (int i = 0; i < eConfig.numRows; i++)  {
-        memcpy(p, eConfig.row[i].characters, eConfig.row[i].size);
-        p += eConfig.row[i].size;
+    for (int i = 0; i < eBuffer->numRows; i++)  {
+        memcpy(p, eBuffer->row[i].characters, eBuffer->row[i].size);
+        p += eBuffer->row[i].size;
         *p = '\n';
         p++; // next memory address
     }
@@ -1104,44 +3028,98 @@ char *rows_to_string(int *bufferLength) {
  * Updates the highlight array to contain colours of characters
  */
 void update_syntax(editorRow *row) {
-    row->highlight = realloc(row->highlight, row->size); // In case row grew in size before last call
+    int inComment = (row->index > 0 && eBuffer->row[row->index - 1].highlightOpenComment); // True if row starts inside a multiline comment
+    editorRow *edited = row;
+    unsigned char *scratch = NULL;
+
+    // If the comment status at the end of the row changes, the following rows must be recoloured as well
+    while (1) {
+        int openComment = (row == edited) ? highlight_row(row, inComment, &eBuffer->giantPending) : row_carry_comment(row, inComment, &scratch);
+        int changed = (row->highlightOpenComment != openComment);
+        row->highlightOpenComment = openComment;
+
+        if (!changed || row->index + 1 >= eBuffer->numRows) {
+            break;
+        }
+        row = &eBuffer->row[row->index + 1];
+        inComment = openComment;
+    }
+    free(scratch);
+}
+
+/**
+ * Colours a single row assuming it starts with the given multiline comment state. Returns the state at the end of the row.
+ * A giant row that still has checkpoints to validate sets *giantPending, which threads point at a flag of their own.
+ * Threads may only colour rows from bracketDirtyRow on, as rows before it update the bracket tree.
+ */
+int highlight_row(editorRow *row, int inComment, int *giantPending) {
+    if (row->render == NULL) {
+        update_render(row);
+    }
+
+    if (row->giant) { // Only the part on screen has a render to colour
+        return giant_row_highlight(row, inComment, giantPending);
+    }
+
+    row->highlight = realloc(row->highlight, row->rsize); // In case row grew in size before last call
     memset(row->highlight, HL_NORMAL, row->rsize); // Sets memory
 
-    if (eConfig.syntax == NULL) {
-        return;
+    int openComment = 0;
+    if (eBuffer->syntax != NULL) {
+        struct highlightState state = {inComment, 0, HL_NORMAL, 1, HL_NORMAL};
+        highlight_text(row->render, row->rsize, row->rsize, row->highlight, &state);
+        openComment = state.inComment;
     }
 
-    char **keywords = eConfig.syntax->keywords;
+    bracket_row_summary(row); // Needs the colours to know which brackets are in strings or comments
+    return openComment;
+}
+
+/**
+ * Colours text starting in the given highlighter state and leaves the state at the end of it in state. Tokens that start
+ * before length may run on up to limit, which highlight must have room for. Returns the index where colouring stopped,
+ * which is length unless a token ran past it.
+ */
+int highlight_text(const char *text, int length, int limit, unsigned char *highlight, struct highlightState *state) {
+    struct editorSyntax *syntax = eBuffer->syntax;
 
-    char *scs = eConfig.syntax->singlelineCommentStart;
-    char *mcs = eConfig.syntax->mlCommentStart;
-    char *mce = eConfig.syntax->mlCommentEnd;
+    char *scs = syntax->singlelineCommentStart;
+    char *mcs = syntax->mlCommentStart;
+    char *mce = syntax->mlCommentEnd;
 
     int scsLen = scs ? strlen(scs) : 0;
     int mcsLen = mcs ? strlen(mcs) : 0;
     int mceLen = mce ? strlen(mce) : 0;
-    
-    int previousSeparator = 1; // Consider begining of line as separator
-    int inString = 0;
-    int inComment = (row->index > 0 && eConfig.row[row->index - 1].highlightOpenComment); // True if row has a multiline comment
+
+    int inComment = state->inComment;
+    int inString = state->inString;
+    int previousSeparator = state->previousSeparator;
 
     int i = 0;
-    while (i < row->size) {
-        char c = row->render[i];
-        unsigned char prevHighlight = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
+    if (state->restOfLine != HL_NORMAL) { // A single line comment started earlier in the row
+        memset(highlight, state->restOfLine, length);
+        i = length;
+    }
 
-        if (scsLen && !inString && !inComment) { // Checks is we are not within quotations
-            if (!strncmp(&row->render[i], scs, scsLen)) { // Checks if string is present in line
-                memset(&row->highlight[i], HL_COMMENT, row->rsize - i); // Colours
+    while (i < length) {
+        char c = text[i];
+        unsigned char prevHighlight = (i > 0) ? highlight[i - 1] : state->previousHighlight;
+        unsigned char start = syntax->startFlags[(unsigned char) c]; // Tokens that can begin at this character
+
+        if (scsLen && !inString && !inComment && (start & SYNTAX_START_SLCOMMENT)) { // Checks is we are not within quotations
+            if (i + scsLen <= limit && !strncmp(&text[i], scs, scsLen)) { // Checks if string is present in line
+                memset(&highlight[i], HL_COMMENT, length - i); // Colours
+                state->restOfLine = HL_COMMENT;
+                i = length;
                 break; // At end of line so we exit loop
             }
         }
 
         if (mcsLen && mceLen && !inString) { // Ensures parameters are defined
             if (inComment) { // Sees if we are in comment
-                row->highlight[i] = HL_MLCOMMENT; // Sets highlight colour
-                if (!strncmp(&row->render[i], mce, mceLen)) { // If we are at the end of the comment
-                    memset(&row->highlight[i], HL_MLCOMMENT, mceLen); 
+                highlight[i] = HL_MLCOMMENT; // Sets highlight colour
+                if ((start & SYNTAX_END_MLCOMMENT) && i + mceLen <= limit && !strncmp(&text[i], mce, mceLen)) { // If we are at the end of the comment
+                    memset(&highlight[i], HL_MLCOMMENT, mceLen); 
                     i += mceLen;
                     inComment = 0;
                     previousSeparator = 1;
@@ -1150,17 +3128,17 @@ void update_syntax(editorRow *row) {
                     i++;
                     continue;
                 } 
-            } else if (!strncmp(&row->render[i], mcs, mcsLen)) { // If we have reached the start of a ML comment
-                memset(&row->highlight[i], HL_MLCOMMENT, mcsLen);
+            } else if ((start & SYNTAX_START_MLCOMMENT) && i + mcsLen <= limit && !strncmp(&text[i], mcs, mcsLen)) { // If we have reached the start of a ML comment
+                memset(&highlight[i], HL_MLCOMMENT, mcsLen);
                 i += mcsLen;
                 inComment = 1;
                 continue;
             }
         }
 
-        if (eConfig.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (inString) {
-                row->highlight[i] = HL_STRING;
+                highlight[i] = HL_STRING;
                 if (c == inString) { // Check if current character is closing quotation
                     inString = 0;
                 }
@@ -1168,57 +3146,199 @@ void update_syntax(editorRow *row) {
                 previousSeparator = 1;
                 continue;
             } else {
-                if (c == '"' || c == '\'' || c == '\"') {
+                if (start & SYNTAX_START_STRING) {
                     inString = c;
-                    row->highlight[i] = HL_STRING;
+                    highlight[i] = HL_STRING;
                     i++;
                     continue;
                 }
             }
         }
         
-        if (eConfig.syntax->flags & HL_HIGHLIGHT_NUMBERS) { // Checks if numbers should be highighted for the current file type
-            if (isdigit(c) && (previousSeparator || prevHighlight == HL_NUMBER) || (c == '.' && prevHighlight == HL_NUMBER)) { // If number, use number highlighting
-                row->highlight[i] = HL_NUMBER;
+        if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) && (start & SYNTAX_START_NUMBER)) { // Checks if numbers should be highighted for the current file type
+            if ((CHAR_CLASS(c) & CHAR_DIGIT) && (previousSeparator || prevHighlight == HL_NUMBER) || (c == '.' && prevHighlight == HL_NUMBER)) { // If number, use number highlighting
+                highlight[i] = HL_NUMBER;
                 i++;
                 previousSeparator = 0;
                 continue;
             }
         } 
 
-        if (previousSeparator) { // Check if previous character was a separator
-            int j;
-            for (j = 0; keywords[j]; j++) { // Go through all available keywords until match is found
-                int keywordLen = strlen(keywords[j]);
-                
-                // Checks if secondary keyword and if so, remove '|'
-                int keyword2 = (keywords[j][keywordLen - 1] == '|'); 
-                if (keyword2) {
-                    keywordLen--;
+        if (start & SYNTAX_START_RULE) { // Extra token rules from the syntax file
+            int r;
+            for (r = 0; r < syntax->numRules; r++) {
+                struct syntaxRule *rule = &syntax->rules[r];
+                if (i + rule->prefixLength <= limit && !strncmp(&text[i], rule->prefix, rule->prefixLength)) {
+                    if (rule->toEndOfLine) {
+                        memset(&highlight[i], rule->highlight, length - i);
+                        state->restOfLine = rule->highlight;
+                        i = length;
+                        break;
+                    }
+
+                    int end = i + rule->prefixLength;
+                    while (end < limit && !(CHAR_CLASS(text[end]) & CHAR_SEPARATOR)) {
+                        end++;
+                    }
+                    memset(&highlight[i], rule->highlight, end - i);
+                    i = end;
+                    break;
+                }
+            }
+
+            if (r < syntax->numRules) {
+                previousSeparator = 1;
+                continue;
+            }
+        }
+
+        if (previousSeparator && syntax->byteClass[(unsigned char) c]) { // Check if previous character was a separator
+            // Walk the keyword trie and remember the longest keyword that is followed by a separator
+            int trieState = 1;
+            int matchLength = 0;
+            unsigned char matchHighlight = HL_NORMAL;
+            for (int k = i; k < limit; k++) {
+                int byteClass = syntax->byteClass[(unsigned char) text[k]];
+                if (!byteClass) {
+                    break;
                 }
 
-                if (!strncmp(&row->render[i], keywords[j], keywordLen) /* Does keyword exist? */ && is_separator(row->render[i + keywordLen]) /* Is there a separator directly after keyword */) {
-                    memset(&row->highlight[i], keyword2 ? HL_KEYWORD2 : HL_KEYWORD1, keywordLen);
-                    i+= keywordLen;
+                trieState = syntax->transitions[trieState * syntax->numClasses + byteClass];
+                if (!trieState) {
                     break;
                 }
+
+                if (syntax->accept[trieState] && (k + 1 >= limit || (CHAR_CLASS(text[k + 1]) & CHAR_SEPARATOR))) {
+                    matchLength = k - i + 1;
+                    matchHighlight = syntax->accept[trieState];
+                }
             }
 
-            if (keywords[j] != NULL) {
+            if (matchLength) {
+                memset(&highlight[i], matchHighlight, matchLength);
+                i += matchLength;
                 previousSeparator = 0;
                 continue;
             }
         }
         
-        previousSeparator = is_separator(c);
+        previousSeparator = CHAR_CLASS(c) & CHAR_SEPARATOR;
         i++;
     }
 
-    // Tells us if multicomment is closed in this row or if it continues
-    int changed = (row->highlightOpenComment != inComment);
-    row->highlightOpenComment = inComment;
-    if (changed && row->index + 1 < eConfig.numRows) { // If comment status changed, update syntax for all rows 
-        update_syntax(&eConfig.row[row->index + 1]);
+    state->inComment = inComment;
+    state->inString = inString;
+    state->previousSeparator = previousSeparator;
+    if (i > 0) {
+        state->previousHighlight = highlight[i - 1];
+    }
+    return i;
+}
+
+/**
+ * Thread entry point for the initial highlight pass. Colours its chunk assuming the chunk starts outside of a multiline comment.
+ */
+void *highlight_chunk_worker(void *arg) {
+    struct highlightChunk *chunk = arg;
+
+    int inComment = 0;
+    for (int i = chunk->start; i < chunk->end; i++) {
+        inComment = highlight_row(&eBuffer->row[i], inComment, &chunk->giantPending);
+        eBuffer->row[i].highlightOpenComment = inComment;
+    }
+
+    return NULL;
+}
+
+/**
+ * Recolours rows starting at index with the correct multiline comment state until the state at the end of a row matches
+ * what was computed before. Rows that aren't coloured only have their state carried. Returns the index of the row where
+ * the states agreed again.
+ */
+int rehighlight_from(int index, int inComment) {
+    unsigned char *scratch = NULL;
+    int i;
+    for (i = index; i < eBuffer->numRows; i++) {
+        int openComment = row_carry_comment(&eBuffer->row[i], inComment, &scratch);
+        int converged = (openComment == eBuffer->row[i].highlightOpenComment);
+        eBuffer->row[i].highlightOpenComment = openComment;
+        inComment = openComment;
+
+        if (converged) {
+            break;
+        }
+    }
+    free(scratch);
+    return i;
+}
+
+/**
+ * Colours every row in the file. Large files are split into chunks that are highlighted speculatively on several threads,
+ * then a sequential pass redoes only the chunks that actually started inside a multiline comment.
+ */
+void highlight_all_rows() {
+    eBuffer->generation++;
+    if (eBuffer->paged) { // Would bring the whole file into memory, so rows are coloured as they are displayed instead
+        paged_release_all();
+        comment_scan_start();
+        return;
+    }
+    eBuffer->bracketDirtyRow = 0; // Rows are recoloured on several threads, which must not update the tree
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = eBuffer->numRows / HIGHLIGHT_CHUNK_MIN_ROWS;
+    if (threads > cores) {
+        threads = cores;
+    }
+    if (threads > HIGHLIGHT_MAX_THREADS) {
+        threads = HIGHLIGHT_MAX_THREADS;
+    }
+
+    if (threads <= 1) { // Not worth the threads, colour everything in order
+        int inComment = 0;
+        for (int i = 0; i < eBuffer->numRows; i++) {
+            inComment = highlight_row(&eBuffer->row[i], inComment, &eBuffer->giantPending);
+            eBuffer->row[i].highlightOpenComment = inComment;
+        }
+        return;
+    }
+
+    struct highlightChunk chunks[HIGHLIGHT_MAX_THREADS];
+    int chunkSize = (eBuffer->numRows + threads - 1) / threads;
+
+    for (int t = 0; t < threads; t++) {
+        chunks[t].start = t * chunkSize;
+        chunks[t].end = chunks[t].start + chunkSize;
+        chunks[t].giantPending = 0;
+        if (chunks[t].end > eBuffer->numRows) {
+            chunks[t].end = eBuffer->numRows;
+        }
+
+        // If a thread can't be created, colour the chunk on this thread instead
+        chunks[t].threaded = (pthread_create(&chunks[t].thread, NULL, highlight_chunk_worker, &chunks[t]) == 0);
+        if (!chunks[t].threaded) {
+            highlight_chunk_worker(&chunks[t]);
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        if (chunks[t].threaded) {
+            pthread_join(chunks[t].thread, NULL);
+        }
+        eBuffer->giantPending |= chunks[t].giantPending;
+    }
+
+    // Fix-up pass: a chunk only needs recolouring if the row before it ends inside a comment
+    int resumeFrom = 0;
+    for (int t = 1; t < threads; t++) {
+        int start = chunks[t].start;
+        if (start < resumeFrom) { // Already recoloured while fixing a previous chunk
+            continue;
+        }
+
+        if (eBuffer->row[start - 1].highlightOpenComment) {
+            resumeFrom = rehighlight_from(start, 1) + 1;
+        }
     }
 }
 
@@ -1252,170 +3372,5912 @@ int syntax_to_colour(int highlightValue) {
 } 
 
 /**
- * 
+ * Chooses the syntax for the current file, looking the extension up in the syntax hash table
  */
 void select_syntax_highlight() {
-    eConfig.syntax = NULL;
+    eBuffer->syntax = NULL;
 
-    if (eConfig.fileName == NULL) {
+    if (eBuffer->fileName == NULL) {
         return;
     }
 
-    char *extension = strrchr(eConfig.fileName, '.'); // Get pointer to extensions part of the filename
+    char *extension = strrchr(eBuffer->fileName, '.'); // Get pointer to extensions part of the filename
 
-    for (int i = 0; i < HLDB_ENTRIES; i++) { // Loop through each editor syntax 
-        struct editorSyntax *s = &HLDB[i];
-        unsigned int j = 0;
-        while (s->filematch[j]) { // Loop through each pattern in filematch array
-            int isExtension = (s->filematch[j][0] == '.'); // Checks if file extension exists
-            if ((isExtension && extension && !strcmp(extension, s->filematch[j])) || (!isExtension && strstr(eConfig.fileName, s->filematch[j]) /* If no file extension, sees if character sequence appears in filename at all */)) {
-                eConfig.syntax = s;
-
-                for (int fileRow = 0; fileRow < eConfig.numRows; fileRow++) {
-                    update_syntax(&eConfig.row[fileRow]);
-                }
+    if (extension && syntaxExtensionsCapacity) {
+        unsigned int mask = syntaxExtensionsCapacity - 1;
+        for (unsigned int slot = hash_string(extension) & mask; syntaxExtensions[slot].extension; slot = (slot + 1) & mask) {
+            if (!strcmp(syntaxExtensions[slot].extension, extension)) {
+                eBuffer->syntax = syntaxExtensions[slot].syntax;
+                break;
+            }
+        }
+    }
 
-                return;
+    // Patterns without a leading dot match anywhere in the filename, so they can't be hashed
+    for (int i = 0; i < syntaxDBLength && eBuffer->syntax == NULL; i++) {
+        struct editorSyntax *s = &syntaxDB[i];
+        for (unsigned int j = 0; s->filematch[j]; j++) {
+            if (s->filematch[j][0] != '.' && strstr(eBuffer->fileName, s->filematch[j])) {
+                eBuffer->syntax = s;
+                break;
             }
-            j++;
         }
     }
+
+    if (eBuffer->syntax) {
+        highlight_all_rows();
+    }
 }
 
 /**
- * Saves all changes made to the file onto the disk 
- */  
-void save() {
-    if (eConfig.fileName == NULL) {
-        eConfig.fileName = prompt("Save as: %s (ESC to cancel)", NULL);
-        if (eConfig.fileName == NULL) {
-            set_status_message("Save canceled");
-            return;
-        }
-        select_syntax_highlight();
+ * Builds the syntax database from the built-in HLDB entries and the definition files in the syntax directory
+ * ($TEXTO_SYNTAX_DIR, or ~/.texto/syntax). Returns how long loading took in microseconds.
+ */
+long load_syntax_database() {
+    struct timespec startTime, endTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    syntaxDB = malloc(sizeof(struct editorSyntax) * HLDB_ENTRIES);
+    memcpy(syntaxDB, HLDB, sizeof(struct editorSyntax) * HLDB_ENTRIES);
+    syntaxDBLength = HLDB_ENTRIES;
+
+    char path[4096];
+    char *directory = getenv("TEXTO_SYNTAX_DIR");
+    if (directory == NULL && getenv("HOME")) {
+        snprintf(path, sizeof(path), "%s/.texto/syntax", getenv("HOME"));
+        directory = path;
     }
 
-    int length;
-    char *buf = rows_to_string(&length);
-
-    // O_CREATE -> create file if it does not exist
-    // O_RDWR -> open file for reading and writing
-    // 0644 -> standard permissions (reading and writing)
-    int fd = open(eConfig.fileName, O_RDWR | O_CREAT, 0644);
+    DIR *dir = directory ? opendir(directory) : NULL;
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char *suffix = strrchr(entry->d_name, '.');
+            if (suffix == NULL || strcmp(suffix, ".syntax")) {
+                continue;
+            }
 
-    if (fd != -1) {
-        if (ftruncate(fd, length) /* Sets file size to specified length */ != -1) {
-            if (write(fd, buf, length) == length) {
-                close(fd);
-                free(buf);
-                set_status_message("%d bytes written to disk", length);
-                eConfig.unsavedChanges = 0;
-                return;
+            char filePath[4096];
+            if (snprintf(filePath, sizeof(filePath), "%s/%s", directory, entry->d_name) >= (int) sizeof(filePath)) {
+                continue; // Cut short, it would name some other file
             }
+            load_syntax_file(filePath);
         }
-        close(fd);
+        closedir(dir);
     }
 
-    free(buf);
-    set_status_message("Can't save to disk! I/O error: %s", strerror(errno));
+    for (int i = 0; i < syntaxDBLength; i++) {
+        int dropped = compile_syntax(&syntaxDB[i]);
+        if (dropped > 0) {
+            snprintf(syntaxWarning, sizeof(syntaxWarning), "Syntax %.40s has too many keywords, %d were left out", syntaxDB[i].filetype, dropped);
+        }
+    }
+    register_syntax_extensions();
+
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    return (endTime.tv_sec - startTime.tv_sec) * 1000000 + (endTime.tv_nsec - startTime.tv_nsec) / 1000;
 }
 
 /**
- * Finds occurences of query
+ * Parses a syntax definition file and adds it to the syntax database. Each line is a directive followed by its values:
+ *   filetype python
+ *   extensions .py .pyw
+ *   keywords if else while
+ *   types int str
+ *   singleline #
+ *   multiline """ """
+ *   flags numbers strings
+ *   rule @ keyword2 word
  */
-void find_callback(char *query, int key) {
-    static int lastMatch = -1;
-    static int direction = 1;
+void load_syntax_file(const char *filePath) {
+    FILE *fp = fopen(filePath, "r");
+    if (!fp) {
+        return;
+    }
 
-    static int savedHighlightLine;
-    static char *savedHighlight = NULL;
+    struct editorSyntax syntax;
+    memset(&syntax, 0, sizeof(syntax));
+    int numExtensions = 0, numKeywords = 0;
+    syntax.filematch = calloc(1, sizeof(char*));
+    syntax.keywords = calloc(1, sizeof(char*));
 
-    if (savedHighlight) { // Restores colours to default
-        memcpy(eConfig.row[savedHighlightLine].highlight, savedHighlight, eConfig.row[savedHighlightLine].rsize);
-        free(savedHighlight);
-        savedHighlight = NULL;
+    char *line = NULL;
+    size_t lineCap = 0;
+    while (getline(&line, &lineCap, fp) != -1) {
+        char *savePointer;
+        char *directive = strtok_r(line, " \t\r\n", &savePointer);
+        if (directive == NULL || directive[0] == '#') {
+            continue;
+        }
+
+        char *value;
+        if (!strcmp(directive, "filetype")) {
+            if ((value = strtok_r(NULL, " \t\r\n", &savePointer))) {
+                free(syntax.filetype);
+                syntax.filetype = strdup(value);
+            }
+        } else if (!strcmp(directive, "extensions")) {
+            while ((value = strtok_r(NULL, " \t\r\n", &savePointer))) {
+                syntax.filematch = realloc(syntax.filematch, sizeof(char*) * (numExtensions + 2));
+                syntax.filematch[numExtensions++] = strdup(value);
+                syntax.filematch[numExtensions] = NULL;
+            }
+        } else if (!strcmp(directive, "keywords") || !strcmp(directive, "types")) {
+            int secondary = !strcmp(directive, "types"); // Secondary keywords are marked with a trailing '|'
+            while ((value = strtok_r(NULL, " \t\r\n", &savePointer))) {
+                syntax.keywords = realloc(syntax.keywords, sizeof(char*) * (numKeywords + 2));
+                char *keyword = malloc(strlen(value) + 2);
+                sprintf(keyword, secondary ? "%s|" : "%s", value);
+                syntax.keywords[numKeywords++] = keyword;
+                syntax.keywords[numKeywords] = NULL;
+            }
+        } else if (!strcmp(directive, "singleline")) {
+            if ((value = strtok_r(NULL, " \t\r\n", &savePointer))) {
+                syntax.singlelineCommentStart = strdup(value);
+            }
+        } else if (!strcmp(directive, "multiline")) {
+            char *end;
+            if ((value = strtok_r(NULL, " \t\r\n", &savePointer)) && (end = strtok_r(NULL, " \t\r\n", &savePointer))) {
+                syntax.mlCommentStart = strdup(value);
+                syntax.mlCommentEnd = strdup(end);
+            }
+        } else if (!strcmp(directive, "flags")) {
+            while ((value = strtok_r(NULL, " \t\r\n", &savePointer))) {
+                if (!strcmp(value, "numbers")) {
+                    syntax.flags |= HL_HIGHLIGHT_NUMBERS;
+                } else if (!strcmp(value, "strings")) {
+                    syntax.flags |= HL_HIGHLIGHT_STRINGS;
+                }
+            }
+        } else if (!strcmp(directive, "rule")) {
+            char *prefix = strtok_r(NULL, " \t\r\n", &savePointer);
+            char *highlight = strtok_r(NULL, " \t\r\n", &savePointer);
+            char *extent = strtok_r(NULL, " \t\r\n", &savePointer);
+            if (prefix == NULL || highlight == NULL) {
+                continue;
+            }
+
+            struct syntaxRule rule;
+            rule.prefix = strdup(prefix);
+            rule.prefixLength = strlen(prefix);
+            rule.toEndOfLine = (extent && !strcmp(extent, "line"));
+            if (!strcmp(highlight, "keyword1")) {
+                rule.highlight = HL_KEYWORD1;
+            } else if (!strcmp(highlight, "keyword2")) {
+                rule.highlight = HL_KEYWORD2;
+            } else if (!strcmp(highlight, "string")) {
+                rule.highlight = HL_STRING;
+            } else if (!strcmp(highlight, "number")) {
+                rule.highlight = HL_NUMBER;
+            } else {
+                rule.highlight = HL_COMMENT;
+            }
+
+            syntax.rules = realloc(syntax.rules, sizeof(struct syntaxRule) * (syntax.numRules + 1));
+            syntax.rules[syntax.numRules++] = rule;
+        }
     }
 
-    if (key == '\x1b') { // Pressing enter or escape leaves mode
-        lastMatch = -1;
-        direction = 1;
+    free(line);
+    fclose(fp);
+
+    if (syntax.filetype == NULL || numExtensions == 0) { // Definition is unusable without a name and something to match
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        lastMatch = -1;
-        direction = 1;
     }
 
-    if (lastMatch == -1) {
-        direction = 1;
+    syntaxDB = realloc(syntaxDB, sizeof(struct editorSyntax) * (syntaxDBLength + 1));
+    syntaxDB[syntaxDBLength++] = syntax;
+}
+
+/**
+ * Compiles a syntax's keywords into a trie driven by a transition table, and marks which bytes can start each kind of token.
+ * Returns how many keywords were left out because the trie would need more than SYNTAX_MAX_STATES states.
+ */
+int compile_syntax(struct editorSyntax *syntax) {
+    memset(syntax->startFlags, 0, sizeof(syntax->startFlags));
+    memset(syntax->byteClass, 0, sizeof(syntax->byteClass));
+
+    if (syntax->singlelineCommentStart && syntax->singlelineCommentStart[0]) {
+        syntax->startFlags[(unsigned char) syntax->singlelineCommentStart[0]] |= SYNTAX_START_SLCOMMENT;
+    }
+    if (syntax->mlCommentStart && syntax->mlCommentEnd && syntax->mlCommentStart[0] && syntax->mlCommentEnd[0]) {
+        syntax->startFlags[(unsigned char) syntax->mlCommentStart[0]] |= SYNTAX_START_MLCOMMENT;
+        syntax->startFlags[(unsigned char) syntax->mlCommentEnd[0]] |= SYNTAX_END_MLCOMMENT;
+    }
+    syntax->startFlags['"'] |= SYNTAX_START_STRING;
+    syntax->startFlags['\''] |= SYNTAX_START_STRING;
+    syntax->startFlags['.'] |= SYNTAX_START_NUMBER;
+    for (int c = '0'; c <= '9'; c++) {
+        syntax->startFlags[c] |= SYNTAX_START_NUMBER;
+    }
+    for (int r = 0; r < syntax->numRules; r++) {
+        syntax->startFlags[(unsigned char) syntax->rules[r].prefix[0]] |= SYNTAX_START_RULE;
     }
-    int current = lastMatch; // Index of the current row we are searching in the "row" parameter
 
-    for (int i = 0; i < eConfig.numRows; i++) {
-        current += direction;
-        if (current == -1) { // If at top of file, go to bottom
-            current = eConfig.numRows - 1;
-        } else if (current == eConfig.numRows) { // If at end of file, go to beginning
-            current = 0;
+    // Give every byte used in a keyword its own class so the table only needs a column per distinct byte
+    int numStates = 2;
+    syntax->numClasses = 1;
+    for (int j = 0; syntax->keywords[j]; j++) {
+        for (char *k = syntax->keywords[j]; *k && *k != '|'; k++) {
+            if (!syntax->byteClass[(unsigned char) *k]) {
+                syntax->byteClass[(unsigned char) *k] = syntax->numClasses++;
+            }
+            numStates++;
         }
+    }
+    if (numStates > SYNTAX_MAX_STATES) {
+        numStates = SYNTAX_MAX_STATES;
+    }
 
-        editorRow *row = &eConfig.row[current];
-
-        char *match = strstr(row->render, query); // Finds first occurence of substring (needle [second param]) in the string (haystack [first param])
-        if (match) {
-            lastMatch = current;
-            eConfig.characterY = current;
-            eConfig.characterX = row_render_index_to_character_index(row, match - row->render);
-            eConfig.rowOffset = current - 10;
-            if (current - 10 < 0) {
-                eConfig.rowOffset = 0;
+    free(syntax->transitions);
+    free(syntax->accept);
+    syntax->transitions = calloc(numStates * syntax->numClasses, sizeof(unsigned short));
+    syntax->accept = calloc(numStates, 1);
+
+    int nextState = 2;
+    int dropped = 0;
+    for (int j = 0; syntax->keywords[j]; j++) {
+        int keywordLen = strlen(syntax->keywords[j]);
+        int keyword2 = (keywordLen > 0 && syntax->keywords[j][keywordLen - 1] == '|');
+        if (keyword2) {
+            keywordLen--;
+        }
+        if (keywordLen == 0) {
+            continue;
+        }
+        // Follows the prefix already in the trie, then checks the rest fits. Only fails once the table hit SYNTAX_MAX_STATES.
+        int state = 1, shared = 0;
+        for (; shared < keywordLen; shared++) {
+            unsigned short next = syntax->transitions[state * syntax->numClasses + syntax->byteClass[(unsigned char) syntax->keywords[j][shared]]];
+            if (!next) {
+                break;
             }
+            state = next;
+        }
+        if (nextState + keywordLen - shared > numStates) {
+            dropped++;
+            continue;
+        }
 
-            // Before highlighting match we must save the current row
-            savedHighlightLine = current;
-            savedHighlight = malloc(row->size);
-            memcpy(savedHighlight, row->highlight, row->rsize); 
-            
-            memset(&row->highlight[match - row->render], HL_SEARCH_RESULT, strlen(query)); // Highlights matches
+        for (int k = shared; k < keywordLen; k++) {
+            unsigned short *transition = &syntax->transitions[state * syntax->numClasses + syntax->byteClass[(unsigned char) syntax->keywords[j][k]]];
+            if (!*transition) {
+                *transition = nextState++;
+            }
+            state = *transition;
+        }
 
-            break;
+        if (!syntax->accept[state]) { // Earlier keywords win, as they did when keywords were checked in order
+            syntax->accept[state] = keyword2 ? HL_KEYWORD2 : HL_KEYWORD1;
         }
     }
+    return dropped;
 }
 
 /**
- * Used to handle case when Ctrl-F is pressed
+ * FNV-1a hash of a string
  */
-void find() {
-    // Save initial cursor location
-    int savedCharacterX = eConfig.characterX;
-    int savedCharacterY = eConfig.characterY;
-    int savedColOff = eConfig.colOffset;
-    int savedRowOff = eConfig.rowOffset;
+unsigned int hash_string(const char *str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char) *str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    // Get query
-    char *query = prompt("Search %s (ESC to exit | Arrows to navigate)", find_callback);
+/**
+ * Builds the open addressing hash table mapping extensions to syntaxes. Later definitions replace earlier ones,
+ * so a syntax file can override a built-in language.
+ */
+void register_syntax_extensions() {
+    int numExtensions = 0;
+    for (int i = 0; i < syntaxDBLength; i++) {
+        for (int j = 0; syntaxDB[i].filematch[j]; j++) {
+            numExtensions++;
+        }
+    }
+
+    syntaxExtensionsCapacity = 16;
+    while (syntaxExtensionsCapacity < numExtensions * 2) { // Keep the table at most half full
+        syntaxExtensionsCapacity *= 2;
+    }
+    free(syntaxExtensions);
+    syntaxExtensions = calloc(syntaxExtensionsCapacity, sizeof(struct syntaxExtension));
+
+    unsigned int mask = syntaxExtensionsCapacity - 1;
+    for (int i = 0; i < syntaxDBLength; i++) {
+        for (int j = 0; syntaxDB[i].filematch[j]; j++) {
+            char *extension = syntaxDB[i].filematch[j];
+            if (extension[0] != '.') {
+                continue;
+            }
+
+            unsigned int slot = hash_string(extension) & mask;
+            while (syntaxExtensions[slot].extension && strcmp(syntaxExtensions[slot].extension, extension)) {
+                slot = (slot + 1) & mask;
+            }
+            syntaxExtensions[slot].extension = extension;
+            syntaxExtensions[slot].syntax = &syntaxDB[i];
+        }
+    }
+}
+
+/**
+ * Saves all changes made to the file onto the disk 
+ */  
+void save() {
+    if (eBuffer->fileName == NULL) {
+        eBuffer->fileName = prompt("Save as: %s (ESC to cancel)", NULL, 0);
+        if (eBuffer->fileName == NULL) {
+            set_status_message("Save canceled");
+            return;
+        }
+        select_syntax_highlight();
+    }
+
+    if (save_in_place()) {
+        return;
+    }
+
+    if (eBuffer->paged) { // The file may not fit in memory, so it is written a batch of rows at a time
+        save_paged();
+        return;
+    }
+
+    int length;
+    char *buf = rows_to_string(&length);
+
+    if (eBuffer->fileMapping) {
+        // Rows still point into the mapped file, so write a new file and swap it in rather than overwriting the mapped one
+        char *temporaryPath = sidecar_path(eBuffer->fileName, ".texto-tmp");
+        struct stat fileStat;
+        int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, stat(eBuffer->fileName, &fileStat) == 0 ? fileStat.st_mode & 0777 : 0644);
+
+        if (fd != -1 && write(fd, buf, length) == length && close(fd) == 0 && rename(temporaryPath, eBuffer->fileName) == 0) {
+            free(temporaryPath);
+            free(buf);
+            set_status_message("%d bytes written to disk", length);
+            eBuffer->unsavedChanges = 0;
+            journal_reset();
+            file_state_record();
+            if (eConfig.useIndex) {
+                write_index();
+            }
+            return;
+        }
+
+        if (fd != -1) {
+            close(fd);
+        }
+        unlink(temporaryPath);
+        free(temporaryPath);
+        free(buf);
+        set_status_message("Can't save to disk! I/O error: %s", strerror(errno));
+        return;
+    }
+
+    // O_CREATE -> create file if it does not exist
+    // O_RDWR -> open file for reading and writing
+    // 0644 -> standard permissions (reading and writing)
+    int fd = open(eBuffer->fileName, O_RDWR | O_CREAT, 0644);
+
+    if (fd != -1) {
+        if (ftruncate(fd, length) /* Sets file size to specified length */ != -1) {
+            if (write(fd, buf, length) == length) {
+                close(fd);
+                free(buf);
+                set_status_message("%d bytes written to disk", length);
+                eBuffer->unsavedChanges = 0;
+                journal_reset();
+                file_state_record();
+                if (eConfig.useIndex) {
+                    write_index();
+                }
+                return;
+            }
+        }
+        close(fd);
+    }
+
+    free(buf);
+    set_status_message("Can't save to disk! I/O error: %s", strerror(errno));
+}
+
+/**
+ * Finds occurences of query
+ */
+void find_callback(char *query, int key) {
+    static int lastMatch = -1;
+    static int direction = 1;
+
+    static int savedHighlightLine;
+    static char *savedHighlight = NULL;
+    static int savedHighlightLength;
+
+    if (savedHighlight) { // Restores colours to default
+        eBuffer->generation++;
+        if (savedHighlightLine < eBuffer->numRows && eBuffer->row[savedHighlightLine].rsize == savedHighlightLength) { // A giant row may have moved its render since
+            memcpy(eBuffer->row[savedHighlightLine].highlight, savedHighlight, savedHighlightLength);
+        }
+        free(savedHighlight);
+        savedHighlight = NULL;
+    }
+
+    if (key == '\x1b') { // Pressing enter or escape leaves mode
+        lastMatch = -1;
+        direction = 1;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        lastMatch = -1;
+        direction = 1;
+    }
+
+    if (lastMatch == -1) {
+        direction = 1;
+    }
+    int current = lastMatch; // Index of the current row we are searching in the "row" parameter
+
+    // With a trigram index only the rows that contain every trigram of the query are searched
+    int *candidates = NULL;
+    int numCandidates = eBuffer->trigrams ? trigram_candidates(query, &candidates) : -1;
+    int candidate = 0;
+    if (numCandidates > 0) { // Starts from the first candidate past the last match, the way the rows are walked below
+        int low = 0, high = numCandidates;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (candidates[middle] <= lastMatch) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        candidate = low;
+        if (direction == -1) {
+            candidate = (low > 0 && candidates[low - 1] == lastMatch) ? low - 2 : low - 1;
+        }
+    }
+    int numTries = (numCandidates >= 0) ? numCandidates : eBuffer->numRows;
+
+    for (int i = 0; i < numTries; i++) {
+        if (numCandidates >= 0) {
+            candidate = (candidate + numCandidates) % numCandidates;
+            current = candidates[candidate];
+            candidate += direction;
+        } else {
+            current += direction;
+            if (current == -1) { // If at top of file, go to bottom
+                current = eBuffer->numRows - 1;
+            } else if (current == eBuffer->numRows) { // If at end of file, go to beginning
+                current = 0;
+            }
+        }
+
+        editorRow *row = &eBuffer->row[current];
+
+        char *match = memmem(row->characters, row->size, query, strlen(query)); // Finds first occurence of the query (needle [third param]) in the row (haystack [first param])
+        if (match) {
+            row_materialize(row);
+            if (row->giant) { // Moves the render to the match
+                giant_row_window(row, row_character_index_to_column(row, match - row->characters), 0);
+            }
+            int renderIndex = row_character_index_to_render_index(row, match - row->characters);
+
+            lastMatch = current;
+            eBuffer->characterY = current;
+            eBuffer->characterX = match - row->characters;
+            eBuffer->rowOffset = current - 10;
+            eBuffer->wrapOffset = 0;
+            if (current - 10 < 0) {
+                eBuffer->rowOffset = 0;
+            }
+
+            // Before highlighting match we must save the current row
+            savedHighlightLine = current;
+            savedHighlight = malloc(row->rsize);
+            savedHighlightLength = row->rsize;
+            memcpy(savedHighlight, row->highlight, row->rsize); 
+            
+            int renderEnd = row_character_index_to_render_index(row, match - row->characters + strlen(query)); // Tabs in the match take up more of the render
+            if (renderEnd > row->rsize) { // Match runs past the end of a giant row's render
+                renderEnd = row->rsize;
+            }
+            memset(&row->highlight[renderIndex], HL_SEARCH_RESULT, renderEnd - renderIndex); // Highlights matches
+            eBuffer->generation++;
+
+            break;
+        }
+    }
+}
+
+/**
+ * Used to handle case when Ctrl-F is pressed
+ */
+void find() {
+    // Save initial cursor location
+    int savedCharacterX = eBuffer->characterX;
+    int savedCharacterY = eBuffer->characterY;
+    int savedColOff = eBuffer->colOffset;
+    int savedRowOff = eBuffer->rowOffset;
+    int savedWrapOff = eBuffer->wrapOffset;
+
+    // Get query
+    char *query = prompt("Search %s (ESC to exit | Arrows to navigate)", find_callback, 0);
     
     // If query exists, free it from heap, else restore previous cursor position
     if (query) {
         free(query);
     } else {
-        eConfig.characterX = savedCharacterX;
-        eConfig.characterY = savedCharacterY;
-        eConfig.rowOffset = savedRowOff;
-        eConfig.colOffset = savedColOff;
+        eBuffer->characterX = savedCharacterX;
+        eBuffer->characterY = savedCharacterY;
+        eBuffer->rowOffset = savedRowOff;
+        eBuffer->wrapOffset = savedWrapOff;
+        eBuffer->colOffset = savedColOff;
     }
 
     set_status_message("Exited Search Mode");
 }
 
 /**
- * Determines if character separates words
+ * Returns the path of a hidden file kept next to a file, such as its journal (".<name>.texto-swp")
+ */
+char *sidecar_path(const char *fileName, const char *suffix) {
+    const char *slash = strrchr(fileName, '/');
+    int directoryLength = slash ? slash - fileName + 1 : 0;
+
+    char *path = malloc(strlen(fileName) + strlen(suffix) + 2);
+    sprintf(path, "%.*s.%s%s", directoryLength, fileName, fileName + directoryLength, suffix);
+    return path;
+}
+
+/**
+ * Starts an empty journal for the current file, replacing any old one
+ */
+void journal_open() {
+    if (eBuffer->fileName == NULL) {
+        return;
+    }
+
+    if (eBuffer->journalFd == -1) {
+        char *path = sidecar_path(eBuffer->fileName, ".texto-swp");
+        eBuffer->journalFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        free(path);
+        if (eBuffer->journalFd == -1) {
+            return;
+        }
+    }
+
+    journal_reset();
+}
+
+/**
+ * Queues an edit in the journal. Records are only written out in batches, when the editor is idle or enough have built up.
+ */
+void journal_record(int operation, int a, int b, const char *text, int length) {
+    if (eBuffer->journalFd == -1) {
+        return;
+    }
+
+    char header[1 + 3 * sizeof(int32_t)];
+    int32_t fields[3] = {a, b, length};
+    header[0] = operation;
+    memcpy(&header[1], fields, sizeof(fields));
+
+    append_to_append_buffer(&eBuffer->journal, header, sizeof(header));
+    if (length) {
+        append_to_append_buffer(&eBuffer->journal, text, length);
+    }
+
+    if (eBuffer->journal.length >= JOURNAL_FLUSH_SIZE) {
+        journal_flush();
+    }
+}
+
+/**
+ * Appends queued records to the journal file
+ */
+void journal_flush() {
+    if (eBuffer->journalFd == -1 || eBuffer->journal.length == 0) {
+        return;
+    }
+
+    struct iovec part = {eBuffer->journal.buf, eBuffer->journal.length};
+    journal_write(&part, 1);
+    free_append_buffer(&eBuffer->journal);
+    eBuffer->journal.buf = NULL;
+    eBuffer->journal.length = 0;
+}
+
+/**
+ * Empties the journal. Called once the file on disk matches the buffer, so the header records the file's new size and time.
+ */
+void journal_reset() {
+    free_append_buffer(&eBuffer->journal);
+    eBuffer->journal.buf = NULL;
+    eBuffer->journal.length = 0;
+
+    if (eBuffer->journalFd == -1) {
+        journal_open();
+        return;
+    }
+
+    struct stat fileStat;
+    int64_t stamp[3] = {0, 0, 0};
+    if (stat(eBuffer->fileName, &fileStat) == 0) {
+        stamp[0] = fileStat.st_size;
+        stamp[1] = fileStat.st_mtim.tv_sec;
+        stamp[2] = fileStat.st_mtim.tv_nsec;
+    }
+
+    ftruncate(eBuffer->journalFd, 0);
+    struct iovec parts[2] = {{JOURNAL_MAGIC, 8}, {stamp, sizeof(stamp)}};
+    journal_write(parts, 2);
+}
+
+/**
+ * Deletes the journal file
+ */
+void journal_remove() {
+    if (eBuffer->journalFd == -1) {
+        return;
+    }
+
+    close(eBuffer->journalFd);
+    eBuffer->journalFd = -1;
+
+    char *path = sidecar_path(eBuffer->fileName, ".texto-swp");
+    unlink(path);
+    free(path);
+}
+
+/**
+ * Looks for a journal left behind by an editor that didn't exit cleanly, offers to replay it and then starts a fresh journal
+ */
+void journal_recover() {
+    char *path = sidecar_path(eBuffer->fileName, ".texto-swp");
+    int fd = open(path, O_RDONLY);
+
+    if (fd != -1) {
+        struct stat journalStat, fileStat;
+        char *data = NULL;
+        int length = 0;
+
+        if (fstat(fd, &journalStat) == 0 && journalStat.st_size > (off_t) JOURNAL_HEADER_SIZE && journalStat.st_size <= INT_MAX) {
+            length = journalStat.st_size;
+            data = malloc(length);
+            if (read(fd, data, length) != length) {
+                length = 0;
+            }
+        }
+        close(fd);
+
+        int64_t stamp[3];
+        if (length > (int) JOURNAL_HEADER_SIZE && !memcmp(data, JOURNAL_MAGIC, 8)) {
+            memcpy(stamp, data + 8, sizeof(stamp));
+
+            // Edits are only meaningful against the exact file they were made to, down to when it was last written
+            if (stat(eBuffer->fileName, &fileStat) == 0 && stamp[0] == fileStat.st_size && stamp[1] == fileStat.st_mtim.tv_sec
+                && stamp[2] == fileStat.st_mtim.tv_nsec) {
+                if (confirm("Unsaved changes were found in the journal. Recover them? (y/n)")) {
+                    journal_replay(data + JOURNAL_HEADER_SIZE, length - JOURNAL_HEADER_SIZE);
+                    free(data);
+
+                    // Keep the old records so they can still be recovered if we crash again
+                    eBuffer->journalFd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+                    free(path);
+                    set_status_message("Recovered %d edits from the journal", eBuffer->unsavedChanges);
+                    return;
+                }
+            } else {
+                set_status_message("Journal is out of date with the file and was discarded");
+            }
+        }
+        free(data);
+    }
+    free(path);
+
+    journal_open();
+}
+
+/**
+ * Applies the edits stored in journal records to the buffer
+ */
+void journal_replay(char *data, int length) {
+    int offset = 0;
+    const int headerSize = 1 + 3 * sizeof(int32_t);
+
+    while (offset + headerSize <= length) {
+        int operation = data[offset];
+        int32_t fields[3];
+        memcpy(fields, &data[offset + 1], sizeof(fields));
+        char *text = &data[offset + headerSize];
+        offset += headerSize;
+
+        if (fields[2] < 0 || offset + fields[2] > length) { // Last record was cut off when the editor died
+            break;
+        }
+        offset += fields[2];
+
+        int index = fields[0];
+        if (operation != JOURNAL_INSERT_ROW && operation != JOURNAL_INSERT_ROWS && (index < 0 || index >= eBuffer->numRows)) {
+            continue;
+        }
+
+        editorRow *row = &eBuffer->row[index];
+        switch (operation) {
+            case JOURNAL_INSERT_ROW:
+                insert_row(index, text, fields[2]);
+                break;
+            case JOURNAL_DELETE_ROW:
+                delete_row(index);
+                break;
+            case JOURNAL_INSERT_CHARACTER:
+                insert_character_in_row(row, fields[1], fields[2] ? text[0] : ' ');
+                break;
+            case JOURNAL_DELETE_CHARACTER:
+                delete_character_in_row(row, fields[1]);
+                break;
+            case JOURNAL_APPEND_STRING:
+                append_string_in_row(row, text, fields[2]);
+                break;
+            case JOURNAL_SET_ROW:
+                row_make_writable(row);
+                free(row->characters);
+                row->characters = malloc(fields[2] + 1);
+                memcpy(row->characters, text, fields[2]);
+                row->characters[fields[2]] = '\0';
+                row->size = fields[2];
+                update_row(row);
+                eBuffer->unsavedChanges++;
+                break;
+            case JOURNAL_TRUNCATE_ROW:
+                if (fields[1] >= 0 && fields[1] <= row->size) {
+                    truncate_row(row, fields[1]);
+                    eBuffer->unsavedChanges++;
+                }
+                break;
+            case JOURNAL_DELETE_ROWS:
+                if (fields[1] > 0 && index + fields[1] <= eBuffer->numRows) {
+                    delete_rows(index, fields[1]);
+                }
+                break;
+            case JOURNAL_INSERT_ROWS:
+                journal_replay_rows(index, fields[1], text, fields[2]);
+                break;
+        }
+    }
+}
+
+/**
+ * Asks a yes or no question in the message bar. Returns 1 if the user answered yes.
+ */
+int confirm(const char *question) {
+    while (1) {
+        set_status_message("%s", question);
+        if (!input_pending()) {
+            refresh_screen();
+        }
+
+        int input = read_key();
+        if (input == 'y' || input == 'Y') {
+            set_status_message("");
+            return 1;
+        } else if (input == 'n' || input == 'N' || input == '\x1b') {
+            set_status_message("");
+            return 0;
+        }
+    }
+}
+
+/**
+ * Runs background work while the editor is waiting for input
+ */
+void editor_idle() {
+    if (eBuffer->loader) {
+        loader_poll(1);
+    }
+
+    // Hidden buffers keep taking in their rows, but only finish loading once shown since that may ask about the journal
+    struct editorBuffer *current = eBuffer;
+    for (int i = 0; i < numEditorBuffers; i++) {
+        if (editorBuffers[i] != current && editorBuffers[i]->loader) {
+            eBuffer = editorBuffers[i];
+            loader_poll(0);
+        }
+    }
+    eBuffer = current;
+
+    journal_flush();
+    if (eBuffer->follow) {
+        follow_poll();
+    } else {
+        reload_check();
+    }
+    if (eBuffer->trigrams && (eBuffer->trigrams->indexed < eBuffer->trigrams->numIds || eBuffer->trigrams->deadIds >= TRIGRAM_COMPACT_MIN || eBuffer->trigrams->compactNewId)) {
+        trigram_build();
+    }
+    if (eBuffer->uncountedRows > 0) {
+        stats_count_idle();
+    }
+    if (eBuffer->commentScanRow != INT_MAX) {
+        comment_scan_idle();
+    }
+
+    // Validates the checkpoints of edited giant rows a chunk at a time, then passes their new end state to the rows below
+    if (eBuffer->giantPending) {
+        struct timespec startTime, now;
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+        eBuffer->giantPending = 0;
+
+        for (int i = 0; i < eBuffer->numRows; i++) {
+            editorRow *row = &eBuffer->row[i];
+            if (row->giant == NULL || row->giant->complete) {
+                continue;
+            }
+
+            long elapsed = 0;
+            while (!row->giant->complete && elapsed < GIANT_ROW_IDLE_US) {
+                giant_row_extend(row, row->giant->checkpoints[row->giant->numCheckpoints - 1].index, INT_MAX); // One chunk
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                elapsed = (now.tv_sec - startTime.tv_sec) * 1000000 + (now.tv_nsec - startTime.tv_nsec) / 1000;
+            }
+            if (!row->giant->complete) { // Out of time, carries on at the next tick
+                eBuffer->giantPending = 1;
+                break;
+            }
+
+            int openComment = row->giant->checkpoints[row->giant->numCheckpoints - 1].state.inComment;
+            if (openComment != row->highlightOpenComment) {
+                row->highlightOpenComment = openComment;
+                rehighlight_from(i + 1, openComment);
+                eBuffer->generation++;
+            }
+        }
+    }
+}
+
+/**
+ * Records that a giant row is about to change from index onwards, so its checkpoints before that point can be kept
  */
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+void giant_row_edited(editorRow *row, int index) {
+    if (row->giant && index < row->giant->editIndex) {
+        row->giant->editIndex = index;
+    }
 }
 
+/**
+ * Drops the checkpoints of a giant row that come after the edits recorded by giant_row_edited(). Without a recorded edit
+ * only the first checkpoint is kept.
+ */
+void giant_row_invalidate(editorRow *row) {
+    struct giantRow *giant = row->giant;
+    int index = (giant->editIndex == INT_MAX) ? 0 : giant->editIndex;
+
+    while (giant->numCheckpoints > 1 && giant->checkpoints[giant->numCheckpoints - 1].index > index) {
+        giant->numCheckpoints--;
+    }
+    giant->complete = 0;
+    giant->editIndex = INT_MAX;
+    eBuffer->giantPending = 1;
+}
+
+/**
+ * Adds checkpoints to a giant row until one lies past both index and column, or the end of the row is reached. Each
+ * chunk is highlighted into a scratch buffer to find the highlighter state at its end.
+ */
+void giant_row_extend(editorRow *row, int index, int column) {
+    struct giantRow *giant = row->giant;
+    unsigned char *scratch = NULL;
+
+    while (!giant->complete) {
+        struct rowCheckpoint last = giant->checkpoints[giant->numCheckpoints - 1];
+        if (last.index > index || last.column > column) {
+            break;
+        }
+
+        int end = last.index + GIANT_ROW_CHUNK;
+        if (end > row->size) {
+            end = row->size;
+        }
+        while (end < row->size && (row->characters[end] & 0xc0) == 0x80) { // Checkpoints are at the start of a character
+            end++;
+        }
+
+        struct highlightState state = last.state;
+        int stop = end;
+        if (eBuffer->syntax) {
+            int limit = (end + GIANT_ROW_OVERRUN < row->size) ? end + GIANT_ROW_OVERRUN : row->size;
+            if (scratch == NULL) {
+                scratch = malloc(GIANT_ROW_CHUNK + GIANT_ROW_OVERRUN + 4);
+            }
+            stop = last.index + highlight_text(&row->characters[last.index], end - last.index, limit - last.index, scratch, &state);
+            while (stop < row->size && (row->characters[stop] & 0xc0) == 0x80) {
+                stop++;
+            }
+        }
+
+        if (giant->numCheckpoints == giant->checkpointsCapacity) {
+            giant->checkpointsCapacity *= 2;
+            giant->checkpoints = realloc(giant->checkpoints, sizeof(struct rowCheckpoint) * giant->checkpointsCapacity);
+        }
+        struct rowCheckpoint *next = &giant->checkpoints[giant->numCheckpoints++];
+        next->index = stop;
+        next->column = columns_advance(&row->characters[last.index], stop - last.index, last.column);
+        next->state = state;
+
+        if (stop >= row->size) {
+            giant->complete = 1;
+        }
+    }
+
+    free(scratch);
+}
+
+/**
+ * Returns the last checkpoint of a giant row that is at or before both index and column
+ */
+struct rowCheckpoint *giant_row_checkpoint(editorRow *row, int index, int column) {
+    if (row->giant == NULL) {
+        row_materialize(row);
+    }
+    giant_row_extend(row, index, column);
+
+    struct giantRow *giant = row->giant;
+    int low = 0;
+    int high = giant->numCheckpoints - 1;
+    while (low < high) { // Both index and column only grow along the row
+        int middle = (low + high + 1) / 2;
+        if (giant->checkpoints[middle].index <= index && giant->checkpoints[middle].column <= column) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return &giant->checkpoints[low];
+}
+
+/**
+ * Makes the render and highlight of a giant row cover the screen starting at column, building them from the nearest
+ * checkpoint. Nothing is rebuilt if they already do, unless force is set.
+ */
+void giant_row_window(editorRow *row, int column, int force) {
+    if (row->giant == NULL) {
+        struct giantRow *giant = malloc(sizeof(struct giantRow));
+        giant->checkpointsCapacity = 64;
+        giant->checkpoints = malloc(sizeof(struct rowCheckpoint) * giant->checkpointsCapacity);
+        giant->numCheckpoints = 1;
+        giant->checkpoints[0].index = 0;
+        giant->checkpoints[0].column = 0;
+        struct highlightState state = {0, 0, HL_NORMAL, 1, HL_NORMAL};
+        giant->checkpoints[0].state = state;
+        giant->complete = 0;
+        giant->editIndex = INT_MAX;
+        giant->scanned = 0;
+        giant->syntax = eBuffer->syntax;
+        giant->windowEnd = 0;
+        giant->windowEndColumn = 0;
+        row->giant = giant;
+        force = 1;
+    }
+
+    struct giantRow *giant = row->giant;
+    giant->windowColumn = column;
+    if (!force && row->render && row->highlight && row->renderColumn <= column
+            && (column + text_columns() <= giant->windowEndColumn || giant->windowEnd >= row->size)) {
+        return;
+    }
+
+    int first = giant_row_checkpoint(row, INT_MAX, column) - giant->checkpoints;
+    giant_row_extend(row, INT_MAX, column + text_columns());
+
+    // The window ends at the first checkpoint past the right edge of the screen
+    int last = first + 1;
+    while (last < giant->numCheckpoints - 1 && giant->checkpoints[last].column <= column + text_columns()) {
+        last++;
+    }
+    if (last >= giant->numCheckpoints) {
+        last = giant->numCheckpoints - 1;
+    }
+
+    render_span(row, giant->checkpoints[first].index, giant->checkpoints[last].index, giant->checkpoints[first].column);
+    giant->windowEnd = giant->checkpoints[last].index;
+    giant->windowEndColumn = giant->checkpoints[last].column;
+
+    row->highlight = realloc(row->highlight, row->rsize);
+    memset(row->highlight, HL_NORMAL, row->rsize);
+    if (eBuffer->syntax) {
+        // The checkpoint states come from the row's text, so that is what gets coloured, and each character's colour is
+        // then spread over the bytes it renders as. Only tabs render differently, as several spaces.
+        int start = giant->checkpoints[first].index;
+        int length = giant->windowEnd - start;
+        unsigned char *colours = malloc(length + 1);
+        memset(colours, HL_NORMAL, length + 1);
+        struct highlightState state = giant->checkpoints[first].state;
+        highlight_text(&row->characters[start], length, length, colours, &state);
+
+        int column = giant->checkpoints[first].column;
+        for (int i = 0, r = 0; i < length && r < row->rsize;) {
+            if (row->characters[start + i] == '\t') {
+                do {
+                    row->highlight[r++] = colours[i];
+                    column++;
+                } while (column % TAB_STOP != 0 && r < row->rsize);
+                i++;
+                continue;
+            }
+
+            int codepoint = (unsigned char) row->characters[start + i];
+            int bytes = row->ascii ? 1 : utf8_decode(&row->characters[start + i], length - i, &codepoint);
+            for (int b = 0; b < bytes && r < row->rsize; b++) {
+                row->highlight[r++] = colours[i + b];
+            }
+            column += row->ascii ? 1 : codepoint_width(codepoint);
+            i += bytes;
+        }
+        free(colours);
+    }
+}
+
+/**
+ * highlight_row() for giant rows. Colours the window on screen and returns the state at the end of the row if it is
+ * known; otherwise the previous state is kept until editor_idle() has validated the rest of the row.
+ */
+int giant_row_highlight(editorRow *row, int inComment, int *pending) {
+    struct giantRow *giant = row->giant;
+    if (giant->syntax != eBuffer->syntax) { // Every state is different, rebuilds them all now
+        giant->syntax = eBuffer->syntax;
+        giant->numCheckpoints = 1;
+        giant->complete = 0;
+        giant->scanned = 0;
+    }
+    if (giant->checkpoints[0].state.inComment != inComment) {
+        giant->checkpoints[0].state.inComment = inComment;
+        giant->numCheckpoints = 1;
+        giant->complete = 0;
+    }
+
+    if (!giant->scanned) { // First time the row is highlighted, like any other row it is done in full
+        giant_row_extend(row, INT_MAX, INT_MAX);
+        giant->scanned = 1;
+    }
+
+    giant_row_window(row, giant->windowColumn, 1);
+
+    if (!giant->complete) {
+        *pending = 1;
+        return row->highlightOpenComment;
+    }
+    return giant->checkpoints[giant->numCheckpoints - 1].state.inComment;
+}
+
+/**
+ * Frees the checkpoints of a giant row
+ */
+void giant_row_free(editorRow *row) {
+    if (row->giant == NULL) {
+        return;
+    }
+
+    free(row->giant->checkpoints);
+    free(row->giant);
+    row->giant = NULL;
+}
+
+/**
+ * Returns the column reached after displaying text that starts at the given column
+ */
+int columns_advance(const char *text, int length, int column) {
+    if (is_ascii(text, length) && memchr(text, '\t', length) == NULL) {
+        return column + length;
+    }
+
+    for (int i = 0; i < length;) {
+        int codepoint;
+        int characterLength = utf8_decode(&text[i], length - i, &codepoint);
+        if (codepoint == '\t') {
+            column += TAB_STOP - (column % TAB_STOP);
+        } else {
+            column += codepoint_width(codepoint);
+        }
+        i += characterLength;
+    }
+    return column;
+}
+
+/**
+ * Replaces every match in a row with one pass over the text and a single allocation. Matches are literal unless regex is given.
+ * Only the render is rebuilt, the caller is responsible for highlighting. Returns the number of replacements.
+ */
+int replace_in_row(editorRow *row, const char *query, int queryLength, regex_t *regex, const char *replacement, int replacementLength) {
+    static int *matches = NULL; // Start and end offsets of each match, reused between rows
+    static int matchesCapacity = 0;
+    int numMatches = 0;
+    int newSize = row->size;
+
+    int offset = 0;
+    while (offset <= row->size) {
+        int start, end;
+        if (regex) {
+            regmatch_t match;
+            match.rm_so = offset; // Bounds the search, since rows pointing into a block aren't NUL terminated
+            match.rm_eo = row->size;
+            if (regexec(regex, row->characters, 1, &match, REG_STARTEND | (offset > 0 ? REG_NOTBOL : 0)) != 0) {
+                break;
+            }
+            start = match.rm_so;
+            end = match.rm_eo;
+            if (start == end && numMatches > 0 && start == matches[numMatches * 2 - 1]) { // Like sed, an empty match right where the last one ended doesn't count
+                offset = end + 1;
+                continue;
+            }
+        } else {
+            char *found = memmem(&row->characters[offset], row->size - offset, query, queryLength);
+            if (found == NULL) {
+                break;
+            }
+            start = found - row->characters;
+            end = start + queryLength;
+        }
+
+        if (numMatches * 2 + 2 > matchesCapacity) {
+            matchesCapacity = matchesCapacity ? matchesCapacity * 2 : 64;
+            matches = realloc(matches, sizeof(int) * matchesCapacity);
+        }
+        matches[numMatches * 2] = start;
+        matches[numMatches * 2 + 1] = end;
+        numMatches++;
+        newSize += replacementLength - (end - start);
+
+        offset = (end > start) ? end : end + 1; // Step past empty regex matches so they aren't found again
+    }
+
+    if (numMatches == 0) {
+        return 0;
+    }
+
+    char *characters = malloc(newSize + 1);
+    char *p = characters;
+    int copied = 0;
+    for (int m = 0; m < numMatches; m++) {
+        memcpy(p, &row->characters[copied], matches[m * 2] - copied);
+        p += matches[m * 2] - copied;
+        memcpy(p, replacement, replacementLength);
+        p += replacementLength;
+        copied = matches[m * 2 + 1];
+    }
+    memcpy(p, &row->characters[copied], row->size - copied);
+    characters[newSize] = '\0';
+
+    row_make_writable(row);
+    giant_row_edited(row, matches[0]);
+    free(row->characters);
+    row->characters = characters;
+    row->size = newSize;
+
+    eBuffer->deferHighlight = 1;
+    update_row(row);
+    eBuffer->deferHighlight = 0;
+
+    journal_record(JOURNAL_SET_ROW, row->index, 0, row->characters, row->size);
+    return numMatches;
+}
+
+/**
+ * Used to handle case when Ctrl-R is pressed. Replaces every occurence of a string, or of a regular expression written as /pattern/.
+ */
+void replace_all() {
+    char *query = prompt("Replace: %s (/regex/ for a regular expression | ESC to cancel)", NULL, 0);
+    if (query == NULL) {
+        set_status_message("Replace canceled");
+        return;
+    }
+
+    char *replacement = prompt("Replace with: %s (ESC to cancel)", NULL, 1);
+    if (replacement == NULL) {
+        free(query);
+        set_status_message("Replace canceled");
+        return;
+    }
+
+    regex_t regex;
+    int queryLength = strlen(query);
+    int isRegex = (queryLength > 2 && query[0] == '/' && query[queryLength - 1] == '/');
+    if (isRegex) {
+        query[queryLength - 1] = '\0';
+        int error = regcomp(&regex, query + 1, REG_EXTENDED);
+        if (error) {
+            char message[80];
+            regerror(error, &regex, message, sizeof(message));
+            set_status_message("Invalid regular expression: %s", message);
+            free(query);
+            free(replacement);
+            return;
+        }
+    }
+
+    int count = 0;
+    int replacementLength = strlen(replacement);
+    int previousStateChanged = 0; // Whether the row above now ends in a different multiline comment state
+
+    // Rows are highlighted in the same pass, so every row is coloured at most once even when comments open or close
+    for (int i = 0; i < eBuffer->numRows; i++) {
+        editorRow *row = &eBuffer->row[i];
+        int replaced = replace_in_row(row, query, queryLength, isRegex ? &regex : NULL, replacement, replacementLength);
+        count += replaced;
+
+        if (replaced || previousStateChanged) {
+            int openComment = highlight_row(row, i > 0 ? eBuffer->row[i - 1].highlightOpenComment : 0, &eBuffer->giantPending);
+            previousStateChanged = (openComment != row->highlightOpenComment);
+            row->highlightOpenComment = openComment;
+        }
+    }
+
+    if (isRegex) {
+        regfree(&regex);
+    }
+    free(query);
+    free(replacement);
+
+    // Keep the cursor inside its row in case the row got shorter
+    if (eBuffer->characterY < eBuffer->numRows && eBuffer->characterX > eBuffer->row[eBuffer->characterY].size) {
+        eBuffer->characterX = eBuffer->row[eBuffer->characterY].size;
+    }
+
+    eBuffer->unsavedChanges += count;
+    set_status_message("Replaced %d occurrences", count);
+}
+
+/**
+ * Copies the active view out of eConfig and eBuffer
+ */
+void view_save(struct editorView *view) {
+    view->characterX = eBuffer->characterX;
+    view->characterY = eBuffer->characterY;
+    view->renderX = eBuffer->renderX;
+    view->renderY = eBuffer->renderY;
+    view->windowRows = eConfig.windowRows;
+    view->windowCols = eConfig.windowCols;
+    view->rowOffset = eBuffer->rowOffset;
+    view->colOffset = eBuffer->colOffset;
+    view->softWrap = eBuffer->softWrap;
+    view->wrapOffset = eBuffer->wrapOffset;
+    view->markActive = eBuffer->markActive;
+    view->markX = eBuffer->markX;
+    view->markY = eBuffer->markY;
+    view->cursors = eBuffer->cursors;
+    view->numCursors = eBuffer->numCursors;
+    view->cursorsCapacity = eBuffer->cursorsCapacity;
+    view->screenValid = eConfig.screenValid;
+    view->drawnRowOffset = eConfig.drawnRowOffset;
+    view->drawnColOffset = eConfig.drawnColOffset;
+    view->drawnWrapOffset = eConfig.drawnWrapOffset;
+    view->drawnGeneration = eConfig.drawnGeneration;
+    view->synchronizedOutput = eConfig.synchronizedOutput;
+    memcpy(view->statusMessage, eConfig.statusMessage, sizeof(view->statusMessage));
+    view->statusMessageTime = eConfig.statusMessageTime;
+}
+
+/**
+ * Makes a view the active one in eConfig and eBuffer. Another client may have shortened the buffer, so the cursor is clamped.
+ */
+void view_load(const struct editorView *view) {
+    eBuffer->characterX = view->characterX;
+    eBuffer->characterY = view->characterY;
+    eBuffer->renderX = view->renderX;
+    eBuffer->renderY = view->renderY;
+    eConfig.windowRows = view->windowRows;
+    eConfig.windowCols = view->windowCols;
+    eBuffer->rowOffset = view->rowOffset;
+    eBuffer->colOffset = view->colOffset;
+    eBuffer->softWrap = view->softWrap;
+    eBuffer->wrapOffset = view->wrapOffset;
+    eBuffer->markActive = view->markActive;
+    eBuffer->markX = view->markX;
+    eBuffer->markY = view->markY;
+    eBuffer->cursors = view->cursors;
+    eBuffer->numCursors = view->numCursors;
+    eBuffer->cursorsCapacity = view->cursorsCapacity;
+    eConfig.screenValid = view->screenValid;
+    eConfig.drawnRowOffset = view->drawnRowOffset;
+    eConfig.drawnColOffset = view->drawnColOffset;
+    eConfig.drawnWrapOffset = view->drawnWrapOffset;
+    eConfig.drawnGeneration = view->drawnGeneration;
+    eConfig.synchronizedOutput = view->synchronizedOutput;
+    memcpy(eConfig.statusMessage, view->statusMessage, sizeof(view->statusMessage));
+    eConfig.statusMessageTime = view->statusMessageTime;
+
+    if (eBuffer->characterY > eBuffer->numRows) {
+        eBuffer->characterY = eBuffer->numRows;
+    }
+    int rowLength = (eBuffer->characterY < eBuffer->numRows) ? eBuffer->row[eBuffer->characterY].size : 0;
+    if (eBuffer->characterX > rowLength) {
+        eBuffer->characterX = rowLength;
+    }
+}
+
+/**
+ * Returns the path of the server's Unix domain socket
+ */
+char *server_socket_path() {
+    static char path[108]; // Size of sun_path
+    char *runtimeDirectory = getenv("XDG_RUNTIME_DIR");
+    int length;
+    if (runtimeDirectory) {
+        length = snprintf(path, sizeof(path), "%s/texto.sock", runtimeDirectory);
+    } else {
+        // /tmp is shared, so the socket goes in a directory only this user can get into. Anyone could have made it
+        // first, so it only counts if it's a real directory that this user owns and nobody else can open.
+        char directory[64];
+        snprintf(directory, sizeof(directory), "/tmp/texto-%d", (int) getuid());
+        struct stat info;
+        if (mkdir(directory, 0700) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Can't create %s: %s\n", directory, strerror(errno));
+            return NULL;
+        }
+        if (lstat(directory, &info) == -1 || !S_ISDIR(info.st_mode) || info.st_uid != getuid() || (info.st_mode & 077)) {
+            fprintf(stderr, "%s isn't a private directory owned by you, so it can't hold the socket\n", directory);
+            return NULL;
+        }
+        length = snprintf(path, sizeof(path), "%s/texto.sock", directory);
+    }
+    if (length >= (int) sizeof(path)) { // Cut short, it would be some other socket. Only a long XDG_RUNTIME_DIR gets here.
+        fprintf(stderr, "XDG_RUNTIME_DIR is too long for a socket path\n");
+        return NULL;
+    }
+    return path;
+}
+
+/**
+ * Runs the server: files stay loaded between attaches and several clients can view the same buffer.
+ * Clients are served one at a time, with the client's socket standing in for the terminal on stdin and stdout.
+ */
+int server_main() {
+    char *socketPath = server_socket_path();
+    if (socketPath == NULL) {
+        return 1;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd == -1) {
+        perror("socket");
+        return 1;
+    }
+
+    if (connect(listenFd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+        fprintf(stderr, "A server is already running at %s\n", address.sun_path);
+        return 1;
+    }
+    close(listenFd);
+    unlink(address.sun_path); // Left behind by a server that died
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0); // Filter commands run from the server mustn't hold it open
+    if (bind(listenFd, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listenFd, 16) == -1) {
+        perror("bind");
+        return 1;
+    }
+
+    serverMode = 1;
+    signal(SIGPIPE, SIG_IGN); // A client vanishing mid-write shouldn't kill the server
+    load_syntax_database();
+
+    while (1) {
+        struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < serverNumClients; i++) {
+            fds[i + 1].fd = serverClients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        int ready = poll(fds, serverNumClients + 1, SERVER_IDLE_MS);
+        if (ready == -1) {
+            continue;
+        }
+
+        if (ready == 0) { // Nobody is typing, so run each buffer's idle work
+            for (int i = 0; i < serverNumBuffers; i++) {
+                eBuffer = serverBuffers[i]->state;
+                editor_idle();
+            }
+            continue;
+        }
+
+        // Handle clients from the back so removing one doesn't shift the ones still to be checked
+        for (int i = serverNumClients - 1; i >= 0; i--) {
+            if (fds[i + 1].revents) {
+                server_handle_client(i);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int clientFd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if (clientFd != -1 && socket_peer_is_user(clientFd)) {
+                server_attach(clientFd);
+            } else if (clientFd != -1) { // Another user got through to the socket; they don't get to see our files
+                close(clientFd);
+            }
+        }
+    }
+}
+
+/**
+ * Reads a new client's request (window size and file path), loading the file if no client has it open yet
+ */
+void server_attach(int fd) {
+    // Reads time out like a terminal in raw mode, and a stuck client can't block the server forever
+    struct timeval timeout = {0, SERVER_IDLE_MS * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct timeval sendTimeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+    int32_t request[4]; // Rows, columns, synchronized output support and path length
+    char path[4096];
+    if (serverNumClients == SERVER_MAX_CLIENTS || recv(fd, request, sizeof(request), MSG_WAITALL) != sizeof(request)
+            || request[3] <= 0 || request[3] >= (int) sizeof(path) || recv(fd, path, request[3], MSG_WAITALL) != request[3]) {
+        close(fd);
+        return;
+    }
+    path[request[3]] = '\0';
+
+    struct serverClient *client = &serverClients[serverNumClients++];
+    client->fd = fd;
+    client->buffer = NULL;
+    for (int i = 0; i < serverNumBuffers; i++) {
+        if (!strcmp(serverBuffers[i]->path, path)) {
+            client->buffer = serverBuffers[i];
+        }
+    }
+
+    memset(&eConfig, 0, sizeof(eConfig));
+    init();
+    eConfig.windowRows = request[0] - 2;
+    eConfig.windowCols = request[1];
+    eConfig.synchronizedOutput = request[2];
+
+    // A new client starts at the top of the file, with only the view's fields taken from this fresh buffer
+    struct editorBuffer *fresh = buffer_create();
+    eBuffer = fresh;
+    view_save(&client->view);
+    if (client->buffer) { // Already loaded, so attaching is instant
+        free(fresh);
+        eBuffer = client->buffer->state;
+        view_load(&client->view);
+    }
+
+    server_activate(client);
+    if (setjmp(serverDetachJump) != 0) { // Client left while the file was loading, or the file couldn't be read
+        if (eBuffer->fileName == NULL) { // open_file() failed before loading anything, so no other client could be using the buffer
+            serverNumBuffers--;
+            free(client->buffer->path);
+            free(client->buffer->state);
+            free(client->buffer);
+        }
+        server_remove_client(serverNumClients - 1);
+        return;
+    }
+
+    if (client->buffer == NULL) {
+        client->buffer = malloc(sizeof(struct serverBuffer));
+        client->buffer->path = strdup(path);
+        client->buffer->state = fresh;
+        serverBuffers = realloc(serverBuffers, sizeof(struct serverBuffer*) * (serverNumBuffers + 1));
+        serverBuffers[serverNumBuffers++] = client->buffer;
+
+        if (access(path, F_OK) == 0) {
+            open_file(path);
+        } else { // New file, created on the first save
+            eBuffer->fileName = strdup(path);
+            select_syntax_highlight();
+        }
+    }
+
+    set_status_message("HELP: Ctrl-Q = detach | Ctrl-F = find | Ctrl-R = replace | Ctrl-S = save");
+    if (syntaxWarning[0]) {
+        set_status_message("%s", syntaxWarning);
+    }
+    view_save(&client->view);
+    server_redraw(client->buffer);
+}
+
+/**
+ * Processes the keys a client has sent, then redraws every client looking at the same buffer
+ */
+void server_handle_client(int index) {
+    struct serverClient *client = &serverClients[index];
+    eBuffer = client->buffer->state;
+    view_load(&client->view);
+    server_activate(client);
+
+    if (setjmp(serverDetachJump) == 0) {
+        int pending = 0;
+        do {
+            if (pending > 0) { // Not redrawn in between, but keys like PAGE_DOWN need the offsets a redraw would settle
+                scroll();
+            }
+            process_key_press();
+        } while ((pending = input_pending()));
+
+        view_save(&client->view);
+        server_redraw(client->buffer);
+    } else { // Client quit or hung up
+        server_remove_client(index);
+    }
+}
+
+/**
+ * Points stdin and stdout at a client's socket, so the editor reads its keys and draws to its terminal
+ */
+void server_activate(struct serverClient *client) {
+    dup2(client->fd, STDIN_FILENO);
+    dup2(client->fd, STDOUT_FILENO);
+}
+
+/**
+ * Redraws the screen of every client viewing a buffer
+ */
+void server_redraw(struct serverBuffer *buffer) {
+    eBuffer = buffer->state;
+    for (int i = 0; i < serverNumClients; i++) {
+        if (serverClients[i].buffer != buffer) {
+            continue;
+        }
+
+        view_load(&serverClients[i].view);
+        server_activate(&serverClients[i]);
+        refresh_screen();
+        view_save(&serverClients[i].view);
+    }
+}
+
+/**
+ * Disconnects a client. Its buffer stays loaded.
+ */
+void server_remove_client(int index) {
+    write(serverClients[index].fd, "\x1b[2J\x1b[H", 7);
+    keyQueueLength = 0; // Keys it typed aren't for the next client
+
+    // stdin and stdout may still refer to the socket, which would keep the connection open
+    int devNull = open("/dev/null", O_RDWR);
+    dup2(devNull, STDIN_FILENO);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+    close(serverClients[index].fd);
+    free(serverClients[index].view.cursors);
+    serverClients[index] = serverClients[--serverNumClients];
+}
+
+/**
+ * Abandons handling of the active client
+ */
+void server_detach() {
+    longjmp(serverDetachJump, 1);
+}
+
+/**
+ * Attaches this terminal to the server (starting one if needed) and relays keys and screen output until the server hangs up
+ */
+int client_main(char *fileName) {
+    // The server may run in another directory, so send it an absolute path
+    char path[4096];
+    if (fileName[0] == '/') {
+        if (snprintf(path, sizeof(path), "%s", fileName) >= (int) sizeof(path)) {
+            fprintf(stderr, "Path of %s is too long\n", fileName);
+            return 1;
+        }
+    } else if (realpath(fileName, path) == NULL) {
+        char directory[4096];
+        if (getcwd(directory, sizeof(directory)) == NULL) {
+            perror("getcwd");
+            return 1;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", directory, fileName) >= (int) sizeof(path)) {
+            fprintf(stderr, "Path of %s is too long\n", fileName);
+            return 1;
+        }
+    }
+
+    char *socketPath = server_socket_path();
+    if (socketPath == NULL) {
+        return 1;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        if (fork() == 0) { // No server yet, so start one detached from this terminal
+            setsid();
+            int devNull = open("/dev/null", O_RDWR);
+            dup2(devNull, STDIN_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+            exit(server_main());
+        }
+
+        int connected = 0;
+        for (int attempt = 0; attempt < 50 && !connected; attempt++) {
+            usleep(20000);
+            close(fd);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            connected = (connect(fd, (struct sockaddr*) &address, sizeof(address)) == 0);
+        }
+        if (!connected) {
+            perror("connect");
+            return 1;
+        }
+    }
+    if (!socket_peer_is_user(fd)) { // Keys and paths are about to go down the socket, so it had better be our own server
+        fprintf(stderr, "The server at %s belongs to another user\n", address.sun_path);
+        return 1;
+    }
+
+    enable_raw_mode();
+    int rows, cols;
+    if (get_window_size(&rows, &cols) == -1) {
+        safe_exit("get_window_size");
+    }
+
+    int32_t request[4] = {rows, cols, detect_synchronized_output(), strlen(path)};
+    write(fd, request, sizeof(request));
+    write(fd, path, request[3]);
+    if (keyQueueLength > 0) { // Typed while the terminal was being asked about synchronized output
+        write(fd, keyQueue, keyQueueLength);
+        keyQueueLength = 0;
+    }
+
+    char buf[65536];
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int length = read(STDIN_FILENO, buf, sizeof(buf));
+            if (length > 0 && write(fd, buf, length) != length) {
+                break;
+            }
+        }
+
+        if (fds[1].revents) {
+            int length = read(fd, buf, sizeof(buf));
+            if (length <= 0) { // Server hung up, we're detached
+                break;
+            }
+            write(STDOUT_FILENO, buf, length);
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * Drops a reference to a text block, unmapping it once no row uses it. mapping points at the buffer's file mapping, which is
+ * cleared if this was its last reference. The loader thread passes NULL, as it must not touch eBuffer and never drops a mapping.
+ */
+void text_block_release(struct textBlock *block, struct textBlock **mapping) {
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (mapping && *mapping == block) {
+        *mapping = NULL;
+    }
+    if (block->mapped) {
+        if (block->mapped == 2) { // Gives the disk space back, the swap file only ever grows
+            madvise(block->base, block->length, MADV_REMOVE);
+        }
+        munmap(block->base, block->length);
+        free(block);
+        return;
+    }
+
+    // Blocks of the usual size are kept for the next file that is loaded
+    pthread_mutex_lock(&textBlockPoolLock);
+    if (block->length == LOAD_BLOCK_SIZE && textBlockPoolSize < TEXT_BLOCK_POOL_MAX) {
+        block->next = textBlockPool;
+        textBlockPool = block;
+        textBlockPoolSize++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&textBlockPoolLock);
+
+    if (block) {
+        free(block->base);
+        free(block);
+    }
+}
+
+/**
+ * Gives a row its own copy of its text so it can be edited
+ */
+void row_make_writable(editorRow *row) {
+    if (row->block == NULL) {
+        return;
+    }
+
+    char *characters = malloc(row->size + 1);
+    memcpy(characters, row->characters, row->size);
+    characters[row->size] = '\0';
+
+    text_block_release(row->block, &eBuffer->fileMapping);
+    row->block = NULL;
+    row->characters = characters;
+}
+
+/**
+ * Builds the render and colours of a row that hasn't been displayed yet. Its multiline comment state is already known.
+ */
+void row_materialize(editorRow *row) {
+    if (row->render != NULL && row->highlight != NULL) {
+        return;
+    }
+
+    highlight_row(row, row->index > 0 ? eBuffer->row[row->index - 1].highlightOpenComment : 0, &eBuffer->giantPending);
+}
+
+/**
+ * Hashes a block of bytes eight at a time, continuing from a previous hash
+ */
+uint64_t hash_bytes(const char *data, size_t length, uint64_t hash) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, &data[i], 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Hashes a file's content for validating its index. Both ends of the file are hashed in full and the middle is sampled,
+ * which together with the size and modification time catches changes without reading all of a huge file.
+ */
+uint64_t hash_file_content(const char *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    if (length <= 2 * INDEX_HASH_EDGE) {
+        return hash_bytes(data, length, hash);
+    }
+
+    hash = hash_bytes(data, INDEX_HASH_EDGE, hash);
+    for (size_t offset = INDEX_HASH_EDGE; offset + INDEX_HASH_SAMPLE < length - INDEX_HASH_EDGE; offset += INDEX_HASH_STRIDE) {
+        hash = hash_bytes(&data[offset], INDEX_HASH_SAMPLE, hash);
+    }
+    return hash_bytes(&data[length - INDEX_HASH_EDGE], INDEX_HASH_EDGE, hash);
+}
+
+/**
+ * Identifies the comment rules of the current syntax, since cached comment states are only valid for the same rules
+ */
+uint64_t syntax_signature() {
+    struct editorSyntax *syntax = eBuffer->syntax;
+    if (syntax == NULL) {
+        return 0;
+    }
+
+    uint64_t signature = hash_string(syntax->filetype);
+    char *markers[3] = {syntax->singlelineCommentStart, syntax->mlCommentStart, syntax->mlCommentEnd};
+    for (int i = 0; i < 3; i++) {
+        if (markers[i]) {
+            signature = signature * 31 + hash_string(markers[i]);
+        }
+    }
+    return signature * 31 + syntax->flags;
+}
+
+/**
+ * Hashes the absolute path of the current file, so an index is only used for the file it was written for
+ */
+uint64_t index_path_hash() {
+    char resolved[4096];
+    return hash_string(realpath(eBuffer->fileName, resolved) ? resolved : eBuffer->fileName);
+}
+
+/**
+ * Loads the current file using its index: after validating the index, rows are pointed straight into a mapping of the file.
+ * Returns 0 if there is no valid index.
+ */
+int open_file_from_index() {
+    char *indexPath = sidecar_path(eBuffer->fileName, ".texto-idx");
+    int indexFd = open(indexPath, O_RDONLY);
+    free(indexPath);
+    if (indexFd == -1) {
+        return 0;
+    }
+
+    struct stat indexStat, fileStat;
+    int64_t header[INDEX_HEADER_FIELDS];
+    if (fstat(indexFd, &indexStat) == -1 || stat(eBuffer->fileName, &fileStat) == -1 || indexStat.st_size < 8 + (off_t) sizeof(header)) {
+        close(indexFd);
+        return 0;
+    }
+
+    char *index = mmap(NULL, indexStat.st_size, PROT_READ, MAP_PRIVATE, indexFd, 0);
+    close(indexFd);
+    if (index == MAP_FAILED) {
+        return 0;
+    }
+    memcpy(header, index + 8, sizeof(header));
+    int64_t numRows = header[5];
+
+    // Cheap checks first, the content hash needs the file mapped
+    int valid = !memcmp(index, INDEX_MAGIC, 8) && header[0] == fileStat.st_size && header[1] == fileStat.st_mtim.tv_sec
+        && header[2] == fileStat.st_mtim.tv_nsec && header[4] == (int64_t) syntax_signature() && header[6] == (int64_t) index_path_hash()
+        && numRows >= 0 && numRows < INT32_MAX && indexStat.st_size == 8 + (off_t) sizeof(header) + (numRows + 1) * 8 + numRows;
+
+    // The content hash doesn't cover the offsets, so a damaged index mustn't point rows outside the file
+    int64_t *offsets = (int64_t*) (index + 8 + sizeof(header));
+    if (valid) {
+        valid = offsets[0] == 0 && offsets[numRows] == fileStat.st_size && (numRows == 0 || fileStat.st_size > 0);
+        for (int64_t i = 0; valid && i < numRows; i++) {
+            valid = offsets[i + 1] >= offsets[i] && offsets[i + 1] - offsets[i] <= INT_MAX;
+        }
+    }
+
+    char *data = NULL;
+    if (valid && fileStat.st_size > 0) {
+        int fd = open(eBuffer->fileName, O_RDONLY);
+        data = (fd == -1) ? MAP_FAILED : mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd != -1) {
+            close(fd);
+        }
+        valid = (data != MAP_FAILED && header[3] == (int64_t) hash_file_content(data, fileStat.st_size));
+        if (!valid && data != MAP_FAILED) {
+            munmap(data, fileStat.st_size);
+        }
+    }
+
+    if (!valid) {
+        munmap(index, indexStat.st_size);
+        return 0;
+    }
+
+    unsigned char *states = (unsigned char*) &offsets[numRows + 1];
+
+    if (data) {
+        eBuffer->fileMapping = malloc(sizeof(struct textBlock));
+        eBuffer->fileMapping->refs = numRows;
+        eBuffer->fileMapping->base = data;
+        eBuffer->fileMapping->length = fileStat.st_size;
+        eBuffer->fileMapping->mapped = 1;
+    }
+
+    rows_reserve(numRows ? numRows : 1);
+    for (int i = 0; i < numRows; i++) {
+        editorRow *row = &eBuffer->row[i];
+        int length = offsets[i + 1] - offsets[i];
+        char *line = data + offsets[i];
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            length--;
+        }
+
+        row->index = i;
+        row->characters = line;
+        row->size = length;
+        row->block = eBuffer->fileMapping;
+        row->render = NULL;
+        row->rsize = 0;
+        row->highlight = NULL;
+        row->ascii = 0; // Not known until the render is built, and the UTF-8 code paths are correct for ASCII too
+        row->wrapHeight = 0;
+        row->giant = NULL;
+        row->renderStart = 0;
+        row->renderColumn = 0;
+        row->highlightOpenComment = states[i];
+        row->bracketDelta = 0;
+        row->bracketMin = 1;
+        row->id = -1;
+        row->lineHash = 0;
+        row->resident = 0;
+        stats_row_added(row);
+        if (eBuffer->trigrams) {
+            trigram_row_changed(row);
+        }
+    }
+    eBuffer->numRows = numRows;
+    eBuffer->unsavedChanges = 0;
+    eBuffer->bracketDirtyRow = 0;
+
+    munmap(index, indexStat.st_size);
+    return 1;
+}
+
+/**
+ * Writes the index for the current file: where every line starts and the multiline comment state each line ends in
+ */
+void write_index() {
+    if (eBuffer->commentScanRow != INT_MAX) { // Written once the scan knows every comment state
+        return;
+    }
+
+    struct stat fileStat;
+    int fd = open(eBuffer->fileName, O_RDONLY);
+    if (fd == -1 || fstat(fd, &fileStat) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    char *data = (fileStat.st_size > 0) ? mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    // Split the file the same way getline() does in open_file()
+    int numRows = 0;
+    int64_t *offsets = malloc(sizeof(int64_t) * (eBuffer->numRows + 1));
+    int64_t offset = 0;
+    while (offset < fileStat.st_size && numRows < eBuffer->numRows) {
+        char *newline = memchr(data + offset, '\n', fileStat.st_size - offset);
+        offsets[numRows++] = offset;
+        offset = newline ? newline - data + 1 : fileStat.st_size;
+    }
+    offsets[numRows] = offset;
+
+    if (numRows == eBuffer->numRows && offset == fileStat.st_size) { // Otherwise the buffer doesn't match the file
+        int64_t header[INDEX_HEADER_FIELDS] = {fileStat.st_size, fileStat.st_mtim.tv_sec, fileStat.st_mtim.tv_nsec,
+            hash_file_content(data, fileStat.st_size), syntax_signature(), numRows, index_path_hash()};
+        unsigned char *states = malloc(numRows ? numRows : 1);
+        for (int i = 0; i < numRows; i++) {
+            states[i] = eBuffer->row[i].highlightOpenComment;
+        }
+
+        // Write to a temporary file first so a reader never sees half an index
+        char *indexPath = sidecar_path(eBuffer->fileName, ".texto-idx");
+        char *temporaryPath = sidecar_path(eBuffer->fileName, ".texto-idx-tmp");
+        int indexFd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (indexFd != -1) {
+            int written = write(indexFd, INDEX_MAGIC, 8) == 8 && write(indexFd, header, sizeof(header)) == sizeof(header)
+                && write(indexFd, offsets, sizeof(int64_t) * (numRows + 1)) == (ssize_t) (sizeof(int64_t) * (numRows + 1))
+                && write(indexFd, states, numRows) == numRows;
+            close(indexFd);
+            if (!written || rename(temporaryPath, indexPath) == -1) {
+                unlink(temporaryPath);
+            }
+        }
+
+        free(states);
+        free(indexPath);
+        free(temporaryPath);
+    }
+
+    free(offsets);
+    if (data) {
+        munmap(data, fileStat.st_size);
+    }
+}
+
+/**
+ * Starts following the file that was just loaded, from the end of what open_file() read
+ */
+void follow_start() {
+    eBuffer->followFd = open(eBuffer->fileName, O_RDONLY | O_CLOEXEC);
+    if (eBuffer->followFd == -1) {
+        safe_exit("open");
+    }
+
+    // A last line without a newline is still being written, so appended bytes belong to it
+    char last;
+    eBuffer->followPartial = eBuffer->followOffset > 0 && pread(eBuffer->followFd, &last, 1, eBuffer->followOffset - 1) == 1 && last != '\n';
+
+    follow_watch();
+    eBuffer->characterY = eBuffer->numRows; // Pinned to the end
+}
+
+/**
+ * Asks inotify to report writes to the followed file. Without inotify the file is checked on every idle tick instead.
+ */
+void follow_watch() {
+    eBuffer->followWatch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (eBuffer->followWatch == -1) {
+        return;
+    }
+    if (inotify_add_watch(eBuffer->followWatch, eBuffer->fileName, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+        close(eBuffer->followWatch);
+        eBuffer->followWatch = -1;
+    }
+}
+
+/**
+ * Loads whatever was written to the followed file since the last call. A file that was rotated away is replaced by
+ * the new file at the same path once it shows up.
+ */
+void follow_poll() {
+    if (eBuffer->followWatch != -1) {
+        char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        int changed = 0;
+        int moved = 0;
+        ssize_t length;
+
+        // Drains every queued event, a burst of writes only needs one read of the file
+        while ((length = read(eBuffer->followWatch, events, sizeof(events))) > 0) {
+            for (char *p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+                struct inotify_event *event = (struct inotify_event*) p;
+                if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+                    moved = 1;
+                }
+                changed = 1;
+            }
+        }
+
+        if (moved) { // The watch followed the old file, so from now on the path is checked until a new file appears
+            close(eBuffer->followWatch);
+            eBuffer->followWatch = -1;
+        } else if (!changed) {
+            return;
+        }
+    }
+
+    if (eBuffer->followWatch == -1) {
+        struct stat pathStat, fileStat;
+        if (stat(eBuffer->fileName, &pathStat) == 0 && fstat(eBuffer->followFd, &fileStat) == 0
+            && (pathStat.st_ino != fileStat.st_ino || pathStat.st_dev != fileStat.st_dev)) {
+            follow_read(); // Whatever was written to the old file before it was replaced
+
+            int fd = open(eBuffer->fileName, O_RDONLY);
+            if (fd != -1) {
+                close(eBuffer->followFd);
+                eBuffer->followFd = fd;
+                follow_reset();
+                follow_watch();
+                set_status_message("%s was replaced, following the new file", eBuffer->fileName);
+            }
+        }
+    }
+
+    follow_read();
+}
+
+/**
+ * Appends the bytes past followOffset to the buffer. Only the rows that changed are highlighted.
+ */
+void follow_read() {
+    struct stat fileStat;
+    if (fstat(eBuffer->followFd, &fileStat) == -1) {
+        return;
+    }
+    if (fileStat.st_size < eBuffer->followOffset) { // Truncated, so starts over with what is in the file now
+        follow_reset();
+        set_status_message("%s was truncated", eBuffer->fileName);
+    }
+    if (fileStat.st_size == eBuffer->followOffset) {
+        return;
+    }
+
+    int pinned = eBuffer->characterY >= eBuffer->numRows;
+    int firstChanged = eBuffer->followPartial ? eBuffer->numRows - 1 : eBuffer->numRows;
+    char *buffer = malloc(FOLLOW_READ_SIZE);
+
+    eBuffer->deferHighlight = 1;
+    while (eBuffer->followOffset < fileStat.st_size) { // Stops at the size seen above, so a fast writer can't keep us here
+        size_t wanted = fileStat.st_size - eBuffer->followOffset;
+        ssize_t got = pread(eBuffer->followFd, buffer, wanted < FOLLOW_READ_SIZE ? wanted : FOLLOW_READ_SIZE, eBuffer->followOffset);
+        if (got <= 0) {
+            break;
+        }
+        eBuffer->followOffset += got;
+
+        char *p = buffer;
+        char *end = buffer + got;
+        while (p < end) {
+            char *newline = memchr(p, '\n', end - p);
+            char *lineEnd = newline ? newline : end;
+
+            if (eBuffer->followPartial) {
+                append_string_in_row(&eBuffer->row[eBuffer->numRows - 1], p, lineEnd - p);
+            } else {
+                insert_row(eBuffer->numRows, p, lineEnd - p);
+            }
+
+            editorRow *row = &eBuffer->row[eBuffer->numRows - 1];
+            if (newline && row->size > 0 && row->characters[row->size - 1] == '\r') { // Trims the row the way open_file() does
+                row->characters[--row->size] = '\0';
+                update_row(row);
+            }
+
+            eBuffer->followPartial = (newline == NULL);
+            p = newline ? newline + 1 : end;
+        }
+    }
+    eBuffer->deferHighlight = 0;
+    free(buffer);
+
+    int inComment = firstChanged > 0 ? eBuffer->row[firstChanged - 1].highlightOpenComment : 0;
+    for (int i = firstChanged; i < eBuffer->numRows; i++) {
+        inComment = highlight_row(&eBuffer->row[i], inComment, &eBuffer->giantPending);
+        eBuffer->row[i].highlightOpenComment = inComment;
+    }
+
+    eBuffer->unsavedChanges = 0; // Nothing was edited, the buffer still matches the file
+    eBuffer->generation++;
+    if (pinned) {
+        eBuffer->characterY = eBuffer->numRows;
+        eBuffer->characterX = 0;
+    }
+}
+
+/**
+ * Empties the buffer so the followed file is loaded again from the start
+ */
+void follow_reset() {
+    for (int i = 0; i < eBuffer->numRows; i++) {
+        free_row(&eBuffer->row[i]);
+    }
+    eBuffer->numRows = 0;
+    if (eBuffer->paged) {
+        eBuffer->paged->numResident = 0;
+    }
+    if (eBuffer->trigrams) { // Every id is gone, so start over rather than keep postings that lead nowhere
+        trigram_free(eBuffer->trigrams);
+        eBuffer->trigrams = trigram_create();
+    }
+    eBuffer->followOffset = 0;
+    eBuffer->followPartial = 0;
+    eBuffer->characterX = 0;
+    eBuffer->characterY = 0;
+    eBuffer->rowOffset = 0;
+    eBuffer->colOffset = 0;
+    eBuffer->wrapOffset = 0;
+    eBuffer->numFolds = 0;
+    eBuffer->diffValid = 0;
+    eBuffer->diffPartial = 0;
+    eBuffer->layoutValid = 0;
+    eBuffer->bracketDirtyRow = 0;
+    eBuffer->generation++;
+}
+
+/**
+ * Remembers the size, modification time and content hash of the file as it is on disk now
+ */
+void file_state_record() {
+    struct stat fileStat;
+    int fd = open(eBuffer->fileName, O_RDONLY);
+    if (fd == -1 || fstat(fd, &fileStat) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        eBuffer->fileSize = -1;
+        return;
+    }
+
+    char *data = (fileStat.st_size > 0) ? mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        eBuffer->fileSize = -1;
+        return;
+    }
+
+    eBuffer->fileSize = fileStat.st_size;
+    eBuffer->fileModified = fileStat.st_mtim;
+    eBuffer->fileInode = fileStat.st_ino;
+    eBuffer->fileHash = hash_file_content(data, fileStat.st_size);
+    save_state_reset(data, fileStat.st_size);
+    if (eBuffer->diffGutter) {
+        diff_gutter_record(data, fileStat.st_size);
+    }
+    if (data) {
+        munmap(data, fileStat.st_size);
+    }
+}
+
+/**
+ * Checks if another program changed the file since it was loaded or saved, and if so brings the buffer up to date.
+ * Unsaved changes are only thrown away after asking.
+ */
+void reload_check() {
+    struct stat fileStat;
+    if (eBuffer->fileName == NULL || eBuffer->fileSize == -1 || stat(eBuffer->fileName, &fileStat) == -1) {
+        return;
+    }
+    if (fileStat.st_size == eBuffer->fileSize && fileStat.st_ino == eBuffer->fileInode
+        && fileStat.st_mtim.tv_sec == eBuffer->fileModified.tv_sec && fileStat.st_mtim.tv_nsec == eBuffer->fileModified.tv_nsec) {
+        return;
+    }
+
+    int fd = open(eBuffer->fileName, O_RDONLY);
+    if (fd == -1 || fstat(fd, &fileStat) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    char *data = (fileStat.st_size > 0) ? mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    // Same test as for the index: a touched file with the same size and hash is taken to be unchanged
+    uint64_t hash = hash_file_content(data, fileStat.st_size);
+    int changed = (fileStat.st_size != eBuffer->fileSize || hash != eBuffer->fileHash);
+    int rowsStale = (eBuffer->fileMapping && fileStat.st_ino == eBuffer->fileInode); // Rewritten in place, so mapped rows already show the new content
+
+    // Recorded first so the check doesn't fire again while the user is being asked
+    eBuffer->fileSize = fileStat.st_size;
+    eBuffer->fileModified = fileStat.st_mtim;
+    eBuffer->fileInode = fileStat.st_ino;
+    eBuffer->fileHash = hash;
+    if (changed && eBuffer->diffGutter) { // Whether or not the buffer is reloaded, the gutter compares with the new file
+        diff_gutter_record(data, fileStat.st_size);
+    }
+
+    if (changed) {
+        if (eBuffer->unsavedChanges == 0 || (!serverMode && confirm("File changed on disk. Reload and lose unsaved changes? (y/n)"))) {
+            reload_apply(data, fileStat.st_size, rowsStale);
+            save_state_reset(data, fileStat.st_size);
+        } else {
+            eBuffer->fileRowsExact = 0; // Has to be written in full
+            set_status_message("File changed on disk. Saving will overwrite it.");
+        }
+    }
+
+    if (data) {
+        munmap(data, fileStat.st_size);
+    }
+}
+
+/**
+ * Turns the buffer into the given file content by splicing in only the lines that differ. The cursor and the window
+ * stay on the same lines, and rows that didn't change keep their colours.
+ */
+void reload_apply(const char *data, size_t length, int rowsStale) {
+    // Splits the file the same way open_file() does
+    int numLines = 0;
+    int linesCapacity = 1024;
+    char **lines = malloc(sizeof(char*) * linesCapacity);
+    size_t *lengths = malloc(sizeof(size_t) * linesCapacity);
+    size_t offset = 0;
+    while (offset < length) {
+        const char *newline = memchr(data + offset, '\n', length - offset);
+        size_t end = newline ? (size_t) (newline - data) : length;
+        size_t lineLength = end - offset;
+        while (lineLength > 0 && (data[offset + lineLength - 1] == '\n' || data[offset + lineLength - 1] == '\r')) {
+            lineLength--;
+        }
+
+        if (numLines == linesCapacity) {
+            linesCapacity *= 2;
+            lines = realloc(lines, sizeof(char*) * linesCapacity);
+            lengths = realloc(lengths, sizeof(size_t) * linesCapacity);
+        }
+        lines[numLines] = (char*) data + offset;
+        lengths[numLines++] = lineLength;
+        offset = newline ? end + 1 : length;
+    }
+
+    struct diffHunk *hunks;
+    int numHunks;
+    if (rowsStale) { // The old lines can't be read any more, so everything is replaced
+        hunks = malloc(sizeof(struct diffHunk));
+        hunks[0] = (struct diffHunk) {0, eBuffer->numRows, 0, numLines};
+        numHunks = 1;
+    } else {
+        uint64_t *oldHashes = malloc(sizeof(uint64_t) * (eBuffer->numRows + 1));
+        uint64_t *newHashes = malloc(sizeof(uint64_t) * (numLines + 1));
+        for (int i = 0; i < eBuffer->numRows; i++) {
+            oldHashes[i] = hash_bytes(eBuffer->row[i].characters, eBuffer->row[i].size, 0xcbf29ce484222325ULL);
+        }
+        for (int i = 0; i < numLines; i++) {
+            newHashes[i] = hash_bytes(lines[i], lengths[i], 0xcbf29ce484222325ULL);
+        }
+        numHunks = diff_lines(oldHashes, eBuffer->numRows, newHashes, numLines, &hunks);
+        free(oldHashes);
+        free(newHashes);
+    }
+
+    // Keeps the cursor and the top of the window on the same lines
+    int rowOffset = diff_map_line(hunks, numHunks, eBuffer->rowOffset);
+    if (rowOffset != eBuffer->rowOffset) {
+        eBuffer->rowOffset = rowOffset;
+        eBuffer->wrapOffset = 0;
+    }
+    eBuffer->characterY = diff_map_line(hunks, numHunks, eBuffer->characterY);
+
+    // Applies the hunks from the bottom up so the ones above keep their positions
+    int changedLines = 0;
+    eBuffer->deferHighlight = 1;
+    for (int h = numHunks - 1; h >= 0; h--) {
+        splice_rows(hunks[h].oldStart, hunks[h].oldCount, &lines[hunks[h].newStart], &lengths[hunks[h].newStart], NULL, hunks[h].newCount);
+        changedLines += hunks[h].oldCount > hunks[h].newCount ? hunks[h].oldCount : hunks[h].newCount;
+    }
+    eBuffer->deferHighlight = 0;
+
+    // Colours the new rows, then carries their comment state down until it matches what the rows below already had
+    int highlighted = 0; // Rows before this are up to date
+    for (int h = 0; h < numHunks; h++) {
+        int end = hunks[h].newStart + hunks[h].newCount;
+        int i = hunks[h].newStart > highlighted ? hunks[h].newStart : highlighted;
+        if (i > end) {
+            continue;
+        }
+
+        int inComment = i > 0 ? eBuffer->row[i - 1].highlightOpenComment : 0;
+        for (; i < end; i++) {
+            inComment = highlight_row(&eBuffer->row[i], inComment, &eBuffer->giantPending);
+            eBuffer->row[i].highlightOpenComment = inComment;
+        }
+        highlighted = (i < eBuffer->numRows) ? rehighlight_from(i, inComment) + 1 : i;
+    }
+
+    if (eBuffer->characterY > eBuffer->numRows) {
+        eBuffer->characterY = eBuffer->numRows;
+    }
+    int rowLength = (eBuffer->characterY < eBuffer->numRows) ? eBuffer->row[eBuffer->characterY].size : 0;
+    if (eBuffer->characterX > rowLength) {
+        eBuffer->characterX = rowLength;
+    }
+
+    eBuffer->unsavedChanges = 0;
+    journal_reset(); // The journal applies to the file as it was
+    if (eConfig.useIndex) {
+        write_index();
+    }
+    set_status_message("Reloaded %s from disk, %d lines changed", eBuffer->fileName, changedLines);
+
+    free(hunks);
+    free(lines);
+    free(lengths);
+}
+
+/**
+ * Finds the smallest set of changed lines between two files, given as line hashes, with Myers' algorithm in linear space.
+ * Returns the number of hunks, which are in order and stored in an array the caller frees.
+ */
+int diff_lines(const uint64_t *a, int n, const uint64_t *b, int m, struct diffHunk **hunks) {
+    unsigned char *aChanged = calloc(n + 1, 1);
+    unsigned char *bChanged = calloc(m + 1, 1);
+    int *v = malloc(sizeof(int) * 4 * (DIFF_MAX_EDITS + 1)); // Forward and backward furthest reaching paths
+
+    diff_compare(a, 0, n, b, 0, m, v, aChanged, bChanged);
+
+    // Walks both files together. Unchanged lines pair up one to one, and each run of changed lines between them is a hunk.
+    int numHunks = 0;
+    int capacity = 16;
+    *hunks = malloc(sizeof(struct diffHunk) * capacity);
+    int i = 0, j = 0;
+    while (i < n || j < m) {
+        if (i < n && j < m && !aChanged[i] && !bChanged[j]) {
+            i++;
+            j++;
+            continue;
+        }
+
+        struct diffHunk hunk = {i, 0, j, 0};
+        while (i < n && aChanged[i]) {
+            i++;
+            hunk.oldCount++;
+        }
+        while (j < m && bChanged[j]) {
+            j++;
+            hunk.newCount++;
+        }
+        if (hunk.oldCount == 0 && hunk.newCount == 0) { // Only if the files disagree on what is unchanged, which can't happen
+            break;
+        }
+
+        if (numHunks == capacity) {
+            capacity *= 2;
+            *hunks = realloc(*hunks, sizeof(struct diffHunk) * capacity);
+        }
+        (*hunks)[numHunks++] = hunk;
+    }
+
+    free(aChanged);
+    free(bChanged);
+    free(v);
+    return numHunks;
+}
+
+/**
+ * Marks the lines that differ between a[aStart..aEnd) and b[bStart..bEnd). The ranges are split at the middle of an
+ * optimal edit path and each half is compared on its own.
+ */
+void diff_compare(const uint64_t *a, int aStart, int aEnd, const uint64_t *b, int bStart, int bEnd, int *v, unsigned char *aChanged, unsigned char *bChanged) {
+    // Lines equal at both ends are never part of the difference
+    while (aStart < aEnd && bStart < bEnd && a[aStart] == b[bStart]) {
+        aStart++;
+        bStart++;
+    }
+    while (aStart < aEnd && bStart < bEnd && a[aEnd - 1] == b[bEnd - 1]) {
+        aEnd--;
+        bEnd--;
+    }
+
+    int x, y;
+    if (aStart == aEnd || bStart == bEnd || !diff_bisect(a + aStart, aEnd - aStart, b + bStart, bEnd - bStart, v, &x, &y)) {
+        memset(aChanged + aStart, 1, aEnd - aStart);
+        memset(bChanged + bStart, 1, bEnd - bStart);
+        return;
+    }
+
+    diff_compare(a, aStart, aStart + x, b, bStart, bStart + y, v, aChanged, bChanged);
+    diff_compare(a, aStart + x, aEnd, b, bStart + y, bEnd, v, aChanged, bChanged);
+}
+
+/**
+ * Finds where the forward and backward searches for the shortest edit path meet. Returns 0 if the ranges need more than
+ * DIFF_MAX_EDITS edits or have no point worth splitting at.
+ */
+int diff_bisect(const uint64_t *a, int n, const uint64_t *b, int m, int *v, int *splitX, int *splitY) {
+    int maxEdits = (n + m + 1) / 2;
+    if (maxEdits > DIFF_MAX_EDITS) {
+        maxEdits = DIFF_MAX_EDITS;
+    }
+
+    // v holds the furthest x reached on each diagonal k = x - y, forward in the first half and backward in the second
+    int vOffset = maxEdits;
+    int vLength = 2 * maxEdits + 2;
+    int *forward = v;
+    int *backward = v + vLength;
+    for (int i = 0; i < vLength; i++) {
+        forward[i] = -1;
+        backward[i] = -1;
+    }
+    forward[vOffset + 1] = 0;
+    backward[vOffset + 1] = 0;
+
+    int delta = n - m;
+    int forwardChecks = delta & 1; // With an odd delta the paths can only meet during a forward step
+    int kForwardStart = 0, kForwardEnd = 0, kBackwardStart = 0, kBackwardEnd = 0; // Diagonals that ran off the edge
+
+    for (int d = 0; d < maxEdits; d++) {
+        for (int k = -d + kForwardStart; k <= d - kForwardEnd; k += 2) {
+            int kOffset = vOffset + k;
+            int x = (k == -d || (k != d && forward[kOffset - 1] < forward[kOffset + 1])) ? forward[kOffset + 1] : forward[kOffset - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            forward[kOffset] = x;
+
+            if (x > n) {
+                kForwardEnd += 2;
+            } else if (y > m) {
+                kForwardStart += 2;
+            } else if (forwardChecks) {
+                int backwardOffset = vOffset + delta - k;
+                if (backwardOffset >= 0 && backwardOffset < vLength && backward[backwardOffset] != -1 && x >= n - backward[backwardOffset]) {
+                    *splitX = x;
+                    *splitY = y;
+                    return (x > 0 || y > 0) && (x < n || y < m);
+                }
+            }
+        }
+
+        for (int k = -d + kBackwardStart; k <= d - kBackwardEnd; k += 2) {
+            int kOffset = vOffset + k;
+            int x = (k == -d || (k != d && backward[kOffset - 1] < backward[kOffset + 1])) ? backward[kOffset + 1] : backward[kOffset - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[n - x - 1] == b[m - y - 1]) {
+                x++;
+                y++;
+            }
+            backward[kOffset] = x;
+
+            if (x > n) {
+                kBackwardEnd += 2;
+            } else if (y > m) {
+                kBackwardStart += 2;
+            } else if (!forwardChecks) {
+                int forwardOffset = vOffset + delta - k;
+                if (forwardOffset >= 0 && forwardOffset < vLength && forward[forwardOffset] != -1) {
+                    int forwardX = forward[forwardOffset];
+                    int forwardY = vOffset + forwardX - forwardOffset;
+                    if (forwardX >= n - x) {
+                        *splitX = forwardX;
+                        *splitY = forwardY;
+                        return (forwardX > 0 || forwardY > 0) && (forwardX < n || forwardY < m);
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Finds where a line of the old file ended up in the new one. Lines inside a changed hunk keep their distance from its
+ * start as far as the new lines reach.
+ */
+int diff_map_line(const struct diffHunk *hunks, int numHunks, int line) {
+    int shift = 0;
+    for (int h = 0; h < numHunks && line >= hunks[h].oldStart; h++) {
+        if (line < hunks[h].oldStart + hunks[h].oldCount) {
+            int offset = line - hunks[h].oldStart;
+            return hunks[h].newStart + (offset < hunks[h].newCount ? offset : hunks[h].newCount);
+        }
+        shift += hunks[h].newCount - hunks[h].oldCount;
+    }
+    return line + shift;
+}
+
+/**
+ * Opens a file in a new buffer and makes it the current one. A file that is already open is switched to instead.
+ */
+void buffer_open(char *fileName) {
+    for (int i = 0; i < numEditorBuffers; i++) {
+        char *name = editorBuffers[i]->fileName;
+        if (name && !strcmp(name, fileName)) {
+            buffer_switch(i);
+            return;
+        }
+    }
+
+    if (access(fileName, R_OK) == -1) { // open_file() gives up on the whole editor if it can't read the file
+        set_status_message("Can't open %s: %s", fileName, strerror(errno));
+        return;
+    }
+
+    editorBuffers = realloc(editorBuffers, sizeof(struct editorBuffer*) * (numEditorBuffers + 1));
+    editorBuffers[numEditorBuffers] = buffer_create();
+    numEditorBuffers++;
+    buffer_switch(numEditorBuffers - 1);
+    open_file(fileName);
+}
+
+/**
+ * Makes another buffer the current one
+ */
+void buffer_switch(int index) {
+    if (index == currentBuffer) {
+        return;
+    }
+
+    eBuffer = editorBuffers[index];
+    currentBuffer = index;
+    eConfig.screenValid = 0;
+    eBuffer->layoutValid = 0; // The window may have been resized while the buffer was hidden
+}
+
+/**
+ * Closes the current buffer and switches to the one before it. There must be another buffer to switch to.
+ */
+void buffer_close() {
+    if (eBuffer->loader) {
+        loader_cancel();
+    }
+    if (eBuffer->journalFd != -1) {
+        close(eBuffer->journalFd);
+    }
+    if (eBuffer->followFd != -1) {
+        close(eBuffer->followFd);
+    }
+    if (eBuffer->followWatch != -1) {
+        close(eBuffer->followWatch);
+    }
+    for (int i = 0; i < eBuffer->numRows; i++) {
+        free_row(&eBuffer->row[i]);
+    }
+    if (eBuffer->paged) {
+        paged_free();
+    } else {
+        free(eBuffer->row);
+    }
+    free(eBuffer->layoutTree);
+    free(eBuffer->bracketTree);
+    free(eBuffer->cursors);
+    free(eBuffer->folds);
+    free(eBuffer->savedHashes);
+    free(eBuffer->diffHunks);
+    if (eBuffer->trigrams) {
+        trigram_free(eBuffer->trigrams);
+    }
+    free(eBuffer->fileName);
+    free_append_buffer(&eBuffer->journal);
+    free(eBuffer);
+
+    int closed = currentBuffer;
+    buffer_switch(closed > 0 ? closed - 1 : 1);
+    memmove(&editorBuffers[closed], &editorBuffers[closed + 1], sizeof(struct editorBuffer*) * (numEditorBuffers - closed - 1));
+    numEditorBuffers--;
+    if (currentBuffer > closed) {
+        currentBuffer--;
+    }
+}
+
+/**
+ * Gets a block to read text into, from the pool when it has one of the right size
+ */
+struct textBlock *text_block_alloc(size_t length) {
+    struct textBlock *block = NULL;
+    if (length == LOAD_BLOCK_SIZE) {
+        pthread_mutex_lock(&textBlockPoolLock);
+        if (textBlockPool) {
+            block = textBlockPool;
+            textBlockPool = block->next;
+            textBlockPoolSize--;
+        }
+        pthread_mutex_unlock(&textBlockPoolLock);
+    }
+
+    if (block == NULL) {
+        block = malloc(sizeof(struct textBlock));
+        block->base = malloc(length);
+        block->length = length;
+    }
+    block->refs = 0;
+    block->mapped = 0;
+    block->next = NULL;
+    return block;
+}
+
+/**
+ * Starts reading the current file on a background thread, then waits until there are enough rows to fill the screen
+ */
+void loader_start() {
+    struct fileLoader *loader = calloc(1, sizeof(struct fileLoader));
+    loader->fd = open(eBuffer->fileName, O_RDONLY | O_CLOEXEC);
+    if (loader->fd == -1) {
+        safe_exit("open");
+    }
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->progress, NULL);
+    eBuffer->loader = loader;
+
+    void *(*worker)(void*) = loader_worker;
+    struct stat fileStat;
+    if (eBuffer->paged && fstat(loader->fd, &fileStat) == 0 && fileStat.st_size > 0) { // Rows point straight into the file
+        char *data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, loader->fd, 0);
+        if (data != MAP_FAILED) {
+            loader->mapping = malloc(sizeof(struct textBlock));
+            loader->mapping->refs = 1; // Held by the loader until it is done
+            loader->mapping->base = data;
+            loader->mapping->length = fileStat.st_size;
+            loader->mapping->mapped = 1;
+            loader->mapping->next = NULL;
+            eBuffer->fileMapping = loader->mapping;
+            worker = loader_map_worker;
+        }
+    }
+
+    // If a thread can't be created, the file is read here instead
+    loader->threaded = (pthread_create(&loader->thread, NULL, worker, loader) == 0);
+    if (!loader->threaded) {
+        worker(loader);
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    while (!loader->done && loader->numLines < eConfig.windowRows) {
+        pthread_cond_wait(&loader->progress, &loader->lock);
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    loader_poll(1);
+}
+
+/**
+ * Reads a file into text blocks and splits it into lines the same way getline() does in open_file(). A line never
+ * spans two blocks: the start of a line that doesn't fit is moved into the next block.
+ */
+void *loader_worker(void *arg) {
+    struct fileLoader *loader = arg;
+    struct textBlock *block = text_block_alloc(LOAD_BLOCK_SIZE);
+    size_t used = 0;
+    size_t lineStart = 0; // Start of the line that hasn't ended yet
+
+    struct loadedLine *lines = NULL; // Lines of the block being filled
+    int numLines = 0;
+    int linesCapacity = 0;
+
+    while (1) {
+        if (used == block->length) { // Full, so it is handed over and the unfinished line is carried on in a new block
+            size_t carried = used - lineStart;
+            struct textBlock *next = text_block_alloc(carried * 2 > LOAD_BLOCK_SIZE ? carried * 2 : LOAD_BLOCK_SIZE);
+            memcpy(next->base, block->base + lineStart, carried);
+            loader_publish(loader, block, lines, numLines);
+            numLines = 0;
+            block = next;
+            used = carried;
+            lineStart = 0;
+
+            pthread_mutex_lock(&loader->lock);
+            int cancel = loader->cancel;
+            pthread_mutex_unlock(&loader->lock);
+            if (cancel) {
+                break;
+            }
+        }
+
+        ssize_t got = read(loader->fd, block->base + used, block->length - used);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+
+        char *end = block->base + used + got;
+        char *newline;
+        used += got;
+        while ((newline = memchr(block->base + lineStart, '\n', end - (block->base + lineStart))) != NULL) {
+            size_t length = newline - (block->base + lineStart);
+            while (length > 0 && block->base[lineStart + length - 1] == '\r') {
+                length--;
+            }
+
+            if (numLines == linesCapacity) {
+                linesCapacity = linesCapacity ? linesCapacity * 2 : 1024;
+                lines = realloc(lines, sizeof(struct loadedLine) * linesCapacity);
+            }
+            lines[numLines++] = (struct loadedLine) {block, block->base + lineStart, length};
+            lineStart = newline - block->base + 1;
+        }
+    }
+
+    if (used > lineStart) { // Last line without a newline
+        size_t length = used - lineStart;
+        while (length > 0 && block->base[lineStart + length - 1] == '\r') {
+            length--;
+        }
+        if (numLines == linesCapacity) {
+            linesCapacity = linesCapacity ? linesCapacity * 2 : 1;
+            lines = realloc(lines, sizeof(struct loadedLine) * linesCapacity);
+        }
+        lines[numLines++] = (struct loadedLine) {block, block->base + lineStart, length};
+    }
+    loader_publish(loader, block, lines, numLines);
+    free(lines);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->done = 1;
+    pthread_cond_signal(&loader->progress);
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+/**
+ * Hands the lines of a finished block over to the editor thread. Each line holds a reference to the block.
+ */
+void loader_publish(struct fileLoader *loader, struct textBlock *block, struct loadedLine *lines, int numLines) {
+    if (block == loader->mapping) { // Lines of a mapping get their references on the editor thread as they become rows
+        if (numLines == 0) {
+            return;
+        }
+    } else if (numLines == 0) {
+        block->refs = 1;
+        text_block_release(block, NULL);
+        return;
+    } else {
+        block->refs = numLines;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->numLines + numLines > loader->linesCapacity) {
+        while (loader->numLines + numLines > loader->linesCapacity) {
+            loader->linesCapacity = loader->linesCapacity ? loader->linesCapacity * 2 : 1024;
+        }
+        loader->lines = realloc(loader->lines, sizeof(struct loadedLine) * loader->linesCapacity);
+    }
+    memcpy(&loader->lines[loader->numLines], lines, sizeof(struct loadedLine) * numLines);
+    loader->numLines += numLines;
+    pthread_cond_signal(&loader->progress);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+/**
+ * Turns the lines read so far into rows. They point into the loader's blocks and are coloured once the whole file is in,
+ * since multiline comments can only be followed from the start of the file.
+ */
+void loader_poll(int finish) {
+    struct fileLoader *loader = eBuffer->loader;
+
+    pthread_mutex_lock(&loader->lock);
+    int numLines = loader->numLines;
+    int done = loader->done;
+    if (numLines > loader->adopted) {
+        rows_reserve(eBuffer->numRows + numLines - loader->adopted);
+        bracket_rows_moved(eBuffer->numRows);
+
+        for (int i = loader->adopted; i < numLines; i++) {
+            editorRow *row = &eBuffer->row[eBuffer->numRows];
+            row->index = eBuffer->numRows++;
+            row->characters = loader->lines[i].characters;
+            row->size = loader->lines[i].size;
+            row->block = loader->lines[i].block;
+            row->render = NULL;
+            row->rsize = 0;
+            row->highlight = NULL;
+            row->ascii = 0;
+            row->wrapHeight = 0;
+            row->giant = NULL;
+            row->renderStart = 0;
+            row->renderColumn = 0;
+            row->highlightOpenComment = 0;
+            row->bracketDelta = 0;
+            row->bracketMin = 1;
+            row->id = -1;
+            row->lineHash = 0;
+            row->resident = 0;
+            stats_row_added(row);
+            if (row->block == loader->mapping) {
+                __atomic_add_fetch(&row->block->refs, 1, __ATOMIC_RELAXED);
+            }
+            if (eBuffer->trigrams) {
+                trigram_row_changed(row);
+            }
+        }
+        loader->adopted = numLines;
+        if (loader->mapping) { // Nothing else refers to the lines, and a huge file has too many of them to keep around
+            loader->numLines = 0;
+            loader->adopted = 0;
+        }
+        eBuffer->diffValid = 0;
+        eBuffer->diffPartial = 0;
+        eBuffer->layoutValid = 0;
+        eBuffer->generation++;
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    if (done && finish) {
+        loader_finish();
+    }
+}
+
+/**
+ * Cleans up after the whole file has been read, then does what open_file() does once a file is loaded
+ */
+void loader_finish() {
+    struct fileLoader *loader = eBuffer->loader;
+    if (loader->threaded) {
+        pthread_join(loader->thread, NULL);
+    }
+    close(loader->fd);
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->progress);
+    free(loader->lines);
+    if (loader->mapping) {
+        text_block_release(loader->mapping, &eBuffer->fileMapping);
+    }
+    free(loader);
+    eBuffer->loader = NULL;
+
+    comment_scan_start();
+    eBuffer->unsavedChanges = 0;
+    if (eConfig.useIndex) {
+        write_index();
+    }
+    file_state_record();
+    journal_recover();
+}
+
+/**
+ * Stops the loader of a buffer that is being closed and drops the lines it read that never became rows
+ */
+void loader_cancel() {
+    struct fileLoader *loader = eBuffer->loader;
+    pthread_mutex_lock(&loader->lock);
+    loader->cancel = 1;
+    pthread_mutex_unlock(&loader->lock);
+    if (loader->threaded) {
+        pthread_join(loader->thread, NULL);
+    }
+
+    for (int i = loader->adopted; i < loader->numLines; i++) {
+        if (loader->lines[i].block != loader->mapping) {
+            text_block_release(loader->lines[i].block, &eBuffer->fileMapping);
+        }
+    }
+    close(loader->fd);
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->progress);
+    free(loader->lines);
+    if (loader->mapping) {
+        text_block_release(loader->mapping, &eBuffer->fileMapping);
+    }
+    free(loader);
+    eBuffer->loader = NULL;
+}
+
+/**
+ * Returns 1 for an opening bracket, -1 for a closing one and 0 for anything else
+ */
+int bracket_change(int character) {
+    switch (character) {
+        case '(':
+        case '[':
+        case '{':
+            return 1;
+        case ')':
+        case ']':
+        case '}':
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Works out how a freshly coloured row changes the bracket depth, and updates the tree if it changed. Brackets in
+ * strings and comments don't count. Giant rows are only coloured around the part on screen, so theirs aren't counted.
+ */
+void bracket_row_summary(editorRow *row) {
+    int delta = 0;
+    int lowest = 0;
+    if (row->giant == NULL) {
+        for (int i = 0; i < row->rsize; i++) {
+            int change = bracket_change(row->render[i]);
+            if (change == 0 || row->highlight[i] == HL_STRING || row->highlight[i] == HL_COMMENT || row->highlight[i] == HL_MLCOMMENT) {
+                continue;
+            }
+            delta += change;
+            if (delta < lowest) {
+                lowest = delta;
+            }
+        }
+    }
+
+    bracket_row_set(row, delta, lowest);
+}
+
+/**
+ * Stores the bracket summary of a row, and updates its leaf unless the tree is out of date there anyway
+ */
+void bracket_row_set(editorRow *row, int delta, int lowest) {
+    if (delta != row->bracketDelta || lowest != row->bracketMin) {
+        row->bracketDelta = delta;
+        row->bracketMin = lowest;
+        if (row->index < eBuffer->bracketDirtyRow) {
+            bracket_update(row->index);
+        }
+    }
+}
+
+/**
+ * Records that the leaves from a row on no longer line up with the rows, because rows were added or removed there
+ */
+void bracket_rows_moved(int index) {
+    if (index < eBuffer->bracketDirtyRow) {
+        eBuffer->bracketDirtyRow = index;
+    }
+}
+
+/**
+ * Rebuilds the leaves of the bracket tree from bracketDirtyRow on and the nodes above them, or the whole tree if the rows
+ * outgrew it. Rows that were never coloured only have their text scanned, without building a render.
+ */
+void bracket_build() {
+    int size = 1;
+    while (size < eBuffer->numRows) {
+        size *= 2;
+    }
+    int first = (eBuffer->bracketDirtyRow < size) ? eBuffer->bracketDirtyRow : size;
+    if (size != eBuffer->bracketTreeSize) {
+        eBuffer->bracketTree = realloc(eBuffer->bracketTree, sizeof(struct bracketNode) * 2 * size);
+        eBuffer->bracketTreeSize = size;
+        first = 0;
+    }
+
+    unsigned char *scratch = NULL;
+    struct pagedStream stream = {NULL, NULL};
+    for (int i = first; i < size; i++) {
+        struct bracketNode leaf = {0, 0};
+        if (i < eBuffer->numRows) {
+            editorRow *row = &eBuffer->row[i];
+            if (row->bracketMin > 0) {
+                if (scratch == NULL) {
+                    scratch = malloc(GIANT_ROW_CHUNK + GIANT_ROW_OVERRUN + 4);
+                }
+                row->highlightOpenComment = row_summarize(row, i > 0 ? eBuffer->row[i - 1].highlightOpenComment : 0, scratch);
+                paged_stream(&stream, row);
+            }
+            leaf.sum = row->bracketDelta;
+            leaf.min = row->bracketMin;
+        }
+        eBuffer->bracketTree[size + i] = leaf;
+    }
+    paged_stream(&stream, NULL);
+    free(scratch);
+
+    // Only the nodes above the rebuilt leaves change, which on each level are the ones from the parent of the first on
+    for (int level = size / 2, start = (size + first) / 2; level > 0; level /= 2, start /= 2) {
+        for (int node = start; node < 2 * level; node++) {
+            struct bracketNode *left = &eBuffer->bracketTree[2 * node];
+            struct bracketNode *right = &eBuffer->bracketTree[2 * node + 1];
+            eBuffer->bracketTree[node].sum = left->sum + right->sum;
+            eBuffer->bracketTree[node].min = (left->min < left->sum + right->min) ? left->min : left->sum + right->min;
+        }
+    }
+    eBuffer->bracketDirtyRow = INT_MAX;
+}
+
+/**
+ * Updates the leaf of a row and the nodes above it
+ */
+void bracket_update(int index) {
+    int node = eBuffer->bracketTreeSize + index;
+    eBuffer->bracketTree[node].sum = eBuffer->row[index].bracketDelta;
+    eBuffer->bracketTree[node].min = eBuffer->row[index].bracketMin;
+
+    for (node /= 2; node > 0; node /= 2) {
+        struct bracketNode *left = &eBuffer->bracketTree[2 * node];
+        struct bracketNode *right = &eBuffer->bracketTree[2 * node + 1];
+        eBuffer->bracketTree[node].sum = left->sum + right->sum;
+        eBuffer->bracketTree[node].min = (left->min < left->sum + right->min) ? left->min : left->sum + right->min;
+    }
+}
+
+/**
+ * Finds the first row from start on where the depth, starting at depth and going down through the rows, reaches 0.
+ * The depth change of the rows passed over is added to sum. Returns -1 if the depth never runs out.
+ */
+int bracket_find_forward(int node, int nodeStart, int nodeEnd, int start, int depth, int *sum) {
+    if (nodeEnd <= start || nodeStart >= eBuffer->numRows) {
+        return -1;
+    }
+
+    struct bracketNode *current = &eBuffer->bracketTree[node];
+    if (nodeStart >= start && depth + *sum + current->min > 0) { // Runs out nowhere in this node, so it is skipped whole
+        *sum += current->sum;
+        return -1;
+    }
+    if (nodeEnd - nodeStart == 1) {
+        return nodeStart;
+    }
+
+    int middle = (nodeStart + nodeEnd) / 2;
+    int found = bracket_find_forward(2 * node, nodeStart, middle, start, depth, sum);
+    return (found != -1) ? found : bracket_find_forward(2 * node + 1, middle, nodeEnd, start, depth, sum);
+}
+
+/**
+ * Finds the last row before end where the depth, starting at depth and going up through the rows from their ends,
+ * reaches 0. The depth change of the rows passed over is added to sum. Returns -1 if the depth never runs out.
+ */
+int bracket_find_backward(int node, int nodeStart, int nodeEnd, int end, int depth, int *sum) {
+    if (nodeStart >= end) {
+        return -1;
+    }
+
+    // Going backwards, the highest depth reached is the depth change minus the lowest depth reached going forwards
+    struct bracketNode *current = &eBuffer->bracketTree[node];
+    if (nodeEnd <= end && depth - *sum - (current->sum - current->min) > 0) {
+        *sum += current->sum;
+        return -1;
+    }
+    if (nodeEnd - nodeStart == 1) {
+        return nodeStart;
+    }
+
+    int middle = (nodeStart + nodeEnd) / 2;
+    int found = bracket_find_backward(2 * node + 1, middle, nodeEnd, end, depth, sum);
+    return (found != -1) ? found : bracket_find_backward(2 * node, nodeStart, middle, end, depth, sum);
+}
+
+/**
+ * Walks the render of a row from index in direction, counting brackets that go deeper in that direction as +1, until
+ * depth reaches 0. Returns 1 and the index of that bracket if it does.
+ */
+int bracket_scan_row(editorRow *row, int *index, int direction, int *depth) {
+    for (int i = *index; i >= 0 && i < row->rsize; i += direction) {
+        int change = bracket_change(row->render[i]);
+        if (change == 0 || row->highlight[i] == HL_STRING || row->highlight[i] == HL_COMMENT || row->highlight[i] == HL_MLCOMMENT) {
+            continue;
+        }
+
+        *depth += change * direction;
+        if (*depth == 0) {
+            *index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Finds the bracket where depth runs out, starting at a render index of a row. Rows in between are jumped over using
+ * the bracket tree, so only the first and last rows are scanned.
+ */
+int bracket_search(int *rowIndex, int *renderIndex, int direction, int depth) {
+    editorRow *row = &eBuffer->row[*rowIndex];
+    int index = *renderIndex;
+
+    while (!bracket_scan_row(row, &index, direction, &depth)) {
+        if (eBuffer->bracketDirtyRow != INT_MAX) {
+            bracket_build();
+        }
+
+        int sum = 0;
+        int next;
+        if (direction > 0) {
+            next = bracket_find_forward(1, 0, eBuffer->bracketTreeSize, row->index + 1, depth, &sum);
+            depth += sum;
+        } else {
+            next = bracket_find_backward(1, 0, eBuffer->bracketTreeSize, row->index, depth, &sum);
+            depth -= sum;
+        }
+        if (next == -1) {
+            return 0;
+        }
+
+        row = &eBuffer->row[next];
+        row_materialize(row);
+        index = (direction > 0) ? 0 : row->rsize - 1;
+    }
+
+    *rowIndex = row->index;
+    *renderIndex = index;
+    return 1;
+}
+
+/**
+ * Moves the cursor to the bracket matching the one under it
+ */
+void bracket_match() {
+    if (eBuffer->characterY >= eBuffer->numRows) {
+        return;
+    }
+
+    editorRow *row = &eBuffer->row[eBuffer->characterY];
+    row_materialize(row);
+    int index = row_character_index_to_render_index(row, eBuffer->characterX);
+    int change = 0;
+    if (index < row->rsize && row->highlight[index] != HL_STRING && row->highlight[index] != HL_COMMENT && row->highlight[index] != HL_MLCOMMENT) {
+        change = bracket_change(row->render[index]);
+    }
+    if (change == 0) {
+        set_status_message("No bracket under the cursor");
+        return;
+    }
+
+    char bracket = row->render[index];
+    int rowIndex = row->index;
+    index += change;
+    if (!bracket_search(&rowIndex, &index, change, 1)) {
+        set_status_message("No matching bracket");
+        return;
+    }
+
+    row = &eBuffer->row[rowIndex];
+    eBuffer->characterY = rowIndex;
+    eBuffer->characterX = row_render_index_to_character_index(row, index);
+
+    // All kinds of bracket share one depth, so a bracket of another kind means the nesting is broken
+    char pair[] = {bracket, row->render[index], '\0'};
+    if (strcmp(pair, "()") && strcmp(pair, ")(") && strcmp(pair, "[]") && strcmp(pair, "][") && strcmp(pair, "{}") && strcmp(pair, "}{")) {
+        set_status_message("Mismatched bracket");
+    }
+}
+
+/**
+ * Moves the cursor to the opening bracket of the block it is in. Repeating it moves out one block at a time.
+ */
+void bracket_enclosing() {
+    if (eBuffer->numRows == 0) {
+        return;
+    }
+
+    int rowIndex = eBuffer->characterY;
+    int index;
+    if (rowIndex >= eBuffer->numRows) { // Past the last row, so every row is before the cursor
+        rowIndex = eBuffer->numRows - 1;
+        row_materialize(&eBuffer->row[rowIndex]);
+        index = eBuffer->row[rowIndex].rsize - 1;
+    } else {
+        row_materialize(&eBuffer->row[rowIndex]);
+        index = row_character_index_to_render_index(&eBuffer->row[rowIndex], eBuffer->characterX) - 1;
+    }
+
+    if (!bracket_search(&rowIndex, &index, -1, 1)) {
+        set_status_message("Not inside a block");
+        return;
+    }
+    eBuffer->characterY = rowIndex;
+    eBuffer->characterX = row_render_index_to_character_index(&eBuffer->row[rowIndex], index);
+}
+
+/**
+ * Checks if screen lines have to be found through the layout index, which is when rows wrap or some are folded
+ */
+int layout_active() {
+    return eBuffer->softWrap || eBuffer->numFolds > 0;
+}
+
+/**
+ * Returns the fold that hides a row, or -1 if the row is on screen. Folds are sorted, so this is a binary search.
+ */
+int fold_containing(int index) {
+    int low = 0;
+    int high = eBuffer->numFolds; // Finds the first fold that starts at or after the row
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (eBuffer->folds[middle].start < index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low > 0 && eBuffer->folds[low - 1].end >= index) {
+        return low - 1;
+    }
+    return -1;
+}
+
+/**
+ * Returns the row shown after a row, skipping what is folded behind it
+ */
+int fold_next_row(int index) {
+    int fold = eBuffer->numFolds ? fold_containing(index + 1) : -1;
+    return (fold >= 0) ? eBuffer->folds[fold].end + 1 : index + 1;
+}
+
+/**
+ * Returns the row itself if it is on screen, or else the row its fold is shown as
+ */
+int fold_visible_row(int index) {
+    int fold = eBuffer->numFolds ? fold_containing(index) : -1;
+    return (fold >= 0) ? eBuffer->folds[fold].start : index;
+}
+
+/**
+ * Folds rows start + 1 to end behind row start. Folds inside the range are merged into it.
+ */
+void fold_add(int start, int end) {
+    int first = 0; // Folds from first up to last start inside the range
+    while (first < eBuffer->numFolds && eBuffer->folds[first].start < start) {
+        first++;
+    }
+    int last = first;
+    while (last < eBuffer->numFolds && eBuffer->folds[last].start <= end) {
+        last++;
+    }
+    if (last > first && eBuffer->folds[last - 1].end > end) {
+        end = eBuffer->folds[last - 1].end;
+    }
+
+    if (last == first) { // Makes room for one more
+        if (eBuffer->numFolds == eBuffer->foldsCapacity) {
+            eBuffer->foldsCapacity = eBuffer->foldsCapacity ? eBuffer->foldsCapacity * 2 : 16;
+            eBuffer->folds = realloc(eBuffer->folds, sizeof(struct foldRange) * eBuffer->foldsCapacity);
+        }
+        last++;
+        memmove(&eBuffer->folds[last], &eBuffer->folds[first], sizeof(struct foldRange) * (eBuffer->numFolds - first));
+        eBuffer->numFolds++;
+    }
+    memmove(&eBuffer->folds[first + 1], &eBuffer->folds[last], sizeof(struct foldRange) * (eBuffer->numFolds - last));
+    eBuffer->numFolds -= last - first - 1;
+    eBuffer->folds[first].start = start;
+    eBuffer->folds[first].end = end;
+    fold_changed();
+}
+
+/**
+ * Opens a fold
+ */
+void fold_remove(int fold) {
+    memmove(&eBuffer->folds[fold], &eBuffer->folds[fold + 1], sizeof(struct foldRange) * (eBuffer->numFolds - fold - 1));
+    eBuffer->numFolds--;
+    fold_changed();
+}
+
+/**
+ * Moves folds along with the rows after deleteCount rows at index were replaced by insertCount rows. Folds whose first
+ * row was deleted are dropped, and rows added inside a fold stay folded.
+ */
+void fold_rows_changed(int index, int deleteCount, int insertCount) {
+    int kept = 0;
+    for (int i = 0; i < eBuffer->numFolds; i++) {
+        struct foldRange fold = eBuffer->folds[i];
+        if (fold.start >= index + deleteCount) { // After the change
+            fold.start += insertCount - deleteCount;
+            fold.end += insertCount - deleteCount;
+        } else if (fold.start >= index) { // Its first row is gone
+            continue;
+        } else if (fold.end >= index) { // Around the change. Deleted rows past its end come out of the rows after it.
+            int deletedInside = (fold.end < index + deleteCount) ? fold.end - index + 1 : deleteCount;
+            fold.end += insertCount - deletedInside;
+            if (fold.end <= fold.start) {
+                continue;
+            }
+        }
+        eBuffer->folds[kept++] = fold;
+    }
+
+    if (kept != eBuffer->numFolds) {
+        eBuffer->numFolds = kept;
+        eConfig.screenValid = 0;
+    }
+}
+
+/**
+ * Makes the layout and screen catch up with folds being added or removed
+ */
+void fold_changed() {
+    eBuffer->layoutValid = 0;
+    eConfig.screenValid = 0;
+}
+
+/**
+ * Returns the width of the indentation of a row in columns, or -1 if the row is blank
+ */
+int fold_indent(editorRow *row) {
+    int column = 0;
+    for (int i = 0; i < row->size; i++) {
+        if (row->characters[i] == '\t') {
+            column += TAB_STOP - (column % TAB_STOP);
+        } else if (row->characters[i] == ' ') {
+            column++;
+        } else {
+            return column;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Folds the block the cursor is in. The block is the brackets still open at the end of the cursor's row, found through
+ * the bracket tree, or else the rows indented further than the row that starts it.
+ */
+void fold_block() {
+    if (eBuffer->characterY >= eBuffer->numRows) {
+        return;
+    }
+
+    editorRow *row = &eBuffer->row[eBuffer->characterY];
+    row_materialize(row);
+    int start = eBuffer->characterY;
+    int openIndex = row->rsize - 1;
+    int end = eBuffer->characterY;
+    int closeIndex = row->rsize;
+    if (bracket_search(&start, &openIndex, -1, 1) && bracket_search(&end, &closeIndex, 1, 1)) {
+        end--; // The row with the closing bracket stays on screen, as it may open the next block
+    } else {
+        start = end = eBuffer->characterY;
+    }
+
+    if (end <= start) { // Not in brackets that span rows, so uses the indentation instead
+        int indent = fold_indent(row);
+        if (indent == -1) {
+            set_status_message("Nothing to fold");
+            return;
+        }
+
+        // Starts the block here if the next row that isn't blank is indented further, or else at the row above it begins in
+        int next = start + 1;
+        while (next < eBuffer->numRows && fold_indent(&eBuffer->row[next]) == -1) {
+            next++;
+        }
+        if (next >= eBuffer->numRows || fold_indent(&eBuffer->row[next]) <= indent) {
+            while (start > 0 && (fold_indent(&eBuffer->row[start]) == -1 || fold_indent(&eBuffer->row[start]) >= indent)) {
+                start--;
+            }
+        }
+
+        // Blank rows at the end of the block are left out
+        indent = fold_indent(&eBuffer->row[start]);
+        end = start;
+        for (int i = start + 1; i < eBuffer->numRows; i++) {
+            int rowIndent = fold_indent(&eBuffer->row[i]);
+            if (rowIndent != -1 && rowIndent <= indent) {
+                break;
+            }
+            if (rowIndent != -1) {
+                end = i;
+            }
+        }
+        if (end <= start) {
+            set_status_message("Nothing to fold");
+            return;
+        }
+    }
+
+    start = fold_visible_row(start); // The block may start inside a fold that is shown as its first row
+    fold_add(start, end);
+    if (eBuffer->characterY > start) {
+        eBuffer->characterY = start;
+        eBuffer->characterX = 0;
+    }
+    set_status_message("Folded %d lines", end - start);
+}
+
+/**
+ * Folds the rows between the cursor and a line number typed by the user
+ */
+void fold_manual() {
+    char *input = prompt("Fold to line: %s (ESC to cancel)", NULL, 0);
+    if (!input) {
+        return;
+    }
+    int line = atoi(input) - 1;
+    free(input);
+
+    int start = eBuffer->characterY < line ? eBuffer->characterY : line;
+    int end = eBuffer->characterY < line ? line : eBuffer->characterY;
+    if (start < 0 || end >= eBuffer->numRows || end == start) {
+        set_status_message("No such line");
+        return;
+    }
+
+    start = fold_visible_row(start);
+    fold_add(start, end);
+    eBuffer->characterY = start;
+    eBuffer->characterX = 0;
+    set_status_message("Folded %d lines", end - start);
+}
+
+/**
+ * Cuts a row off at size
+ */
+void truncate_row(editorRow *row, int size) {
+    row_make_writable(row);
+    giant_row_edited(row, size);
+    row->size = size;
+    row->characters[row->size] = '\0';
+    update_row(row);
+    journal_record(JOURNAL_TRUNCATE_ROW, row->index, row->size, NULL, 0);
+}
+
+/**
+ * Removes count rows starting at index, moving the rows after them only once
+ */
+void delete_rows(int index, int count) {
+    splice_rows(index, count, NULL, NULL, NULL, 0);
+    journal_record(JOURNAL_DELETE_ROWS, index, count, NULL, 0);
+    eBuffer->unsavedChanges++;
+}
+
+/**
+ * Journals rows inserted at index in one go. Each record holds a batch of rows as a length followed by the text, and is
+ * written straight from the rows' text rather than being copied into the journal buffer first.
+ */
+void journal_record_rows(int index, char **values, size_t *lengths, int count) {
+    if (eBuffer->journalFd == -1) {
+        return;
+    }
+    journal_flush(); // Keeps the records in order
+    if (eBuffer->journalFd == -1) { // The flush failed and turned journaling off
+        return;
+    }
+
+    char header[1 + 3 * sizeof(int32_t)];
+    int32_t rowLengths[JOURNAL_BATCH_ROWS];
+    struct iovec parts[1 + 2 * JOURNAL_BATCH_ROWS];
+    for (int i = 0; i < count;) {
+        int batch = 0;
+        size_t payload = 0;
+        while (i + batch < count && batch < JOURNAL_BATCH_ROWS && payload < JOURNAL_BATCH_SIZE) {
+            rowLengths[batch] = lengths[i + batch];
+            parts[1 + 2 * batch].iov_base = &rowLengths[batch];
+            parts[1 + 2 * batch].iov_len = sizeof(int32_t);
+            parts[2 + 2 * batch].iov_base = values[i + batch];
+            parts[2 + 2 * batch].iov_len = lengths[i + batch];
+            payload += sizeof(int32_t) + lengths[i + batch];
+            batch++;
+        }
+
+        int32_t fields[3] = {index + i, batch, payload};
+        header[0] = JOURNAL_INSERT_ROWS;
+        memcpy(&header[1], fields, sizeof(fields));
+        parts[0].iov_base = header;
+        parts[0].iov_len = sizeof(header);
+        if (journal_write(parts, 1 + 2 * batch) == -1) {
+            return;
+        }
+        i += batch;
+    }
+}
+
+/**
+ * Replays a record of rows inserted in one go
+ */
+void journal_replay_rows(int index, int count, char *text, int length) {
+    if (index < 0 || index > eBuffer->numRows || count <= 0) {
+        return;
+    }
+
+    char **values = malloc(sizeof(char*) * count);
+    size_t *lengths = malloc(sizeof(size_t) * count);
+    int offset = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        int32_t rowLength;
+        if (offset + (int) sizeof(int32_t) > length) {
+            break;
+        }
+        memcpy(&rowLength, &text[offset], sizeof(int32_t));
+        offset += sizeof(int32_t);
+        if (rowLength < 0 || offset + rowLength > length) {
+            break;
+        }
+        values[i] = &text[offset];
+        lengths[i] = rowLength;
+        offset += rowLength;
+    }
+
+    if (i == count) {
+        splice_rows(index, 0, values, lengths, NULL, count);
+        eBuffer->unsavedChanges++;
+    }
+    free(values);
+    free(lengths);
+}
+
+/**
+ * Takes a reference to the text of a row. Rows with their own copy of the text hand it over to a new block, so the row
+ * and whoever else holds the block share it until the row is edited.
+ */
+struct textBlock *row_share(editorRow *row) {
+    if (row->block == NULL) {
+        struct textBlock *block = malloc(sizeof(struct textBlock));
+        block->refs = 1;
+        block->base = row->characters;
+        block->length = row->size + 1;
+        block->mapped = 0;
+        block->next = NULL;
+        row->block = block;
+    }
+    __atomic_add_fetch(&row->block->refs, 1, __ATOMIC_RELAXED);
+    return row->block;
+}
+
+/**
+ * Finds the selected text, from the mark to the cursor in either order. Returns 0 if nothing is selected.
+ */
+int selection_bounds(int *startY, int *startX, int *endY, int *endX) {
+    if (!eBuffer->markActive) {
+        return 0;
+    }
+
+    // The rows may have changed since the mark was set
+    int markY = eBuffer->markY < eBuffer->numRows ? eBuffer->markY : eBuffer->numRows;
+    int markX = markY < eBuffer->numRows ? eBuffer->markX : 0;
+    if (markY < eBuffer->numRows && markX > eBuffer->row[markY].size) {
+        markX = eBuffer->row[markY].size;
+    }
+
+    if (markY < eBuffer->characterY || (markY == eBuffer->characterY && markX < eBuffer->characterX)) {
+        *startY = markY;
+        *startX = markX;
+        *endY = eBuffer->characterY;
+        *endX = eBuffer->characterX;
+    } else {
+        *startY = eBuffer->characterY;
+        *startX = eBuffer->characterX;
+        *endY = markY;
+        *endX = markX;
+    }
+    return 1;
+}
+
+/**
+ * Finds the render indices of the part of a row that is selected
+ */
+void selection_render_range(editorRow *row, int *start, int *end) {
+    int startY, startX, endY, endX;
+    *start = *end = 0;
+    if (!selection_bounds(&startY, &startX, &endY, &endX) || row->index < startY || row->index > endY) {
+        return;
+    }
+
+    *start = (row->index == startY) ? row_character_index_to_render_index(row, startX) : 0;
+    *end = (row->index == endY) ? row_character_index_to_render_index(row, endX) : row->rsize;
+}
+
+/**
+ * Drops the mark
+ */
+void selection_clear() {
+    if (eBuffer->markActive) {
+        eBuffer->markActive = 0;
+        eConfig.screenValid = 0;
+    }
+}
+
+/**
+ * Empties the clipboard, releasing the text it shares with rows
+ */
+void clipboard_clear() {
+    for (int i = 0; i < clipboardLength; i++) {
+        if (clipboard[i].block) {
+            text_block_release(clipboard[i].block, &eBuffer->fileMapping);
+        }
+    }
+    free(clipboard);
+    clipboard = NULL;
+    clipboardLength = 0;
+}
+
+/**
+ * Copies the selection to the clipboard. Lines only take a reference to the text of their rows, so this is O(rows)
+ * however much text is selected. Returns 0 if nothing is selected.
+ */
+int clipboard_copy() {
+    int startY, startX, endY, endX;
+    if (!selection_bounds(&startY, &startX, &endY, &endX)) {
+        set_status_message("Nothing selected, Ctrl-Space sets the mark");
+        return 0;
+    }
+
+    clipboard_clear();
+    clipboardLength = endY - startY + 1;
+    clipboard = malloc(sizeof(struct clipboardLine) * clipboardLength);
+    clipboardSyntax = eBuffer->syntax;
+    clipboardCommentsKnown = (eBuffer->loader == NULL && endY < eBuffer->commentScanRow); // Later rows haven't been coloured
+
+    for (int i = 0; i < clipboardLength; i++) {
+        struct clipboardLine *line = &clipboard[i];
+        int y = startY + i;
+        if (y >= eBuffer->numRows) { // The selection ends past the last row
+            line->block = NULL;
+            line->characters = "";
+            line->size = 0;
+            line->openComment = 0;
+            continue;
+        }
+
+        editorRow *row = &eBuffer->row[y];
+        int from = (i == 0) ? startX : 0;
+        int to = (y == endY) ? endX : row->size;
+        line->block = row_share(row);
+        line->characters = &row->characters[from];
+        line->size = to - from;
+        line->openComment = row->highlightOpenComment;
+    }
+    return 1;
+}
+
+/**
+ * Copies the selection to the clipboard and deletes it. The rows in between are removed in one splice.
+ */
+void clipboard_cut() {
+    int startY, startX, endY, endX;
+    if (!selection_bounds(&startY, &startX, &endY, &endX) || !clipboard_copy()) {
+        return;
+    }
+    selection_clear();
+    eBuffer->characterY = startY;
+    eBuffer->characterX = startX;
+    if (startY >= eBuffer->numRows) {
+        return;
+    }
+
+    // What is left of the last row joins the first one
+    int lastRow = (endY < eBuffer->numRows) ? endY : eBuffer->numRows - 1;
+    int tailLength = (endY < eBuffer->numRows) ? eBuffer->row[endY].size - endX : 0;
+    char *tail = malloc(tailLength + 1);
+    memcpy(tail, &eBuffer->row[lastRow].characters[eBuffer->row[lastRow].size - tailLength], tailLength);
+    int inComment = (startY > 0) ? eBuffer->row[startY - 1].highlightOpenComment : 0;
+    int oldComment = eBuffer->row[lastRow].highlightOpenComment; // What the rows after the selection were coloured with
+
+    eBuffer->deferHighlight = 1; // Coloured once at the end, rather than after every step
+    truncate_row(&eBuffer->row[startY], startX);
+    append_string_in_row(&eBuffer->row[startY], tail, tailLength);
+    if (lastRow > startY) {
+        delete_rows(startY + 1, lastRow - startY);
+    }
+    eBuffer->deferHighlight = 0;
+    free(tail);
+
+    int openComment = highlight_row(&eBuffer->row[startY], inComment, &eBuffer->giantPending);
+    eBuffer->row[startY].highlightOpenComment = openComment;
+    if (openComment != oldComment) {
+        rehighlight_from(startY + 1, openComment);
+    }
+    set_status_message("Cut %d lines", clipboardLength);
+}
+
+/**
+ * Inserts the clipboard at the cursor. Whole lines become rows sharing the clipboard's text in a single splice, and are
+ * only rendered and coloured when displayed. Their comment states are reused if the first line ends in the same state
+ * it did where it was copied from.
+ */
+void clipboard_paste() {
+    if (clipboardLength == 0) {
+        set_status_message("Nothing to paste");
+        return;
+    }
+    if (eBuffer->characterY == eBuffer->numRows) {
+        insert_row(eBuffer->numRows, "", 0);
+    }
+
+    int y = eBuffer->characterY;
+    int x = eBuffer->characterX;
+    editorRow *row = &eBuffer->row[y];
+    int inComment = (y > 0) ? eBuffer->row[y - 1].highlightOpenComment : 0;
+    int oldComment = row->highlightOpenComment;
+
+    // The text after the cursor ends up after the last pasted line
+    struct clipboardLine *last = &clipboard[clipboardLength - 1];
+    int tailLength = row->size - x;
+    int lastLength = last->size + tailLength;
+    char *lastText = malloc(lastLength + 1);
+    memcpy(lastText, last->characters, last->size);
+    memcpy(&lastText[last->size], &row->characters[x], tailLength);
+
+    eBuffer->deferHighlight = 1;
+    truncate_row(row, x);
+    if (clipboardLength == 1) {
+        append_string_in_row(row, lastText, lastLength);
+    } else {
+        append_string_in_row(row, clipboard[0].characters, clipboard[0].size);
+
+        int count = clipboardLength - 2;
+        char **values = malloc(sizeof(char*) * (count + 1));
+        size_t *lengths = malloc(sizeof(size_t) * (count + 1));
+        struct textBlock **blocks = malloc(sizeof(struct textBlock*) * (count + 1));
+        for (int i = 0; i < count; i++) {
+            values[i] = clipboard[i + 1].characters;
+            lengths[i] = clipboard[i + 1].size;
+            blocks[i] = clipboard[i + 1].block;
+        }
+        splice_rows(y + 1, 0, values, lengths, blocks, count);
+        journal_record_rows(y + 1, values, lengths, count);
+        eBuffer->unsavedChanges++;
+        free(values);
+        free(lengths);
+        free(blocks);
+
+        insert_row(y + clipboardLength - 1, lastText, lastLength);
+    }
+    eBuffer->deferHighlight = 0;
+    free(lastText);
+
+    int openComment = highlight_row(&eBuffer->row[y], inComment, &eBuffer->giantPending);
+    eBuffer->row[y].highlightOpenComment = openComment;
+    int lastRow = y + clipboardLength - 1;
+    if (clipboardLength > 1) {
+        int statesKnown = clipboardCommentsKnown && clipboardSyntax == eBuffer->syntax && openComment == clipboard[0].openComment;
+        for (int i = y + 1; i < lastRow; i++) {
+            if (statesKnown) {
+                eBuffer->row[i].highlightOpenComment = clipboard[i - y].openComment;
+            } else {
+                eBuffer->row[i].highlightOpenComment = highlight_row(&eBuffer->row[i], openComment, &eBuffer->giantPending);
+            }
+            openComment = eBuffer->row[i].highlightOpenComment;
+        }
+        openComment = highlight_row(&eBuffer->row[lastRow], openComment, &eBuffer->giantPending);
+        eBuffer->row[lastRow].highlightOpenComment = openComment;
+    }
+    if (openComment != oldComment) {
+        rehighlight_from(lastRow + 1, openComment);
+    }
+
+    eBuffer->characterY = lastRow;
+    eBuffer->characterX = (clipboardLength == 1 ? x : 0) + last->size;
+    set_status_message("Pasted %d lines", clipboardLength);
+}
+
+/**
+ * Creates an empty trigram index. Rows are added to it while the editor is idle.
+ */
+struct trigramIndex *trigram_create() {
+    struct trigramIndex *index = malloc(sizeof(struct trigramIndex));
+    index->lists = calloc(TRIGRAM_KEYS, sizeof(struct trigramList));
+    index->idRow = NULL;
+    index->numIds = 0;
+    index->deadIds = 0;
+    index->idsCapacity = 0;
+    index->indexed = 0;
+    index->epoch = 0;
+    index->cachedQuery = NULL;
+    index->cachedEpoch = 0;
+    index->cachedRows = NULL;
+    index->cachedCount = 0;
+    index->compactNewId = NULL;
+    index->compactOldId = NULL;
+    return index;
+}
+
+void trigram_free(struct trigramIndex *index) {
+    for (int i = 0; i < TRIGRAM_KEYS; i++) {
+        free(index->lists[i].postings);
+    }
+    free(index->lists);
+    free(index->idRow);
+    free(index->cachedQuery);
+    free(index->cachedRows);
+    free(index->compactNewId);
+    free(index->compactOldId);
+    free(index);
+}
+
+/**
+ * Gives a row a new id after its text changed. The postings of its old text stay behind but no longer lead to it.
+ */
+void trigram_row_changed(editorRow *row) {
+    struct trigramIndex *index = eBuffer->trigrams;
+    if (row->id >= 0) {
+        index->idRow[row->id] = -1;
+        index->deadIds++;
+    }
+    if (index->numIds == index->idsCapacity) {
+        index->idsCapacity = index->idsCapacity ? index->idsCapacity * 2 : 1024;
+        index->idRow = realloc(index->idRow, sizeof(int) * index->idsCapacity);
+    }
+    row->id = index->numIds++;
+    index->idRow[row->id] = row->index;
+    index->epoch++;
+}
+
+/**
+ * Points the ids of the rows from start onwards at their new places after rows were added or removed above them. Those
+ * rows are renumbered by the edit anyway, so this adds nothing to its cost, and find never has to catch up on them.
+ */
+void trigram_rows_moved(int start) {
+    struct trigramIndex *index = eBuffer->trigrams;
+    for (int i = start; i < eBuffer->numRows; i++) {
+        if (eBuffer->row[i].id >= 0) {
+            index->idRow[eBuffer->row[i].id] = i;
+        }
+    }
+    index->epoch++;
+}
+
+/**
+ * Adds the rows given ids since the last tick to the index, for at most TRIGRAM_IDLE_US
+ */
+void trigram_build() {
+    struct trigramIndex *index = eBuffer->trigrams;
+    struct timespec startTime, now;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    if (index->compactNewId || (index->deadIds >= TRIGRAM_COMPACT_MIN && index->deadIds > index->numIds / 2)) {
+        trigram_compact(); // Rows are indexed again once it is done
+        return;
+    }
+
+    struct pagedStream stream = {NULL, NULL};
+    while (index->indexed < index->numIds) {
+        int id = index->indexed++;
+        if (index->idRow[id] >= 0) { // Rows that changed again since are indexed under their newer id
+            editorRow *row = &eBuffer->row[index->idRow[id]];
+            paged_stream(&stream, row);
+            for (int i = 0; i + 3 <= row->size; i++) {
+                struct trigramList *list = &index->lists[trigram_key(&row->characters[i])];
+                if (list->length > 0 && list->lastId == id) { // The trigram came up earlier in the row
+                    continue;
+                }
+                if (list->length + 5 > list->capacity) { // A delta takes at most 5 bytes
+                    list->capacity = list->capacity ? list->capacity * 2 : 16;
+                    list->postings = realloc(list->postings, list->capacity);
+                }
+                unsigned int delta = id - list->lastId;
+                do {
+                    list->postings[list->length++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+                    delta >>= 7;
+                } while (delta);
+                list->lastId = id;
+            }
+        }
+
+        if ((id & 255) == 255) { // Checking the clock for every row would cost more than short rows take to index
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - startTime.tv_sec) * 1000000 + (now.tv_nsec - startTime.tv_nsec) / 1000 >= TRIGRAM_IDLE_US) {
+                break;
+            }
+        }
+    }
+    paged_stream(&stream, NULL);
+}
+
+/**
+ * Hashes the three bytes at text into the number of a posting list
+ */
+int trigram_key(const char *text) {
+    uint32_t trigram = (unsigned char) text[0] | (unsigned char) text[1] << 8 | (unsigned char) text[2] << 16;
+    return (uint32_t) (trigram * 2654435761u) >> 14; // Top 18 bits of a multiplicative hash, one per TRIGRAM_KEYS
+}
+
+/**
+ * Appends the ids in a posting list to ids, growing it as needed
+ */
+void trigram_decode(const struct trigramList *list, int **ids, int *numIds, int *capacity) {
+    int id = 0;
+    for (uint32_t i = 0; i < list->length;) {
+        unsigned int delta = 0;
+        int shift = 0;
+        do {
+            delta |= (list->postings[i] & 0x7f) << shift;
+            shift += 7;
+        } while (list->postings[i++] & 0x80);
+        id += delta;
+
+        if (*numIds == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            *ids = realloc(*ids, sizeof(int) * *capacity);
+        }
+        (*ids)[(*numIds)++] = id;
+    }
+}
+
+int trigram_compare_rows(const void *a, const void *b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+/**
+ * Finds the rows that may contain query, in ascending order, and returns how many there are. Returns -1 if the index
+ * can't narrow the search down, because the query is too short or most rows haven't been indexed yet. The result is
+ * kept until rows change, so moving from match to match doesn't repeat the lookup.
+ */
+int trigram_candidates(const char *query, int **rows) {
+    struct trigramIndex *index = eBuffer->trigrams;
+    int length = strlen(query);
+    if (length < 3 || index->indexed < index->numIds / 2) {
+        return -1;
+    }
+    if (index->cachedQuery && index->cachedEpoch == index->epoch && !strcmp(index->cachedQuery, query)) {
+        *rows = index->cachedRows;
+        return index->cachedCount;
+    }
+
+    // Keeps the ids listed for every trigram of the query
+    int *ids = NULL, numIds = 0, idsCapacity = 0;
+    int *other = NULL, numOther = 0, otherCapacity = 0;
+    trigram_lookup(index, trigram_key(query), &ids, &numIds, &idsCapacity);
+    for (int i = 1; i + 3 <= length && numIds > 0; i++) {
+        numOther = 0;
+        trigram_lookup(index, trigram_key(&query[i]), &other, &numOther, &otherCapacity);
+        int kept = 0;
+        for (int a = 0, b = 0; a < numIds && b < numOther;) {
+            if (ids[a] < other[b]) {
+                a++;
+            } else if (ids[a] > other[b]) {
+                b++;
+            } else {
+                ids[kept++] = ids[a];
+                a++;
+                b++;
+            }
+        }
+        numIds = kept;
+    }
+    free(other);
+
+    // Rows still holding the remaining ids, and every row whose text hasn't been indexed yet
+    int *result = NULL, count = 0, capacity = 0;
+    for (int i = 0; i < numIds + index->numIds - index->indexed; i++) {
+        int id = (i < numIds) ? ids[i] : index->indexed + i - numIds;
+        if (index->idRow[id] < 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            result = realloc(result, sizeof(int) * capacity);
+        }
+        result[count++] = index->idRow[id];
+    }
+    free(ids);
+    qsort(result, count, sizeof(int), trigram_compare_rows);
+
+    free(index->cachedQuery);
+    free(index->cachedRows);
+    index->cachedQuery = strdup(query);
+    index->cachedEpoch = index->epoch;
+    index->cachedRows = result;
+    index->cachedCount = count;
+    *rows = result;
+    return count;
+}
+
+/**
+ * Returns how many screen columns are left for text next to the gutter
+ */
+int text_columns() {
+    int columns = eConfig.windowCols - gutter_width();
+    return (columns > 0) ? columns : 1; // Narrow terminals can be eaten whole by the gutter; wrapping divides by this
+}
+
+/**
+ * Returns how many screen columns the gutter at the left of the rows takes up
+ */
+int gutter_width() {
+    int width = eBuffer->diffGutter ? 2 : 0; // The mark and a space
+    if (eBuffer->lineNumbers) {
+        width += eBuffer->lineNumberDigits + 1;
+    }
+    return width;
+}
+
+/**
+ * Hashes a line for diffing. Never returns 0, so 0 can mean a row's hash isn't known.
+ */
+uint64_t line_hash(const char *characters, size_t length) {
+    return hash_bytes(characters, length, 0xcbf29ce484222325ULL) | 1;
+}
+
+/**
+ * Turns the diff gutter on or off. Turning it on reads the file as it is on disk now to compare the rows with.
+ */
+void diff_gutter_toggle() {
+    eConfig.screenValid = 0;
+    eBuffer->layoutValid = 0; // Soft wrapped rows get narrower or wider
+    if (eBuffer->diffGutter) {
+        eBuffer->diffGutter = 0;
+        free(eBuffer->savedHashes);
+        eBuffer->savedHashes = NULL;
+        set_status_message("Diff gutter off");
+        return;
+    }
+
+    eBuffer->diffGutter = 1;
+    struct stat fileStat;
+    int fd = eBuffer->fileName ? open(eBuffer->fileName, O_RDONLY) : -1;
+    if (fd == -1 || fstat(fd, &fileStat) == -1) { // Not saved yet, so every row is new
+        if (fd != -1) {
+            close(fd);
+        }
+        diff_gutter_record(NULL, 0);
+        set_status_message("Diff gutter on, no file on disk yet");
+        return;
+    }
+
+    char *data = (fileStat.st_size > 0) ? mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        eBuffer->diffGutter = 0;
+        set_status_message("Can't read %s: %s", eBuffer->fileName, strerror(errno));
+        return;
+    }
+    diff_gutter_record(data, fileStat.st_size);
+    if (data) {
+        munmap(data, fileStat.st_size);
+    }
+    set_status_message("Diff gutter on");
+}
+
+/**
+ * Remembers the lines of the file on disk, split the same way open_file() does, as the version rows are compared with
+ */
+void diff_gutter_record(const char *data, size_t length) {
+    int linesCapacity = 1024;
+    eBuffer->numSavedLines = 0;
+    eBuffer->savedHashes = realloc(eBuffer->savedHashes, sizeof(uint64_t) * linesCapacity);
+    size_t offset = 0;
+    while (offset < length) {
+        const char *newline = memchr(data + offset, '\n', length - offset);
+        size_t end = newline ? (size_t) (newline - data) : length;
+        size_t lineLength = end - offset;
+        while (lineLength > 0 && (data[offset + lineLength - 1] == '\n' || data[offset + lineLength - 1] == '\r')) {
+            lineLength--;
+        }
+
+        if (eBuffer->numSavedLines == linesCapacity) {
+            linesCapacity *= 2;
+            eBuffer->savedHashes = realloc(eBuffer->savedHashes, sizeof(uint64_t) * linesCapacity);
+        }
+        eBuffer->savedHashes[eBuffer->numSavedLines++] = line_hash(data + offset, lineLength);
+        offset = newline ? end + 1 : length;
+    }
+    eBuffer->diffValid = 0;
+    eBuffer->diffPartial = 0;
+}
+
+/**
+ * Diffs the rows against the file on disk. After edits only the changed rows are diffed again, together with the hunks
+ * they touch and the lines those hunks came from, so a keystroke costs the size of the hunk around it rather than of the
+ * file. Hunks further away are kept and those below are moved by the rows added or removed.
+ */
+void diff_gutter_update() {
+    struct diffHunk *old = eBuffer->diffHunks;
+    int from = 0, to = eBuffer->numRows, oldFrom = 0, oldTo = eBuffer->numSavedLines;
+    int first = 0, last = eBuffer->numDiffHunks; // Hunks before first and from last on stay as they are
+    int shift = 0;
+    if (eBuffer->diffPartial) {
+        // Widens the changed rows, in row numbers from before the edits, by a margin and then to every hunk they touch
+        int start = eBuffer->diffFrom - DIFF_CONTEXT_ROWS, end = eBuffer->diffTo - eBuffer->diffShift + DIFF_CONTEXT_ROWS;
+        start = (start > 0) ? start : 0;
+        end = (end < eBuffer->numRows - eBuffer->diffShift) ? end : eBuffer->numRows - eBuffer->diffShift;
+        int before = 0, within = 0; // Lines of the file minus rows, in the kept hunks above and in the window
+        for (first = 0; first < eBuffer->numDiffHunks && old[first].newStart + old[first].newCount < start; first++) {
+            before += old[first].oldCount - old[first].newCount;
+        }
+        for (last = first; last < eBuffer->numDiffHunks && old[last].newStart <= end; last++) {
+            start = (old[last].newStart < start) ? old[last].newStart : start;
+            end = (old[last].newStart + old[last].newCount > end) ? old[last].newStart + old[last].newCount : end;
+            within += old[last].oldCount - old[last].newCount;
+        }
+        shift = eBuffer->diffShift;
+        from = start;
+        to = end + shift;
+        oldFrom = start + before;
+        oldTo = end + before + within;
+        if (from < 0 || from > to || to > eBuffer->numRows || oldFrom < 0 || oldFrom > oldTo || oldTo > eBuffer->numSavedLines) {
+            eBuffer->diffPartial = 0; // Shouldn't happen, but a full diff is always right
+            diff_gutter_update();
+            return;
+        }
+    }
+
+    uint64_t *hashes = malloc(sizeof(uint64_t) * (to - from + 1));
+    struct pagedStream stream = {NULL, NULL};
+    for (int i = from; i < to; i++) {
+        editorRow *row = &eBuffer->row[i];
+        if (row->lineHash == 0) {
+            row->lineHash = line_hash(row->characters, row->size);
+            paged_stream(&stream, row);
+        }
+        hashes[i - from] = row->lineHash;
+    }
+    paged_stream(&stream, NULL);
+    struct diffHunk *window;
+    int numWindow = diff_lines(eBuffer->savedHashes + oldFrom, oldTo - oldFrom, hashes, to - from, &window);
+    free(hashes);
+
+    int numHunks = 0;
+    struct diffHunk *hunks = malloc(sizeof(struct diffHunk) * (first + numWindow + eBuffer->numDiffHunks - last + 1));
+    for (int h = 0; h < first; h++) {
+        hunks[numHunks++] = old[h];
+    }
+    for (int h = 0; h < numWindow; h++) {
+        window[h].oldStart += oldFrom;
+        window[h].newStart += from;
+        hunks[numHunks++] = window[h];
+    }
+    for (int h = last; h < eBuffer->numDiffHunks; h++) {
+        hunks[numHunks] = old[h];
+        hunks[numHunks++].newStart += shift;
+    }
+    free(window);
+    free(old);
+
+    eBuffer->diffHunks = hunks;
+    eBuffer->numDiffHunks = numHunks;
+    eBuffer->diffValid = 1;
+    eBuffer->diffPartial = 0;
+    eConfig.screenValid = 0; // Marks can change on rows other than the edited one
+}
+
+/**
+ * Returns the gutter mark of a row: '+' for an added row, '~' for a changed one, '_' if lines were deleted after it,
+ * '^' if lines were deleted before the first row, or a space
+ */
+int diff_mark(int row) {
+    // Finds the first hunk that starts after the row, the one before it is the only one that can contain it
+    int low = 0, high = eBuffer->numDiffHunks;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (eBuffer->diffHunks[middle].newStart <= row) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low > 0) {
+        struct diffHunk *hunk = &eBuffer->diffHunks[low - 1];
+        if (row < hunk->newStart + hunk->newCount) {
+            return (row - hunk->newStart < hunk->oldCount) ? '~' : '+';
+        }
+        if (row == 0 && hunk->newStart == 0 && hunk->newCount == 0) {
+            return '^';
+        }
+    }
+    if (low < eBuffer->numDiffHunks && eBuffer->diffHunks[low].newStart == row + 1 && eBuffer->diffHunks[low].newCount == 0) {
+        return '_';
+    }
+    return ' ';
+}
+
+/**
+ * Draws the gutter for one screen line
+ */
+void draw_diff_mark(struct appendBuffer *obj, int mark) {
+    char cell[16];
+    int colour = (mark == '+') ? 32 : (mark == '~') ? 33 : 31; // Green, yellow, or red for deletions
+    int length = (mark == ' ') ? snprintf(cell, sizeof(cell), "  ") : snprintf(cell, sizeof(cell), "\x1b[%dm%c\x1b[39m ", colour, mark);
+    append_to_append_buffer(obj, cell, length);
+}
+
+/**
+ * Makes room for at least numRows rows. Grows geometrically so appending rows one by one stays linear.
+ */
+void rows_reserve(int numRows) {
+    if (numRows <= eBuffer->rowsCapacity) {
+        return;
+    }
+    int capacity = eBuffer->rowsCapacity ? eBuffer->rowsCapacity : 16;
+    while (numRows > capacity) {
+        capacity = (capacity > INT_MAX / 2) ? INT_MAX : capacity * 2;
+    }
+
+    if (eBuffer->paged) { // The array is a shared mapping of a file, so its pages can be written out instead of swapped
+        struct pagedBuffer *paged = eBuffer->paged;
+        size_t length = sizeof(editorRow) * (size_t) capacity;
+        if (ftruncate(paged->rowsFd, length) == -1) {
+            safe_exit("ftruncate");
+        }
+        void *rows = eBuffer->row ? mremap(eBuffer->row, paged->rowsMapped, length, MREMAP_MAYMOVE) : mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, paged->rowsFd, 0);
+        if (rows == MAP_FAILED) {
+            safe_exit("mmap");
+        }
+        eBuffer->row = rows;
+        paged->rowsMapped = length;
+    } else {
+        eBuffer->row = realloc(eBuffer->row, sizeof(editorRow) * capacity);
+    }
+    eBuffer->rowsCapacity = capacity;
+}
+
+/**
+ * Sets up paging for the file being opened. The temporary files are next to it rather than in /tmp, which is often
+ * kept in memory, and are unlinked right away so they disappear with the editor.
+ */
+struct pagedBuffer *paged_create() {
+    struct pagedBuffer *paged = malloc(sizeof(struct pagedBuffer));
+    char *rowsPath = sidecar_path(eBuffer->fileName, ".texto-rows");
+    char *swapPath = sidecar_path(eBuffer->fileName, ".texto-pages");
+    paged->rowsFd = open(rowsPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    paged->swapFd = open(swapPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (paged->rowsFd == -1 || paged->swapFd == -1) {
+        safe_exit("open");
+    }
+    unlink(rowsPath);
+    unlink(swapPath);
+    free(rowsPath);
+    free(swapPath);
+
+    paged->budget = (size_t) eConfig.pagingBudget << 20;
+    paged->rowsMapped = 0;
+    paged->swapSize = 0;
+    paged->resident = NULL;
+    paged->numResident = 0;
+    paged->residentCapacity = 0;
+    paged->residentBytes = 0;
+    return paged;
+}
+
+/**
+ * Unmaps the row array of the current buffer and closes its temporary files. The rows must have been freed already.
+ */
+void paged_free() {
+    struct pagedBuffer *paged = eBuffer->paged;
+    if (eBuffer->row) {
+        munmap(eBuffer->row, paged->rowsMapped);
+    }
+    close(paged->rowsFd);
+    close(paged->swapFd);
+    free(paged->resident);
+    free(paged);
+    eBuffer->paged = NULL;
+}
+
+/**
+ * Counts a row that is getting a render, colours or text of its own against the budget
+ */
+void paged_touch(editorRow *row) {
+    struct pagedBuffer *paged = eBuffer->paged;
+    if (row->resident) {
+        return;
+    }
+    if (paged->residentBytes > paged->budget) { // Edits like replace all or a big paste touch rows faster than the screen is drawn
+        paged_trim();
+    }
+    if (paged->numResident == paged->residentCapacity) {
+        paged->residentCapacity = paged->residentCapacity ? paged->residentCapacity * 2 : 1024;
+        paged->resident = realloc(paged->resident, sizeof(int) * paged->residentCapacity);
+    }
+    row->resident = 1;
+    paged->resident[paged->numResident++] = row->index;
+    paged->residentBytes += paged_row_cost(row) + 3 * row->size; // The render and colours about to be built
+}
+
+/**
+ * Keeps the resident rows pointing at the right rows after deleteCount rows at index were replaced by insertCount rows
+ */
+void paged_rows_moved(int index, int deleteCount, int insertCount) {
+    struct pagedBuffer *paged = eBuffer->paged;
+    int kept = 0;
+    for (int i = 0; i < paged->numResident; i++) {
+        int row = paged->resident[i];
+        if (row >= index && row < index + deleteCount) { // Freed along with the row
+            continue;
+        }
+        paged->resident[kept++] = (row >= index + deleteCount) ? row + insertCount - deleteCount : row;
+    }
+    paged->numResident = kept;
+}
+
+/**
+ * Returns the memory a row holds on top of its place in the row array
+ */
+size_t paged_row_cost(editorRow *row) {
+    size_t cost = row->block ? 0 : row->size + 1;
+    if (row->render) {
+        cost += 2 * row->rsize + 1; // Render and colours
+    }
+    return cost;
+}
+
+/**
+ * Brings a paged buffer back to half its budget. The oldest resident rows away from the screen lose their render and
+ * colours, which are rebuilt when they are displayed again, and edited text is moved to the swap file.
+ */
+void paged_trim() {
+    struct pagedBuffer *paged = eBuffer->paged;
+    size_t total = 0;
+    for (int i = 0; i < paged->numResident; i++) {
+        total += paged_row_cost(&eBuffer->row[paged->resident[i]]);
+    }
+
+    int *spill = malloc(sizeof(int) * (paged->numResident + 1));
+    int numSpill = 0;
+    int kept = 0;
+    for (int i = 0; i < paged->numResident; i++) {
+        int index = paged->resident[i];
+        editorRow *row = &eBuffer->row[index];
+        int nearScreen = (index >= eBuffer->rowOffset - eConfig.windowRows && index < eBuffer->rowOffset + 2 * eConfig.windowRows)
+            || index == eBuffer->characterY || (eBuffer->markActive && index == eBuffer->markY);
+        if (total <= paged->budget / 2 || nearScreen || row->giant) {
+            paged->resident[kept++] = index;
+            continue;
+        }
+
+        total -= paged_row_cost(row);
+        free(row->render);
+        free(row->highlight);
+        row->render = NULL;
+        row->highlight = NULL;
+        row->rsize = 0;
+        row->renderStart = 0;
+        row->renderColumn = 0;
+        row->resident = 0;
+        if (row->block == NULL && row->size > 0) {
+            spill[numSpill++] = index;
+        }
+    }
+    paged->numResident = kept;
+    paged->residentBytes = total;
+
+    if (numSpill > 0) {
+        paged_spill(spill, numSpill);
+    }
+    free(spill);
+}
+
+/**
+ * Drops the render and colours of every resident row, so they are rebuilt the next time they are displayed
+ */
+void paged_release_all() {
+    struct pagedBuffer *paged = eBuffer->paged;
+    for (int i = 0; i < paged->numResident; i++) {
+        editorRow *row = &eBuffer->row[paged->resident[i]];
+        if (row->giant) {
+            continue;
+        }
+        free(row->render);
+        free(row->highlight);
+        row->render = NULL;
+        row->highlight = NULL;
+        row->rsize = 0;
+    }
+    eConfig.screenValid = 0;
+}
+
+/**
+ * Moves the edited text of rows to the end of the swap file and points the rows into a mapping of it, which the kernel
+ * can drop and read back as needed. The rows share the mapping like rows share a loaded block.
+ */
+void paged_spill(int *rows, int numRows) {
+    struct pagedBuffer *paged = eBuffer->paged;
+    size_t length = 0;
+    for (int i = 0; i < numRows; i++) {
+        length += eBuffer->row[rows[i]].size;
+    }
+
+    char *text = malloc(length);
+    size_t offset = 0;
+    for (int i = 0; i < numRows; i++) {
+        editorRow *row = &eBuffer->row[rows[i]];
+        memcpy(text + offset, row->characters, row->size);
+        offset += row->size;
+    }
+    int written = 0;
+    for (offset = 0; offset < length;) {
+        ssize_t got = pwrite(paged->swapFd, text + offset, length - offset, paged->swapSize + offset);
+        if (got <= 0) {
+            break;
+        }
+        offset += got;
+    }
+    free(text);
+    written = (offset == length);
+
+    char *data = written ? mmap(NULL, length, PROT_READ, MAP_SHARED, paged->swapFd, paged->swapSize) : MAP_FAILED;
+    if (data == MAP_FAILED) { // Out of disk space, so the text stays in memory
+        return;
+    }
+    struct textBlock *block = malloc(sizeof(struct textBlock));
+    block->refs = numRows;
+    block->base = data;
+    block->length = length;
+    block->mapped = 2;
+    block->next = NULL;
+
+    offset = 0;
+    for (int i = 0; i < numRows; i++) {
+        editorRow *row = &eBuffer->row[rows[i]];
+        free(row->characters);
+        row->characters = data + offset;
+        row->block = block;
+        offset += row->size;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    paged->swapSize += (length + pageSize - 1) / pageSize * pageSize; // The next mapping must start on a page
+}
+
+/**
+ * Notes that a walk over the rows read the text of row, or that the walk is done when row is NULL. The pages of mapped
+ * text read by a walk over a paged buffer are dropped a PAGED_SCAN_CHUNK at a time, like loader_map_worker() drops the
+ * ones it scanned, so walking a file larger than memory doesn't push everything else out.
+ */
+void paged_stream(struct pagedStream *stream, editorRow *row) {
+    if (eBuffer->paged == NULL) {
+        return;
+    }
+
+    int mapped = row && row->block && row->block->mapped;
+    if (mapped && stream->start && row->characters >= stream->end && row->characters - stream->end <= 2 && stream->end - stream->start < PAGED_SCAN_CHUNK) {
+        stream->end = row->characters + row->size; // Carries on the run, the gap is the line ending
+        return;
+    }
+
+    if (stream->start) { // Only whole pages, the ones at the edges hold other rows too
+        long pageSize = sysconf(_SC_PAGESIZE);
+        uintptr_t from = ((uintptr_t) stream->start + pageSize - 1) / pageSize * pageSize;
+        uintptr_t to = (uintptr_t) stream->end / pageSize * pageSize;
+        if (to > from) {
+            madvise((void*) from, to - from, MADV_DONTNEED);
+        }
+    }
+    stream->start = mapped ? row->characters : NULL;
+    stream->end = mapped ? row->characters + row->size : NULL;
+}
+
+/**
+ * Splits a mapped file into lines the same way loader_worker() does. The lines point into the mapping, and the pages
+ * scanned are dropped as it goes so that reading a file larger than memory doesn't push everything else out.
+ */
+void *loader_map_worker(void *arg) {
+    struct fileLoader *loader = arg;
+    char *data = loader->mapping->base;
+    size_t length = loader->mapping->length;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    struct loadedLine *lines = NULL;
+    int numLines = 0;
+    int linesCapacity = 0;
+    size_t offset = 0;
+    size_t chunkStart = 0; // Start of the pages scanned since the last hand over
+    madvise(data, length, MADV_SEQUENTIAL);
+
+    while (offset < length) {
+        const char *newline = memchr(data + offset, '\n', length - offset);
+        size_t end = newline ? (size_t) (newline - data) : length;
+        size_t lineLength = end - offset;
+        while (lineLength > 0 && data[offset + lineLength - 1] == '\r') {
+            lineLength--;
+        }
+
+        if (numLines == linesCapacity) {
+            linesCapacity = linesCapacity ? linesCapacity * 2 : 1024;
+            lines = realloc(lines, sizeof(struct loadedLine) * linesCapacity);
+        }
+        lines[numLines++] = (struct loadedLine) {loader->mapping, data + offset, lineLength};
+        offset = newline ? end + 1 : length;
+
+        if (offset - chunkStart >= PAGED_SCAN_CHUNK || offset == length) {
+            loader_publish(loader, loader->mapping, lines, numLines);
+            numLines = 0;
+            size_t dropEnd = offset / pageSize * pageSize;
+            madvise(data + chunkStart, dropEnd - chunkStart, MADV_DONTNEED);
+            chunkStart = dropEnd;
+
+            pthread_mutex_lock(&loader->lock);
+            int cancel = loader->cancel;
+            pthread_mutex_unlock(&loader->lock);
+            if (cancel) {
+                break;
+            }
+        }
+    }
+    madvise(data, length, MADV_NORMAL);
+    free(lines);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->done = 1;
+    pthread_cond_signal(&loader->progress);
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+/**
+ * Saves a paged buffer. Rows are copied into a buffer of limited size that is written out whenever it fills up, into a
+ * new file that replaces the old one, since rows still point into the mapping of the old one.
+ */
+void save_paged() {
+    char *temporaryPath = sidecar_path(eBuffer->fileName, ".texto-tmp");
+    struct stat fileStat;
+    int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, stat(eBuffer->fileName, &fileStat) == 0 ? fileStat.st_mode & 0777 : 0644);
+
+    long long length = (fd != -1) ? write_rows(fd, 0, eBuffer->numRows, 0) : -1;
+    int ok = (length >= 0);
+
+    if (ok && close(fd) == 0 && rename(temporaryPath, eBuffer->fileName) == 0) {
+        free(temporaryPath);
+        set_status_message("%lld bytes written to disk", length);
+        eBuffer->unsavedChanges = 0;
+        journal_reset();
+        file_state_record();
+        if (eConfig.useIndex) {
+            write_index();
+        }
+        return;
+    }
+
+    if (fd != -1 && !ok) {
+        close(fd);
+    }
+    unlink(temporaryPath);
+    free(temporaryPath);
+    set_status_message("Can't save to disk! I/O error: %s", strerror(errno));
+}
+
+/** Save helpers **/
+
+/** Notes that rows from first on changed, with tail rows left untouched at the end */
+void save_mark_dirty(int first, int tail) {
+    if (first < eBuffer->firstDirtyRow) {
+        eBuffer->firstDirtyRow = first;
+    }
+    if (tail < eBuffer->cleanTailRows) {
+        eBuffer->cleanTailRows = tail < 0 ? 0 : tail;
+    }
+}
+
+/** Starts tracking changes afresh against the file content on disk */
+void save_state_reset(const char *data, off_t size) {
+    long long length = 0;
+    for (int i = 0; i < eBuffer->numRows; i++) {
+        length += eBuffer->row[i].size + 1;
+    }
+    // CRLF endings or a missing final newline mean the rows don't map byte for byte onto the file
+    eBuffer->fileRowsExact = (length == size && (size == 0 || data[size - 1] == '\n'));
+    eBuffer->firstDirtyRow = INT_MAX;
+    eBuffer->cleanTailRows = eBuffer->numRows;
+}
+
+/** Writes rows start to end - 1 at the given file offset, returning the bytes written or -1 */
+long long write_rows(int fd, int start, int end, off_t offset) {
+    size_t bufferSize = 1 << 20;
+    char *buf = malloc(bufferSize);
+    size_t used = 0;
+    long long length = 0;
+    int ok = 1;
+    for (int i = start; ok && i <= end; i++) {
+        editorRow *row = (i < end) ? &eBuffer->row[i] : NULL;
+        size_t rowSize = row ? row->size + 1 : 0;
+        if (row == NULL || used + rowSize > bufferSize) { // Full, or nothing left to add
+            for (size_t written = 0; ok && written < used;) {
+                ssize_t got = pwrite(fd, buf + written, used - written, offset);
+                ok = (got > 0);
+                written += ok ? got : 0;
+                offset += ok ? got : 0;
+            }
+            used = 0;
+        }
+        if (row && rowSize > bufferSize) { // Too long for the buffer, so it gets one of its own
+            bufferSize = rowSize;
+            buf = realloc(buf, bufferSize);
+        }
+        if (row) {
+            memcpy(buf + used, row->characters, row->size);
+            buf[used + row->size] = '\n';
+            used += rowSize;
+            length += rowSize;
+        }
+    }
+    free(buf);
+    return ok ? length : -1;
+}
+
+/** Writes only the changed part of the file when the edits allow it, returning 0 to fall back to a full save */
+int save_in_place() {
+    if (!file_rows_on_disk()) {
+        return 0; // Not the file we loaded, so we can't trust its bytes
+    }
+
+    int start = (eBuffer->firstDirtyRow < eBuffer->numRows) ? eBuffer->firstDirtyRow : eBuffer->numRows;
+    int tailStart = eBuffer->numRows - eBuffer->cleanTailRows;
+    if (tailStart < start) {
+        tailStart = start;
+    }
+    long long offset = 0, tailOffset = 0, length = 0;
+    for (int i = 0; i < eBuffer->numRows; i++) {
+        offset += (i < start) ? eBuffer->row[i].size + 1 : 0;
+        tailOffset += (i < tailStart) ? eBuffer->row[i].size + 1 : 0;
+        length += eBuffer->row[i].size + 1;
+    }
+    // The prefix always stays; the untouched tail does too when it hasn't moved
+    int end = (length == eBuffer->fileSize) ? tailStart : eBuffer->numRows;
+    if (start == 0 && end == eBuffer->numRows) {
+        return 0; // Nothing to keep, and a full save swaps the file in atomically
+    }
+    size_t regionSize = (size_t) (((end == tailStart) ? tailOffset : length) - offset); // Never negative, the region starts at offset
+    if (eBuffer->paged && regionSize > eBuffer->paged->budget) {
+        return 0; // Copying that much out of the mapping wouldn't fit, a full rewrite streams instead
+    }
+
+    // Rows still pointing into the file would read back what we're overwriting
+    if (eBuffer->fileMapping) {
+        int mappedRows = 0;
+        for (int i = 0; i < eBuffer->numRows; i++) {
+            mappedRows += (eBuffer->row[i].block == eBuffer->fileMapping);
+        }
+        if (eBuffer->fileMapping->refs > mappedRows) {
+            return 0; // The clipboard or the journal holds text in the file too, only a new file keeps it intact
+        }
+
+        for (int i = start; i < end; i++) {
+            editorRow *row = &eBuffer->row[i];
+            if (row->block == eBuffer->fileMapping) {
+                row_make_writable(row);
+                if (eBuffer->paged) {
+                    paged_touch(row);
+                }
+            }
+        }
+    }
+
+    int fd = open(eBuffer->fileName, O_WRONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    // The journal is the only way back from a torn file, so the new bytes must be on disk before it is reset
+    long long written = write_rows(fd, start, end, offset);
+    int failed = (written < 0 || ftruncate(fd, length) != 0 || fsync(fd) != 0);
+    int error = errno;
+    if (close(fd) != 0 && !failed) {
+        failed = 1;
+        error = errno;
+    }
+    if (failed) {
+        set_status_message("Can't save to disk! I/O error: %s", strerror(error));
+        return 1; // Partly written, a full save from here is the way out
+    }
+
+    set_status_message("%lld of %lld bytes written to disk", written, length);
+    eBuffer->unsavedChanges = 0;
+    journal_reset();
+    file_state_record();
+    if (eConfig.useIndex) {
+        write_index();
+    }
+    return 1;
+}
+
+/**
+ * Checks that the file on disk is still the one last loaded or saved, and holds exactly the rows that haven't changed since
+ */
+int file_rows_on_disk() {
+    struct stat fileStat;
+    return eBuffer->fileRowsExact && eBuffer->fileName && stat(eBuffer->fileName, &fileStat) == 0 && S_ISREG(fileStat.st_mode) &&
+        fileStat.st_size == eBuffer->fileSize && fileStat.st_ino == eBuffer->fileInode &&
+        fileStat.st_mtim.tv_sec == eBuffer->fileModified.tv_sec && fileStat.st_mtim.tv_nsec == eBuffer->fileModified.tv_nsec;
+}
+
+/** Filtering through commands **/
+
+/**
+ * Pipes the selected rows, or the whole buffer when nothing is selected, through a shell command typed by the user and
+ * replaces them with its output in one splice. The new rows share the output's text instead of copying it.
+ */
+void filter_rows() {
+    int start = 0, end = eBuffer->numRows;
+    int startY, startX, endY, endX;
+    if (selection_bounds(&startY, &startX, &endY, &endX)) {
+        start = startY;
+        end = (endX == 0 && endY > startY) ? endY : endY + 1; // A selection ending at the start of a row leaves that row out
+        if (end > eBuffer->numRows) {
+            end = eBuffer->numRows;
+        }
+        if (start > end) {
+            start = end;
+        }
+        selection_clear();
+    }
+
+    char promptText[80];
+    snprintf(promptText, sizeof(promptText), "Filter %d lines through: %%s (ESC to cancel)", end - start);
+    char *command = prompt(promptText, NULL, 0);
+    if (!command) {
+        return;
+    }
+    char *data;
+    size_t length;
+    int failed = filter_run(start, end, command, &data, &length);
+    free(command);
+    if (failed) {
+        return;
+    }
+
+    // Each line of the output becomes a row pointing into it
+    int count = 0, capacity = 1024;
+    char **values = malloc(sizeof(char*) * capacity);
+    size_t *lengths = malloc(sizeof(size_t) * capacity);
+    for (size_t offset = 0; offset < length;) {
+        char *newline = memchr(&data[offset], '\n', length - offset);
+        size_t lineLength = newline ? (size_t) (newline - &data[offset]) : length - offset;
+        size_t next = offset + lineLength + 1;
+        while (lineLength > 0 && data[offset + lineLength - 1] == '\r') {
+            lineLength--;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            values = realloc(values, sizeof(char*) * capacity);
+            lengths = realloc(lengths, sizeof(size_t) * capacity);
+        }
+        values[count] = &data[offset];
+        lengths[count] = lineLength;
+        count++;
+        offset = next;
+    }
+
+    struct textBlock **blocks = malloc(sizeof(struct textBlock*) * (count + 1));
+    if (count > 0) {
+        struct textBlock *block = malloc(sizeof(struct textBlock));
+        block->refs = 0; // Taken by the rows
+        block->base = data;
+        block->length = length;
+        block->mapped = 1;
+        block->next = NULL;
+        for (int i = 0; i < count; i++) {
+            blocks[i] = block;
+        }
+    }
+
+    int inComment = (start > 0) ? eBuffer->row[start - 1].highlightOpenComment : 0;
+    int oldComment = (end > start) ? eBuffer->row[end - 1].highlightOpenComment : inComment;
+    splice_rows(start, end - start, values, lengths, blocks, count);
+    journal_record(JOURNAL_DELETE_ROWS, start, end - start, NULL, 0);
+    journal_record_rows(start, values, lengths, count);
+    eBuffer->unsavedChanges++;
+    free(values);
+    free(lengths);
+    free(blocks);
+
+    if (!eBuffer->paged) { // Paged buffers colour rows as they are displayed
+        int openComment = inComment;
+        for (int i = start; i < start + count; i++) {
+            openComment = highlight_row(&eBuffer->row[i], openComment, &eBuffer->giantPending);
+            eBuffer->row[i].highlightOpenComment = openComment;
+        }
+        if (openComment != oldComment) {
+            rehighlight_from(start + count, openComment);
+        }
+    }
+
+    eBuffer->characterY = start;
+    eBuffer->characterX = 0;
+    set_status_message("Filtered %d lines into %d", end - start, count);
+}
+
+/**
+ * Runs a command with rows start to end - 1 on its stdin. Its input and output are moved through non-blocking pipes at the
+ * same time, so neither side waits on a full pipe however much it writes. Unchanged rows are spliced straight from the file,
+ * and the output is spliced into an unlinked temporary file that is mapped once the command exits. Esc or Ctrl-C kills it.
+ * Returns 0 with the output in data on success, otherwise leaves a message in the status bar and returns -1.
+ */
+int filter_run(int start, int end, char *command, char **data, size_t *length) {
+    int input[2] = {-1, -1}, output[2] = {-1, -1}, errors[2] = {-1, -1};
+    int outputFd = filter_output_file();
+    if (outputFd == -1 || pipe2(input, O_CLOEXEC) == -1 || pipe2(output, O_CLOEXEC) == -1 || pipe2(errors, O_CLOEXEC) == -1) {
+        set_status_message("Can't run command: %s", strerror(errno));
+        int opened[7] = {outputFd, input[0], input[1], output[0], output[1], errors[0], errors[1]};
+        for (int i = 0; i < 7; i++) {
+            if (opened[i] != -1) {
+                close(opened[i]);
+            }
+        }
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0); // So the whole pipeline can be killed
+        dup2(input[0], STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        dup2(errors[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", command, (char*) NULL);
+        _exit(127);
+    }
+    if (pid != -1) { // Also done here, so a cancel before the child gets to it still finds the group
+        setpgid(pid, pid);
+    }
+    close(input[0]);
+    close(output[1]);
+    close(errors[1]);
+    if (pid == -1) {
+        set_status_message("Can't run command: %s", strerror(errno));
+        close(input[1]);
+        close(output[0]);
+        close(errors[0]);
+        close(outputFd);
+        return -1;
+    }
+    fcntl(input[1], F_SETFL, O_NONBLOCK);
+    fcntl(output[0], F_SETFL, O_NONBLOCK);
+    fcntl(errors[0], F_SETFL, O_NONBLOCK);
+
+    // Rows that match the file on disk are sent from there without passing through our memory
+    int diskFd = -1;
+    off_t diskOffset = 0, diskEnd = 0;
+    if (end > start && end <= eBuffer->firstDirtyRow && file_rows_on_disk()) {
+        for (int i = 0; i < end; i++) {
+            diskOffset += (i < start) ? eBuffer->row[i].size + 1 : 0;
+            diskEnd += eBuffer->row[i].size + 1;
+        }
+        diskFd = open(eBuffer->fileName, O_RDONLY);
+    }
+    off_t diskStart = diskOffset;
+
+    void (*oldHandler)(int) = signal(SIGPIPE, SIG_IGN); // A command that stops reading early mustn't take the editor down
+    struct pollfd fds[4] = {{input[1], POLLOUT, 0}, {output[0], POLLIN, 0}, {errors[0], POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+    int row = start;
+    size_t rowOffset = 0; // Bytes of the row already sent, its newline being the last one
+    off_t outputLength = 0;
+    int spliceOutput = 1, canceled = 0, inputLost = 0, outputLost = 0;
+    char errorText[128];
+    size_t errorLength = 0;
+    char copy[65536];
+
+    while (!canceled && !inputLost && !outputLost && (fds[0].fd != -1 || fds[1].fd != -1 || fds[2].fd != -1)) {
+        if (fds[0].fd != -1 && diskFd == -1 && row == end) { // Everything is sent, so the command sees the end of its input
+            close(fds[0].fd);
+            fds[0].fd = -1;
+            continue; // The command may be done already, with nothing left to wait for
+        }
+        if (poll(fds, 4, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[0].revents) {
+            ssize_t sent = -1;
+            if (diskFd != -1) {
+                sent = splice(diskFd, &diskOffset, fds[0].fd, NULL, diskEnd - diskOffset, SPLICE_F_NONBLOCK);
+                if (sent == -1 && errno == EINVAL && diskOffset == diskStart) { // Can't splice from this file system, send the rows
+                    close(diskFd);
+                    diskFd = -1;
+                    continue;
+                }
+                if (sent == 0) { // The file got shorter under us, so what is left of the rows isn't there any more
+                    sent = -1;
+                    errno = EIO;
+                }
+                if (sent > 0 && diskOffset == diskEnd) {
+                    close(diskFd);
+                    diskFd = -1;
+                    row = end;
+                }
+            } else {
+                struct iovec parts[2 * FILTER_PIPE_ROWS];
+                int numParts = 0;
+                for (int i = row; i < end && numParts < 2 * FILTER_PIPE_ROWS; i++) {
+                    size_t skip = (i == row) ? rowOffset : 0;
+                    editorRow *current = &eBuffer->row[i];
+                    if (skip < (size_t) current->size) {
+                        parts[numParts++] = (struct iovec) {&current->characters[skip], current->size - skip};
+                    }
+                    parts[numParts++] = (struct iovec) {"\n", 1};
+                }
+                sent = writev(fds[0].fd, parts, numParts);
+                for (ssize_t left = sent; left > 0;) { // Moves past what was written
+                    size_t rowLeft = eBuffer->row[row].size + 1 - rowOffset;
+                    if ((size_t) left >= rowLeft) {
+                        left -= rowLeft;
+                        row++;
+                        rowOffset = 0;
+                    } else {
+                        rowOffset += left;
+                        left = 0;
+                    }
+                }
+            }
+            if (sent == -1 && errno == EPIPE) { // The command closed its input, which is up to it
+                if (diskFd != -1) {
+                    close(diskFd);
+                    diskFd = -1;
+                }
+                row = end;
+            } else if (sent == -1 && errno != EAGAIN) { // The command didn't get all of its input, so its output can't be trusted
+                inputLost = errno;
+            }
+        }
+
+        if (fds[1].revents) {
+            ssize_t got = -1;
+            if (spliceOutput) {
+                got = splice(fds[1].fd, NULL, outputFd, NULL, FILTER_CHUNK, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+                if (got == -1 && errno == EINVAL) { // Copied by hand on file systems that don't take splices
+                    spliceOutput = 0;
+                    continue;
+                }
+            } else {
+                got = read(fds[1].fd, copy, sizeof(copy));
+                for (ssize_t written = 0; got > 0 && written < got;) {
+                    ssize_t part = write(outputFd, &copy[written], got - written);
+                    if (part <= 0) {
+                        got = -1;
+                        errno = EIO;
+                        break;
+                    }
+                    written += part;
+                }
+            }
+            if (got > 0) {
+                outputLength += got;
+            } else if (got == 0 || errno != EAGAIN) {
+                outputLost = (got == -1) ? errno : 0; // Nowhere to put the output
+                close(fds[1].fd);
+                fds[1].fd = -1;
+            }
+        }
+
+        if (fds[2].revents) { // Keeps the start of what the command complains about for the status bar
+            ssize_t got = read(fds[2].fd, copy, sizeof(copy));
+            if (got > 0 && errorLength < sizeof(errorText) - 1) {
+                size_t take = (size_t) got < sizeof(errorText) - 1 - errorLength ? (size_t) got : sizeof(errorText) - 1 - errorLength;
+                memcpy(&errorText[errorLength], copy, take);
+                errorLength += take;
+            } else if (got == 0 || (got == -1 && errno != EAGAIN)) {
+                close(fds[2].fd);
+                fds[2].fd = -1;
+            }
+        }
+
+        if (fds[3].revents) { // Keys typed meanwhile are kept for after the command, apart from a cancel
+            char key;
+            ssize_t got = read(STDIN_FILENO, &key, 1);
+            if (got == 1 && (key == CTRL_KEY('c') || (key == '\x1b' && !input_arrives(ESCAPE_TIMEOUT_MS)))) {
+                canceled = 1; // Esc on its own, not the start of an arrow key or the like
+            } else if (got == 1) {
+                queue_input(&key, 1);
+            }
+            if (got == 0 || keyQueueLength == KEY_QUEUE_SIZE) { // Left unread once there's no room for more
+                fds[3].fd = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (fds[i].fd != -1) {
+            close(fds[i].fd);
+        }
+    }
+    if (diskFd != -1) {
+        close(diskFd);
+    }
+    int status;
+    if (canceled || inputLost || outputLost) {
+        kill(-pid, SIGKILL);
+    }
+    waitpid(pid, &status, 0);
+    signal(SIGPIPE, oldHandler);
+
+    *data = NULL;
+    *length = outputLength;
+    int failed = 1;
+    errorText[errorLength] = '\0';
+    char *newline = strchr(errorText, '\n');
+    if (newline) {
+        *newline = '\0';
+    }
+    if (canceled) {
+        set_status_message("Filter canceled");
+    } else if (inputLost) {
+        set_status_message("Can't send the lines to the command: %s", strerror(inputLost));
+    } else if (outputLost) {
+        set_status_message("Can't keep the output: %s", strerror(outputLost));
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (errorLength) {
+            set_status_message("Command failed: %s", errorText);
+        } else {
+            set_status_message("Command failed with status %d", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        }
+    } else if (outputLength > 0 && (*data = mmap(NULL, outputLength, PROT_READ, MAP_PRIVATE, outputFd, 0)) == MAP_FAILED) {
+        *data = NULL;
+        set_status_message("Can't map the output: %s", strerror(errno));
+    } else {
+        failed = 0;
+    }
+    close(outputFd);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Opens an unlinked temporary file for a command's output, next to the file so it can be spliced into, or in /tmp
+ */
+int filter_output_file() {
+    char *path = eBuffer->fileName ? sidecar_path(eBuffer->fileName, ".texto-filter-XXXXXX") : strdup("/tmp/.texto-filter-XXXXXX");
+    int fd = mkostemp(path, O_CLOEXEC); // The command writes to a pipe, never straight into this
+    if (fd == -1 && eBuffer->fileName) { // The file's directory may not be writable
+        free(path);
+        path = strdup("/tmp/.texto-filter-XXXXXX");
+        fd = mkostemp(path, O_CLOEXEC);
+    }
+    if (fd != -1) {
+        unlink(path);
+    }
+    free(path);
+    return fd;
+}
+
+/** Character classes **/
+
+/**
+ * Fills in the class of every byte value once, so the hot loops look classes up instead of calling isspace() and strchr()
+ */
+void char_class_init() {
+    for (int c = 0; c < 256; c++) {
+        unsigned char flags = 0;
+        if (isspace(c) || c == '\0') {
+            flags |= CHAR_SPACE | CHAR_SEPARATOR;
+        }
+        if (c != '\0' && strchr(",.()+-/*=~%<>[];", c) != NULL) {
+            flags |= CHAR_SEPARATOR;
+        }
+        if (isalnum(c) || c == '_' || c >= 0x80) { // Bytes of UTF-8 characters count as letters
+            flags |= CHAR_WORD;
+        }
+        if (isdigit(c)) {
+            flags |= CHAR_DIGIT;
+        }
+        charClass[c] = flags;
+    }
+}
+
+/** Document statistics **/
+
+/**
+ * Adds a new row's bytes to the totals. Its words are counted while the editor is idle, so loading stays fast.
+ */
+void stats_row_added(editorRow *row) {
+    row->words = -1;
+    row->countedSize = row->size;
+    eBuffer->totalBytes += row->size + 1;
+    eBuffer->uncountedRows++;
+}
+
+/**
+ * Takes a row that is going away out of the totals
+ */
+void stats_row_removed(editorRow *row) {
+    eBuffer->totalBytes -= row->countedSize + 1;
+    if (row->words < 0) {
+        eBuffer->uncountedRows--;
+    } else {
+        eBuffer->totalWords -= row->words;
+    }
+}
+
+/**
+ * Brings the totals up to date after a row was edited. Only the row is recounted, or later when idle if it is a giant row.
+ */
+void stats_row_changed(editorRow *row) {
+    eBuffer->totalBytes += row->size - row->countedSize;
+    row->countedSize = row->size;
+    if (row->words >= 0) {
+        eBuffer->totalWords -= row->words;
+        row->words = -1;
+        eBuffer->uncountedRows++;
+    }
+    if (row->size < GIANT_ROW_SIZE) {
+        stats_count_row(row);
+    }
+}
+
+/**
+ * Counts the words of a row the way wc does, as runs of bytes that aren't white space
+ */
+void stats_count_row(editorRow *row) {
+    int words = 0;
+    int inSpace = 1;
+    for (int i = 0; i < row->size; i++) {
+        int space = CHAR_CLASS(row->characters[i]) & CHAR_SPACE;
+        words += inSpace && !space;
+        inSpace = space;
+    }
+    row->words = words;
+    eBuffer->totalWords += words;
+    eBuffer->uncountedRows--;
+}
+
+/**
+ * Counts the words of rows that haven't been counted yet, for at most STATS_IDLE_US
+ */
+void stats_count_idle() {
+    struct timespec startTime, now;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    struct pagedStream stream = {NULL, NULL};
+    for (int scanned = 0; eBuffer->uncountedRows > 0 && scanned < eBuffer->numRows; scanned++) {
+        if (eBuffer->nextUncountedRow >= eBuffer->numRows) { // Rows before the last stop may have been added or edited since
+            eBuffer->nextUncountedRow = 0;
+        }
+        editorRow *row = &eBuffer->row[eBuffer->nextUncountedRow++];
+        if (row->words < 0) {
+            stats_count_row(row);
+            paged_stream(&stream, row);
+        }
+
+        // Checked for every row, counted or not: one long row, or a long run of rows counted already, can use up the time
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - startTime.tv_sec) * 1000000 + (now.tv_nsec - startTime.tv_nsec) / 1000 >= STATS_IDLE_US) {
+            break;
+        }
+    }
+    paged_stream(&stream, NULL);
+    if (eBuffer->uncountedRows == 0) { // Redraws the status bar with the total
+        eBuffer->generation++;
+    }
+}
+
+/** Word motion **/
+
+/**
+ * Moves the cursor to the start of the next word, or back to the start of the previous one. Words are runs of letters or
+ * runs of punctuation, and the ends of rows are stops too.
+ */
+void move_word(int input) {
+    if (eBuffer->characterY >= eBuffer->numRows) {
+        move_cursor(input == CTRL_ARROW_LEFT ? ARROW_LEFT : ARROW_RIGHT);
+        return;
+    }
+    editorRow *row = &eBuffer->row[eBuffer->characterY];
+    int x = eBuffer->characterX;
+
+    if (input == CTRL_ARROW_RIGHT) {
+        if (x >= row->size) {
+            move_cursor(ARROW_RIGHT);
+            return;
+        }
+        int kind = CHAR_CLASS(row->characters[x]) & (CHAR_SPACE | CHAR_WORD);
+        while (kind != CHAR_SPACE && x < row->size && (CHAR_CLASS(row->characters[x]) & (CHAR_SPACE | CHAR_WORD)) == kind) {
+            x++;
+        }
+        while (x < row->size && (CHAR_CLASS(row->characters[x]) & CHAR_SPACE)) {
+            x++;
+        }
+    } else {
+        if (x == 0) {
+            move_cursor(ARROW_LEFT);
+            return;
+        }
+        while (x > 0 && (CHAR_CLASS(row->characters[x - 1]) & CHAR_SPACE)) {
+            x--;
+        }
+        int kind = (x > 0) ? CHAR_CLASS(row->characters[x - 1]) & (CHAR_SPACE | CHAR_WORD) : 0;
+        while (x > 0 && (CHAR_CLASS(row->characters[x - 1]) & (CHAR_SPACE | CHAR_WORD)) == kind) {
+            x--;
+        }
+    }
+    eBuffer->characterX = x;
+}
+
+/** Multiple cursors **/
+
+/**
+ * Orders cursors by row and then by index
+ */
+int cursor_compare(const void *a, const void *b) {
+    const struct cursorPosition *first = a, *second = b;
+    if (first->y != second->y) {
+        return first->y < second->y ? -1 : 1;
+    }
+    return (first->x > second->x) - (first->x < second->x);
+}
+
+/**
+ * Adds a cursor on the row below the lowest cursor, or one on every selected row, at the main cursor's column
+ */
+void cursors_add() {
+    int column = 0;
+    if (eBuffer->characterY < eBuffer->numRows) {
+        column = row_character_index_to_column(&eBuffer->row[eBuffer->characterY], eBuffer->characterX);
+    }
+
+    int startY, startX, endY, endX;
+    if (selection_bounds(&startY, &startX, &endY, &endX)) {
+        selection_clear();
+    } else {
+        startY = endY = eBuffer->characterY;
+        if (eBuffer->numCursors && eBuffer->cursors[eBuffer->numCursors - 1].y > startY) {
+            startY = endY = eBuffer->cursors[eBuffer->numCursors - 1].y;
+        }
+        startY = endY = fold_next_row(startY);
+    }
+    if (endY >= eBuffer->numRows) {
+        endY = eBuffer->numRows - 1;
+    }
+
+    for (int y = startY; y <= endY; y++) {
+        if (eBuffer->numCursors == eBuffer->cursorsCapacity) {
+            eBuffer->cursorsCapacity = eBuffer->cursorsCapacity ? eBuffer->cursorsCapacity * 2 : 16;
+            eBuffer->cursors = realloc(eBuffer->cursors, sizeof(struct cursorPosition) * eBuffer->cursorsCapacity);
+        }
+        eBuffer->cursors[eBuffer->numCursors++] = (struct cursorPosition) {row_column_to_character_index(&eBuffer->row[y], column), y, 0};
+    }
+
+    // Sorted, without duplicates or the main cursor
+    cursors_gather();
+    cursors_scatter();
+    eConfig.screenValid = 0;
+    set_status_message("%d cursors (Esc to leave one)", eBuffer->numCursors + 1);
+}
+
+/**
+ * Drops every cursor but the main one
+ */
+void cursors_clear() {
+    if (eBuffer->numCursors) {
+        eBuffer->numCursors = 0;
+        eConfig.screenValid = 0;
+    }
+}
+
+/**
+ * Adds the main cursor to the others, then sorts them
+ */
+void cursors_gather() {
+    if (eBuffer->numCursors == eBuffer->cursorsCapacity) {
+        eBuffer->cursorsCapacity = eBuffer->cursorsCapacity ? eBuffer->cursorsCapacity * 2 : 16;
+        eBuffer->cursors = realloc(eBuffer->cursors, sizeof(struct cursorPosition) * eBuffer->cursorsCapacity);
+    }
+    eBuffer->cursors[eBuffer->numCursors++] = (struct cursorPosition) {eBuffer->characterX, eBuffer->characterY, 1};
+    cursors_normalize();
+}
+
+/**
+ * Sorts the cursors and removes duplicates and cursors past the end of the buffer
+ */
+void cursors_normalize() {
+    qsort(eBuffer->cursors, eBuffer->numCursors, sizeof(struct cursorPosition), cursor_compare);
+
+    int kept = 0;
+    for (int i = 0; i < eBuffer->numCursors; i++) {
+        struct cursorPosition cursor = eBuffer->cursors[i];
+        if (cursor.y > eBuffer->numRows || (cursor.y == eBuffer->numRows && !cursor.primary)) { // Another client shortened the buffer
+            continue;
+        }
+        int size = (cursor.y < eBuffer->numRows) ? eBuffer->row[cursor.y].size : 0;
+        cursor.x = (cursor.x > size) ? size : cursor.x;
+        if (kept > 0 && eBuffer->cursors[kept - 1].y == cursor.y && eBuffer->cursors[kept - 1].x == cursor.x) {
+            eBuffer->cursors[kept - 1].primary |= cursor.primary;
+            continue;
+        }
+        eBuffer->cursors[kept++] = cursor;
+    }
+    eBuffer->numCursors = kept;
+}
+
+/**
+ * Takes the main cursor back out of the others after cursors_gather()
+ */
+void cursors_scatter() {
+    for (int i = 0; i < eBuffer->numCursors; i++) {
+        if (eBuffer->cursors[i].primary) {
+            eBuffer->characterX = eBuffer->cursors[i].x;
+            eBuffer->characterY = eBuffer->cursors[i].y;
+            memmove(&eBuffer->cursors[i], &eBuffer->cursors[i + 1], sizeof(struct cursorPosition) * (eBuffer->numCursors - i - 1));
+            eBuffer->numCursors--;
+            return;
+        }
+    }
+}
+
+/**
+ * Handles a key while there are extra cursors. Typing and deleting happen at every cursor and moving along the row moves
+ * them all. Other edits only make sense at one place, so they drop the extra cursors. Returns 1 if the key was handled.
+ */
+int cursors_handle_key(int input) {
+    switch (input) {
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DELETE_KEY:
+            cursors_edit(input);
+            return 1;
+
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            cursors_move(input);
+            return 1;
+
+        case '\x1b':
+            cursors_clear();
+            return 0;
+    }
+
+    if (input == '\t' || (input >= 32 && input < 256 && input != BACKSPACE)) {
+        cursors_edit(input);
+        return 1;
+    }
+    if (is_edit_key(input)) {
+        cursors_clear();
+    }
+    return 0;
+}
+
+/**
+ * Types a character, or deletes the one before or after, at every cursor. All the changes to a row are made in one copy of
+ * it, which is then rebuilt once, and every changed row is coloured once in order so comment states carry down correctly.
+ */
+void cursors_edit(int input) {
+    cursors_gather();
+    int insert = (input != BACKSPACE && input != CTRL_KEY('h') && input != DELETE_KEY);
+    int *changed = malloc(sizeof(int) * eBuffer->numCursors);
+    int numChanged = 0;
+
+    eBuffer->deferHighlight = 1; // Coloured once at the end, rather than after every row
+    for (int first = 0; first < eBuffer->numCursors;) {
+        int y = eBuffer->cursors[first].y;
+        int end = first;
+        while (end < eBuffer->numCursors && eBuffer->cursors[end].y == y) {
+            end++;
+        }
+        if (y == eBuffer->numRows) { // The main cursor is past the last row
+            if (!insert) {
+                break;
+            }
+            insert_row(eBuffer->numRows, "", 0);
+        }
+
+        editorRow *row = &eBuffer->row[y];
+        char *characters = malloc(row->size + (end - first) + 1);
+        int length = 0, copied = 0;
+        for (int i = first; i < end; i++) {
+            struct cursorPosition *cursor = &eBuffer->cursors[i];
+            int from = cursor->x, to = cursor->x; // Characters removed at this cursor
+            if ((input == BACKSPACE || input == CTRL_KEY('h')) && from > 0) {
+                do { // Every byte of a multibyte character
+                    from--;
+                } while (from > 0 && (row->characters[from] & 0xc0) == 0x80);
+            } else if (input == DELETE_KEY && to < row->size) {
+                do {
+                    to++;
+                } while (to < row->size && (row->characters[to] & 0xc0) == 0x80);
+            }
+            from = (from < copied) ? copied : from; // Already removed at the cursor before
+            to = (to < from) ? from : to;
+
+            memcpy(&characters[length], &row->characters[copied], from - copied);
+            length += from - copied;
+            if (insert) {
+                characters[length++] = input;
+            }
+            cursor->x = length;
+            copied = to;
+        }
+        memcpy(&characters[length], &row->characters[copied], row->size - copied);
+        length += row->size - copied;
+        characters[length] = '\0';
+
+        if (length == row->size && !insert) { // Every cursor was at the start (or end) of the row
+            free(characters);
+        } else {
+            row_make_writable(row);
+            giant_row_edited(row, eBuffer->cursors[first].x > 0 ? eBuffer->cursors[first].x - 1 : 0);
+            free(row->characters);
+            row->characters = characters;
+            row->size = length;
+            update_row(row);
+            journal_record(JOURNAL_SET_ROW, y, 0, row->characters, row->size);
+            changed[numChanged++] = y;
+        }
+        first = end;
+    }
+    eBuffer->deferHighlight = 0;
+
+    // Rows recoloured because a comment opened or closed above them aren't coloured again
+    int coloured = 0;
+    for (int i = 0; i < numChanged; i++) {
+        int y = changed[i];
+        if (y < coloured) {
+            continue;
+        }
+        editorRow *row = &eBuffer->row[y];
+        int openComment = highlight_row(row, y > 0 ? eBuffer->row[y - 1].highlightOpenComment : 0, &eBuffer->giantPending);
+        int stateChanged = (openComment != row->highlightOpenComment);
+        row->highlightOpenComment = openComment;
+        coloured = stateChanged ? rehighlight_from(y + 1, openComment) + 1 : y + 1;
+    }
+    free(changed);
+
+    if (numChanged) {
+        eBuffer->unsavedChanges++;
+    }
+    cursors_normalize(); // Cursors that met are merged
+    cursors_scatter();
+}
+
+/**
+ * Moves every cursor along its row
+ */
+void cursors_move(int input) {
+    cursors_gather();
+    for (int i = 0; i < eBuffer->numCursors; i++) {
+        struct cursorPosition *cursor = &eBuffer->cursors[i];
+        editorRow *row = (cursor->y < eBuffer->numRows) ? &eBuffer->row[cursor->y] : NULL;
+        if (row == NULL) {
+            continue;
+        }
+        if (input == HOME_KEY) {
+            cursor->x = 0;
+        } else if (input == END_KEY) {
+            cursor->x = row->size;
+        } else if (input == ARROW_LEFT && cursor->x > 0) {
+            do {
+                cursor->x--;
+            } while (cursor->x > 0 && (row->characters[cursor->x] & 0xc0) == 0x80);
+        } else if (input == ARROW_RIGHT && cursor->x < row->size) {
+            do {
+                cursor->x++;
+            } while (cursor->x < row->size && (row->characters[cursor->x] & 0xc0) == 0x80);
+        }
+    }
+    cursors_normalize();
+    cursors_scatter();
+    eConfig.screenValid = 0;
+}
+
+/**
+ * Finds the first extra cursor on a row or after it
+ */
+int cursors_first_in_row(int y) {
+    int low = 0, high = eBuffer->numCursors;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (eBuffer->cursors[middle].y < y) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Gives the render index of the next extra cursor on a row at or after from, moving *next past the ones before it.
+ * Returns -1 when there are none left on the row.
+ */
+int cursor_render_index(editorRow *row, int *next, int from) {
+    while (*next < eBuffer->numCursors && eBuffer->cursors[*next].y == row->index) {
+        struct cursorPosition *cursor = &eBuffer->cursors[(*next)++];
+        if (cursor->x < row->renderStart || cursor->x > row->size) { // Off the part of a giant row that is rendered
+            continue;
+        }
+        int index = row_character_index_to_render_index(row, cursor->x);
+        if (index >= from) {
+            (*next)--; // Still ahead, so it is looked at again next time
+            return index;
+        }
+    }
+    return -1;
+}
+
+/** Line numbers **/
+
+/**
+ * Shows or hides the line numbers
+ */
+void line_numbers_toggle() {
+    eBuffer->lineNumbers = !eBuffer->lineNumbers;
+    eBuffer->lineNumberRows = -1; // Worked out when the screen is next drawn
+    eConfig.screenValid = 0;
+    eBuffer->layoutValid = 0; // Soft wrapped rows get narrower or wider
+    set_status_message("Line numbers %s", eBuffer->lineNumbers ? "on" : "off");
+}
+
+/**
+ * Works out how many digits the largest line number needs, after the number of rows changed
+ */
+void line_numbers_update() {
+    eBuffer->lineNumberRows = eBuffer->numRows;
+    int digits = 1;
+    for (int rows = eBuffer->numRows; rows >= 10; rows /= 10) {
+        digits++;
+    }
+    if (digits < LINE_NUMBER_MIN_DIGITS) {
+        digits = LINE_NUMBER_MIN_DIGITS;
+    }
+
+    if (digits != eBuffer->lineNumberDigits) { // Everything to the right of the gutter moves
+        eBuffer->lineNumberDigits = digits;
+        eConfig.screenValid = 0;
+        eBuffer->layoutValid = 0;
+    }
+}
+
+/**
+ * Draws a line number right aligned in the gutter, or blanks for 0
+ */
+void draw_line_number(struct appendBuffer *obj, int number) {
+    char cell[32];
+    int length = number ? snprintf(cell, sizeof(cell), "\x1b[90m%*d\x1b[39m ", eBuffer->lineNumberDigits, number)
+                        : snprintf(cell, sizeof(cell), "%*s", eBuffer->lineNumberDigits + 1, "");
+    append_to_append_buffer(obj, cell, length);
+}
+
+/**
+ * Moves the cursor to a line number typed by the user and puts it in the middle of the screen. The cursor and the offsets
+ * are set directly, so distant lines are reached as quickly as near ones.
+ */
+void goto_line() {
+    char *input = prompt("Go to line: %s (ESC to cancel)", NULL, 0);
+    if (!input) {
+        return;
+    }
+    int line = atoi(input);
+    free(input);
+    if (line < 1 || eBuffer->numRows == 0) {
+        set_status_message("No such line");
+        return;
+    }
+    if (line > eBuffer->numRows) {
+        line = eBuffer->numRows;
+    }
+
+    eBuffer->characterY = fold_visible_row(line - 1);
+    eBuffer->characterX = 0;
+    if (layout_active()) { // Counts screen lines through the layout index
+        layout_build();
+        int topLine = layout_line_of_row(eBuffer->characterY) - eConfig.windowRows / 2;
+        eBuffer->rowOffset = layout_row_at_line(topLine > 0 ? topLine : 0, &eBuffer->wrapOffset);
+    } else {
+        eBuffer->rowOffset = (eBuffer->characterY > eConfig.windowRows / 2) ? eBuffer->characterY - eConfig.windowRows / 2 : 0;
+        eBuffer->wrapOffset = 0;
+    }
+}
+
+/**
+ * Drops the dead ids from the index. Live ids are renumbered in order, so every list keeps ascending and its deltas only
+ * shrink, which lets each list be rewritten in place. Runs once dead ids outnumber live ones, so its cost is spread over
+ * the edits that made them, and rewrites lists for at most TRIGRAM_IDLE_US per tick. No rows are indexed until it is
+ * done, so the lists it hasn't reached yet keep the old ids.
+ */
+void trigram_compact() {
+    struct trigramIndex *index = eBuffer->trigrams;
+    struct timespec startTime, now;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    if (index->compactNewId == NULL) {
+        index->compactNewId = malloc(sizeof(int) * (index->numIds + 1));
+        index->compactOldId = malloc(sizeof(int) * (index->numIds + 1));
+        int numLive = 0, indexedLive = 0;
+        for (int id = 0; id < index->numIds; id++) {
+            index->compactNewId[id] = -1;
+            if (index->idRow[id] >= 0) {
+                index->compactOldId[numLive] = id;
+                index->compactNewId[id] = numLive++;
+            }
+            if (id == index->indexed - 1) {
+                indexedLive = numLive;
+            }
+        }
+        index->compactIds = index->numIds;
+        index->compactLive = numLive;
+        index->compactIndexed = indexedLive;
+        index->compactKey = 0;
+    }
+
+    int *newId = index->compactNewId;
+    for (; index->compactKey < TRIGRAM_KEYS; index->compactKey++) {
+        if ((index->compactKey & 63) == 63) { // Most lists are short, so the clock is checked every few
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - startTime.tv_sec) * 1000000 + (now.tv_nsec - startTime.tv_nsec) / 1000 >= TRIGRAM_IDLE_US) {
+                return;
+            }
+        }
+
+        struct trigramList *list = &index->lists[index->compactKey];
+        uint32_t written = 0;
+        int id = 0, lastId = 0;
+        for (uint32_t i = 0; i < list->length;) {
+            unsigned int delta = 0;
+            int shift = 0;
+            do {
+                delta |= (list->postings[i] & 0x7f) << shift;
+                shift += 7;
+            } while (list->postings[i++] & 0x80);
+            id += delta;
+            if (newId[id] < 0) {
+                continue;
+            }
+
+            delta = newId[id] - lastId;
+            do {
+                list->postings[written++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+                delta >>= 7;
+            } while (delta);
+            lastId = newId[id];
+        }
+        list->length = written;
+        list->lastId = lastId;
+        if (written == 0) {
+            free(list->postings);
+            list->postings = NULL;
+            list->capacity = 0;
+        } else if (written + 5 < list->capacity / 4) { // Gives back most of what the dead ids took
+            list->capacity = written + 5;
+            list->postings = realloc(list->postings, list->capacity);
+        }
+    }
+
+    // Ids given out while the lists were rewritten go after the live ones, and those that died meanwhile stay dead
+    int numIds = index->compactLive + index->numIds - index->compactIds;
+    int *idRow = malloc(sizeof(int) * (numIds ? numIds : 1));
+    int deadIds = 0;
+    for (int id = 0; id < index->numIds; id++) {
+        int renumbered = (id < index->compactIds) ? newId[id] : index->compactLive + id - index->compactIds;
+        if (renumbered < 0) {
+            continue;
+        }
+        idRow[renumbered] = index->idRow[id];
+        if (idRow[renumbered] >= 0) {
+            eBuffer->row[idRow[renumbered]].id = renumbered;
+        } else {
+            deadIds++;
+        }
+    }
+    free(index->compactNewId);
+    free(index->compactOldId);
+    index->compactNewId = NULL;
+    index->compactOldId = NULL;
+    free(index->idRow);
+    index->idRow = idRow;
+    index->idsCapacity = numIds ? numIds : 1;
+    index->numIds = numIds;
+    index->indexed = index->compactIndexed;
+    index->deadIds = deadIds;
+    index->epoch++;
+}
+
+/**
+ * Notes that deleteCount rows at index were replaced by insertCount rows, so the diff gutter only needs to look there again
+ */
+void diff_rows_changed(int index, int deleteCount, int insertCount) {
+    if (eBuffer->diffValid) { // The first change since the hunks were computed
+        eBuffer->diffValid = 0;
+        eBuffer->diffPartial = 1;
+        eBuffer->diffFrom = index;
+        eBuffer->diffTo = index + insertCount;
+        eBuffer->diffShift = insertCount - deleteCount;
+    } else if (eBuffer->diffPartial) { // Grows the changed rows to cover this change too
+        int to = (eBuffer->diffTo > index + deleteCount) ? eBuffer->diffTo + insertCount - deleteCount : index + insertCount;
+        eBuffer->diffFrom = (index < eBuffer->diffFrom) ? index : eBuffer->diffFrom;
+        eBuffer->diffTo = (to > index + insertCount) ? to : index + insertCount;
+        eBuffer->diffShift += insertCount - deleteCount;
+    }
+}
+
+/**
+ * Writes parts to the journal in full, carrying on after short writes. If the journal can't be written it is deleted and
+ * journaling stops until the next save, since replaying a journal with records missing would corrupt the buffer.
+ * Returns -1 in that case.
+ */
+int journal_write(struct iovec *parts, int numParts) {
+    while (numParts > 0) {
+        ssize_t written = writev(eBuffer->journalFd, parts, numParts < IOV_MAX ? numParts : IOV_MAX);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            set_status_message("Can't write the journal: %s. Edits are no longer journaled until you save.", strerror(written == 0 ? EIO : errno));
+            journal_remove();
+            return -1;
+        }
+
+        // Skips what was written, which may end partway through a part
+        while (numParts > 0 && (size_t) written >= parts[0].iov_len) {
+            written -= parts[0].iov_len;
+            parts++;
+            numParts--;
+        }
+        if (numParts > 0) {
+            parts[0].iov_base = (char*) parts[0].iov_base + written;
+            parts[0].iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns whether the process at the other end of a Unix domain socket runs as this user
+ */
+int socket_peer_is_user(int fd) {
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && peer.uid == getuid();
+}
+
+/** Key queue **/
+
+/**
+ * Reads one byte of input like read() on stdin, taking it from the queue first
+ */
+ssize_t read_input(char *byte) {
+    if (keyQueueLength == 0) {
+        return read(STDIN_FILENO, byte, 1);
+    }
+    *byte = keyQueue[0];
+    memmove(keyQueue, &keyQueue[1], --keyQueueLength);
+    return 1;
+}
+
+/**
+ * Keeps bytes read from the terminal so read_key() sees them in order. Whatever doesn't fit is dropped.
+ */
+void queue_input(const char *bytes, int length) {
+    if (length > KEY_QUEUE_SIZE - keyQueueLength) {
+        length = KEY_QUEUE_SIZE - keyQueueLength;
+    }
+    memcpy(&keyQueue[keyQueueLength], bytes, length);
+    keyQueueLength += length;
+}
+
+/**
+ * Returns 1 if more input arrives on stdin within timeout milliseconds. The queue doesn't count, it holds earlier keys.
+ */
+int input_arrives(int timeout) {
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    return poll(&input, 1, timeout) > 0;
+}
+
+/** Comment scan **/
+
+/**
+ * Has the multiline comment states of a freshly loaded file worked out while the editor is idle, rather than colouring
+ * every row before the file can be edited
+ */
+void comment_scan_start() {
+    eBuffer->generation++;
+    eBuffer->commentScanRow = (eBuffer->syntax != NULL && eBuffer->syntax->mlCommentStart != NULL) ? 0 : INT_MAX;
+}
+
+/**
+ * Carries multiline comment states down from commentScanRow for at most COMMENT_SCAN_IDLE_US. Rows that have been drawn
+ * are recoloured as the scan passes them, the others only get their state.
+ */
+void comment_scan_idle() {
+    struct timespec startTime, now;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    unsigned char *scratch = NULL;
+    struct pagedStream stream = {NULL, NULL};
+    int i = eBuffer->commentScanRow;
+    int inComment = (i > 0 && i <= eBuffer->numRows) ? eBuffer->row[i - 1].highlightOpenComment : 0;
+    for (; i < eBuffer->numRows; i++) {
+        editorRow *row = &eBuffer->row[i];
+        if (row->highlight) {
+            eBuffer->generation++;
+        } else {
+            paged_stream(&stream, row);
+        }
+        inComment = row_carry_comment(row, inComment, &scratch);
+        row->highlightOpenComment = inComment;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - startTime.tv_sec) * 1000000 + (now.tv_nsec - startTime.tv_nsec) / 1000 >= COMMENT_SCAN_IDLE_US) {
+            i++;
+            break;
+        }
+    }
+    paged_stream(&stream, NULL);
+    free(scratch);
+
+    eBuffer->commentScanRow = (i < eBuffer->numRows) ? i : INT_MAX;
+    if (eBuffer->commentScanRow == INT_MAX && eConfig.useIndex) {
+        write_index();
+    }
+}
+
+/**
+ * Works out the bracket summary of a row and returns the multiline comment state at its end, without building its render.
+ * The text is highlighted a chunk at a time into scratch, which needs room for GIANT_ROW_CHUNK + GIANT_ROW_OVERRUN + 4
+ * bytes. Like bracket_row_summary(), it doesn't count the brackets of giant rows.
+ */
+int row_summarize(editorRow *row, int inComment, unsigned char *scratch) {
+    struct highlightState state = {inComment, 0, HL_NORMAL, 1, HL_NORMAL};
+    int delta = 0;
+    int lowest = 0;
+    int index = 0;
+    while (index < row->size) {
+        int end = (row->size - index > GIANT_ROW_CHUNK) ? index + GIANT_ROW_CHUNK : row->size;
+        while (end < row->size && (row->characters[end] & 0xc0) == 0x80) { // Chunks don't split a character
+            end++;
+        }
+
+        int stop = end;
+        int limit = (end + GIANT_ROW_OVERRUN < row->size) ? end + GIANT_ROW_OVERRUN : row->size;
+        memset(scratch, HL_NORMAL, limit - index);
+        if (eBuffer->syntax != NULL) {
+            stop = index + highlight_text(&row->characters[index], end - index, limit - index, scratch, &state);
+            while (stop < row->size && (row->characters[stop] & 0xc0) == 0x80) {
+                stop++;
+            }
+        }
+
+        for (int i = index; i < stop && row->size < GIANT_ROW_SIZE; i++) {
+            int change = bracket_change(row->characters[i]);
+            unsigned char colour = scratch[i - index];
+            if (change == 0 || colour == HL_STRING || colour == HL_COMMENT || colour == HL_MLCOMMENT) {
+                continue;
+            }
+            delta += change;
+            if (delta < lowest) {
+                lowest = delta;
+            }
+        }
+        index = stop;
+    }
+
+    bracket_row_set(row, delta, lowest);
+    return state.inComment;
+}
+
+/**
+ * Passes a multiline comment state through a row and returns the state at its end. A row with colours is coloured again,
+ * one without only has its state and bracket summary worked out, so it isn't rendered, or made resident in a paged
+ * buffer, before it is displayed. *scratch is allocated when first needed and freed by the caller.
+ */
+int row_carry_comment(editorRow *row, int inComment, unsigned char **scratch) {
+    if (row->highlight) {
+        return highlight_row(row, inComment, &eBuffer->giantPending);
+    }
+    if (*scratch == NULL) {
+        *scratch = malloc(GIANT_ROW_CHUNK + GIANT_ROW_OVERRUN + 4);
+    }
+    return row_summarize(row, inComment, *scratch);
+}
+
+/**
+ * Appends the ids listed under a trigram key to ids. Lists a compaction under way has already rewritten are translated
+ * back to the old ids, which the rest of the index uses until it is done.
+ */
+void trigram_lookup(struct trigramIndex *index, int key, int **ids, int *numIds, int *capacity) {
+    int first = *numIds;
+    trigram_decode(&index->lists[key], ids, numIds, capacity);
+    if (index->compactNewId && key < index->compactKey) {
+        for (int i = first; i < *numIds; i++) {
+            (*ids)[i] = index->compactOldId[(*ids)[i]];
+        }
+    }
+}
+
+/**
+ * Waits for a key or a change to the file when following it through inotify, so new lines are shown as soon as they are
+ * written rather than after read() times out. Returns 1 if no key is waiting, so there is nothing to read yet.
+ */
+int follow_wait() {
+    if (eBuffer->followWatch == -1 || keyQueueLength > 0 || serverMode) {
+        return 0;
+    }
+
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {eBuffer->followWatch, POLLIN, 0}};
+    if (poll(fds, 2, FOLLOW_WAIT_MS) == -1) {
+        return 0; // Interrupted, e.g. by a resize, so read() decides
+    }
+    return !(fds[0].revents & (POLLIN | POLLHUP | POLLERR));
+}
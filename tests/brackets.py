@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""
+Jumps between brackets with Ctrl-] and out of blocks with Ctrl-U in a C file, and checks every landing spot against a
+reference scan that skips brackets in strings and comments. The checks are repeated after edits that unbalance the
+brackets and comment out half the file, so the bracket tree has to follow them.
+"""
+import random
+import sys
+import tempfile
+
+from editor import BACKSPACE, ENTER, HOME, RIGHT, Editor, ctrl, run, test_file
+
+FUNCTION = [
+    "void f%d(int a) {",
+    "    if (a[1] > (2)) {",
+    "        s = \"} ) ]\";",
+    "        c = '{';",
+    "        /* ( */ g((a), [b]);",
+    "    }",
+    "    // ]",
+    "    /* { spanning",
+    "       } */",
+    "    while (x) { y(); }",
+    "}",
+]
+
+
+def scan(lines):
+    """Returns the position of every bracket that counts, and the brackets open before each of them"""
+    brackets = []
+    opened = []
+    inComment = False
+    for y, line in enumerate(lines):
+        x = 0
+        quote = None
+        while x < len(line):
+            if inComment:
+                if line.startswith("*/", x):
+                    inComment = False
+                    x += 1
+            elif quote:
+                if line[x] == "\\":
+                    x += 1
+                elif line[x] == quote:
+                    quote = None
+            elif line.startswith("//", x):
+                break
+            elif line.startswith("/*", x):
+                inComment = True
+                x += 1
+            elif line[x] in "\"'":
+                quote = line[x]
+            elif line[x] in "([{)]}":
+                brackets.append(((y, x), list(opened)))
+                if line[x] in "([{":
+                    opened.append((y, x))
+                elif opened:
+                    opened.pop()
+            x += 1
+    return brackets
+
+
+def matches(lines):
+    """Maps every bracket to the one matching it. Kinds share one depth, the way the editor counts them."""
+    pairs = {}
+    stack = []
+    for position, _ in scan(lines):
+        if lines[position[0]][position[1]] in "([{":
+            stack.append(position)
+        elif stack:
+            opening = stack.pop()
+            pairs[opening] = position
+            pairs[position] = opening
+    return pairs
+
+
+def go(editor, position, key):
+    y, x = position
+    editor.type(ctrl("g") + str(y + 1) + ENTER + HOME + RIGHT * x, key)
+    screenY, screenX = editor.cursor()
+    number, column = editor.numbered(screenY)
+    return (number - 1, screenX - column) if number else None
+
+
+def check(editor, lines, generator, when):
+    pairs = matches(lines)
+    brackets = scan(lines)
+    sample = [brackets[0], brackets[-1]] + generator.sample(brackets, 10)
+    for position, opened in sample:
+        landed = go(editor, position, ctrl("]"))
+        if landed != pairs.get(position, position):
+            return "%s: Ctrl-] at %r went to %r, expected %r" % (when, position, landed, pairs.get(position, position))
+
+        # From inside a bracket, Ctrl-U goes out to the one opening the block around it, then to the next one out
+        if lines[position[0]][position[1]] in "([{" and len(opened) >= 1:
+            landed = go(editor, position, ctrl("u"))
+            if landed != opened[-1]:
+                return "%s: Ctrl-U at %r went to %r, expected %r" % (when, position, landed, opened[-1])
+            if len(opened) >= 2:
+                editor.type(ctrl("u"))
+                screenY, screenX = editor.cursor()
+                number, column = editor.numbered(screenY)
+                if (number - 1, screenX - column) != opened[-2]:
+                    return "%s: second Ctrl-U from %r didn't reach %r" % (when, position, opened[-2])
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = ["struct all {"] + [line % n if "%d" in line else line for n in range(300) for line in FUNCTION] + ["};"]
+        test_file(directory, "file.c", "\n".join(lines) + "\n")
+        editor = Editor(["file.c"], directory)
+        editor.type(ctrl("n"))
+        generator = random.Random(40)
+
+        failure = check(editor, lines, generator, "opened")
+        if failure:
+            return failure
+
+        # An extra opening bracket shifts every match after it
+        editor.type(ctrl("g") + "1000" + ENTER + HOME, "{")
+        lines[999] = "{" + lines[999]
+        failure = check(editor, lines, generator, "after adding a bracket")
+        if failure:
+            return failure
+
+        # Splitting at the start of the line leaves an empty row, then an opening bracket gets a row of its own
+        editor.type(ctrl("g") + "1000" + ENTER + HOME + RIGHT, BACKSPACE, ENTER + "x(" + ENTER)
+        lines[999:1000] = ["", "x(", lines[999][1:]]
+        failure = check(editor, lines, generator, "after splitting lines")
+        if failure:
+            return failure
+
+        # Commenting out the middle of the file hides the brackets in it
+        editor.type(ctrl("g") + "1500" + ENTER + HOME, "/*")
+        lines[1499] = "/*" + lines[1499]
+        failure = check(editor, lines, generator, "after opening a comment")
+        if failure:
+            return failure
+        editor.type(ctrl("g") + "1500" + ENTER + HOME + RIGHT * 2, BACKSPACE * 2)
+        lines[1499] = lines[1499][2:]
+        failure = check(editor, lines, generator, "after closing the comment")
+        if failure:
+            return failure
+        editor.quit()
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "brackets"))
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Cuts, copies and pastes selections of one line and of many, in both directions from the mark, within a file and into
+another buffer, and checks the saved files against the same edits made to a string. Pasted rows spanning a comment have
+to be coloured as they are where they land, and a paste has to come back from the journal after a crash.
+"""
+import sys
+import tempfile
+import time
+
+from editor import CTRL_SPACE, END, ENTER, HOME, RIGHT, Editor, ctrl, read_file, run, test_file
+
+
+def offset(text, y, x):
+    lines = text.split("\n")
+    return sum(len(line) + 1 for line in lines[:y]) + x
+
+
+def at(y, x=0):
+    return ctrl("g") + str(y + 1) + ENTER + HOME + RIGHT * x
+
+
+def check_colours(editor, text, when):
+    """Rows of declarations are coloured as types, rows in the comment as comments"""
+    lines = text.split("\n")
+    inComment = []
+    opened = False
+    for line in lines:
+        inComment.append(opened or line.startswith("/*"))
+        if "/*" in line:
+            opened = True
+        if "*/" in line:
+            opened = False
+    for y in range(editor.screen.rows - 2):
+        number, column = editor.numbered(y)
+        if number is None or number > len(lines):
+            continue
+        line = lines[number - 1]
+        expected = 36 if inComment[number - 1] else 32 if line.startswith("int ") else None
+        if expected and editor.colour(y, column) != expected:
+            return "%s: line %d %r had colour %r, expected %r" % (when, number, line, editor.colour(y, column), expected)
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = ["int v%d;" % n for n in range(1, 201)]
+        lines[19:19] = ["/* start", " * middle", " end */"]
+        text = "\n".join(lines)
+        path = test_file(directory, "a.c", text + "\n")
+        otherPath = test_file(directory, "b.c", "int b1;\nint b2;\n")
+        other = "int b1;\nint b2;"
+        editor = Editor(["a.c"], directory)
+        editor.type(ctrl("n"))
+
+        # A cut over several lines joins what is left of the first and last
+        editor.type(at(9, 2), CTRL_SPACE, at(13, 3), ctrl("x"))
+        start, end = offset(text, 9, 2), offset(text, 13, 3)
+        clipboard, text = text[start:end], text[:start] + text[end:]
+        if "Cut 5 lines" not in editor.message():
+            return "cutting reported %r" % editor.message()
+
+        # Pasted twice at the end of a line, the second time right after the first
+        editor.type(at(49) + END, ctrl("v"), ctrl("v"))
+        position = offset(text, 49, len(text.split("\n")[49]))
+        text = text[:position] + clipboard * 2 + text[position:]
+        if "Pasted 5 lines" not in editor.message():
+            return "pasting reported %r" % editor.message()
+
+        # Part of one line, pasted at the start of another
+        editor.type(at(2, 1), CTRL_SPACE, RIGHT * 4, ctrl("c"), at(99), ctrl("v"))
+        position = offset(text, 2, 1)
+        clipboard = text[position:position + 4]
+        position = offset(text, 99, 0)
+        text = text[:position] + clipboard + text[position:]
+
+        # The mark after the cursor, over whole rows that take the comment along
+        editor.type(at(14), CTRL_SPACE, at(19), ctrl("c"), at(120), ctrl("v"))
+        clipboard = text[offset(text, 14, 0):offset(text, 19, 0)]
+        position = offset(text, 120, 0)
+        text = text[:position] + clipboard + text[position:]
+        editor.type(at(120))
+        failure = check_colours(editor, text, "after pasting the comment")
+        if failure:
+            return failure
+        if not editor.save():
+            return "couldn't save"
+        if read_file(path).decode() != text + "\n":
+            return "saved file doesn't have the cuts and pastes"
+
+        # Into another buffer, then back
+        editor.type(ctrl("o") + "b.c" + ENTER, at(1), ctrl("v"))
+        other = other[:offset(other, 1, 0)] + clipboard + other[offset(other, 1, 0):]
+        failure = check_colours(editor, other, "after pasting into another buffer")
+        if failure:
+            return failure
+        if not editor.save():
+            return "couldn't save the other buffer"
+        if read_file(otherPath).decode() != other + "\n":
+            return "other buffer doesn't have the paste"
+        editor.type(ctrl("b"))
+        if "Buffer 1 of 2" not in editor.message():
+            return "switching back showed %r" % editor.message()
+
+        # A paste of whole rows is journalled as rows, and comes back after a crash
+        editor.type(at(150), ctrl("v"), at(5, 3), ctrl("v"))
+        for y, x in ((150, 0), (5, 3)):
+            position = offset(text, y, x)
+            text = text[:position] + clipboard + text[position:]
+        time.sleep(0.5)  # Records are written out once the editor is idle
+        editor.crash()
+        editor = Editor(["a.c"], directory)
+        if not editor.expect("Recover them?"):
+            return "no journal was found after the crash"
+        editor.type("y")
+        if not editor.save():
+            return "couldn't save the recovered buffer"
+        editor.quit()
+        if read_file(path).decode() != text + "\n":
+            return "recovered file doesn't have the pastes"
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "clipboard"))
@@ -0,0 +1,259 @@
+"""
+Runs texto on a pseudo-terminal for the tests. Keys are typed into it, and its output is fed to a small terminal
+emulator so tests can look at the text and colours on the screen as well as at the files it saves.
+"""
+import os
+import pty
+import re
+import select
+import signal
+import struct
+import sys
+import time
+import fcntl
+import termios
+import unicodedata
+
+TEXTO = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./texto")
+
+ENTER = "\r"
+ESC = "\x1b"
+BACKSPACE = "\x7f"
+UP = "\x1b[A"
+DOWN = "\x1b[B"
+RIGHT = "\x1b[C"
+LEFT = "\x1b[D"
+HOME = "\x1b[H"
+END = "\x1b[F"
+DELETE = "\x1b[3~"
+PAGE_DOWN = "\x1b[6~"
+CTRL_DOWN = "\x1b[1;5B"
+CTRL_SPACE = "\x00"
+
+FRAME_END = "\x1b[?25h"  # Shows the cursor again once a frame is drawn
+
+running = []  # Killed by run() however the test ends
+
+
+def ctrl(letter):
+    return chr(ord(letter) & 0x1f)
+
+
+class Screen:
+    """Keeps the characters and foreground colours the editor draws, for the escape sequences it uses"""
+
+    def __init__(self, rows, columns):
+        self.rows = rows
+        self.columns = columns
+        self.text = [[" "] * columns for _ in range(rows)]
+        self.colours = [[None] * columns for _ in range(rows)]
+        self.y = self.x = 0
+        self.top, self.bottom = 0, rows - 1
+        self.colour = None
+        self.pending = b""
+
+    def scroll(self, count, up):
+        for _ in range(count):
+            for grid, blank in ((self.text, " "), (self.colours, None)):
+                if up:
+                    del grid[self.top]
+                    grid.insert(self.bottom, [blank] * self.columns)
+                else:
+                    del grid[self.bottom]
+                    grid.insert(self.top, [blank] * self.columns)
+
+    def control(self, private, parameters, final):
+        numbers = [int(p) if p else 0 for p in parameters.replace("$", "").split(";")] if parameters else []
+        first = numbers[0] if numbers else 0
+        if private or "$" in parameters:
+            return
+        if final == "H":
+            self.y = min(self.rows - 1, (first or 1) - 1)
+            self.x = min(self.columns - 1, ((numbers[1] if len(numbers) > 1 else 0) or 1) - 1)
+        elif final == "K":
+            self.text[self.y][self.x:] = [" "] * (self.columns - self.x)
+            self.colours[self.y][self.x:] = [None] * (self.columns - self.x)
+        elif final == "J":
+            self.text = [[" "] * self.columns for _ in range(self.rows)]
+            self.colours = [[None] * self.columns for _ in range(self.rows)]
+        elif final == "r":
+            self.top = (first or 1) - 1
+            self.bottom = (numbers[1] - 1) if len(numbers) > 1 else self.rows - 1
+            self.y = self.x = 0
+        elif final in "ST":
+            self.scroll(first or 1, final == "S")
+        elif final == "C":
+            self.x = min(self.columns - 1, self.x + (first or 1))
+        elif final == "m":
+            for number in numbers or [0]:
+                if 30 <= number <= 37 or 90 <= number <= 97:
+                    self.colour = number
+                elif number in (0, 39):
+                    self.colour = None
+
+    def feed(self, data):
+        data = self.pending + data
+        i = 0
+        while i < len(data):
+            byte = data[i]
+            if byte == 0x1b:
+                match = re.match(rb"\x1b\[([?]?)([0-9;$]*)([A-Za-z~])", data[i:])
+                if not match:
+                    if len(data) - i < 16:  # The rest of the sequence is still on its way
+                        break
+                    i += 1
+                    continue
+                i += match.end()
+                self.control(match.group(1), match.group(2).decode(), match.group(3).decode())
+            elif byte == 13:
+                self.x = 0
+                i += 1
+            elif byte == 10:
+                if self.y == self.bottom:
+                    self.scroll(1, True)
+                else:
+                    self.y = min(self.rows - 1, self.y + 1)
+                i += 1
+            elif byte < 32:
+                i += 1
+            else:
+                length = 1 if byte < 0x80 else 2 if byte >> 5 == 6 else 3 if byte >> 4 == 14 else 4
+                if i + length > len(data):
+                    break
+                character = data[i:i + length].decode("utf8", "replace")
+                i += length
+                if self.x < self.columns:
+                    self.text[self.y][self.x] = character
+                    self.colours[self.y][self.x] = self.colour
+                    if unicodedata.east_asian_width(character) in "WF" and self.x + 1 < self.columns:
+                        self.text[self.y][self.x + 1] = ""
+                        self.x += 1
+                self.x += 1
+        self.pending = data[i:]
+
+    def line(self, y):
+        return "".join(self.text[y])
+
+
+class Editor:
+    """A texto process on a terminal of the given size, started in directory"""
+
+    def __init__(self, arguments, directory, rows=24, columns=80, environment=None):
+        self.screen = Screen(rows, columns)
+        self.recent = b""  # Output since the last key
+        self.pid, self.fd = pty.fork()
+        running.append(self)
+        if self.pid == 0:  # Sized before the editor starts, or it would ask the terminal where its cursor is
+            fcntl.ioctl(0, termios.TIOCSWINSZ, struct.pack("HHHH", rows, columns, 0, 0))
+            os.chdir(directory)
+            os.execve(TEXTO, [TEXTO] + arguments, dict(os.environ, **(environment or {})))
+        self.expect(FRAME_END)
+        self.settle(0.3)  # Longer than an idle tick, so comment states found after the first frame are drawn too
+
+    def read(self, seconds):
+        """Takes in the editor's output for up to seconds. Returns whether there was any, or None once it has exited."""
+        ready, _, _ = select.select([self.fd], [], [], seconds)
+        if not ready:
+            return False
+        try:
+            data = os.read(self.fd, 65536)
+        except OSError:
+            return None
+        if b"\x1b[c" in data:  # Answers the device attributes query, so the editor doesn't wait for it at startup
+            os.write(self.fd, b"\x1b[?62c")
+        self.recent += data
+        self.screen.feed(data)
+        return True
+
+    def settle(self, quiet=0.08, limit=5.0):
+        """Reads output until the editor has been quiet for a while"""
+        deadline = time.time() + limit
+        while time.time() < deadline and self.read(quiet):
+            pass
+
+    def type(self, *keys):
+        for key in keys:
+            self.recent = b""
+            os.write(self.fd, key.encode())
+            self.expect(FRAME_END, 5.0)
+
+    def expect(self, text, seconds=10.0):
+        """Waits for text to be drawn after the last key. Returns whether it was."""
+        deadline = time.time() + seconds
+        while text.encode() not in self.recent and time.time() < deadline:
+            if self.read(0.05) is None:
+                break
+        self.settle()
+        return text.encode() in self.recent
+
+    def lines(self):
+        return [self.screen.line(y) for y in range(self.screen.rows)]
+
+    def message(self):
+        return self.screen.line(self.screen.rows - 1).strip()
+
+    def cursor(self):
+        return self.screen.y, self.screen.x
+
+    def colour(self, y, x):
+        return self.screen.colours[y][x]
+
+    def numbered(self, y):
+        """With line numbers shown (Ctrl-N), returns the number on screen line y and the column its text starts at"""
+        match = re.match(r" *(\d+) ", self.screen.line(y))
+        return (int(match.group(1)), match.end()) if match else (None, None)
+
+    def save(self):
+        self.type(ctrl("s"))
+        return self.expect("written to disk")
+
+    def crash(self):
+        os.kill(self.pid, signal.SIGKILL)
+        os.waitpid(self.pid, 0)
+        os.close(self.fd)
+        self.pid = None
+
+    def quit(self):
+        """Closes every buffer. Returns whether the editor exited."""
+        deadline = time.time() + 5
+        while self.pid and time.time() < deadline:
+            self.type(ctrl("q"))
+            if os.waitpid(self.pid, os.WNOHANG)[0] == self.pid:
+                os.close(self.fd)
+                self.pid = None
+        if self.pid:
+            self.crash()
+            return False
+        return True
+
+    def close(self):
+        if self.pid:
+            self.crash()
+
+
+def test_file(directory, name, text):
+    path = os.path.join(directory, name)
+    with open(path, "wb") as f:
+        f.write(text.encode() if isinstance(text, str) else text)
+    return path
+
+
+def read_file(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def run(main, name):
+    """Runs a test's main function, which returns a failure message or None"""
+    try:
+        failure = main()
+    except OSError as error:
+        failure = str(error)
+    finally:
+        for editor in running:
+            editor.close()
+    if failure:
+        print("FAIL: %s: %s" % (name, failure))
+        return 1
+    print("PASS: %s" % name)
+    return 0
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+Pipes the buffer and selections through shell commands with Ctrl-E and checks the saved file against the command run on
+the same lines: a round trip through cat is byte for byte, output of any size replaces the rows, commands that fail or
+are cancelled leave the buffer alone, and keys typed while a command runs still arrive.
+"""
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from editor import CTRL_SPACE, ENTER, ESC, HOME, RIGHT, Editor, ctrl, read_file, run, test_file
+
+
+def at(y, x=0):
+    return ctrl("g") + str(y + 1) + ENTER + HOME + RIGHT * x
+
+
+def through(command, lines):
+    text = "".join(line + "\n" for line in lines)
+    output = subprocess.run(["sh", "-c", command], input=text.encode(), stdout=subprocess.PIPE, check=True).stdout
+    return output.decode().split("\n")[:-1] if output else []
+
+
+def saved(editor, path, lines):
+    if not editor.save():
+        return "couldn't save"
+    if read_file(path) != "".join(line + "\n" for line in lines).encode():
+        return "saved file doesn't match the filtered lines"
+    return None
+
+
+def filtered(editor, command, count, outputCount):
+    editor.type(ctrl("e"), command + ENTER)
+    if "Filtered %d lines into %d" % (count, outputCount) not in editor.message():
+        return "%r reported %r, expected %d lines into %d" % (command, editor.message(), count, outputCount)
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = ["%05d\tline %s ünïcödé" % ((n * 7919) % 3001, "xyz"[n % 3]) for n in range(3000)]
+        path = test_file(directory, "file.txt", "".join(line + "\n" for line in lines))
+        editor = Editor(["file.txt"], directory)
+
+        # Straight from the file, then from rows that were edited
+        failure = filtered(editor, "cat", 3000, 3000) or saved(editor, path, lines)
+        if failure:
+            return "unedited: %s" % failure
+        editor.type(at(0), "edited ")
+        lines[0] = "edited " + lines[0]
+        failure = filtered(editor, "cat", 3000, 3000) or saved(editor, path, lines)
+        if failure:
+            return "edited: %s" % failure
+        failure = filtered(editor, "LC_ALL=C sort", 3000, 3000)
+        lines = through("LC_ALL=C sort", lines)
+        failure = failure or saved(editor, path, lines)
+        if failure:
+            return failure
+
+        # A selection takes whole rows, leaving out a last row it only reaches the start of
+        editor.type(at(10, 3), CTRL_SPACE, at(14, 2))
+        failure = filtered(editor, "tr a-z A-Z", 5, 5)
+        lines[10:15] = through("tr a-z A-Z", lines[10:15])
+        editor.type(at(20), CTRL_SPACE, at(23))
+        failure = failure or filtered(editor, "tac", 3, 3)
+        lines[20:23] = lines[20:23][::-1]
+        failure = failure or saved(editor, path, lines)
+        if failure:
+            return "selection: %s" % failure
+
+        # A command that fails changes nothing, and says why
+        for command, message in [("echo oops >&2; exit 3", "Command failed: oops"), ("exit 4", "Command failed with status 4")]:
+            editor.type(ctrl("e"), command + ENTER)
+            if message not in editor.message():
+                return "%r reported %r" % (command, editor.message())
+        failure = saved(editor, path, lines)
+        if failure:
+            return "after failing: %s" % failure
+
+        # Esc or Ctrl-C kills a command that takes too long, other keys are typed once it is done
+        for key in (ESC, ctrl("c")):
+            started = time.time()
+            editor.type(ctrl("e"))
+            os.write(editor.fd, ("sleep 10" + ENTER).encode())
+            time.sleep(0.3)
+            editor.type(key)
+            if "Filter canceled" not in editor.message() or time.time() - started > 5:
+                return "cancelling reported %r after %.1fs" % (editor.message(), time.time() - started)
+        editor.type(at(5), ctrl("e"))
+        os.write(editor.fd, ("sleep 0.5; cat" + ENTER).encode())
+        time.sleep(0.2)
+        editor.type("Z")
+        editor.expect("Filtered")
+        lines[0] = "Z" + lines[0]
+        failure = saved(editor, path, lines)
+        if failure:
+            return "typed during a command: %s" % failure
+
+        # Output much larger than the rows it replaces, then a command that stops reading its input early
+        editor.type(at(100), CTRL_SPACE, at(101))
+        failure = filtered(editor, "seq 1 200000", 1, 200000)
+        lines[100:101] = [str(n) for n in range(1, 200001)]
+        failure = failure or saved(editor, path, lines)
+        if failure:
+            return "large output: %s" % failure
+        failure = filtered(editor, "head -n 3", len(lines), 3)
+        lines = lines[:3]
+        failure = failure or saved(editor, path, lines)
+        if failure:
+            return "early exit: %s" % failure
+
+        # Filtered rows are journalled, and come back after a crash
+        failure = filtered(editor, "seq 5 -1 1; cat", 3, 8)
+        lines = ["5", "4", "3", "2", "1"] + lines
+        if failure:
+            return failure
+        time.sleep(0.5)  # Records are written out once the editor is idle
+        editor.crash()
+        editor = Editor(["file.txt"], directory)
+        if not editor.expect("Recover them?"):
+            return "no journal was found after the crash"
+        editor.type("y")
+        failure = saved(editor, path, lines)
+        if failure:
+            return "recovered: %s" % failure
+        editor.quit()
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "filter"))
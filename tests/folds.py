@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""
+Folds blocks by their brackets and by indentation, folds a range by line number, nests and opens folds, and checks the
+screen against a model of which rows are shown. The folds have to follow rows added above them, the cursor has to step
+over them, and find has to open the fold it lands in.
+"""
+import sys
+import tempfile
+
+from editor import DOWN, ENTER, HOME, Editor, ctrl, read_file, run, test_file
+
+FUNCTION = ["void f%d() {", "    a();", "    if (x) {", "        b();", "    }", "}"]
+SECTION = ["section", "    item 1", "    item 2", "", "    item 3", "other"]
+
+
+def visible(lines, folds):
+    """Rows on screen, in order, each with the number of rows folded behind it"""
+    shown = []
+    row = 0
+    while row < len(lines):
+        end = folds.get(row)
+        shown.append((row, end - row if end else 0))
+        row = end + 1 if end else row + 1
+    return shown
+
+
+def check(editor, lines, folds, when):
+    shown = visible(lines, folds)
+    order = {row: i for i, (row, _) in enumerate(shown)}
+    previous = None
+    checked = 0
+    for y in range(editor.screen.rows - 2):
+        number, column = editor.numbered(y)
+        if number is None:
+            continue
+        row = number - 1
+        if row not in order:
+            return "%s: folded line %d is on screen" % (when, number)
+        if previous is not None and order[row] != order[previous] + 1:
+            return "%s: line %d is shown after line %d" % (when, number, previous + 1)
+        folded = shown[order[row]][1]
+        expected = lines[row] + (" [+%d lines]" % folded if folded else "")
+        if editor.screen.line(y)[column:].rstrip() != expected:
+            return "%s: line %d showed %r, expected %r" % (when, number, editor.screen.line(y)[column:].rstrip(), expected)
+        previous = row
+        checked += 1
+    if not checked:
+        return "%s: no numbered lines on screen" % when
+    return None
+
+
+def cursor_line(editor):
+    y, _ = editor.cursor()
+    return editor.numbered(y)[0]
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = [line % n if "%d" in line else line for n in range(30) for line in FUNCTION] + SECTION
+        path = test_file(directory, "file.c", "\n".join(lines) + "\n")
+        editor = Editor(["file.c"], directory)
+        editor.type(ctrl("n"))
+        folds = {}  # First row of each fold, to its last row
+
+        # By brackets: the body of f0, up to the row with its closing bracket
+        editor.type(ctrl("g") + "2" + ENTER, ctrl("k"))
+        folds[0] = 4
+        failure = check(editor, lines, folds, "after folding f0")
+        if failure:
+            return failure
+        editor.type(DOWN)
+        if cursor_line(editor) != 6:
+            return "moving down from a fold went to line %r" % cursor_line(editor)
+
+        # A fold inside f1, then all of f1's body, which takes the inner fold in
+        editor.type(ctrl("g") + "10" + ENTER, ctrl("k"))
+        folds[8] = 9
+        failure = check(editor, lines, folds, "after folding the if in f1")
+        if failure:
+            return failure
+        editor.type(ctrl("g") + "8" + ENTER, ctrl("k"))
+        del folds[8]
+        folds[6] = 10
+        failure = check(editor, lines, folds, "after folding f1 around it")
+        if failure:
+            return failure
+
+        # Ctrl-K on a folded row opens it
+        editor.type(ctrl("k"))
+        del folds[6]
+        failure = check(editor, lines, folds, "after opening f1")
+        if failure:
+            return failure
+
+        # By indentation, taking in the blank row between indented ones
+        first = len(lines) - len(SECTION)
+        editor.type(ctrl("g") + str(first + 1) + ENTER, ctrl("k"))
+        folds[first] = first + 4
+        failure = check(editor, lines, folds, "after folding the indented section")
+        if failure:
+            return failure
+
+        # By line number
+        editor.type(ctrl("g") + "20" + ENTER, ctrl("y") + "25" + ENTER)
+        folds[19] = 24
+        failure = check(editor, lines, folds, "after folding lines 20 to 25")
+        if failure:
+            return failure
+
+        # A row added above every fold moves them all down
+        editor.type(ctrl("g") + "1" + ENTER + HOME, ENTER)
+        lines.insert(0, "")
+        folds = {start + 1: end + 1 for start, end in folds.items()}
+        failure = check(editor, lines, folds, "after adding a row above")
+        if failure:
+            return failure
+
+        # Find lands inside the indented section and opens its fold
+        editor.type(ctrl("f"), "item 2", ENTER)
+        del folds[first + 1]
+        if cursor_line(editor) != first + 4:
+            return "find went to line %r" % cursor_line(editor)
+        failure = check(editor, lines, folds, "after finding a folded line")
+        if failure:
+            return failure
+        editor.type(ctrl("g") + "1" + ENTER)
+        failure = check(editor, lines, folds, "at the top")
+        if failure:
+            return failure
+
+        if not editor.save():
+            return "couldn't save"
+        editor.quit()
+        if read_file(path).decode() != "\n".join(lines) + "\n":
+            return "folding changed the saved text"
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "folds"))
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""
+Opens a C file whose multiline comments span thousands of lines, the way files are split between highlighting threads,
+and checks the colour of every line shown around the comments' ends. The file is opened normally, through the server
+(which colours it all at once) and paged.
+"""
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from editor import ENTER, TEXTO, Editor, ctrl, run, test_file
+
+NUM_LINES = 20000
+COMMENTS = [(100, 150), (4000, 4200), (5000, 9000), (12287, 12289), (16383, 16385)]  # First and last line, from 1
+
+
+def build():
+    lines = ["int v%d = %d;" % (n, n) for n in range(1, NUM_LINES + 1)]
+    inComment = [False] * (NUM_LINES + 1)
+    for first, last in COMMENTS:
+        lines[first - 1] = "/* opened on %d" % first
+        lines[last - 1] = "closed */ int w%d;" % last
+        for n in range(first, last + 1):
+            inComment[n] = True
+    lines[199] = "int a; /* not spanning */ int b;"  # Opens and closes on one line
+    lines[299] = "char *s = \"/* in a string\";"
+    return "\n".join(lines) + "\n", inComment
+
+
+def check(editor, inComment, mode):
+    editor.type(ctrl("n"))
+    for first, last in COMMENTS + [(200, 200), (300, 300), (NUM_LINES, NUM_LINES)]:
+        for line in (first, last + 1):
+            editor.type(ctrl("g") + str(min(line, NUM_LINES)) + ENTER)
+            for y in range(editor.screen.rows - 2):
+                number, column = editor.numbered(y)
+                if number is None:
+                    continue
+                expected = 36 if inComment[number] else 32
+                if editor.colour(y, column) != expected:
+                    return "%s: line %d was coloured %r, expected %d" % (mode, number, editor.colour(y, column), expected)
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        text, inComment = build()
+        test_file(directory, "file.c", text)
+
+        for mode, arguments in [("normal", ["file.c"]), ("paged", ["--paged", "file.c"])]:
+            editor = Editor(arguments, directory)
+            time.sleep(1)  # Comment states are carried down the file while idle
+            failure = check(editor, inComment, mode)
+            if failure:
+                return failure
+            editor.quit()
+
+        environment = dict(os.environ, XDG_RUNTIME_DIR=directory)
+        server = subprocess.Popen([TEXTO, "--server"], env=environment, cwd=directory,
+                                  stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            for _ in range(100):
+                if os.path.exists(os.path.join(directory, "texto.sock")):
+                    break
+                time.sleep(0.02)
+            editor = Editor(["-c", "file.c"], directory, environment={"XDG_RUNTIME_DIR": directory})
+            failure = check(editor, inComment, "server")
+            if failure:
+                return failure
+            editor.quit()
+        finally:
+            server.kill()
+            server.wait()
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "highlight_open"))
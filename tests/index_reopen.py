@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Opens files with --index and checks that reopening them from the index shows the same lines and comment colours as
+parsing them, that edits saved through an index-backed buffer are written and indexed correctly, and that an index is
+ignored once the file changes under it, even when its size and modification time are put back.
+"""
+import os
+import sys
+import tempfile
+import time
+
+from editor import ENTER, HOME, Editor, ctrl, read_file, run, test_file
+
+NUM_LINES = 6000
+CHECKED = [1, 999, 1000, 1500, 2000, 2001, 2999, 3000, 3001, 4500, NUM_LINES]
+
+
+def build():
+    lines = ["int v%d;" % n for n in range(1, NUM_LINES + 1)]
+    lines[999] = "/* opened on 1000"
+    lines[2999] = "closed */ int w;"
+    return lines
+
+
+def colours(lines):
+    """Expected colour of the first character of every line, following the comments the way the editor does"""
+    expected = []
+    inComment = False
+    for line in lines:
+        if inComment or line.startswith("/*"):
+            expected.append(36)
+        else:
+            expected.append(32 if line.startswith("int") else None)
+        position = 0
+        while True:
+            marker = line.find("*/" if inComment else "/*", position)
+            if marker == -1:
+                break
+            inComment = not inComment
+            position = marker + 2
+    return expected
+
+
+def check(editor, lines, when):
+    expected = colours(lines)
+    for line in CHECKED:
+        editor.type(ctrl("g") + str(line) + ENTER)
+        for y in range(editor.screen.rows - 2):
+            number, column = editor.numbered(y)
+            if number is None:
+                continue
+            text = editor.screen.line(y)[column:].rstrip()
+            if text != lines[number - 1]:
+                return "%s: line %d showed %r, expected %r" % (when, number, text, lines[number - 1])
+            if editor.colour(y, column) != expected[number - 1]:
+                return "%s: line %d was coloured %r, expected %r" % (when, number, editor.colour(y, column), expected[number - 1])
+    return None
+
+
+def reopen(directory, lines, when):
+    editor = Editor(["--index", "file.c"], directory)
+    editor.type(ctrl("n"))
+    return editor, check(editor, lines, when)
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = build()
+        path = test_file(directory, "file.c", "\n".join(lines) + "\n")
+        index = os.path.join(directory, ".file.c.texto-idx")
+
+        editor = Editor(["--index", "file.c"], directory)
+        time.sleep(1)  # Written once every comment state is known
+        editor.quit()
+        if not os.path.exists(index):
+            return "no index was written"
+        written = os.stat(index).st_mtime_ns
+
+        editor, failure = reopen(directory, lines, "reopened")
+        if failure:
+            return failure
+        if os.stat(index).st_mtime_ns != written:
+            return "a valid index was written again instead of being used"
+
+        # Closing the comment early changes the state of a thousand lines, which the new index has to record
+        editor.type(ctrl("g") + "2000" + ENTER, HOME, "*/ ")
+        lines[1999] = "*/ " + lines[1999]
+        editor.type(ctrl("g") + str(NUM_LINES) + ENTER, "x")
+        lines[-1] = "x" + lines[-1]
+        if not editor.save():
+            return "index-backed buffer couldn't be saved"
+        editor.quit()
+        if read_file(path).decode() != "\n".join(lines) + "\n":
+            return "edits through the index saved the wrong file"
+
+        editor, failure = reopen(directory, lines, "reopened after saving")
+        if failure:
+            return failure
+        editor.quit()
+
+        # Same size and time, but the lines start elsewhere: only the content hash tells them apart
+        stat = os.stat(path)
+        lines[0], lines[1] = "int v1;;", "int v2"
+        test_file(directory, "file.c", "\n".join(lines) + "\n")
+        os.utime(path, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+        editor, failure = reopen(directory, lines, "reopened after an edit behind its back")
+        if failure:
+            return failure
+        editor.quit()
+
+        # Lines ending in CRLF, and a last line without a newline
+        test_file(directory, "file.c", "int a;\r\nint b;\r\n/* c\r\nd */")
+        for when in ("crlf", "crlf reopened"):
+            editor = Editor(["--index", "file.c"], directory)
+            editor.type(ctrl("n"))
+            shown = [editor.screen.line(y)[editor.numbered(y)[1]:].rstrip() for y in range(4)]
+            if shown != ["int a;", "int b;", "/* c", "d */"]:
+                return "%s: showed %r" % (when, shown)
+            time.sleep(1)
+            editor.quit()
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "index_reopen"))
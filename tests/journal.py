@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""
+Kills the editor after some edits and checks that reopening the file offers to replay them from the journal, that the
+replayed buffer saves the same file the edits would have, and that journals for another version of the file are dropped.
+"""
+import os
+import sys
+import tempfile
+import time
+
+from editor import BACKSPACE, DELETE, DOWN, END, ENTER, HOME, Editor, ctrl, read_file, run, test_file
+
+TEXT = "one\ntwo\nthree\nfour\n"
+EDITED = "0ne 1\ntw0\n2bthree\n0ur\n"
+
+
+def crash_after(editor, *keys):
+    editor.type(*keys)
+    time.sleep(0.5)  # Records are written out once the editor is idle
+    editor.crash()
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        path = test_file(directory, "file.txt", TEXT)
+        journal = os.path.join(directory, ".file.txt.texto-swp")
+
+        # Typing, splitting and joining lines, and a replace-all
+        editor = Editor(["file.txt"], directory)
+        crash_after(editor, END, " 1", DOWN, END, ENTER, "2b", DOWN, HOME, BACKSPACE, DOWN, HOME, DELETE,
+                    ctrl("r"), "o", ENTER, "0", ENTER)
+        if not os.path.exists(journal):
+            return "no journal was left behind"
+
+        # Recovered edits stay in the journal, so a second crash keeps them and the ones made since
+        editor = Editor(["file.txt"], directory)
+        if "Recover them?" not in editor.message():
+            return "reopening didn't offer to recover, status was %r" % editor.message()
+        editor.type("y")
+        crash_after(editor, "X")
+
+        editor = Editor(["file.txt"], directory)
+        editor.type("y")
+        if not editor.save():
+            return "recovered buffer couldn't be saved"
+        editor.quit()
+        if read_file(path).decode() != "X" + EDITED:
+            return "recovered file was %r, expected %r" % (read_file(path).decode(), "X" + EDITED)
+
+        # Saving starts a new journal, so there is nothing to recover after a clean exit
+        editor = Editor(["file.txt"], directory)
+        if "Recover" in editor.message():
+            return "offered to recover after the file was saved"
+        editor.quit()
+        if os.path.exists(journal):
+            return "quitting left the journal behind"
+
+        # Declining leaves the file as it is on disk
+        test_file(directory, "file.txt", TEXT)
+        crash_after(Editor(["file.txt"], directory), "lost")
+        editor = Editor(["file.txt"], directory)
+        editor.type("n")
+        editor.save()
+        editor.quit()
+        if read_file(path).decode() != TEXT:
+            return "declined recovery saved %r" % read_file(path).decode()
+
+        # A journal is only replayed onto the file it was made against
+        crash_after(Editor(["file.txt"], directory), "stale")
+        with open(path, "a") as f:
+            f.write("five\n")
+        editor = Editor(["file.txt"], directory)
+        if "out of date" not in editor.message():
+            return "a journal for an older file was offered, status was %r" % editor.message()
+        editor.save()
+        editor.quit()
+        if read_file(path).decode() != TEXT + "five\n":
+            return "stale journal changed the file to %r" % read_file(path).decode()
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "journal"))
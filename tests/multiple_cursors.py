@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Adds cursors with Ctrl-Down, below the cursor and on every row of a selection, types, deletes and moves at all of them,
+and checks the saved file against the same keys applied to a model of the cursors. Shorter rows take their cursor at
+their end, multibyte characters are deleted and stepped over whole, and other edits leave just the main cursor.
+"""
+import sys
+import tempfile
+import time
+
+from editor import BACKSPACE, CTRL_DOWN, CTRL_SPACE, DELETE, END, ENTER, ESC, HOME, LEFT, RIGHT, Editor, ctrl, read_file, \
+    run, test_file
+
+
+def at(y, x=0):
+    return ctrl("g") + str(y + 1) + ENTER + HOME + RIGHT * x
+
+
+def press(rows, cursors, key):
+    """Applies a key at every cursor, the way the editor does"""
+    for cursor in cursors:
+        row = rows[cursor[0]]
+        x = cursor[1]
+        if key == BACKSPACE:
+            if x > 0:
+                rows[cursor[0]] = row[:x - 1] + row[x:]
+                cursor[1] -= 1
+        elif key == DELETE:
+            rows[cursor[0]] = row[:x] + row[x + 1:]
+        elif key in (HOME, END):
+            cursor[1] = 0 if key == HOME else len(row)
+        elif key == LEFT:
+            cursor[1] = max(0, x - 1)
+        elif key == RIGHT:
+            cursor[1] = min(len(row), x + 1)
+        elif len(key) == 1 and key >= " ":
+            rows[cursor[0]] = row[:x] + key + row[x:]
+            cursor[1] += 1
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = ["alpha one", "beta two", "γamma three", "d", "epsilon five", "", "zeta séven"] + \
+            ["row %d content" % n for n in range(7, 40)]
+        path = test_file(directory, "file.txt", "\n".join(lines) + "\n")
+        editor = Editor(["file.txt"], directory)
+
+        # Below the cursor, at its column or the end of shorter rows
+        editor.type(at(0, 4), CTRL_DOWN, CTRL_DOWN, CTRL_DOWN)
+        cursors = [[0, 4], [1, 4], [2, 4], [3, 1]]
+        if "4 cursors" not in editor.message():
+            return "adding cursors reported %r" % editor.message()
+        for key in ["X", "Y", BACKSPACE, BACKSPACE, BACKSPACE, HOME, RIGHT, BACKSPACE, END, "!", LEFT, LEFT, "-",
+                    HOME, DELETE, DELETE, RIGHT, "+"]:
+            editor.type(key)
+            press(lines, cursors, key)
+
+        # Esc leaves the main cursor
+        editor.type(ESC, "Q")
+        press(lines, cursors[:1], "Q")
+
+        # One on every selected row, then one more below them, across a row of multibyte characters
+        editor.type(at(4, 3), CTRL_SPACE, at(8, 3), CTRL_DOWN, CTRL_DOWN)
+        cursors = [[y, 3] for y in range(4, 10)]
+        cursors[1][1] = 0  # The empty row
+        if "6 cursors" not in editor.message():
+            return "adding cursors on a selection reported %r" % editor.message()
+        for key in ["#"] + [RIGHT] * 7 + [BACKSPACE, DELETE, "é"]:
+            editor.type(key)
+            press(lines, cursors, key)
+
+        # Splitting the row is done at the main cursor alone, and typing after it too
+        editor.type(ENTER, "s")
+        y, x = cursors[4]  # Where the selection ended, the cursor added below it being an extra one
+        lines[y:y + 1] = [lines[y][:x], "s" + lines[y][x:]]
+
+        if not editor.save():
+            return "couldn't save"
+        if read_file(path).decode() != "\n".join(lines) + "\n":
+            return "saved file doesn't have the edits made at every cursor"
+
+        # Rows edited at every cursor are journalled, and come back after a crash
+        editor.type(at(20, 2), CTRL_DOWN, CTRL_DOWN, "~")
+        for y in range(20, 23):
+            lines[y] = lines[y][:2] + "~" + lines[y][2:]
+        time.sleep(0.5)  # Records are written out once the editor is idle
+        editor.crash()
+        editor = Editor(["file.txt"], directory)
+        if not editor.expect("Recover them?"):
+            return "no journal was found after the crash"
+        editor.type("y")
+        if not editor.save():
+            return "couldn't save the recovered buffer"
+        editor.quit()
+        if read_file(path).decode() != "\n".join(lines) + "\n":
+            return "recovered file doesn't have the edits"
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "multiple_cursors"))
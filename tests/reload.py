@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""
+Changes a file behind the editor's back and checks that the buffer is reloaded by splicing in only the changed lines:
+the cursor stays on its line, the number of changed lines is reported, comment colours follow the new text, and unsaved
+changes are only thrown away when the user agrees.
+"""
+import os
+import random
+import sys
+import tempfile
+
+from editor import ENTER, Editor, ctrl, read_file, run, test_file
+
+
+def write_behind(directory, lines, inPlace=False):
+    """Writes the file the way another program would, replacing it unless inPlace"""
+    text = "".join(line + "\n" for line in lines)
+    if inPlace:  # Written over the old text in one go, so the editor never sees the file empty
+        fd = os.open(os.path.join(directory, "file.c"), os.O_WRONLY)
+        os.write(fd, text.encode())
+        os.ftruncate(fd, len(text))
+        os.close(fd)
+    else:
+        test_file(directory, "file.c.new", text)
+        os.rename(os.path.join(directory, "file.c.new"), os.path.join(directory, "file.c"))
+
+
+def reload(editor, directory, lines, changed, inPlace=False):
+    editor.recent = b""
+    write_behind(directory, lines, inPlace)
+    if not editor.expect("Reloaded"):
+        return "the change wasn't picked up"
+    if changed is not None and "%d lines changed" % changed not in editor.message():
+        return "reload reported %r, expected %d changed lines" % (editor.message(), changed)
+    return None
+
+
+def saved(editor, path, lines):
+    if not editor.save():
+        return "couldn't save"
+    if read_file(path).decode() != "".join(line + "\n" for line in lines):
+        return "saved file doesn't match the reloaded buffer"
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = ["int v%d;" % n for n in range(1, 201)]
+        path = test_file(directory, "file.c", "".join(line + "\n" for line in lines))
+        editor = Editor(["file.c"], directory)
+        editor.type(ctrl("g") + "100" + ENTER)
+
+        # Lines added above the cursor move it down with its line
+        lines[0:0] = ["int a;", "int b;", "int c;"]
+        failure = reload(editor, directory, lines, 3)
+        if failure:
+            return failure
+        editor.type("!")
+        lines[102] = "!" + lines[102]
+        failure = saved(editor, path, lines)
+        if failure:
+            return failure
+
+        # Lines removed above, one changed below and some appended make three hunks
+        del lines[10:20]
+        lines[150] = "int changed;"
+        lines += ["int e%d;" % n for n in range(5)]
+        failure = reload(editor, directory, lines, 16)
+        if failure:
+            return failure
+        editor.type("?")
+        lines[92] = lines[92][:1] + "?" + lines[92][1:]  # After the "!" typed before
+        failure = saved(editor, path, lines)
+        if failure:
+            return failure
+
+        # Rewritten in place, while rows may still point into the old contents
+        lines[5] = "int rewritten;"
+        failure = reload(editor, directory, lines, None, inPlace=True) or saved(editor, path, lines)
+        if failure:
+            return failure
+
+        # A comment opened above the window recolours the lines shown, and closing it colours them back
+        editor.type(ctrl("g") + "1" + ENTER)
+        failure = reload(editor, directory, ["/* opened"] + lines, 1)
+        if failure:
+            return failure
+        if [editor.colour(y, 0) for y in range(3)] != [36, 36, 36]:
+            return "lines in the new comment weren't recoloured"
+        failure = reload(editor, directory, lines, 1)
+        if failure:
+            return failure
+        if [editor.colour(y, 0) for y in range(3)] != [32, 32, 32]:
+            return "lines out of the removed comment weren't recoloured"
+
+        # Random insertions, deletions and changes, so the diff has hunks of every shape to splice
+        generator = random.Random(38)
+        for attempt in range(5):
+            for _ in range(generator.randint(1, 30)):
+                position = generator.randrange(len(lines) + 1)
+                action = generator.choice(["insert", "delete", "change"])
+                if action == "insert":
+                    lines[position:position] = ["int r%d_%d;" % (attempt, i) for i in range(generator.randint(1, 5))]
+                elif position < len(lines):
+                    if action == "delete":
+                        del lines[position:position + generator.randint(1, 5)]
+                    else:
+                        lines[position] = "int c%d;" % generator.randrange(1000)
+            failure = reload(editor, directory, lines, None) or saved(editor, path, lines)
+            if failure:
+                return "random round %d: %s" % (attempt, failure)
+
+        # With unsaved changes the user decides
+        editor.type("x")
+        write_behind(directory, ["int other;"] + lines)
+        if not editor.expect("Reload and lose unsaved changes?"):
+            return "unsaved changes weren't asked about"
+        editor.type("n")
+        lines[0] = "x" + lines[0]
+        failure = saved(editor, path, lines)
+        if failure:
+            return failure
+
+        editor.type("y")
+        write_behind(directory, ["int other;"] + lines)
+        if not editor.expect("Reload and lose unsaved changes?"):
+            return "unsaved changes weren't asked about"
+        editor.type("y")
+        failure = saved(editor, path, ["int other;"] + lines)
+        if failure:
+            return failure
+        editor.quit()
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "reload"))
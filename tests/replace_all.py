@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""
+Replaces literals and regular expressions across a file with Ctrl-R and checks the saved file against str.replace()
+and sed, including patterns that match the empty string, and that a replacement opening a comment recolours the rows below.
+"""
+import subprocess
+import sys
+import tempfile
+
+from editor import ENTER, Editor, ctrl, read_file, run, test_file
+
+TEXT = "".join([
+    "foo bar foofoo\n",
+    "aaaa baaab\n",
+    "\n",
+    "x1 yy22 zzz333\n",
+    "nothing here\n",
+    "foo\tfoo 4 5 6\n",
+    "xxaxx\n",
+])
+
+
+def replace(directory, query, replacement):
+    path = test_file(directory, "file.txt", TEXT)
+    editor = Editor(["file.txt"], directory)
+    editor.type(ctrl("r"), query, ENTER, replacement, ENTER)
+    message = editor.message()
+    if not editor.save():
+        return None, message
+    editor.quit()
+    return read_file(path).decode(), message
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        for query, replacement in [("foo", "F"), ("aa", "b"), ("foo", ""), (" ", "  "), ("zzz333", "longer text")]:
+            saved, message = replace(directory, query, replacement)
+            expected = TEXT.replace(query, replacement)
+            if saved != expected:
+                return "replacing %r with %r saved %r, expected %r" % (query, replacement, saved, expected)
+            if "Replaced %d occurrences" % TEXT.count(query) not in message:
+                return "replacing %r reported %r" % (query, message)
+
+        # Empty matches replace between characters the way sed does, but not right after a non-empty match
+        for pattern, replacement in [("[0-9]+", "N"), ("x*", "-"), ("^", "> "), ("$", ";"), ("a|", "_"), ("(o+)", "<>")]:
+            saved, message = replace(directory, "/%s/" % pattern, replacement)
+            expected = subprocess.run(["sed", "-E", "s/%s/%s/g" % (pattern, replacement)], input=TEXT.encode(),
+                                      stdout=subprocess.PIPE, check=True).stdout.decode()
+            if saved != expected:
+                return "replacing /%s/ with %r saved %r, expected %r" % (pattern, replacement, saved, expected)
+
+        saved, message = replace(directory, "/(/", "x")
+        if saved != TEXT or "Invalid regular expression" not in message:
+            return "an invalid expression saved %r and reported %r" % (saved, message)
+
+        # Opening a comment on the first row carries down in the same pass
+        test_file(directory, "file.c", "int a; OPEN\nint b;\nint c; */\nint d;\n")
+        editor = Editor(["file.c"], directory)
+        editor.type(ctrl("r"), "OPEN", ENTER, "/*", ENTER)
+        colours = [editor.colour(y, 0) for y in range(4)]
+        if colours[1] != 36 or colours[2] != 36 or colours[3] == 36:
+            return "rows were coloured %r after opening a comment" % colours
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "replace_all"))
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+Saves edits of different shapes and checks that the file on disk matches the buffer byte for byte, that only the rows
+from the first edit on are written when the rest of the file is still in place, and that the file is rewritten as a whole
+when its bytes can't be trusted (CRLF endings, a missing last newline, or text shared with the clipboard).
+"""
+import os
+import sys
+import tempfile
+import time
+
+from editor import CTRL_SPACE, DELETE, END, ENTER, HOME, RIGHT, Editor, ctrl, read_file, run, test_file
+
+
+def at(y, x=0):
+    return ctrl("g") + str(y + 1) + ENTER + HOME + RIGHT * x
+
+
+def saved(editor, path, lines, written):
+    """Saves, expecting written bytes from the rows written in place, or the whole file rewritten if written is None"""
+    inode = os.stat(path).st_ino
+    if not editor.save():
+        return "couldn't save"
+    text = "".join(line + "\n" for line in lines)
+    if read_file(path) != text.encode():
+        return "saved file doesn't match the buffer"
+    if written is None:
+        if not editor.message().startswith("%d bytes written" % len(text)):
+            return "expected the whole file written, got %r" % editor.message()
+    elif "%d of %d bytes written" % (written, len(text)) not in editor.message() or os.stat(path).st_ino != inode:
+        return "expected %d of %d bytes written in place, got %r" % (written, len(text), editor.message())
+    return None
+
+
+def from_row(lines, y):
+    return sum(len(line) + 1 for line in lines[y:])
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        for arguments in ([], ["--paged"], ["--index"]):
+            lines = ["line %04d payload" % n for n in range(3000)]
+            path = test_file(directory, "file.txt", "".join(line + "\n" for line in lines))
+            if arguments == ["--index"]:  # Rows only point into the file when opened from an index written before
+                editor = Editor(arguments + ["file.txt"], directory)
+                time.sleep(1)
+                editor.quit()
+            editor = Editor(arguments + ["file.txt"], directory)
+
+            # An edit that keeps the length writes just its row, even the first one
+            editor.type(at(1500, 5), DELETE + "X")
+            lines[1500] = lines[1500][:5] + "X" + lines[1500][6:]
+            failure = saved(editor, path, lines, len(lines[1500]) + 1)
+            if failure:
+                return "%s: same length: %s" % (arguments, failure)
+            editor.type(at(0), DELETE + "Y")
+            lines[0] = "Y" + lines[0][1:]
+            failure = saved(editor, path, lines, len(lines[0]) + 1)
+            if failure:
+                return "%s: first line: %s" % (arguments, failure)
+
+            # One that moves the rest of the file writes everything after it
+            editor.type(at(2000, 4), "ab")
+            lines[2000] = lines[2000][:4] + "ab" + lines[2000][4:]
+            failure = saved(editor, path, lines, from_row(lines, 2000))
+            if failure:
+                return "%s: longer row: %s" % (arguments, failure)
+
+            # A row added at the end, after the row split to make it, and a row joined into the one above
+            editor.type(at(len(lines) - 1) + END, ENTER + "tail")
+            lines.append("tail")
+            failure = saved(editor, path, lines, from_row(lines, len(lines) - 2))
+            if failure:
+                return "%s: appended: %s" % (arguments, failure)
+            editor.type(at(100) + END, DELETE)
+            lines[100:102] = [lines[100] + lines[101]]
+            failure = saved(editor, path, lines, from_row(lines, 100))
+            if failure:
+                return "%s: joined: %s" % (arguments, failure)
+
+            # Text copied out of a mapped file keeps it from being overwritten, a loaded copy doesn't need to
+            editor.type(at(10), CTRL_SPACE, at(12), ctrl("c"), at(20), "z")
+            lines[20] = "z" + lines[20]
+            failure = saved(editor, path, lines, None if arguments else from_row(lines, 20))
+            if failure:
+                return "%s: copied text: %s" % (arguments, failure)
+            editor.quit()
+
+        # Files whose rows aren't their bytes are rewritten, after which they are
+        for name, text, lines in [("crlf.txt", "a\r\nb\r\nc\r\n", ["a", "b", "c"]), ("open.txt", "a\nb\nc", ["a", "b", "c"])]:
+            path = test_file(directory, name, text)
+            editor = Editor([name], directory)
+            editor.type(at(1), "x")
+            lines[1] = "x" + lines[1]
+            failure = saved(editor, path, lines, None)
+            if failure:
+                return "%s: %s" % (name, failure)
+            editor.type(at(2), "y")
+            lines[2] = "y" + lines[2]
+            failure = saved(editor, path, lines, from_row(lines, 2))
+            if failure:
+                return "%s saved again: %s" % (name, failure)
+            editor.quit()
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "save_in_place"))
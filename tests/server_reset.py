@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+Attaches two clients to a texto server, resets one connection and checks that
+the server keeps serving the other one.
+"""
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+TEXTO = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./texto")
+
+
+def attach(socketPath, filePath):
+    client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    client.connect(socketPath)
+    path = filePath.encode()
+    client.sendall(struct.pack("=4i", 24, 80, 0, len(path)) + path)
+    return client
+
+
+def read_screen(client, seconds=2.0):
+    client.settimeout(0.2)
+    data = b""
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        try:
+            chunk = client.recv(65536)
+        except socket.timeout:
+            if data:
+                break
+            continue
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        environment = dict(os.environ, XDG_RUNTIME_DIR=directory)
+        socketPath = os.path.join(directory, "texto.sock")
+        filePath = os.path.join(directory, "file.txt")
+        with open(filePath, "w") as f:
+            f.write("hello\n")
+
+        server = subprocess.Popen([TEXTO, "--server"], env=environment, cwd=directory,
+                                  stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            for _ in range(100):
+                if os.path.exists(socketPath):
+                    break
+                time.sleep(0.02)
+
+            survivor = attach(socketPath, filePath)
+            if b"hello" not in read_screen(survivor):
+                print("FAIL: first client never saw the file")
+                return 1
+
+            # Closing with the server's output still unread makes the server's next read fail with ECONNRESET
+            victim = attach(socketPath, filePath)
+            time.sleep(0.3)
+            victim.send(b"x")
+            time.sleep(0.1)
+            victim.close()
+            time.sleep(0.3)
+
+            # A file that exists but can't be opened must only turn away the client that asked for it.
+            # fopen() fails on a socket even for root, which permissions wouldn't stop.
+            unreadable = os.path.join(directory, "unreadable")
+            placeholder = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            placeholder.bind(unreadable)
+            rejected = attach(socketPath, unreadable)
+            read_screen(rejected, 1.0)
+            rejected.close()
+            placeholder.close()
+
+            if server.poll() is not None:
+                print("FAIL: server exited with status %d" % server.returncode)
+                return 1
+
+            survivor.sendall(b"abc")
+            if b"abc" not in read_screen(survivor):
+                print("FAIL: remaining client stopped getting updates")
+                return 1
+            survivor.sendall(b"\x11")  # Ctrl-Q detaches
+            survivor.close()
+        finally:
+            server.kill()
+            server.wait()
+
+    print("PASS: server_reset")
+    return 0
+
+
+def run():
+    try:
+        return main()
+    except OSError as error:  # Typically the server died and refused the next connection
+        print("FAIL: %s" % error)
+        return 1
+
+
+if __name__ == "__main__":
+    sys.exit(run())
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Turns on soft wrapping and checks how long, wide-character and tabbed lines are laid out, that the cursor moves and
+types through the wrapped lines at the columns shown, and that going to a line far down lands on it.
+"""
+import sys
+import tempfile
+import unicodedata
+
+from editor import DOWN, END, ENTER, HOME, RIGHT, Editor, ctrl, read_file, run, test_file
+
+ROWS = 14
+COLUMNS = 40
+
+
+def wrap(text):
+    """Splits a line into the screen lines it takes up: characters that don't fit go to the next one, tabs are spaces"""
+    lines = [""]
+    column = rowColumn = 0
+    for character in text:
+        pieces = [(" ", 1)] * (8 - rowColumn % 8) if character == "\t" else \
+            [(character, 2 if unicodedata.east_asian_width(character) in "WF" else 1)]
+        for piece, width in pieces:
+            if column > 0 and column + width > COLUMNS:
+                lines.append("")
+                column = 0
+            lines[-1] += piece
+            column += width
+            rowColumn += width
+    return lines
+
+
+def check_screen(editor, lines, when):
+    expected = [screenLine.rstrip() for line in lines for screenLine in wrap(line)][:ROWS - 2]
+    shown = [editor.screen.line(y).rstrip() for y in range(ROWS - 2)]
+    if shown != expected:
+        return "%s: screen was %r, expected %r" % (when, shown, expected)
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        lines = ["0123456789" * 10, "short", "漢字" * 25, "a\tb" * 8] + ["L%03d " % n + "abcdefghij" * 9 for n in range(5, 301)]
+        path = test_file(directory, "file.txt", "\n".join(lines) + "\n")
+        editor = Editor(["file.txt"], directory, rows=ROWS, columns=COLUMNS)
+        editor.type(ctrl("w"))
+        failure = check_screen(editor, lines, "wrapped")
+        if failure:
+            return failure
+
+        # The end of a row is on its last screen line
+        editor.type(END, "X")
+        lines[0] += "X"
+        if editor.cursor() != (2, 21):
+            return "typing at the end of a wrapped row left the cursor at %r" % (editor.cursor(),)
+
+        # Moving right crosses into the next screen line of the row
+        editor.type(HOME, RIGHT * 45, "Y")
+        lines[0] = lines[0][:45] + "Y" + lines[0][45:]
+        if editor.cursor() != (1, 6):
+            return "typing in the second screen line of a row left the cursor at %r" % (editor.cursor(),)
+
+        # Up and down keep the column in the row, whichever screen line it is on
+        editor.type(DOWN, "Z", DOWN, "W")
+        lines[1] += "Z"
+        lines[2] = lines[2][:3] + "W" + lines[2][3:]
+        failure = check_screen(editor, lines, "edited")
+        if failure:
+            return failure
+
+        editor.type(ctrl("g") + "150" + ENTER, "!")
+        lines[149] = "!" + lines[149]
+        y, x = editor.cursor()
+        if not editor.screen.line(y).startswith("!L150") or x != 1:
+            return "going to line 150 showed %r at the cursor" % editor.screen.line(y)
+
+        editor.type(ctrl("w"))
+        y, x = editor.cursor()
+        if editor.screen.line(y).rstrip() != lines[149][:COLUMNS] or x != 1:
+            return "turning wrapping off showed %r at the cursor" % editor.screen.line(y)
+
+        if not editor.save():
+            return "couldn't save"
+        editor.quit()
+        if read_file(path).decode() != "\n".join(lines) + "\n":
+            return "saved file doesn't have the edits made in wrapped rows"
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "soft_wrap"))
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""
+Loads the syntax definitions shipped in syntax/ and one written by the test, and checks that files they match are
+coloured by their keywords, types, comments, numbers, strings and rules while C keeps its built-in definition.
+"""
+import os
+import sys
+import tempfile
+
+from editor import Editor, run, test_file
+
+SHIPPED = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "syntax")
+
+CUSTOM = """\
+# Comments and blank lines are skipped
+
+filetype applog
+extensions .applog Applog
+keywords ERROR FATAL
+types WARN
+singleline ;;
+rule % string word
+rule >> number line
+"""
+
+# Text of each line, then the expected colour of the character at each column (None is the default colour)
+PYTHON = [
+    ("@cached", {0: 32, 6: 32}),
+    ("def f(x):  # note", {0: 33, 2: 33, 4: None, 11: 36, 16: 36}),
+    ("    return x + 42", {4: 33, 11: None, 15: 31, 16: 31}),
+    ('s = """open', {4: 36, 9: 36}),
+    ('still""" + str(1)', {0: 36, 7: 36, 11: 32, 15: 31}),
+    ("print('if')", {0: None, 6: 35, 7: 35}),
+]
+APPLOG = [
+    ("ERROR disk WARN", {0: 33, 4: 33, 6: None, 11: 32}),
+    ("x %user y", {2: 35, 6: 35, 8: None}),
+    ("a >> b c", {2: 31, 7: 31}),
+    ("FATAL ;; ERROR", {0: 33, 6: 36, 13: 36}),
+]
+C = [
+    ("int x; // if", {0: 32, 4: None, 7: 36}),
+    ("while (1) {}", {0: 33, 7: 31}),
+]
+
+
+def check(directory, name, lines, filetype):
+    test_file(directory, name, "".join(text + "\n" for text, _ in lines))
+    editor = Editor([name], directory, environment={"TEXTO_SYNTAX_DIR": directory})
+    status = editor.screen.line(editor.screen.rows - 2)
+    if filetype not in status:
+        return "%s was opened as %r" % (name, status.strip())
+    for y, (text, colours) in enumerate(lines):
+        for x, colour in colours.items():
+            if editor.colour(y, x) != colour:
+                return "%s: %r at column %d was coloured %r, expected %r" % (name, text, x, editor.colour(y, x), colour)
+    editor.quit()
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        for name in os.listdir(SHIPPED):
+            with open(os.path.join(SHIPPED, name)) as f:
+                test_file(directory, name, f.read())
+        test_file(directory, "applog.syntax", CUSTOM)
+        test_file(directory, "ignored.syntax.txt", "filetype ignored\nextensions .py\n")
+
+        for name, lines, filetype in [("script.py", PYTHON, "python"), ("app.applog", APPLOG, "applog"),
+                                      ("Applog", APPLOG, "applog"), ("main.c", C, "c")]:
+            failure = check(directory, name, lines, filetype)
+            if failure:
+                return failure
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "syntax_files"))
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""
+Searches a large file with the trigram index (--trigrams) and checks that stepping through the matches visits exactly
+the rows a linear scan finds, in order and wrapping around. The search is repeated after edits, after replace-alls that
+give most rows new ids, and while the index drops the dead ids, so rows missing from the candidates would show.
+"""
+import random
+import re
+import sys
+import tempfile
+import time
+
+from editor import BACKSPACE, CTRL_SPACE, DOWN, ENTER, ESC, HOME, RIGHT, UP, Editor, ctrl, read_file, run, test_file
+
+WORDS = ["alpha", "beta", "gamma", "delta", "omega", "theta"]
+QUERIES = ["needle", "r12345", "gamma needle", "zzz"]
+
+
+def at(y, x=0):
+    return ctrl("g") + str(y + 1) + ENTER + HOME + RIGHT * x
+
+
+def match_shown(editor):
+    """Returns the line and column of the match coloured on screen, or None"""
+    for y in range(editor.screen.rows - 2):
+        number, column = editor.numbered(y)
+        if number is None:
+            continue
+        for x in range(column, editor.screen.columns):
+            if editor.colour(y, x) == 34:
+                return number - 1, x - column
+    return None
+
+
+def check(editor, lines, when):
+    for query in QUERIES:
+        expected = [(y, line.find(query)) for y, line in enumerate(lines) if query in line]
+        editor.type(ctrl("f"), query)
+        if not expected:
+            if match_shown(editor) is not None:
+                return "%s: %r matched %r, but isn't in the file" % (when, query, match_shown(editor))
+            editor.type(ESC)
+            continue
+
+        # Every match in turn, back around to the first, then back again to the last
+        landed = [match_shown(editor)]
+        for _ in range(len(expected)):
+            editor.type(DOWN)
+            landed.append(match_shown(editor))
+        editor.type(UP)
+        landed.append(match_shown(editor))
+        editor.type(ESC)
+        if landed != expected + [expected[0], expected[-1]]:
+            return "%s: %r went to %r, expected %r" % (when, query, landed, expected + [expected[0], expected[-1]])
+    return None
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        generator = random.Random(43)
+        lines = ["r%05d %s %s" % (y, generator.choice(WORDS), generator.choice(WORDS)) for y in range(70000)]
+        for y in generator.sample(range(len(lines)), 12):
+            lines[y] += " needle"
+        lines[500] += " needle needle"
+        path = test_file(directory, "file.txt", "\n".join(lines) + "\n")
+        editor = Editor(["--trigrams", "file.txt"], directory)
+        editor.type(ctrl("n"))
+        time.sleep(1)  # Lets the rows be indexed
+        failure = check(editor, lines, "indexed")
+        if failure:
+            return failure
+
+        # Matches typed in, split apart, and cut out, and rows added above the rest
+        editor.type(at(20000, 7), "needle ", at(40000), "needle", at(500, 20), ENTER)
+        lines[20000] = lines[20000][:7] + "needle " + lines[20000][7:]
+        lines[40000] = "needle" + lines[40000]
+        lines[500:501] = [lines[500][:20], lines[500][20:]]
+        first = next(y for y, line in enumerate(lines) if "needle" in line and y > 1000)
+        editor.type(at(first), CTRL_SPACE, at(first + 1), ctrl("x"))
+        del lines[first]
+        editor.type(at(10), ENTER * 3, "gamma needle x", BACKSPACE)
+        lines[10:10] = ["", "", ""]
+        lines[13] = "gamma needle " + lines[13]
+        failure = check(editor, lines, "edited")
+        if failure:
+            return failure
+
+        # Each replace-all gives every row a new id, so the second leaves more dead ids than live ones
+        for pattern, replacement in [("^r", "q"), ("^q", "r"), ("needle", "pin"), ("pin", "needle")]:
+            editor.type(ctrl("r"), "/%s/" % pattern, ENTER, replacement, ENTER)
+            lines = [re.sub(pattern, replacement, line) for line in lines]
+            failure = check(editor, lines, "after replacing /%s/ with %r" % (pattern, replacement))
+            if failure:
+                return failure
+        time.sleep(1)  # Lets the index be compacted and the rows indexed again
+        failure = check(editor, lines, "compacted")
+        if failure:
+            return failure
+
+        if not editor.save():
+            return "couldn't save"
+        editor.quit()
+        if read_file(path).decode() != "\n".join(lines) + "\n":
+            return "saved file doesn't have the edits"
+    return None
+
+
+if __name__ == "__main__":
+    sys.exit(run(main, "trigrams"))